@@ -0,0 +1,113 @@
+#include <cradle/background/internals.hpp>
+#include <atomic>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures how well the memory cache holds up when lots of threads are
+// hitting it at once:
+//
+// - acquiring and releasing pointers to a handful of hot keys (as happens
+//   when many jobs share the same inputs)
+// - the same, but spread over many keys
+// - polling the status of records that aren't ready yet (as the UI and
+//   waiting jobs do)
+// - reporting progress on hot keys
+
+using namespace cradle;
+
+static size_t const operations_per_thread = 200000;
+
+// Run fn(thread_index, i) for i in [0, operations_per_thread) on each of
+// n_threads threads (all started together) and return the elapsed time.
+template<class Fn>
+double run_on_threads(unsigned n_threads, Fn const& fn)
+{
+    std::atomic<unsigned> ready_count(0);
+    std::atomic<bool> go(false);
+    std::vector<alia__shared_ptr<boost::thread> > threads;
+    for (unsigned t = 0; t != n_threads; ++t)
+    {
+        threads.push_back(alia__shared_ptr<boost::thread>(
+            new boost::thread([&, t]() {
+                ++ready_count;
+                while (!go)
+                    boost::this_thread::yield();
+                for (size_t i = 0; i != operations_per_thread; ++i)
+                    fn(t, i);
+            })));
+    }
+    while (ready_count != n_threads)
+        boost::this_thread::yield();
+    return time_once([&]() {
+        go = true;
+        for (auto& thread : threads)
+            thread->join();
+    });
+}
+
+static void
+report_contention(string const& label, unsigned n_threads, double seconds)
+{
+    report_rate("  " + label, double(n_threads) * operations_per_thread,
+        seconds);
+}
+
+int main()
+{
+    unsigned n_cores = (std::max)(boost::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> thread_counts;
+    for (unsigned n = 1; n < n_cores * 2; n *= 2)
+        thread_counts.push_back(n);
+    thread_counts.push_back(n_cores * 2);
+
+    background_execution_system bg(1);
+
+    int const n_hot_keys = 8, n_spread_keys = 4096;
+
+    // Keep the keys referenced throughout so that the records aren't
+    // evicted between operations.
+    std::vector<untyped_background_data_ptr> keepers;
+    for (int key = 0; key != n_spread_keys; ++key)
+        keepers.push_back(untyped_background_data_ptr(bg, make_id(key)));
+
+    for (unsigned n_threads : thread_counts)
+    {
+        std::cout << n_threads << " thread(s)" << std::endl;
+
+        report_contention("acquire/release (hot keys)", n_threads,
+            run_on_threads(n_threads, [&](unsigned t, size_t i) {
+                untyped_background_data_ptr ptr(bg,
+                    make_id(int((t + i) % n_hot_keys)));
+            }));
+
+        report_contention("acquire/release (spread keys)", n_threads,
+            run_on_threads(n_threads, [&](unsigned t, size_t i) {
+                untyped_background_data_ptr ptr(bg,
+                    make_id(int((t * 7919 + i) % n_spread_keys)));
+            }));
+
+        // None of the records has any data, so these never become ready, and
+        // every update() checks the record.
+        std::vector<std::vector<untyped_background_data_ptr> >
+            polled(n_threads);
+        for (auto& ptrs : polled)
+        {
+            for (int key = 0; key != n_hot_keys; ++key)
+                ptrs.push_back(untyped_background_data_ptr(bg, make_id(key)));
+        }
+        report_contention("status polling (hot keys)", n_threads,
+            run_on_threads(n_threads, [&](unsigned t, size_t i) {
+                polled[t][i % n_hot_keys].update();
+            }));
+        polled.clear();
+
+        report_contention("progress updates (hot keys)", n_threads,
+            run_on_threads(n_threads, [&](unsigned t, size_t i) {
+                update_background_data_progress(bg,
+                    make_id(int((t + i) % n_hot_keys)), float(i % 100) / 100);
+            }));
+    }
+
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include <cradle/background/internals.hpp>
+#include <atomic>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures how the throughput of the CALCULATION pool scales with the
+// number of threads in it, using synthetic job graphs made up of lots of
+// fine-grained jobs (like the ones that are generated when scrolling through
+// slices):
+//
+// - independent jobs, all queued from outside the pool
+// - a tree of jobs, where each job queues its children from within the pool
+// - a layered graph, where each job depends on the results of two jobs in
+//   the previous layer (so jobs spend time waiting on their inputs)
+
+using namespace cradle;
+
+// the number of jobs that have finished (in the current graph)
+static std::atomic<size_t> finished_job_count(0);
+
+// Simulate the work that a job does.
+static void do_work(unsigned amount)
+{
+    volatile double x = 0;
+    for (unsigned i = 0; i != amount; ++i)
+        x = x + i * 0.5;
+}
+
+struct independent_job : background_job_interface
+{
+    independent_job(unsigned work) : work(work) {}
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        do_work(work);
+        ++finished_job_count;
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "independent job";
+        return info;
+    }
+    unsigned work;
+};
+
+struct tree_job : background_job_interface
+{
+    tree_job(background_execution_system* bg, unsigned work, unsigned depth,
+        unsigned fan_out)
+      : bg(bg), work(work), depth(depth), fan_out(fan_out)
+    {}
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        if (depth != 0)
+        {
+            for (unsigned i = 0; i != fan_out; ++i)
+            {
+                add_background_job(*bg,
+                    background_job_queue_type::CALCULATION, 0,
+                    new tree_job(bg, work, depth - 1, fan_out));
+            }
+        }
+        do_work(work);
+        ++finished_job_count;
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "tree job";
+        return info;
+    }
+    background_execution_system* bg;
+    unsigned work, depth, fan_out;
+};
+
+struct graph_job : background_job_interface
+{
+    void gather_inputs()
+    {
+        for (auto& input : inputs)
+            input.update();
+    }
+    bool inputs_ready()
+    {
+        for (auto const& input : inputs)
+        {
+            if (!input.is_ready())
+                return false;
+        }
+        return true;
+    }
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        do_work(work);
+        set_cached_data(*bg, make_id(node), erase_type(make_immutable(node)));
+        ++finished_job_count;
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "graph job";
+        return info;
+    }
+    background_execution_system* bg;
+    unsigned work;
+    int node;
+    std::vector<untyped_background_data_ptr> inputs;
+};
+
+static void wait_for_jobs(size_t n_jobs)
+{
+    while (finished_job_count != n_jobs)
+        boost::this_thread::yield();
+}
+
+static double run_independent_jobs(background_execution_system& bg,
+    size_t n_jobs, unsigned work)
+{
+    return time_once([&]() {
+        finished_job_count = 0;
+        for (size_t i = 0; i != n_jobs; ++i)
+        {
+            add_background_job(bg, background_job_queue_type::CALCULATION, 0,
+                new independent_job(work));
+        }
+        wait_for_jobs(n_jobs);
+    });
+}
+
+static double run_job_tree(background_execution_system& bg, unsigned depth,
+    unsigned fan_out, unsigned work, size_t* n_jobs)
+{
+    *n_jobs = 0;
+    for (unsigned i = 0, n = 1; i <= depth; ++i, n *= fan_out)
+        *n_jobs += n;
+    return time_once([&]() {
+        finished_job_count = 0;
+        add_background_job(bg, background_job_queue_type::CALCULATION, 0,
+            new tree_job(&bg, work, depth, fan_out));
+        wait_for_jobs(*n_jobs);
+    });
+}
+
+static double run_layered_graph(background_execution_system& bg,
+    int n_layers, int width, unsigned work, int* next_node)
+{
+    return time_once([&]() {
+        finished_job_count = 0;
+        // Each run uses fresh node IDs so that the results of the previous
+        // run aren't picked up from the cache.
+        int first_node = *next_node;
+        *next_node += n_layers * width;
+        std::vector<untyped_background_data_ptr> ptrs;
+        ptrs.reserve(n_layers * width);
+        // Queue the layers in reverse order so that most jobs have to wait
+        // for their inputs.
+        for (int layer = n_layers - 1; layer >= 0; --layer)
+        {
+            for (int i = 0; i != width; ++i)
+            {
+                int node = first_node + layer * width + i;
+                auto* job = new graph_job;
+                job->bg = &bg;
+                job->work = work;
+                job->node = node;
+                if (layer != 0)
+                {
+                    int previous = node - width;
+                    job->inputs.push_back(
+                        untyped_background_data_ptr(bg, make_id(previous)));
+                    job->inputs.push_back(
+                        untyped_background_data_ptr(bg,
+                            make_id(first_node + (layer - 1) * width +
+                                (i + 1) % width)));
+                }
+                ptrs.push_back(untyped_background_data_ptr(bg, make_id(node)));
+                add_untyped_background_job(ptrs.back(), bg,
+                    background_job_queue_type::CALCULATION, job);
+            }
+        }
+        wait_for_jobs(n_layers * width);
+    });
+}
+
+int main()
+{
+    unsigned n_cores = (std::max)(boost::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> thread_counts;
+    for (unsigned n = 1; n < n_cores; n *= 2)
+        thread_counts.push_back(n);
+    thread_counts.push_back(n_cores);
+
+    int next_node = 0;
+    for (unsigned n_threads : thread_counts)
+    {
+        std::cout << n_threads << " thread(s)" << std::endl;
+        background_execution_system bg(n_threads);
+
+        size_t const n_independent_jobs = 100000;
+        report_rate("  independent jobs", double(n_independent_jobs),
+            run_independent_jobs(bg, n_independent_jobs, 2000));
+
+        size_t n_tree_jobs;
+        double tree_time = run_job_tree(bg, 7, 4, 2000, &n_tree_jobs);
+        report_rate("  job tree", double(n_tree_jobs), tree_time);
+
+        int const n_layers = 50, width = 200;
+        auto& executor = *bg.impl_->pools[
+            int(background_job_queue_type::CALCULATION)].executor;
+        size_t initial_wakeups = executor.woken_job_count;
+        report_rate("  layered graph",
+            double(n_layers * width),
+            run_layered_graph(bg, n_layers, width, 2000, &next_node));
+        report_value("  layered graph wakeups per job",
+            double(executor.woken_job_count - initial_wakeups) /
+                (n_layers * width), "");
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <cradle/encoding.hpp>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures the throughput of each of the base64 methods that the CPU
+// supports, in both directions, on blocks the size of a typical cache key
+// and on a large blob-sized block.
+
+using namespace cradle;
+
+static char const* get_method_name(base64_method method)
+{
+    switch (method)
+    {
+     case base64_method::SCALAR:
+        return "scalar";
+     case base64_method::SSSE3:
+        return "ssse3";
+     case base64_method::AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+int main()
+{
+    std::vector<uint8_t> data(0x1000000);
+    for (size_t i = 0; i != data.size(); ++i)
+        data[i] = uint8_t(i * 2654435761u >> 24);
+
+    std::vector<char> encoded(get_base64_encoded_length(data.size()));
+    std::vector<uint8_t> decoded(data.size());
+
+    std::cout << "preferred method: "
+        << get_method_name(get_preferred_base64_method()) << std::endl;
+
+    base64_method const methods[] = {
+        base64_method::SCALAR, base64_method::SSSE3, base64_method::AVX2 };
+    size_t const block_sizes[] = { 48, 0x10000, data.size() };
+    for (size_t block_size : block_sizes)
+    {
+        std::cout << block_size << "-byte blocks" << std::endl;
+        size_t encoded_size;
+        base64_encode(&encoded[0], &encoded_size, &data[0], block_size,
+            get_mime_base64_character_set());
+        for (auto method : methods)
+        {
+            if (!is_base64_method_supported(method))
+                continue;
+            report_throughput(
+                string("  encode, ") + get_method_name(method),
+                double(block_size),
+                time_per_iteration([&]() {
+                    size_t size;
+                    base64_encode(method, &encoded[0], &size, &data[0],
+                        block_size, get_mime_base64_character_set());
+                }));
+            report_throughput(
+                string("  decode, ") + get_method_name(method),
+                double(block_size),
+                time_per_iteration([&]() {
+                    size_t size;
+                    base64_decode(method, &decoded[0], &size, &encoded[0],
+                        encoded_size, get_mime_base64_character_set());
+                }));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef CRADLE_BENCHMARK_HPP
+#define CRADLE_BENCHMARK_HPP
+
+#include <cradle/common.hpp>
+#include <boost/chrono.hpp>
+#include <iostream>
+#include <iomanip>
+
+// This file provides some simple utilities for timing operations and
+// reporting the results in a consistent format.
+
+namespace cradle {
+
+// Run fn repeatedly (at least min_iterations times, and for at least
+// min_seconds) and return the average time per iteration in seconds.
+template<class Fn>
+double time_per_iteration(Fn const& fn, unsigned min_iterations = 1,
+    double min_seconds = 0.5)
+{
+    typedef boost::chrono::steady_clock clock;
+    unsigned n_iterations = 0;
+    auto start = clock::now();
+    double elapsed;
+    do
+    {
+        fn();
+        ++n_iterations;
+        elapsed =
+            boost::chrono::duration<double>(clock::now() - start).count();
+    }
+    while (n_iterations < min_iterations || elapsed < min_seconds);
+    return elapsed / n_iterations;
+}
+
+// Time a single execution of fn and return the elapsed time in seconds.
+template<class Fn>
+double time_once(Fn const& fn)
+{
+    return time_per_iteration(fn, 1, 0);
+}
+
+// Report a rate in operations per second.
+static inline void
+report_rate(string const& label, double operations, double seconds)
+{
+    std::cout << std::left << std::setw(48) << label << std::right
+        << std::setw(14) << std::fixed << std::setprecision(1)
+        << (operations / seconds) << " ops/s" << std::endl;
+}
+
+// Report a throughput in MB/s.
+static inline void
+report_throughput(string const& label, double bytes, double seconds)
+{
+    std::cout << std::left << std::setw(48) << label << std::right
+        << std::setw(14) << std::fixed << std::setprecision(1)
+        << (bytes / seconds / 0x100000) << " MB/s" << std::endl;
+}
+
+// Report an arbitrary number.
+static inline void
+report_value(string const& label, double value, string const& units)
+{
+    std::cout << std::left << std::setw(48) << label << std::right
+        << std::setw(14) << std::fixed << std::setprecision(3)
+        << value << " " << units << std::endl;
+}
+
+}
+
+#endif
@@ -0,0 +1,64 @@
+#include <cradle/io/crc.hpp>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures the throughput of each of the CRC methods that the CPU
+// supports, on blocks the size of the buffers that the value streams use and
+// on a large image-sized block. It also measures combining CRCs.
+
+using namespace cradle;
+
+static char const* get_method_name(crc32_method method)
+{
+    switch (method)
+    {
+     case crc32_method::BYTEWISE:
+        return "bytewise";
+     case crc32_method::SLICING_BY_8:
+        return "slicing-by-8";
+     case crc32_method::PCLMUL:
+        return "pclmul";
+     case crc32_method::ARMV8:
+        return "armv8";
+    }
+    return "unknown";
+}
+
+int main()
+{
+    std::vector<uint8_t> data(0x4000000);
+    for (size_t i = 0; i != data.size(); ++i)
+        data[i] = uint8_t(i * 2654435761u >> 24);
+
+    std::cout << "preferred method: "
+        << get_method_name(get_preferred_crc32_method()) << std::endl;
+
+    crc32_method const methods[] = {
+        crc32_method::BYTEWISE, crc32_method::SLICING_BY_8,
+        crc32_method::PCLMUL, crc32_method::ARMV8 };
+    size_t const block_sizes[] = { 0x100, 0x10000, data.size() };
+    for (size_t block_size : block_sizes)
+    {
+        std::cout << block_size << "-byte blocks" << std::endl;
+        for (auto method : methods)
+        {
+            if (!is_crc32_method_supported(method))
+                continue;
+            uint32_t crc = 0;
+            report_throughput(string("  ") + get_method_name(method),
+                double(block_size),
+                time_per_iteration([&]() {
+                    crc = compute_crc32(method, crc, &data[0], block_size);
+                }));
+        }
+    }
+
+    uint32_t crc = 1;
+    report_rate("combine", 1,
+        time_per_iteration([&]() {
+            crc = combine_crc32s(crc, 0x12345678, 0x10000);
+        }));
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <cradle/disk_cache.hpp>
+#include <cradle/io/file.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <fstream>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures the throughput of the disk cache index for the access
+// pattern that dominates cache hits in practice: lots of small entries being
+// inserted and then looked up by key.
+
+using namespace cradle;
+
+static string make_key(int i)
+{
+    // Keys in the real cache are fairly long, so mimic that.
+    return "benchmark/" + string(64, 'k') + "/" + to_string(i);
+}
+
+static void write_dummy_file(file_path const& path)
+{
+    std::ofstream f;
+    open(f, path, std::ios::out | std::ios::binary | std::ios::trunc);
+    f << "x";
+}
+
+int main()
+{
+    file_path dir = boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path("cradle-disk-cache-%%%%-%%%%");
+
+    int const n_entries = 5000;
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", int64_t(0x100000000));
+
+        double insert_time = time_once([&]() {
+            for (int i = 0; i != n_entries; ++i)
+            {
+                int64_t id = initiate_insert(cache, make_key(i));
+                write_dummy_file(get_path_for_id(cache, id));
+                finish_insert(cache, id, uint32_t(i));
+            }
+            write_usage_records(cache);
+        });
+        report_rate("inserts", n_entries, insert_time);
+
+        double hit_time = time_once([&]() {
+            for (int i = 0; i != n_entries; ++i)
+            {
+                int64_t id;
+                uint32_t crc;
+                entry_exists(cache, make_key(i), &id, &crc);
+                record_usage(cache, id);
+            }
+            write_usage_records(cache);
+        });
+        report_rate("lookups (hits, with usage records)", n_entries,
+            hit_time);
+
+        double miss_time = time_once([&]() {
+            for (int i = 0; i != n_entries; ++i)
+            {
+                int64_t id;
+                entry_exists(cache, make_key(n_entries + i), &id);
+            }
+        });
+        report_rate("lookups (misses)", n_entries, miss_time);
+    }
+
+    // Compare entries stored in their own files with packed entries.
+    std::vector<uint8_t> data(1000, 'x');
+    for (int packed = 0; packed != 2; ++packed)
+    {
+        string label = packed ? " (packed)" : " (individual files)";
+
+        disk_cache cache;
+        initialize(cache, dir / (packed ? "packed" : "files"), "",
+            int64_t(0x100000000));
+
+        std::vector<int64_t> ids(n_entries);
+        double write_time = time_once([&]() {
+            for (int i = 0; i != n_entries; ++i)
+            {
+                int64_t id = initiate_insert(cache, make_key(i));
+                if (packed)
+                    finish_insert(cache, id, &data[0], data.size(), 0);
+                else
+                {
+                    std::ofstream f;
+                    open(f, get_path_for_id(cache, id),
+                        std::ios::out | std::ios::binary | std::ios::trunc);
+                    f.write(reinterpret_cast<char const*>(&data[0]),
+                        data.size());
+                    f.close();
+                    finish_insert(cache, id, 0);
+                }
+                ids[i] = id;
+            }
+            write_usage_records(cache);
+        });
+        report_rate("1k entry writes" + label, n_entries, write_time);
+
+        double read_time = time_once([&]() {
+            std::vector<uint8_t> entry_data;
+            for (int i = 0; i != n_entries; ++i)
+                read_entry(&entry_data, cache, ids[i]);
+        });
+        report_rate("1k entry reads" + label, n_entries, read_time);
+    }
+
+    boost::filesystem::remove_all(dir);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <cradle/imaging/image.hpp>
+#include <boost/unordered_map.hpp>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures the cost of looking up image-bearing keys in the sort of
+// hash tables that the background and composition caches use, with a few
+// hundred of them live at once. For comparison, it also measures the same
+// lookups with a hash function that lumps all images into the same bucket.
+
+using namespace cradle;
+
+typedef image<3,float,shared> image_type;
+
+// Make a set of images that are identical except for their last pixels, so
+// telling them apart by comparison means looking at all of their pixels.
+static std::vector<image_type> make_images(unsigned n_images)
+{
+    unsigned const n = 32, n_pixels = n * n * n;
+    std::vector<image_type> images;
+    for (unsigned i = 0; i != n_images; ++i)
+    {
+        image<3,float,unique> img;
+        create_image(img, make_vector(n, n, n));
+        for (unsigned j = 0; j != n_pixels; ++j)
+            img.pixels.ptr[j] = float(j % 101);
+        img.pixels.ptr[n_pixels - 1] = float(i);
+        images.push_back(share(img));
+    }
+    return images;
+}
+
+struct constant_hash
+{
+    size_t operator()(image_type const& x) const { return 0; }
+};
+
+template<class Hash>
+static void benchmark_lookups(string const& label,
+    std::vector<image_type> const& images)
+{
+    boost::unordered_map<image_type,int,Hash> table;
+    for (size_t i = 0; i != images.size(); ++i)
+        table[images[i]] = int(i);
+    size_t next = 0;
+    report_rate(label, 1,
+        time_per_iteration([&]() {
+            table.find(images[next]);
+            next = (next + 1) % images.size();
+        }));
+}
+
+int main()
+{
+    unsigned const n_images = 500;
+    auto images = make_images(n_images);
+    double image_size = 32 * 32 * 32 * sizeof(float);
+
+    // The first time an image is hashed, its pixels have to be scanned.
+    // After that, the hash is cached.
+    {
+        auto fresh_images = make_images(n_images);
+        size_t next = 0;
+        double first_time = time_once([&]() {
+            for (auto const& image : fresh_images)
+                std::hash<image_type>()(image);
+        });
+        report_throughput("first hash", image_size * n_images, first_time);
+        report_rate("cached hash", 1,
+            time_per_iteration([&]() {
+                std::hash<image_type>()(fresh_images[next]);
+                next = (next + 1) % n_images;
+            }));
+    }
+
+    std::cout << n_images << " live images" << std::endl;
+    benchmark_lookups<std::hash<image_type> >("  lookup (content hash)",
+        images);
+    benchmark_lookups<constant_hash>("  lookup (constant hash)", images);
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <cradle/io/generic_io.hpp>
+#include <cradle/date_time.hpp>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "benchmark.hpp"
+
+// This measures the throughput of reading and writing JSON for the sorts of
+// responses that come back from Thinknode services: calculation results,
+// which are mostly numbers, and RKS entry listings, which are mostly strings.
+
+using namespace cradle;
+
+// Make something that looks like a Thinknode ID.
+static string make_id(unsigned i)
+{
+    std::ostringstream id;
+    id << std::hex << std::setfill('0');
+    for (unsigned j = 0; j != 4; ++j)
+        id << std::setw(8) << (i + 1) * 2654435761u * (j + 1);
+    return id.str();
+}
+
+// a calculation result: a dose grid along with the contours that were
+// extracted from it
+static value make_calc_response(int n_slices)
+{
+    value_map grid;
+    grid[value("origin")] =
+        value(value_list{ value(-100.25), value(-100.25), value(-50.) });
+    grid[value("spacing")] =
+        value(value_list{ value(2.5), value(2.5), value(2.5) });
+    grid[value("n_points")] =
+        value(value_list{ value(integer(80)), value(integer(80)),
+            value(integer(n_slices)) });
+
+    value_list doses;
+    for (int i = 0; i != 80 * 80 * n_slices / 8; ++i)
+        doses.push_back(value(std::sin(i * 0.001) * 70.0 + 0.123456789 * i));
+
+    value_list contours;
+    for (int k = 0; k != n_slices; ++k)
+    {
+        value_list vertices;
+        for (int i = 0; i != 60; ++i)
+        {
+            double a = i * 2 * 3.14159265 / 60;
+            vertices.push_back(value(value_list{
+                value(40 * std::cos(a) + k * 0.01),
+                value(40 * std::sin(a)) }));
+        }
+        value_map contour;
+        contour[value("position")] = value(k * 2.5);
+        contour[value("vertices")] = value(vertices);
+        contours.push_back(value(contour));
+    }
+
+    value_map response;
+    response[value("grid")] = value(grid);
+    response[value("doses")] = value(doses);
+    response[value("contours")] = value(contours);
+    response[value("units")] = value("Gy");
+    return value(response);
+}
+
+// a listing of RKS entries
+static value make_rks_response(unsigned n_entries)
+{
+    boost::posix_time::ptime const modified_at =
+        parse_time("2017-04-12T18:30:01.123Z");
+    value_list entries;
+    for (unsigned i = 0; i != n_entries; ++i)
+    {
+        value_map record;
+        record[value("account")] = value("decimal");
+        record[value("app")] = value("dosimetry");
+        record[value("name")] = value("treatment_plan");
+        value_map modified_by;
+        modified_by[value("username")] = value("planner@example.com");
+        value_map entry;
+        entry[value("id")] = value(make_id(i));
+        entry[value("name")] =
+            value("Plan " + to_string(i) + " \"revised\" / beam set A");
+        entry[value("parent")] = value(make_id(i / 10));
+        entry[value("immutable")] = value(make_id(i + n_entries));
+        entry[value("revision")] = value(make_id(i + 2 * n_entries));
+        entry[value("active")] = value(i % 7 != 0);
+        entry[value("record")] = value(record);
+        entry[value("modified_at")] = value(modified_at);
+        entry[value("modified_by")] = value(modified_by);
+        entry[value("lock")] = value("unlocked");
+        entries.push_back(value(entry));
+    }
+    return value(entries);
+}
+
+static void benchmark_json(string const& label, value const& v)
+{
+    string json = value_to_json(v);
+    double size = double(json.length());
+    std::cout << label << " (" << (json.length() / 1024) << " KB)"
+        << std::endl;
+
+    report_throughput("  parse", size,
+        time_per_iteration([&]() {
+            value u;
+            parse_json_value(&u, json);
+        }));
+    report_throughput("  write", size,
+        time_per_iteration([&]() {
+            string s;
+            value_to_json(&s, v);
+        }));
+}
+
+int main()
+{
+    benchmark_json("calc response (40 slices)", make_calc_response(40));
+    benchmark_json("rks response (2000 entries)", make_rks_response(2000));
+    return 0;
+}
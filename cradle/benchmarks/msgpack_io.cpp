@@ -0,0 +1,65 @@
+#include <cradle/io/generic_io.hpp>
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures the cost of encoding the sort of value that gets posted to
+// ISS for a calculation: a handful of small fields along with a few large
+// blobs (image pixels). It compares encoding into a single contiguous blob
+// with encoding into segments that reference the blobs in place.
+
+using namespace cradle;
+
+static blob make_pixel_blob(size_t size)
+{
+    auto storage = std::make_shared<std::vector<char> >(size);
+    for (size_t i = 0; i != size; ++i)
+        (*storage)[i] = char(i % 251);
+    blob b;
+    b.ownership = storage;
+    b.data = &(*storage)[0];
+    b.size = size;
+    return b;
+}
+
+static value make_calculation(unsigned n_images, size_t image_size)
+{
+    value_list images;
+    for (unsigned i = 0; i != n_images; ++i)
+    {
+        value_map image;
+        image[value("origin")] =
+            value(value_list{ value(-100.), value(-100.), value(-50.) });
+        image[value("spacing")] =
+            value(value_list{ value(2.5), value(2.5), value(2.5) });
+        image[value("pixels")] = value(make_pixel_blob(image_size));
+        images.push_back(value(image));
+    }
+    value_map calculation;
+    calculation[value("function")] = value("compute_dose");
+    calculation[value("images")] = value(images);
+    return value(calculation);
+}
+
+static void benchmark_encoding(string const& label, value const& v)
+{
+    blob packed = value_to_msgpack_blob(v);
+    double size = double(packed.size);
+    std::cout << label << " (" << (packed.size / 1024) << " KB)"
+        << std::endl;
+
+    report_throughput("  contiguous", size,
+        time_per_iteration([&]() { value_to_msgpack_blob(v); }));
+    report_throughput("  segmented", size,
+        time_per_iteration([&]() { value_to_msgpack_segments(v); }));
+}
+
+int main()
+{
+    benchmark_encoding("4 images (4 MB each)",
+        make_calculation(4, 0x400000));
+    benchmark_encoding("100 images (64 KB each)",
+        make_calculation(100, 0x10000));
+    return 0;
+}
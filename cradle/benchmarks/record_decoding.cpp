@@ -0,0 +1,229 @@
+#include <cradle/io/generic_io.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures the cost of decoding values that are made up of lots of small
+// records, like lists of structure slices and RT plans. Each decoder is
+// measured twice: once before any field names have been interned, so every
+// record gets its own copies of its keys, and once after, which is how things
+// look in practice (since the generated conversion code interns the names of
+// the fields that it reads and writes). Along with the decoding time, this
+// reports how many heap allocations each decode performs and how many bytes
+// it allocates (by replacing the global allocator).
+
+using namespace cradle;
+
+static size_t allocation_count = 0;
+static size_t allocated_bytes = 0;
+
+void* operator new(std::size_t size)
+{
+    ++allocation_count;
+    allocated_bytes += size;
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+static value make_record(
+    std::initializer_list<std::pair<char const*,value> > fields)
+{
+    value_map record;
+    for (auto const& field : fields)
+        record[value(field.first)] = field.second;
+    return value(record);
+}
+
+static value make_vector_value(std::initializer_list<double> elements)
+{
+    value_list list;
+    for (double x : elements)
+        list.push_back(value(x));
+    return value(list);
+}
+
+static value make_polygon_value(int n_vertices, double radius, double z)
+{
+    value_list vertices;
+    for (int i = 0; i != n_vertices; ++i)
+    {
+        double a = i * 2 * 3.14159265 / n_vertices;
+        vertices.push_back(make_vector_value(
+            { radius * std::cos(a) + z * 0.01, radius * std::sin(a) }));
+    }
+    return make_record({ { "vertices", value(vertices) } });
+}
+
+// a std::vector<structure_geometry_slice>-like value
+static value make_slice_list_value(int n_slices)
+{
+    value_list slices;
+    for (int k = 0; k != n_slices; ++k)
+    {
+        double z = k * 2.5;
+        value_list polygons;
+        polygons.push_back(make_polygon_value(60, 40, z));
+        polygons.push_back(make_polygon_value(40, 10, z));
+        value_list holes;
+        holes.push_back(make_polygon_value(20, 5, z));
+        slices.push_back(make_record({
+            { "position", value(z) },
+            { "thickness", value(2.5) },
+            { "region", make_record({
+                { "polygons", value(polygons) },
+                { "holes", value(holes) } }) } }));
+    }
+    return value(slices);
+}
+
+// an RT plan-like value: a list of ion beams, each with a list of control
+// points, each of which has a layer of weighted spots
+static value make_plan_value(int n_beams, int n_control_points, int n_spots)
+{
+    value_list beams;
+    for (int b = 0; b != n_beams; ++b)
+    {
+        value_list control_points;
+        for (int c = 0; c != n_control_points; ++c)
+        {
+            value_list spots;
+            for (int s = 0; s != n_spots; ++s)
+            {
+                spots.push_back(make_record({
+                    { "energy", value(100. + c) },
+                    { "position", make_vector_value(
+                        { (s % 20) * 5. - 50, (s / 20) * 5. - 50 }) },
+                    { "fluence", value(0.001 * s) } }));
+            }
+            control_points.push_back(make_record({
+                { "number", value(integer(c)) },
+                { "meterset_weight", value(c * 0.1) },
+                { "meterset_rate", value(1.) },
+                { "nominal_beam_energy", value(100. + c) },
+                { "nominal_beam_energy_unit", value("MEV") },
+                { "gantry_angle", value(90. * b) },
+                { "gantry_rotation_direction", value("NONE") },
+                { "patient_support_angle", value(0.) },
+                { "patient_support_direction", value("NONE") },
+                { "snout_position", value(300.) },
+                { "isocenter_position", make_vector_value({ 0, 0, 0 }) },
+                { "surface_entry_point", make_vector_value({ 0, -100, 0 }) },
+                { "spot_scan_tune", value("3.0") },
+                { "layer", make_record({
+                    { "num_spot_positions", value(integer(n_spots)) },
+                    { "spots", value(spots) },
+                    { "spot_size", make_vector_value({ 3, 3 }) },
+                    { "num_paintings", value(integer(1)) },
+                    { "spot_tune_id", value(integer(1)) } }) } }));
+        }
+        beams.push_back(make_record({
+            { "beam_number", value(integer(b + 1)) },
+            { "name", value("B" + to_string(b + 1)) },
+            { "description", value("") },
+            { "treatment_machine", value("PBS1") },
+            { "primary_dosimeter_unit", value("MU") },
+            { "treatment_delivery_type", value("TREATMENT") },
+            { "beam_type", value("static") },
+            { "beam_scan_mode", value("modulated") },
+            { "radiation_type", value("proton") },
+            { "virtual_sad", make_vector_value({ 2000, 2000 }) },
+            { "final_meterset_weight", value(1.) },
+            { "snout", make_record({
+                { "id", value("S1") },
+                { "accessory_code", value("") } }) },
+            { "control_points", value(control_points) } }));
+    }
+    return value(beams);
+}
+
+// Intern all the field names that appear in v.
+static void intern_field_names(value const& v)
+{
+    switch (v.type())
+    {
+     case value_type::LIST:
+        for (auto const& item : cast<value_list>(v))
+            intern_field_names(item);
+        break;
+     case value_type::MAP:
+        for (auto const& field : cast<value_map>(v))
+        {
+            intern_field_name(cast<string>(field.first).c_str());
+            intern_field_names(field.second);
+        }
+        break;
+     default:
+        break;
+    }
+}
+
+struct decoder
+{
+    string label;
+    std::function<void(value*)> decode;
+};
+
+static void benchmark_decoders(std::vector<decoder> const& decoders)
+{
+    for (auto const& d : decoders)
+    {
+        {
+            value u;
+            size_t initial_count = allocation_count;
+            size_t initial_bytes = allocated_bytes;
+            d.decode(&u);
+            report_value("  " + d.label + " allocations",
+                double(allocation_count - initial_count), "");
+            report_value("  " + d.label + " memory",
+                double(allocated_bytes - initial_bytes) / 0x100000, "MB");
+        }
+        report_rate("  " + d.label, 1,
+            time_per_iteration([&]() {
+                value u;
+                d.decode(&u);
+            }));
+    }
+}
+
+int main()
+{
+    value slices = make_slice_list_value(400);
+    value plan = make_plan_value(4, 60, 200);
+
+    string slices_json = value_to_json(slices);
+    string plan_json = value_to_json(plan);
+    byte_vector slices_raw, plan_raw;
+    serialize_value(&slices_raw, slices, 0, value_codec::NONE);
+    serialize_value(&plan_raw, plan, 0, value_codec::NONE);
+
+    std::vector<decoder> decoders = {
+        { "slices (400), JSON", [&](value* u) {
+            parse_json_value(u, slices_json); } },
+        { "slices (400), raw", [&](value* u) {
+            deserialize_value(u, &slices_raw[0], slices_raw.size()); } },
+        { "plan (4 beams), JSON", [&](value* u) {
+            parse_json_value(u, plan_json); } },
+        { "plan (4 beams), raw", [&](value* u) {
+            deserialize_value(u, &plan_raw[0], plan_raw.size()); } } };
+
+    std::cout << "without interned field names" << std::endl;
+    benchmark_decoders(decoders);
+
+    intern_field_names(slices);
+    intern_field_names(plan);
+
+    std::cout << "with interned field names" << std::endl;
+    benchmark_decoders(decoders);
+
+    return 0;
+}
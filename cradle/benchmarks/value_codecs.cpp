@@ -0,0 +1,165 @@
+#include <cradle/io/generic_io.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This compares the codecs that can be used to serialize values on values
+// that are representative of what ends up in the disk cache: CT images, dose
+// grids and structure contours. For each codec, it reports encoding and
+// decoding throughput (relative to the size of the raw encoding) and the
+// compression ratio.
+
+using namespace cradle;
+
+template<class Pixel>
+static blob make_pixel_blob(std::vector<Pixel> const& pixels)
+{
+    auto storage = std::make_shared<std::vector<Pixel> >(pixels);
+    blob b;
+    b.ownership = storage;
+    b.data = &(*storage)[0];
+    b.size = storage->size() * sizeof(Pixel);
+    return b;
+}
+
+static value make_image_value(blob const& pixels, int nx, int ny, int nz)
+{
+    value_list size;
+    size.push_back(value(integer(nx)));
+    size.push_back(value(integer(ny)));
+    size.push_back(value(integer(nz)));
+    value_map image;
+    image[value("size")] = value(size);
+    image[value("origin")] = value(value_list(3, value(-250.)));
+    image[value("spacing")] = value(value_list(3, value(1.)));
+    image[value("pixels")] = value(pixels);
+    return value(image);
+}
+
+// a CT-like image: a noisy ellipse of soft tissue surrounded by air
+static value make_ct_value()
+{
+    int const nx = 512, ny = 512, nz = 32;
+    std::vector<int16_t> pixels(nx * ny * nz);
+    std::srand(1);
+    for (int k = 0; k != nz; ++k)
+    {
+        for (int j = 0; j != ny; ++j)
+        {
+            for (int i = 0; i != nx; ++i)
+            {
+                double x = (i - nx / 2) / 200., y = (j - ny / 2) / 150.;
+                bool inside = x * x + y * y < 1;
+                pixels[(k * ny + j) * nx + i] = inside ?
+                    int16_t(40 + std::rand() % 32) : int16_t(-1000);
+            }
+        }
+    }
+    return make_image_value(make_pixel_blob(pixels), nx, ny, nz);
+}
+
+// a dose grid: a smooth falloff around a target, zero far away from it
+static value make_dose_value()
+{
+    int const n = 128;
+    std::vector<float> pixels(n * n * n);
+    for (int k = 0; k != n; ++k)
+    {
+        for (int j = 0; j != n; ++j)
+        {
+            for (int i = 0; i != n; ++i)
+            {
+                double dx = i - 64, dy = j - 60, dz = k - 70;
+                double d = std::sqrt(dx * dx + dy * dy + dz * dz);
+                pixels[(k * n + j) * n + i] =
+                    d < 60 ? float(70 * std::exp(-d * d / 800)) : 0.f;
+            }
+        }
+    }
+    return make_image_value(make_pixel_blob(pixels), n, n, n);
+}
+
+// a structure: a stack of contours, each a list of vertices
+static value make_structure_value()
+{
+    value_list slices;
+    for (int k = 0; k != 100; ++k)
+    {
+        value_list vertices;
+        for (int i = 0; i != 200; ++i)
+        {
+            double a = i * 2 * 3.14159265 / 200;
+            value_list vertex;
+            vertex.push_back(value(50 * std::cos(a) + k * 0.1));
+            vertex.push_back(value(40 * std::sin(a)));
+            vertices.push_back(value(vertex));
+        }
+        value_map slice;
+        slice[value("position")] = value(k * 2.5);
+        slice[value("vertices")] = value(vertices);
+        slices.push_back(value(slice));
+    }
+    value_map structure;
+    structure[value("name")] = value(string("PTV"));
+    structure[value("slices")] = value(slices);
+    return value(structure);
+}
+
+static string get_codec_label(value_codec codec)
+{
+    switch (codec)
+    {
+     case value_codec::ZLIB: return "zlib";
+     case value_codec::NONE: return "none";
+     case value_codec::LZ4: return "lz4";
+     case value_codec::ZSTD_FAST: return "zstd (fast)";
+     case value_codec::ZSTD: return "zstd";
+     case value_codec::ZSTD_HIGH: return "zstd (high)";
+     case value_codec::CHUNKED: return "chunked";
+     case value_codec::INDEXED: return "indexed";
+    }
+    return "";
+}
+
+static void benchmark_codecs(string const& label, value const& v)
+{
+    // The size of the uncompressed encoding is used as the basis for all
+    // the throughput numbers.
+    byte_vector uncompressed;
+    serialize_value(&uncompressed, v, 0, value_codec::NONE);
+    double raw_size = double(uncompressed.size());
+
+    std::cout << label << " (" << (uncompressed.size() / 1024)
+        << " KB, policy chooses "
+        << get_codec_label(choose_value_codec(v, deep_sizeof(v))) << ")"
+        << std::endl;
+
+    value_codec const codecs[] = { value_codec::ZLIB, value_codec::NONE,
+        value_codec::LZ4, value_codec::ZSTD_FAST, value_codec::ZSTD,
+        value_codec::ZSTD_HIGH, value_codec::CHUNKED, value_codec::INDEXED };
+    for (auto codec : codecs)
+    {
+        string codec_label = "  " + get_codec_label(codec);
+        byte_vector data;
+        double encode_time = time_per_iteration([&]() {
+            serialize_value(&data, v, 0, codec);
+        });
+        double decode_time = time_per_iteration([&]() {
+            value u;
+            deserialize_value(&u, &data[0], data.size());
+        });
+        report_throughput(codec_label + " encode", raw_size, encode_time);
+        report_throughput(codec_label + " decode", raw_size, decode_time);
+        report_value(codec_label + " ratio", raw_size / data.size(), "x");
+    }
+}
+
+int main()
+{
+    benchmark_codecs("CT image", make_ct_value());
+    benchmark_codecs("dose grid", make_dose_value());
+    benchmark_codecs("structure", make_structure_value());
+    return 0;
+}
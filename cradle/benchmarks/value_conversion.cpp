@@ -0,0 +1,96 @@
+#include <cradle/geometry/polygonal.hpp>
+#include <cradle/geometry/slicing.hpp>
+#include <cradle/imaging/image.hpp>
+#include <cmath>
+
+#include "benchmark.hpp"
+
+// This measures the cost of converting typed values to and from dynamic
+// values (and, for comparison, to and from their binary encodings), and of
+// the copying that goes on around those conversions (e.g., when a field is
+// pulled out of a record).
+
+using namespace cradle;
+
+static polygon2 make_circle(int n_vertices, double radius, double z)
+{
+    std::vector<vertex2> vertices;
+    for (int i = 0; i != n_vertices; ++i)
+    {
+        double a = i * 2 * 3.14159265 / n_vertices;
+        vertices.push_back(make_vector(radius * std::cos(a) + z * 0.01,
+            radius * std::sin(a)));
+    }
+    return make_polygon2(vertices);
+}
+
+static structure_geometry make_structure(int n_slices)
+{
+    structure_geometry structure;
+    for (int k = 0; k != n_slices; ++k)
+    {
+        double z = k * 2.5;
+        polyset region;
+        region.polygons.push_back(make_circle(60, 40, z));
+        region.polygons.push_back(make_circle(40, 10, z));
+        region.holes.push_back(make_circle(20, 5, z));
+        structure.slices[z] = region;
+        slice_description slice;
+        slice.position = z;
+        slice.thickness = 2.5;
+        structure.master_slice_list.push_back(slice);
+    }
+    return structure;
+}
+
+static image<3,float,shared> make_image(unsigned n)
+{
+    image<3,float,unique> img;
+    create_image(img, make_vector(n, n, n));
+    for (unsigned i = 0; i != n * n * n; ++i)
+        img.pixels.ptr[i] = float(i % 97);
+    return share(img);
+}
+
+template<class T>
+static void benchmark_conversions(string const& label, T const& x)
+{
+    std::cout << label << std::endl;
+
+    value v = to_value(x);
+    report_rate("  to_value", 1,
+        time_per_iteration([&]() { to_value(x); }));
+    report_rate("  from_value", 1,
+        time_per_iteration([&]() { from_value<T>(v); }));
+    report_rate("  round trip", 1,
+        time_per_iteration([&]() { from_value<T>(to_value(x)); }));
+
+    // For comparison, the direct binary encoding skips the dynamic value.
+    auto encoding = binary_encoding_of(x);
+    report_rate("  binary encode", 1,
+        time_per_iteration([&]() { binary_encoding_of(x); }));
+    report_rate("  binary decode", 1,
+        time_per_iteration([&]() {
+            T y;
+            decode_binary(&y, &encoding[0], encoding.size());
+        }));
+
+    // Copying the value and reading a field out of it are the sorts of
+    // things that happen constantly when values are passed between requests.
+    report_rate("  copy", 1,
+        time_per_iteration([&]() { value u = v; }));
+    value_map const& fields = cast<value_map>(v);
+    value first_field_name = fields.begin()->first;
+    report_rate("  get_field", 1,
+        time_per_iteration([&]() {
+            get_field(fields, cast<string>(first_field_name));
+        }));
+}
+
+int main()
+{
+    benchmark_conversions("structure_geometry (200 slices)",
+        make_structure(200));
+    benchmark_conversions("image<3,float> (128^3)", make_image(128));
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <cradle/io/generic_io.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include "benchmark.hpp"
+
+// This measures how much work goes into decoding values that are made up of
+// lots of small pieces, like the structure geometry that's passed around
+// between dose calculation tasks. It counts the heap allocations that each
+// decode performs (by replacing the global allocator), as well as timing it.
+
+using namespace cradle;
+
+static size_t allocation_count = 0;
+
+void* operator new(std::size_t size)
+{
+    ++allocation_count;
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+static blob make_vertices_blob(int n_vertices, double radius, double z)
+{
+    auto storage = std::make_shared<std::vector<double> >(n_vertices * 2);
+    for (int i = 0; i != n_vertices; ++i)
+    {
+        double a = i * 2 * 3.14159265 / n_vertices;
+        (*storage)[i * 2] = radius * std::cos(a) + z * 0.01;
+        (*storage)[i * 2 + 1] = radius * std::sin(a);
+    }
+    blob b;
+    b.ownership = storage;
+    b.data = &(*storage)[0];
+    b.size = storage->size() * sizeof(double);
+    return b;
+}
+
+static value make_polygon_value(int n_vertices, double radius, double z)
+{
+    value_map polygon;
+    polygon[value("vertices")] =
+        value(make_vertices_blob(n_vertices, radius, z));
+    return value(polygon);
+}
+
+// a structure_geometry-like value: a map from slice positions to polysets,
+// each of which has a couple of polygons and a hole
+static value make_structure_geometry_value(int n_slices)
+{
+    value_map slices;
+    for (int k = 0; k != n_slices; ++k)
+    {
+        double z = k * 2.5;
+        value_list polygons;
+        polygons.push_back(make_polygon_value(60, 40, z));
+        polygons.push_back(make_polygon_value(40, 10, z));
+        value_list holes;
+        holes.push_back(make_polygon_value(20, 5, z));
+        value_map polyset;
+        polyset[value("polygons")] = value(polygons);
+        polyset[value("holes")] = value(holes);
+        value_map slice;
+        slice[value("position")] = value(z);
+        slice[value("thickness")] = value(2.5);
+        slices[value(z)] = value(value_map{
+            { value("region"), value(polyset) },
+            { value("slice"), value(slice) } });
+    }
+    return value(slices);
+}
+
+static void benchmark_decoding(string const& label, value const& v)
+{
+    byte_vector uncompressed;
+    serialize_value(&uncompressed, v, 0, value_codec::NONE);
+    double raw_size = double(uncompressed.size());
+    std::cout << label << " (" << (uncompressed.size() / 1024) << " KB)"
+        << std::endl;
+
+    byte_vector compressed;
+    serialize_value(&compressed, v, 0, value_codec::ZSTD);
+    blob mapped;
+    {
+        auto storage = std::make_shared<byte_vector>(uncompressed);
+        mapped.ownership = storage;
+        mapped.data = &(*storage)[0];
+        mapped.size = storage->size();
+    }
+
+    auto benchmark_decoder = [&](string const& decoder_label,
+        std::function<void(value*)> const& decode)
+    {
+        {
+            value u;
+            size_t initial_count = allocation_count;
+            decode(&u);
+            report_value("  " + decoder_label + " allocations",
+                double(allocation_count - initial_count), "");
+        }
+        double decode_time = time_per_iteration([&]() {
+            value u;
+            decode(&u);
+        });
+        report_throughput("  " + decoder_label, raw_size, decode_time);
+    };
+
+    benchmark_decoder("none (copied)", [&](value* u) {
+        deserialize_value(u, &uncompressed[0], uncompressed.size());
+    });
+    benchmark_decoder("none (mapped)", [&](value* u) {
+        deserialize_value(u, mapped);
+    });
+    benchmark_decoder("zstd", [&](value* u) {
+        deserialize_value(u, &compressed[0], compressed.size());
+    });
+}
+
+int main()
+{
+    benchmark_decoding("structure geometry (20 slices)",
+        make_structure_geometry_value(20));
+    benchmark_decoding("structure geometry (200 slices)",
+        make_structure_geometry_value(200));
+    return 0;
+}
@@ -0,0 +1,42 @@
+# - Try to find LZ4
+# Once done this will define
+#
+#  LZ4_INCLUDE_DIR
+#  LZ4_LIBRARIES, the libraries to link against to use LZ4.
+#  LZ4_FOUND, If false, do not try to use LZ4
+
+IF (LZ4_LIBRARIES AND LZ4_INCLUDE_DIR)
+    SET(LZ4_FIND_QUIETLY TRUE) # Already in cache, be silent
+ENDIF (LZ4_LIBRARIES AND LZ4_INCLUDE_DIR)
+
+FIND_PATH(LZ4_INCLUDE_DIR lz4.h
+    /usr/include
+    /usr/local/include
+)
+
+FIND_LIBRARY(LZ4_LIBRARY NAMES lz4 liblz4 PATHS
+    /usr/lib
+    /usr/local/lib
+)
+
+IF (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+        SET(LZ4_FOUND 1)
+        SET(LZ4_LIBRARIES ${LZ4_LIBRARY})
+ELSE (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+        SET(LZ4_FOUND 0)
+        SET(LZ4_LIBRARIES)
+ENDIF (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+
+IF (NOT LZ4_FOUND)
+    SET(LZ4_DIR_MESSAGE "LZ4 was not found. Make sure LZ4_LIBRARY and LZ4_INCLUDE_DIR are set.")
+    IF (LZ4_FIND_REQUIRED)
+        MESSAGE(FATAL_ERROR "${LZ4_DIR_MESSAGE}")
+    ELSEIF (NOT LZ4_FIND_QUIETLY)
+        MESSAGE(STATUS "${LZ4_DIR_MESSAGE}")
+    ENDIF (LZ4_FIND_REQUIRED)
+ENDIF (NOT LZ4_FOUND)
+
+MARK_AS_ADVANCED(
+    LZ4_INCLUDE_DIR
+    LZ4_LIBRARIES
+)
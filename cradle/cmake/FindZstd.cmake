@@ -0,0 +1,42 @@
+# - Try to find Zstd
+# Once done this will define
+#
+#  ZSTD_INCLUDE_DIR
+#  ZSTD_LIBRARIES, the libraries to link against to use Zstd.
+#  ZSTD_FOUND, If false, do not try to use Zstd
+
+IF (ZSTD_LIBRARIES AND ZSTD_INCLUDE_DIR)
+    SET(ZSTD_FIND_QUIETLY TRUE) # Already in cache, be silent
+ENDIF (ZSTD_LIBRARIES AND ZSTD_INCLUDE_DIR)
+
+FIND_PATH(ZSTD_INCLUDE_DIR zstd.h
+    /usr/include
+    /usr/local/include
+)
+
+FIND_LIBRARY(ZSTD_LIBRARY NAMES zstd libzstd PATHS
+    /usr/lib
+    /usr/local/lib
+)
+
+IF (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+        SET(ZSTD_FOUND 1)
+        SET(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+ELSE (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+        SET(ZSTD_FOUND 0)
+        SET(ZSTD_LIBRARIES)
+ENDIF (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+
+IF (NOT ZSTD_FOUND)
+    SET(ZSTD_DIR_MESSAGE "Zstd was not found. Make sure ZSTD_LIBRARY and ZSTD_INCLUDE_DIR are set.")
+    IF (ZSTD_FIND_REQUIRED)
+        MESSAGE(FATAL_ERROR "${ZSTD_DIR_MESSAGE}")
+    ELSEIF (NOT ZSTD_FIND_QUIETLY)
+        MESSAGE(STATUS "${ZSTD_DIR_MESSAGE}")
+    ENDIF (ZSTD_FIND_REQUIRED)
+ENDIF (NOT ZSTD_FOUND)
+
+MARK_AS_ADVANCED(
+    ZSTD_INCLUDE_DIR
+    ZSTD_LIBRARIES
+)
@@ -55,6 +55,14 @@ function(resolve_cradle_dependencies output_prefix)
     list(APPEND include_dirs ${ZLIB_INCLUDE_DIR})
     list(APPEND libraries ${ZLIB_LIBRARIES})
 
+    # LZ4 and Zstandard (used along with zlib to compress cached values)
+    find_package(LZ4 REQUIRED)
+    list(APPEND include_dirs ${LZ4_INCLUDE_DIR})
+    list(APPEND libraries ${LZ4_LIBRARIES})
+    find_package(Zstd REQUIRED)
+    list(APPEND include_dirs ${ZSTD_INCLUDE_DIR})
+    list(APPEND libraries ${ZSTD_LIBRARIES})
+
     # Boost
     add_definitions(-DBOOST_ALL_NO_LIB)
     find_package(Boost
@@ -226,6 +226,34 @@ let enum_deep_sizeof_definition e =
     "static inline size_t deep_sizeof(" ^ e.enum_id ^ ") " ^
     "{ return sizeof(" ^ e.enum_id ^ "); } "
 
+(* Enums are encoded as 32-bit integers. The schema hash covers the value
+   IDs, since they determine the meaning of those integers. *)
+let enum_binary_encoding_definitions e =
+    "static inline void write_binary(cradle::binary_writer& w, " ^
+        e.enum_id ^ " x) " ^
+    "{ " ^
+    "cradle::uint32_t n = cradle::uint32_t(x); " ^
+    "cradle::write_binary_bytes(w, &n, sizeof(n)); " ^
+    "} " ^
+    "static inline void read_binary(cradle::binary_reader& r, " ^
+        e.enum_id ^ "* x) " ^
+    "{ " ^
+    "cradle::uint32_t n; " ^
+    "cradle::read_binary_bytes(r, &n, sizeof(n)); " ^
+    "if (n >= get_value_count(" ^ e.enum_id ^ "())) " ^
+        "throw cradle::corrupt_binary_data(); " ^
+    "*x = " ^ e.enum_id ^ "(n); " ^
+    "} " ^
+    "static inline cradle::uint64_t get_binary_schema_hash(" ^
+        e.enum_id ^ ") " ^
+    "{ " ^
+    "return cradle::hash_binary_schema_description(\"enum " ^
+        e.enum_id ^ "{" ^
+        (String.concat ","
+            (List.map (fun v -> String.uppercase v.ev_id) e.enum_values)) ^
+        "}\"); " ^
+    "} "
+
 let hpp_string_of_enum account_id app_id namespace e =
     (enum_declaration e) ^
     (enum_type_info_declaration e) ^
@@ -233,6 +261,7 @@ let hpp_string_of_enum account_id app_id namespace e =
     (enum_hash_declaration namespace e) ^
     (enum_query_declarations e) ^
     (enum_conversion_declarations e)  ^
+    (enum_binary_encoding_definitions e) ^
     (enum_upgrade_type_declarations e) ^
     (enum_upgrade_declaration e) 
 
@@ -516,6 +516,12 @@ let structure_request_declaration s =
                 structure_request_declaration_instance label assignments s)
             instantiations))
 
+(* Generate the C++ code to declare the interned key for a field. This is a
+   static, so the name is only looked up once. *)
+let field_key_declaration f =
+    "static cradle::field_key const " ^ f.field_id ^ "_key = " ^
+        "cradle::intern_field_name(\"" ^ f.field_id ^ "\"); "
+
 (* Generate the C++ code to convert a structure to and from a dynamic value. *)
 let structure_value_conversion_implementation s =
     (template_parameters_declaration s.structure_parameters) ^
@@ -529,7 +535,8 @@ let structure_value_conversion_implementation s =
       | None -> "") ^
     (String.concat ""
         (List.map (fun f ->
-            "write_field_to_record(record, \"" ^ f.field_id ^ "\", x." ^
+            (field_key_declaration f) ^
+            "write_field_to_record(record, " ^ f.field_id ^ "_key, x." ^
                 f.field_id ^ "); ")
         s.structure_fields)) ^
     "} " ^
@@ -552,8 +559,9 @@ let structure_value_conversion_implementation s =
       | None -> "") ^
     (String.concat ""
         (List.map (fun f ->
-            "read_field_from_record(&x." ^ f.field_id ^ ", record, \"" ^
-                f.field_id ^ "\"); ")
+            (field_key_declaration f) ^
+            "read_field_from_record(&x." ^ f.field_id ^ ", record, " ^
+                f.field_id ^ "_key); ")
         s.structure_fields)) ^
     "} " ^
     (template_parameters_declaration s.structure_parameters) ^
@@ -610,6 +618,105 @@ let structure_value_conversion_declarations s =
     else
         (structure_value_conversion_implementation s)
 
+(* Generate the C++ code to write and read a structure's binary encoding.
+   Fields are encoded in order, after those of the structure's super type.
+   write_binary_fields writes the same encoding but also records where each
+   field lies within it. *)
+let structure_binary_encoding_implementation s =
+    (template_parameters_declaration s.structure_parameters) ^
+    "void write_binary(cradle::binary_writer& w, " ^
+        (full_structure_type s) ^ " const& x) " ^
+    "{ " ^
+    "using cradle::write_binary; " ^
+    (match s.structure_super with
+        Some super -> "write_binary(w, as_" ^ super ^ "(x)); "
+      | None -> "") ^
+    (String.concat ""
+        (List.map (fun f ->
+            "write_binary(w, x." ^ f.field_id ^ "); ")
+        s.structure_fields)) ^
+    "} " ^
+    (template_parameters_declaration s.structure_parameters) ^
+    "void read_binary(cradle::binary_reader& r, " ^
+        (full_structure_type s) ^ "* x) " ^
+    "{ " ^
+    "using cradle::read_binary; " ^
+    (match s.structure_super with
+        Some super -> "read_binary(r, &as_" ^ super ^ "(*x)); "
+      | None -> "") ^
+    (String.concat ""
+        (List.map (fun f ->
+            "read_binary(r, &x->" ^ f.field_id ^ "); ")
+        s.structure_fields)) ^
+    "} " ^
+    (template_parameters_declaration s.structure_parameters) ^
+    "bool write_binary_fields(cradle::binary_writer& w, " ^
+        (full_structure_type s) ^ " const& x, " ^
+        "cradle::binary_field_index* index) " ^
+    "{ " ^
+    "using cradle::write_binary; " ^
+    (match s.structure_super with
+        Some super -> "write_binary(w, as_" ^ super ^ "(x)); "
+      | None -> "") ^
+    (if s.structure_fields <> [] then "std::size_t begin; " else "") ^
+    (String.concat ""
+        (List.map (fun f ->
+            "begin = w.buffer->size(); " ^
+            "write_binary(w, x." ^ f.field_id ^ "); " ^
+            "cradle::add_binary_field(index, \"" ^ f.field_id ^
+                "\", begin, w); ")
+        s.structure_fields)) ^
+    "return true; " ^
+    "} " ^
+    (template_parameters_declaration s.structure_parameters) ^
+    "cradle::uint64_t get_binary_schema_hash(" ^
+        (full_structure_type s) ^ " const& x) " ^
+    "{ " ^
+    "static cradle::binary_schema_hash_cache cache; " ^
+    "cradle::binary_schema_hash_computation computation(cache, " ^
+        "\"struct " ^ (full_structure_type s) ^ "{" ^
+        (match s.structure_super with
+            Some super -> ":" ^ super ^ ";"
+          | None -> "") ^
+        (String.concat "" (List.map field_declaration s.structure_fields)) ^
+        "}\"); " ^
+    "if (computation.needs_parts()) { " ^
+    "using cradle::get_binary_schema_hash; " ^
+    (match s.structure_super with
+        Some super ->
+            "computation.add(get_binary_schema_hash(as_" ^ super ^ "(x))); "
+      | None -> "") ^
+    (String.concat ""
+        (List.map (fun f ->
+            "computation.add(get_binary_schema_hash(x." ^ f.field_id ^
+                ")); ")
+        s.structure_fields)) ^
+    "} " ^
+    "return computation.result(); " ^
+    "} "
+
+(* Generate the definitions of the binary encoding functions. *)
+let structure_binary_encoding_definitions s =
+    if not (has_parameters s) then
+        (structure_binary_encoding_implementation s)
+    else
+        ""
+
+(* Generate the declarations of the binary encoding functions. *)
+let structure_binary_encoding_declarations s =
+    if not (has_parameters s) then
+        "void write_binary(cradle::binary_writer& w, " ^
+            s.structure_id ^ " const& x); " ^
+        "void read_binary(cradle::binary_reader& r, " ^
+            s.structure_id ^ "* x); " ^
+        "bool write_binary_fields(cradle::binary_writer& w, " ^
+            s.structure_id ^ " const& x, " ^
+            "cradle::binary_field_index* index); " ^
+        "cradle::uint64_t get_binary_schema_hash(" ^
+            s.structure_id ^ " const& x); "
+    else
+        (structure_binary_encoding_implementation s)
+
 (* Generate the iostream interface for a structure. *)
 let structure_iostream_implementation s =
     (template_parameters_declaration s.structure_parameters) ^
@@ -1000,6 +1107,7 @@ let hpp_string_of_structure app_id app_namespace env s =
     (structure_swap_declaration s) ^
     (structure_deep_sizeof_declaration s) ^
     (structure_value_conversion_declarations s) ^
+    (structure_binary_encoding_declarations s) ^
     (if structure_component_is_preexisting s "iostream"
         then ""
         else structure_iostream_declarations s) ^
@@ -1024,6 +1132,7 @@ let cpp_string_of_structure account_id app_id app_namespace env s =
     (structure_swap_implementation s) ^
     (structure_deep_sizeof_implementation s) ^
     (structure_value_conversion_definitions s) ^
+    (structure_binary_encoding_definitions s) ^
     (if structure_component_is_preexisting s "iostream"
         then ""
         else structure_iostream_definitions s) ^
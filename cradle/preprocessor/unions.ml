@@ -357,6 +357,12 @@ let union_conversion_declarations u =
     "void from_value(" ^ u.union_id ^ "* x, cradle::value const& v); " ^
     "std::ostream& operator<<(std::ostream& s, " ^ u.union_id ^ " const& x); "
 
+(* Generate the C++ code to declare the interned key for a union member.
+   This is a static, so the name is only looked up once. *)
+let union_member_key_declaration m =
+    "static cradle::field_key const key = " ^
+        "cradle::intern_field_name(\"" ^ m.um_id ^ "\"); "
+
 let union_conversion_definitions u =
     "void to_value(cradle::value* v, " ^ u.union_id ^ " const& x) " ^
     "{ " ^
@@ -366,8 +372,11 @@ let union_conversion_definitions u =
     (String.concat ""
         (List.map (fun m ->
             "case " ^ (cpp_enum_value_of_union_member u m) ^ ": " ^
-            "to_value(&s[value(\"" ^ m.um_id ^ "\")], as_" ^ m.um_id ^ "(x)); " ^
-            "break; ")
+            " { " ^
+            (union_member_key_declaration m) ^
+            "to_value(&s[key.key()], as_" ^ m.um_id ^ "(x)); " ^
+            "break; " ^
+            " } ")
             u.union_members)) ^
     "} " ^
     "v->swap_in(s); " ^
@@ -383,8 +392,9 @@ let union_conversion_definitions u =
         (List.map (fun m ->
             "case " ^ (cpp_enum_value_of_union_member u m) ^ ": " ^
             " { " ^
+            (union_member_key_declaration m) ^
             (cpp_code_for_type m.um_type) ^ " tmp; " ^
-            "from_value(&tmp, get_field(s, \"" ^ m.um_id ^ "\")); " ^
+            "from_value(&tmp, get_field(s, key)); " ^
             "x->contents_ = tmp; " ^
             "break; " ^
             " } ")
@@ -394,6 +404,72 @@ let union_conversion_definitions u =
     "std::ostream& operator<<(std::ostream& s, " ^ u.union_id ^ " const& x) "^
     "{ return generic_ostream_operator(s, x); } "
 
+(* A union is encoded as its type followed by its active member. *)
+let union_binary_encoding_declarations u =
+    "void write_binary(cradle::binary_writer& w, " ^
+        u.union_id ^ " const& x); " ^
+    "void read_binary(cradle::binary_reader& r, " ^ u.union_id ^ "* x); " ^
+    "cradle::uint64_t get_binary_schema_hash(" ^
+        u.union_id ^ " const& x); "
+
+let union_binary_encoding_definitions u =
+    "void write_binary(cradle::binary_writer& w, " ^
+        u.union_id ^ " const& x) " ^
+    "{ " ^
+    "using cradle::write_binary; " ^
+    "write_binary(w, x.type); " ^
+    "switch (x.type) " ^
+    "{ " ^
+    (String.concat ""
+        (List.map (fun m ->
+            "case " ^ (cpp_enum_value_of_union_member u m) ^ ": " ^
+            "write_binary(w, as_" ^ m.um_id ^ "(x)); " ^
+            "break; ")
+            u.union_members)) ^
+    "} " ^
+    "} " ^
+    "void read_binary(cradle::binary_reader& r, " ^ u.union_id ^ "* x) " ^
+    "{ " ^
+    "using cradle::read_binary; " ^
+    "read_binary(r, &x->type); " ^
+    "switch (x->type) " ^
+    "{ " ^
+    (String.concat ""
+        (List.map (fun m ->
+            "case " ^ (cpp_enum_value_of_union_member u m) ^ ": " ^
+            " { " ^
+            (cpp_code_for_type m.um_type) ^ " tmp; " ^
+            "read_binary(r, &tmp); " ^
+            "x->contents_ = std::move(tmp); " ^
+            "break; " ^
+            " } ")
+            u.union_members)) ^
+    "} " ^
+    "} " ^
+    "cradle::uint64_t get_binary_schema_hash(" ^
+        u.union_id ^ " const& x) " ^
+    "{ " ^
+    "static cradle::binary_schema_hash_cache cache; " ^
+    "cradle::binary_schema_hash_computation computation(cache, " ^
+        "\"union " ^ u.union_id ^ "{" ^
+        (String.concat ""
+            (List.map (fun m ->
+                (cpp_code_for_type m.um_type) ^ " " ^ m.um_id ^ ";")
+                u.union_members)) ^
+        "}\"); " ^
+    "if (computation.needs_parts()) { " ^
+    "using cradle::get_binary_schema_hash; " ^
+    (String.concat ""
+        (List.map (fun m ->
+            "{ " ^
+            (cpp_code_for_type m.um_type) ^ " tmp; " ^
+            "computation.add(get_binary_schema_hash(tmp)); " ^
+            "} ")
+            u.union_members)) ^
+    "} " ^
+    "return computation.result(); " ^
+    "} "
+
 let union_swap_declaration u =
     "void swap(" ^ u.union_id ^ "& a, " ^ u.union_id ^ "& b); "
 
@@ -493,6 +569,7 @@ let hpp_string_of_union account_id app_id namespace u =
     (union_hash_declarations namespace u) ^
     (union_swap_declaration u) ^
     (union_conversion_declarations u) ^
+    (union_binary_encoding_declarations u) ^
     (union_deep_sizeof_declaration u) ^     
     (union_upgrade_type_info_declaration u) ^
     (union_auto_upgrade_value_declaration u) ^
@@ -507,6 +584,7 @@ let cpp_string_of_union account_id app_id namespace u =
     (union_hash_definitions namespace u) ^
     (union_swap_definition u) ^
     (union_conversion_definitions u) ^
+    (union_binary_encoding_definitions u) ^
     (union_deep_sizeof_definition u) ^
     (union_upgrade_type_info_definition app_id u) ^
     (union_auto_upgrade_value_definition app_id u) ^
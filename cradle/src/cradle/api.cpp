@@ -428,6 +428,27 @@ generate_api_upgrades(api_implementation const& api)
     return upgrades;
 }
 
+unsigned get_core_count(api_function_interface const& f)
+{
+    auto const& execution_class = f.api_info.execution_class;
+    char const prefix[] = "cpu.x";
+    size_t const prefix_length = sizeof(prefix) - 1;
+    if (execution_class.compare(0, prefix_length, prefix) != 0 ||
+        execution_class.length() == prefix_length)
+    {
+        return 1;
+    }
+    unsigned count = 0;
+    for (size_t i = prefix_length; i != execution_class.length(); ++i)
+    {
+        char c = execution_class[i];
+        if (c < '0' || c > '9' || count > 0xffff)
+            return 1;
+        count = count * 10 + unsigned(c - '0');
+    }
+    return count != 0 ? count : 1;
+}
+
 api_function_interface const&
 find_function_by_name(api_implementation const& api, string const& name)
 {
@@ -306,6 +306,11 @@ bool static inline
 is_reported(api_function_interface const& f)
 { return f.implementation_info.flags & FUNCTION_IS_REPORTED; }
 
+// Get the number of CPU cores that a function's execution class calls for.
+// An execution class of the form "cpu.xN" calls for N cores, and anything
+// else is taken to mean one.
+unsigned get_core_count(api_function_interface const& f);
+
 typedef alia__shared_ptr<api_function_interface> api_function_ptr;
 
 api(struct)
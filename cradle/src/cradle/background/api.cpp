@@ -1,5 +1,9 @@
 #include <cradle/background/internals.hpp>
 
+#include <algorithm>
+
+#include <boost/thread/tss.hpp>
+
 namespace cradle {
 
 // JOBS
@@ -86,8 +90,8 @@ void queue_background_job(
     switch (queue)
     {
      case background_job_queue_type::CALCULATION:
-        queue_background_job<background_job_execution_loop>(
-            system.impl_->pools[int(queue)], job_ptr);
+        queue_background_job(*system.impl_->pools[int(queue)].executor,
+            job_ptr);
         break;
      case background_job_queue_type::DISK:
         queue_background_job<background_job_execution_loop>(
@@ -139,7 +143,7 @@ void add_untyped_background_job(
 {
     auto* record = ptr.record();
     {
-        boost::lock_guard<boost::mutex> lock(record->owner_cache->mutex);
+        boost::lock_guard<boost::mutex> lock(record->owner_segment->mutex);
         // Check that the pointer actually needs a job.
         // It's possible that another thread already added one.
         if (record->state == background_data_state::NOWHERE)
@@ -186,19 +190,28 @@ void retry_background_job(
 
 // CACHING
 
+background_cache_segment&
+get_cache_segment(background_cache& cache, id_interface const& key)
+{
+    // The hash is mixed before it's used, since the low bits also select
+    // the bucket within the segment's map, and segments shouldn't end up
+    // with only some of their buckets in use.
+    uint64_t hash = uint64_t(key.hash()) * 0x9e3779b97f4a7c15ull;
+    return cache.segments[hash >> 60];
+}
+
 void static
-remove_from_eviction_list(
-    background_cache& cache, background_cache_record* record);
+remove_from_eviction_list(background_cache_record* record);
 
 void static
 acquire_cache_record_no_lock(background_cache_record* record)
 {
     ++record->ref_count;
-    auto& evictions = record->owner_cache->eviction_list.records;
+    auto& evictions = record->owner_segment->eviction_list.records;
     if (record->eviction_list_iterator != evictions.end())
     {
         assert(record->ref_count == 1);
-        remove_from_eviction_list(*record->owner_cache, record);
+        remove_from_eviction_list(record);
     }
 }
 
@@ -215,94 +228,166 @@ background_cache_record* acquire_cache_record(
     background_execution_system& system, id_interface const& key)
 {
     auto& cache = system.impl_->cache;
-    boost::lock_guard<boost::mutex> lock(cache.mutex);
-    auto i = cache.records.find(&key);
-    if (i == cache.records.end())
+    auto& segment = get_cache_segment(cache, key);
+    boost::lock_guard<boost::mutex> lock(segment.mutex);
+    background_cache_record* r;
+    auto i = segment.records.find(&key);
+    if (i != segment.records.end())
+        r = &i->second;
+    else
     {
-        background_cache_record r;
-        r.owner_cache = &cache;
-        r.eviction_list_iterator = cache.eviction_list.records.end();
-        r.key.store(key);
-        r.state = background_data_state::NOWHERE;
-        r.progress = 0;
-        r.ref_count = 0;
-        r.job.reset(new background_job_controller);
-        i = cache.records.insert(
-                cache_record_map::value_type(&r.key.get(), r)).first;
+        owned_id owned_key;
+        owned_key.store(key);
+        // (The map's key points to the record's copy of the ID, which shares
+        // its storage with owned_key.)
+        r = &segment.records[&owned_key.get()];
+        r->owner_cache = &cache;
+        r->owner_segment = &segment;
+        r->eviction_list_iterator = segment.eviction_list.records.end();
+        r->key = owned_key;
+        r->job.reset(new background_job_controller);
     }
-    background_cache_record* r = &i->second;
     acquire_cache_record_no_lock(r);
     return r;
 }
 
 void acquire_cache_record(background_cache_record* record)
 {
-    boost::lock_guard<boost::mutex> lock(record->owner_cache->mutex);
+    boost::lock_guard<boost::mutex> lock(record->owner_segment->mutex);
     acquire_cache_record_no_lock(record);
 }
 
+// Update a segment's oldest_use to reflect the front of its eviction list.
+// The segment mutex must be held.
 void static
-add_to_eviction_list(background_cache& cache, background_cache_record* record)
+update_oldest_use(background_cache_segment& segment)
 {
-    auto& list = cache.eviction_list;
+    auto const& records = segment.eviction_list.records;
+    segment.oldest_use =
+        records.empty() ? no_cache_record_use : records.front()->last_use;
+}
+
+// The segment mutex must be held for these.
+
+void static
+add_to_eviction_list(background_cache_record* record)
+{
+    auto& cache = *record->owner_cache;
+    auto& segment = *record->owner_segment;
+    auto& list = segment.eviction_list;
     assert(record->eviction_list_iterator == list.records.end());
+    record->last_use = ++cache.use_counter;
     record->eviction_list_iterator =
         list.records.insert(list.records.end(), record);
     if (record->data.ptr)
-        list.total_size += record->data.ptr->deep_size();
+    {
+        size_t size = record->data.ptr->deep_size();
+        list.total_size += size;
+        cache.evictable_size += size;
+    }
+    if (list.records.size() == 1)
+        update_oldest_use(segment);
 }
 
 void static
-remove_from_eviction_list(background_cache& cache, background_cache_record* record)
+remove_from_eviction_list(background_cache_record* record)
 {
-    auto& list = cache.eviction_list;
+    auto& cache = *record->owner_cache;
+    auto& segment = *record->owner_segment;
+    auto& list = segment.eviction_list;
     assert(record->eviction_list_iterator != list.records.end());
+    bool was_oldest = record->eviction_list_iterator == list.records.begin();
     list.records.erase(record->eviction_list_iterator);
     record->eviction_list_iterator = list.records.end();
     if (record->data.ptr)
-        list.total_size -= record->data.ptr->deep_size();
+    {
+        size_t size = record->data.ptr->deep_size();
+        list.total_size -= size;
+        cache.evictable_size -= size;
+    }
+    if (was_oldest)
+        update_oldest_use(segment);
 }
 
 void reduce_memory_cache_size(background_cache& cache, int desired_size)
 {
+    size_t desired_bytes = size_t(desired_size) * 0x100000;
     // We need to keep the jobs around until after the mutex is released
     // because they may recursively release other records.
     std::list<alia__shared_ptr<background_job_controller> > evicted_jobs;
+    // Any jobs that were waiting on the evicted records are released so that
+    // they can gather their inputs again.
+    std::vector<background_job_ptr> dependent_jobs;
+    while (cache.evictable_size > desired_bytes)
     {
-        boost::lock_guard<boost::mutex> lock(cache.mutex);
-        while (!cache.eviction_list.records.empty() &&
-            cache.eviction_list.total_size > desired_size * 0x100000)
+        // Find the segment with the least recently used record, along with
+        // the last_use of the oldest record in any other segment.
+        background_cache_segment* oldest_segment = 0;
+        uint64_t oldest_use = no_cache_record_use;
+        uint64_t next_oldest_use = no_cache_record_use;
+        for (auto& segment : cache.segments)
+        {
+            uint64_t use = segment.oldest_use;
+            if (use < oldest_use)
+            {
+                next_oldest_use = oldest_use;
+                oldest_use = use;
+                oldest_segment = &segment;
+            }
+            else if (use < next_oldest_use)
+                next_oldest_use = use;
+        }
+        if (!oldest_segment)
+            break;
+
+        // Evict from that segment until its oldest record is more recent
+        // than the other segments' (but always at least one record, so that
+        // this makes progress even if the segments are changing).
+        auto& segment = *oldest_segment;
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
+        auto& list = segment.eviction_list;
+        while (!list.records.empty() &&
+            cache.evictable_size > desired_bytes)
         {
-            auto const& i = cache.eviction_list.records.front();
-            auto data_size = i->data.ptr ? i->data.ptr->deep_size() : 0;
-            evicted_jobs.push_back(i->job);
-            cache.records.erase(&i->key.get());
-            cache.eviction_list.records.pop_front();
-            cache.eviction_list.total_size -= data_size;
+            auto* record = list.records.front();
+            auto data_size =
+                record->data.ptr ? record->data.ptr->deep_size() : 0;
+            evicted_jobs.push_back(record->job);
+            dependent_jobs.insert(dependent_jobs.end(),
+                record->dependent_jobs.begin(), record->dependent_jobs.end());
+            list.records.pop_front();
+            segment.records.erase(&record->key.get());
+            list.total_size -= data_size;
+            cache.evictable_size -= data_size;
+            if (!list.records.empty() &&
+                list.records.front()->last_use > next_oldest_use)
+            {
+                break;
+            }
         }
+        update_oldest_use(segment);
     }
     for (auto const& i : evicted_jobs)
     {
         if (i->is_valid())
             i->cancel();
     }
+    if (!dependent_jobs.empty())
+        release_dependent_jobs(*cache.executor, dependent_jobs);
 }
 
 void release_cache_record(background_cache_record* record)
 {
-    auto& cache = *record->owner_cache;
-    {
-        boost::lock_guard<boost::mutex> lock(cache.mutex);
-        --record->ref_count;
-        if (record->ref_count == 0)
-            add_to_eviction_list(cache, record);
-    }
+    boost::lock_guard<boost::mutex> lock(record->owner_segment->mutex);
+    --record->ref_count;
+    if (record->ref_count == 0)
+        add_to_eviction_list(record);
 }
 
 background_job_controller*
 get_job_interface(background_cache_record* record)
 {
-    boost::lock_guard<boost::mutex> lock(record->owner_cache->mutex);
+    boost::lock_guard<boost::mutex> lock(record->owner_segment->mutex);
     return record->job.get();
 }
 
@@ -310,13 +395,13 @@ void update_background_data_progress(
     background_execution_system& system, id_interface const& key,
     float progress)
 {
-    auto& cache = system.impl_->cache;
+    auto& segment = get_cache_segment(system.impl_->cache, key);
 
     {
-        boost::lock_guard<boost::mutex> lock(cache.mutex);
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
 
-        auto i = cache.records.find(&key);
-        if (i == cache.records.end())
+        auto i = segment.records.find(&key);
+        if (i == segment.records.end())
             return;
 
         background_cache_record* r = &i->second;
@@ -329,45 +414,69 @@ void set_cached_data(
     untyped_immutable const& data)
 {
     auto& cache = system.impl_->cache;
+    auto& segment = get_cache_segment(cache, key);
 
+    std::vector<background_job_ptr> dependent_jobs;
     {
-        boost::lock_guard<boost::mutex> lock(cache.mutex);
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
 
-        auto i = cache.records.find(&key);
-        if (i == cache.records.end())
+        auto i = segment.records.find(&key);
+        if (i == segment.records.end())
             return;
 
         background_cache_record* r = &i->second;
+        // If the record is waiting to be evicted, its size is about to
+        // change.
+        bool in_eviction_list =
+            r->eviction_list_iterator != segment.eviction_list.records.end();
+        if (in_eviction_list)
+            remove_from_eviction_list(r);
         r->data = data;
-        r->state = background_data_state::READY;
         r->progress = 0;
+        // The data has to be in place before the state says that it's ready.
+        r->state = background_data_state::READY;
         // Ideally, the job controller should be reset here, since we don't
         // really need it anymore, but this causes some tricky synchronization
         // issues with the UI code that's observing it.
         //r->job->reset();
+        swap(dependent_jobs, r->dependent_jobs);
+        if (in_eviction_list)
+            add_to_eviction_list(r);
     }
 
-    // Setting this data could've made it possible for any of the waiting
-    // calculation jobs to run.
-    wake_up_waiting_jobs(*system.impl_->pools[
-        int(background_job_queue_type::CALCULATION)].queue);
+    // The jobs that were waiting on this data might be able to run now.
+    if (!dependent_jobs.empty())
+        release_dependent_jobs(*cache.executor, dependent_jobs);
+
+    // Setting this data could've also made it possible for any of the
+    // (untracked) waiting calculation jobs to run.
+    wake_up_waiting_jobs(system.impl_->pools[
+        int(background_job_queue_type::CALCULATION)]);
 }
 
 void
 reset_cached_data(background_execution_system& system, id_interface const& key)
 {
     auto& cache = system.impl_->cache;
+    auto& segment = get_cache_segment(cache, key);
 
+    std::vector<background_job_ptr> dependent_jobs;
     {
-        boost::lock_guard<boost::mutex> lock(cache.mutex);
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
 
-        auto i = cache.records.find(&key);
-        if (i == cache.records.end())
+        auto i = segment.records.find(&key);
+        if (i == segment.records.end())
             return;
 
         background_cache_record* r = &i->second;
         r->state = background_data_state::NOWHERE;
+        swap(dependent_jobs, r->dependent_jobs);
     }
+
+    // Nothing is computing the data anymore, so the jobs that were waiting
+    // on it have to see that for themselves.
+    if (!dependent_jobs.empty())
+        release_dependent_jobs(*cache.executor, dependent_jobs);
 }
 
 string get_key_string(background_cache_record* record)
@@ -375,6 +484,106 @@ string get_key_string(background_cache_record* record)
     return to_string(record->key);
 }
 
+// DEPENDENCY TRACKING
+
+void static
+ignore_input_collector(background_input_collector* collector)
+{
+    // The collector belongs to the execution loop.
+}
+
+static boost::thread_specific_ptr<background_input_collector>
+    the_input_collector(ignore_input_collector);
+
+void set_background_input_collector(background_input_collector* collector)
+{
+    the_input_collector.reset(collector);
+}
+
+// Add a record whose data isn't ready to the current thread's collector
+// (if there is one).
+void static
+collect_input(background_cache_record* record)
+{
+    auto* collector = the_input_collector.get();
+    if (!collector)
+        return;
+    auto& records = collector->records;
+    if (std::find(records.begin(), records.end(), record) != records.end())
+        return;
+    acquire_cache_record(record);
+    records.push_back(record);
+}
+
+size_t add_dependent_job(background_input_collector& inputs,
+    background_job_ptr const& job)
+{
+    // Only register the job if everything it's waiting on is actually being
+    // computed. (The records can be in different segments, so their states
+    // can change between this check and the registration below, but any
+    // change after the job is registered with a record releases it from
+    // that record, and the job just gathers its inputs again.)
+    bool all_computing = true;
+    for (auto* record : inputs.records)
+    {
+        if (record->state == background_data_state::NOWHERE)
+            all_computing = false;
+    }
+    size_t registered = 0;
+    for (auto* record : inputs.records)
+    {
+        boost::lock_guard<boost::mutex> lock(record->owner_segment->mutex);
+        if (all_computing &&
+            record->state == background_data_state::COMPUTING)
+        {
+            record->dependent_jobs.push_back(job);
+            ++job->pending_inputs;
+            ++registered;
+        }
+        --record->ref_count;
+        if (record->ref_count == 0)
+            add_to_eviction_list(record);
+    }
+    inputs.records.clear();
+    return registered;
+}
+
+void release_collected_inputs(background_input_collector& inputs)
+{
+    for (auto* record : inputs.records)
+        release_cache_record(record);
+    inputs.records.clear();
+}
+
+size_t clear_dependent_jobs(background_cache& cache, bool canceled_only)
+{
+    size_t reported = 0;
+    for (auto& segment : cache.segments)
+    {
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
+        for (auto& i : segment.records)
+        {
+            auto& jobs = i.second.dependent_jobs;
+            auto removed =
+                canceled_only ?
+                    std::partition(jobs.begin(), jobs.end(),
+                        [](background_job_ptr const& job) {
+                            return !job->cancel;
+                        }) :
+                    jobs.begin();
+            for (auto j = removed; j != jobs.end(); ++j)
+            {
+                // Once a job's last registration is removed, it's no longer
+                // waiting anywhere.
+                if (--(*j)->pending_inputs == 0 && !(*j)->hidden)
+                    ++reported;
+            }
+            jobs.erase(removed, jobs.end());
+        }
+    }
+    return reported;
+}
+
 // BACKGROUND DATA POINTERS
 
 void untyped_background_data_ptr::reset()
@@ -412,13 +621,17 @@ void untyped_background_data_ptr::update()
 {
     if (status_.state != background_data_state::READY)
     {
+        // Polling the record's status doesn't require any locking. The lock
+        // is only needed to pick up the data once it's ready.
         status_.state = r_->state;
         status_.progress = r_->progress;
         if (status_.state == background_data_state::READY)
         {
-            boost::lock_guard<boost::mutex> lock(r_->owner_cache->mutex);
+            boost::lock_guard<boost::mutex> lock(r_->owner_segment->mutex);
             data_ = r_->data;
         }
+        else
+            collect_input(r_);
     }
 }
 
@@ -50,6 +50,11 @@ struct background_job_interface
         progress_reporter_interface& reporter) = 0;
 
     virtual background_job_info get_info() const = 0;
+
+    // the number of cores that the job uses while it's executing - Jobs
+    // that ask for more than one get a parallel executor for the others via
+    // their check_in object (see parallel_for).
+    virtual unsigned get_core_count() const { return 1; }
 };
 
 // A background_job_controller is used for monitoring and controlling the
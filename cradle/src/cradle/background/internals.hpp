@@ -3,6 +3,8 @@
 
 #include <cradle/background/system.hpp>
 #include <cradle/background/api.hpp>
+#include <atomic>
+#include <deque>
 #include <queue>
 #include <boost/unordered_map.hpp>
 #include <boost/thread/thread.hpp>
@@ -25,7 +27,7 @@ struct background_job_execution_data
         background_job_interface* job, int priority, bool hidden)
       : job(job), priority(priority),
         state(background_job_state::QUEUED), progress(0), cancel(false),
-        hidden(hidden)
+        hidden(hidden), pending_inputs(0), core_count(1)
     {}
     ~background_job_execution_data()
     { delete job; }
@@ -45,6 +47,20 @@ struct background_job_execution_data
 
     // if this is set, the job will be canceled next time it checks in
     volatile bool cancel;
+
+    // the job's info, as of when it was queued - This is only recorded for
+    // jobs that go through a work_stealing_executor (and aren't hidden).
+    background_job_info info;
+
+    // While the job is waiting on its inputs, this is the number of cache
+    // records that it's registered as a dependent of (plus one while it's
+    // still registering). Whoever decrements it to zero requeues the job.
+    std::atomic<int> pending_inputs;
+
+    // the number of cores that the job holds while it's executing - This is
+    // only used by work_stealing_executors, which set it when the job is
+    // queued.
+    unsigned core_count;
 };
 
 typedef alia__shared_ptr<background_job_execution_data> background_job_ptr;
@@ -69,7 +85,7 @@ struct background_job_canceled
 struct background_job_check_in : check_in_interface
 {
     background_job_check_in(background_job_ptr const& job)
-      : job(job)
+      : job(job), parallel(0)
     {}
     void operator()()
     {
@@ -79,7 +95,12 @@ struct background_job_check_in : check_in_interface
             throw background_job_canceled();
         }
     }
+    parallel_executor_interface* parallel_executor()
+    { return parallel; }
     background_job_ptr job;
+    // the executor for the cores that the job's parallel tasks can run on
+    // (if it's not just the shared thread pool)
+    parallel_executor_interface* parallel;
 };
 
 struct background_job_progress_reporter : progress_reporter_interface
@@ -168,64 +189,309 @@ struct background_execution_thread
     alia__shared_ptr<background_thread_data_proxy> data_proxy;
 };
 
+// WORK STEALING
+
+struct background_cache;
+struct parallel_task_group;
+
+// The CALCULATION pool has a thread for every core and is fed lots of
+// fine-grained jobs, so rather than having all its threads contend for a
+// single queue, each thread has its own deque of jobs. A thread pushes the
+// jobs that it creates (e.g., for the inputs of the job that it's running)
+// onto the back of its own deque and takes work from there, so related jobs
+// tend to run together. When its own deque is empty, it takes work from a
+// shared injection queue (where jobs from outside the pool go) or steals
+// from the front of another thread's deque.
+//
+// Rather than being strictly ordered by priority, jobs are divided into
+// bands (positive, zero and negative priority), and threads always look for
+// work in a higher band before a lower one.
+//
+// Each thread stands for one core, and a job can ask for more than one (see
+// background_job_interface::get_core_count). A thread only starts a job once
+// it holds as many cores as the job needs, so while a multi-core job is
+// executing, there are threads left over without cores, and those help with
+// the job's parallel tasks (see parallel_for). A single-core job can also
+// borrow cores that are sitting idle for its parallel tasks.
+
+static unsigned const background_job_priority_band_count = 3;
+
+static inline unsigned
+get_priority_band(int priority)
+{
+    return priority > 0 ? 0 : (priority == 0 ? 1 : 2);
+}
+
+struct background_job_deque
+{
+    std::deque<background_job_ptr> bands[background_job_priority_band_count];
+    // the total number of jobs in all bands - This can be read without the
+    // mutex to quickly skip empty deques.
+    std::atomic<size_t> size;
+    // protects the bands - Since threads mostly work on their own deques,
+    // this is only contended when stealing.
+    boost::mutex mutex;
+
+    background_job_deque() : size(0) {}
+};
+
+struct work_stealing_executor
+{
+    // one for each thread in the pool, indexed by thread
+    std::vector<alia__shared_ptr<background_job_deque> > deques;
+    // jobs that come from outside the pool
+    background_job_deque injection;
+
+    // Jobs that are waiting on their inputs are normally registered as
+    // dependents of the cache records that they're waiting on, and they're
+    // requeued once all of those have been resolved (see below).
+    // However, a job that's waiting on something other than cache records
+    // goes here instead, and these are all woken up whenever any data
+    // arrives (as in background_job_queue).
+    std::vector<background_job_ptr> waiting_jobs;
+    // the number of jobs in waiting_jobs (or about to be added to it)
+    std::atomic<size_t> waiting_count;
+    // counts how many times jobs have been woken up
+    std::atomic<size_t> wake_up_counter;
+    // protects waiting_jobs
+    boost::mutex waiting_mutex;
+
+    // Threads that can't find any work sleep on this.
+    boost::condition_variable idle_cv;
+    boost::mutex idle_mutex;
+    // # of threads that are sleeping on idle_cv
+    std::atomic<size_t> n_sleeping_threads;
+    // # of threads that aren't executing a job (including those that are
+    // looking for one)
+    std::atomic<size_t> n_idle_threads;
+
+    // Status reporting is kept off the hot path: these are just counters,
+    // and the list of jobs is gathered from the deques when a status report
+    // is actually requested.
+    // the number of jobs that aren't marked as hidden, as with
+    // background_job_queue::reported_size
+    std::atomic<size_t> reported_size;
+    // incremented whenever a job that isn't hidden comes or goes
+    std::atomic<size_t> status_version;
+
+    // the number of times that waiting jobs have been requeued
+    std::atomic<size_t> woken_job_count;
+
+    // the cache whose records jobs wait on
+    background_cache* cache;
+
+    // the number of cores that aren't held by executing jobs
+    std::atomic<int> free_cores;
+    // Only one thread at a time can gather cores for a multi-core job (while
+    // holding this). While it's doing so, reservation_pending is set, and
+    // other threads don't take free cores.
+    boost::mutex reservation_mutex;
+    std::atomic<bool> reservation_pending;
+    // The gathering thread waits on this for cores to be released.
+    boost::condition_variable core_cv;
+    boost::mutex core_mutex;
+
+    // the groups of parallel tasks that multi-core jobs are executing
+    std::vector<parallel_task_group*> parallel_groups;
+    // the total number of additional threads that those groups can take
+    std::atomic<size_t> open_parallel_slots;
+    // protects parallel_groups and the groups themselves
+    boost::mutex parallel_mutex;
+
+    work_stealing_executor()
+      : waiting_count(0)
+      , wake_up_counter(0)
+      , n_sleeping_threads(0)
+      , n_idle_threads(0)
+      , reported_size(0)
+      , status_version(0)
+      , woken_job_count(0)
+      , cache(0)
+      , free_cores(0)
+      , reservation_pending(false)
+      , open_parallel_slots(0)
+    {}
+};
+
 // A background_execution_pool combines a queue of jobs with a pool of threads
 // that are intended to execute those jobs.
+// If the pool has an executor, its jobs go through that instead, and the
+// queue is only used for recording failures.
 struct background_execution_pool
 {
     alia__shared_ptr<background_job_queue> queue;
+    alia__shared_ptr<work_stealing_executor> executor;
     std::vector<alia__shared_ptr<background_execution_thread> > threads;
 };
 
-struct background_cache;
+// Queue a job on a work_stealing_executor.
+void queue_background_job(work_stealing_executor& executor,
+    background_job_ptr const& job);
+
+// Move all jobs that are waiting on dependencies in the given pool back to
+// its runnable jobs. (For pools with executors, this only affects the jobs
+// that aren't registered as dependents of cache records.)
+void wake_up_waiting_jobs(background_execution_pool& pool);
+
+// Release one registration of each of the given jobs as a dependent of a
+// cache record. Jobs that are left with no pending inputs are requeued.
+void release_dependent_jobs(work_stealing_executor& executor,
+    std::vector<background_job_ptr> const& jobs);
+
+// A calculation job that has to block on something other than computation
+// (e.g., room in the disk write queue) should do so inside one of these.
+// While it exists, the cores that the job holds are given back to the pool,
+// so that other jobs (and multi-core reservations) aren't held up by it.
+// On threads that aren't calculation threads, it does nothing.
+struct blocking_wait_scope : noncopyable
+{
+    blocking_wait_scope();
+    ~blocking_wait_scope();
+ private:
+    work_stealing_executor* executor_;
+    unsigned core_count_;
+};
+
+struct background_cache_segment;
 
 struct background_cache_record
 {
     // These remain constant for the life of the record.
     background_cache* owner_cache;
+    background_cache_segment* owner_segment;
     owned_id key;
 
-    // All of the following fields are protected by the cache mutex.
-    // The only exception is that the state field can be polled for
-    // informational purposes. However, before accessing any other fields
-    // based on the value of state, you should acquire the mutex and recheck
-    // state.
+    // state and progress can be read at any time without locking, so that
+    // polling them is cheap. However, before accessing any other fields
+    // based on the value of state, you should acquire the segment mutex and
+    // recheck state.
+    std::atomic<background_data_state> state;
+    std::atomic<float> progress;
 
-    volatile background_data_state state;
-    volatile float progress;
+    // All of the following fields are protected by the segment mutex.
 
     // This is a count of how many active pointers reference this data.
     // If this is 0, the data is just hanging around because it was recently
     // used, in which case eviction_list_iterator points to this record's
-    // entry in the eviction list.
+    // entry in the segment's eviction list.
     unsigned ref_count;
 
     std::list<background_cache_record*>::iterator eviction_list_iterator;
+    // when the record was added to the eviction list (see below)
+    uint64_t last_use;
 
     // If state is COMPUTING, this is the associated job.
     alia__shared_ptr<background_job_controller> job;
 
     // If state is READY, this is the associated data.
     untyped_immutable data;
+
+    // the jobs that are waiting on this record's data
+    std::vector<background_job_ptr> dependent_jobs;
+
+    background_cache_record()
+      : owner_cache(0), owner_segment(0),
+        state(background_data_state::NOWHERE), progress(0),
+        ref_count(0), last_use(0)
+    {}
 };
 
+// Records are constructed in place, since they can't be copied.
 typedef boost::unordered_map<id_interface const*,background_cache_record,
     id_interface_pointer_hash,id_interface_pointer_equality_test>
     cache_record_map;
 
 struct cache_record_eviction_list
 {
+    // the records, from least to most recently used
     std::list<background_cache_record*> records;
     size_t total_size;
     cache_record_eviction_list() : total_size(0) {}
 };
 
-struct background_cache : noncopyable
+// The memory cache is split into segments by the hash of the key, and each
+// segment has its own mutex, so threads that are working with different
+// records rarely contend with each other.
+//
+// Each segment keeps its own eviction list, but the records in it are
+// stamped from a counter that's shared by the whole cache, so when the cache
+// needs to shrink, it can always evict from the segment with the least
+// recently used record. (The result is the same as a single LRU list, except
+// for races between threads that are releasing records at the same time.)
+
+struct background_cache_segment : noncopyable
 {
     cache_record_map records;
     cache_record_eviction_list eviction_list;
+    // the last_use stamp of the first record in the eviction list (or
+    // no_cache_record_use if the list is empty) - This can be read without
+    // the mutex.
+    std::atomic<uint64_t> oldest_use;
     boost::mutex mutex;
+
+    background_cache_segment();
+};
+
+static uint64_t const no_cache_record_use = ~uint64_t(0);
+
+inline background_cache_segment::background_cache_segment()
+  : oldest_use(no_cache_record_use)
+{}
+
+static unsigned const background_cache_segment_count = 16;
+
+struct background_cache : noncopyable
+{
+    background_cache_segment segments[background_cache_segment_count];
+    // the total size of the data in all the segments' eviction lists
+    std::atomic<size_t> evictable_size;
+    // the source of the records' last_use stamps
+    std::atomic<uint64_t> use_counter;
+    // the executor that the records' dependent jobs belong to
+    work_stealing_executor* executor;
+
+    background_cache() : evictable_size(0), use_counter(0), executor(0) {}
+};
+
+// Get the segment that holds the record for the given key.
+background_cache_segment&
+get_cache_segment(background_cache& cache, id_interface const& key);
+
+// DEPENDENCY TRACKING
+
+// While a work_stealing_execution_loop has a job gather its inputs, it
+// installs a background_input_collector for the thread, and any
+// untyped_background_data_ptr that's updated and found not to be ready adds
+// its record to the collector. (The collector holds a reference to each
+// record.) If the job's inputs turn out not to be ready, the job is then
+// registered as a dependent of those records, and when they're resolved,
+// the job is requeued.
+
+struct background_input_collector
+{
+    std::vector<background_cache_record*> records;
 };
 
+// Set the collector for the current thread (or clear it by passing 0).
+void set_background_input_collector(background_input_collector* collector);
+
+// Register a job as a dependent of the collected records that still aren't
+// ready and release the collector's references to the records.
+// The return value is the number of records that the job was registered
+// with. (Each of those is added to job->pending_inputs.) If any of the
+// records has no one computing its data, the job isn't registered at all
+// (since it's up to the job to notice that and do something about it).
+size_t add_dependent_job(background_input_collector& inputs,
+    background_job_ptr const& job);
+
+// Release the collector's references to its records without registering
+// anything.
+void release_collected_inputs(background_input_collector& inputs);
+
+// Remove jobs (or just canceled jobs) from the records that they're waiting
+// on. The return value is the number of removed jobs that weren't hidden.
+size_t clear_dependent_jobs(background_cache& cache, bool canceled_only);
+
 // Add a job for the background execution system to execute.
 // If controller is 0, it's ignored.
 // 'priority' controls the priority of the job. A higher number means higher
@@ -478,6 +744,52 @@ void record_context_request_success(background_execution_system& system,
 
 // ACTUAL EXECUTION SYSTEM DEFINITION
 
+// DISK CACHE WRITES
+
+// Writes to the disk cache are done in the background (by the DISK pool) so
+// that the threads that produce the data don't have to wait on serialization
+// and disk I/O.
+
+// a disk cache write that has been queued but not yet completed
+struct pending_disk_write
+{
+    // the data to be written
+    untyped_immutable data;
+    // the (approximate) in-memory size of the data
+    size_t size;
+    // set if a lookup has been satisfied from the data, in which case the
+    // entry's usage is recorded once it's written
+    bool used;
+    // identifies this particular write, since the same key can be queued
+    // again as soon as an earlier write for it is released
+    uint64_t generation;
+
+    pending_disk_write() : size(0), used(false), generation(0) {}
+};
+
+struct disk_write_queue
+{
+    // the pending writes, indexed by disk cache key - While a write is
+    // pending, lookups of its key are satisfied directly from its data.
+    boost::unordered_map<string,pending_disk_write> writes;
+    // the total size of all pending writes
+    size_t in_flight_bytes;
+    // the limit on in_flight_bytes - Queueing a write that would exceed this
+    // blocks until enough of the pending writes have completed. (A
+    // calculation job gives up its cores while it's blocked.)
+    size_t byte_budget;
+    // the generation to assign to the next pending write
+    uint64_t next_generation;
+    // protects the above
+    boost::mutex mutex;
+    // signalled whenever a pending write completes
+    boost::condition_variable cv;
+
+    disk_write_queue()
+      : in_flight_bytes(0), byte_budget(0x10000000), next_generation(1)
+    {}
+};
+
 struct background_execution_system_impl
 {
     background_execution_pool pools[
@@ -487,6 +799,8 @@ struct background_execution_system_impl
 
     alia__shared_ptr<cradle::disk_cache> disk_cache;
 
+    disk_write_queue disk_writes;
+
     background_authentication_data authentication;
     background_context_request_data context;
 
@@ -523,6 +837,26 @@ struct background_job_execution_loop
 void record_failure(background_job_execution_data& job, char const* msg,
     bool transient_failure);
 
+struct work_stealing_execution_loop
+{
+    work_stealing_execution_loop(
+        alia__shared_ptr<work_stealing_executor> const& executor,
+        unsigned index,
+        alia__shared_ptr<background_job_queue> const& queue,
+        alia__shared_ptr<background_thread_data_proxy> const& data_proxy)
+      : executor_(executor), index_(index), queue_(queue)
+      , data_proxy_(data_proxy)
+    {}
+    void operator()();
+ private:
+    alia__shared_ptr<work_stealing_executor> executor_;
+    // the index of this thread's deque within the executor
+    unsigned index_;
+    // where failures are recorded
+    alia__shared_ptr<background_job_queue> queue_;
+    alia__shared_ptr<background_thread_data_proxy> data_proxy_;
+};
+
 struct web_request_processing_loop
 {
     web_request_processing_loop(
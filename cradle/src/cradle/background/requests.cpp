@@ -259,23 +259,431 @@ make_request_id(untyped_request const& request)
 
 // DISK UTILITIES
 
+// Get the disk cache key for the given value (which identifies the data
+// being cached). The key is based on a digest of the value, so its size is
+// fixed regardless of how complex the value is.
+string static
+get_disk_cache_key(
+    framework_context const& context,
+    string const& category,
+    value const& identity)
+{
+    return context.context_id + category +
+        to_hex_string(compute_value_digest(identity));
+}
+
+// Values at least this large are streamed directly into their own files
+// rather than being serialized in memory first.
+static size_t const streamed_disk_cache_value_size = 0x100000;
+
+// Write a value as the data for a disk cache entry and finish its insert.
 void static
-write_to_disk_cache(
+write_disk_cache_value(disk_cache& cache, int64_t entry, value const& v)
+{
+    size_t size = deep_sizeof(v);
+    value_codec codec = choose_value_codec(v, size);
+    uint32_t crc;
+    if (size >= streamed_disk_cache_value_size)
+    {
+        write_value_file(get_path_for_id(cache, entry), v, &crc, codec);
+        finish_insert(cache, entry, crc);
+        return;
+    }
+    byte_vector data;
+    serialize_value(&data, v, &crc, codec);
+    finish_insert(cache, entry, data.empty() ? 0 : &data[0], data.size(),
+        crc);
+}
+
+// Read a value from a disk cache entry.
+// This throws a crc_error if the CRC doesn't match the expected one.
+// If the entry is stored uncompressed, blobs within the value reference the
+// entry's file mapping rather than copies of it.
+void static
+read_disk_cache_value(value* v, disk_cache& cache, int64_t entry,
+    uint32_t expected_crc)
+{
+    blob data = map_entry(cache, entry);
+    if (data.size == 0)
+        throw crc_error();
+    uint32_t crc;
+    deserialize_value(v, data, &crc);
+    if (crc != expected_crc)
+        throw crc_error();
+}
+
+// Results are stored in the disk cache as their binary encodings, wrapped in a
+// record along with the schema hash of the encoding. (The record itself goes
+// through the usual value serialization, which takes care of compression and
+// CRCs.) If the result is a structure, the record also includes the ranges
+// of its fields within the encoding, so that individual fields can be
+// decoded without decoding the whole thing.
+value static
+make_disk_cache_envelope(untyped_immutable const& data)
+{
+    alia__shared_ptr<std::vector<uint8_t> > encoding(
+        new std::vector<uint8_t>);
+    binary_writer w(*encoding);
+    binary_field_index index;
+    bool has_index = data.ptr->encode_binary_fields(w, &index);
+    blob b;
+    b.ownership = encoding;
+    b.data = encoding->empty() ? 0 : &(*encoding)[0];
+    b.size = encoding->size();
+    value_map envelope;
+    envelope[value("binary_schema")] =
+        value(integer(data.ptr->binary_schema_hash()));
+    envelope[value("binary")] = value(b);
+    if (has_index)
+    {
+        value_map fields;
+        for (auto const& field : index)
+        {
+            value_list range;
+            range.push_back(value(integer(field.begin)));
+            range.push_back(value(integer(field.end)));
+            fields[value(field.name)] = value(range);
+        }
+        envelope[value("fields")] = value(fields);
+    }
+    return value(envelope);
+}
+
+// Convert a value read from the disk cache to an immutable of the given
+// type. Entries that aren't envelopes (e.g., those written by older versions)
+// are treated as plain dynamic values. An encoding with the wrong schema
+// throws, so the read fails and the result is recomputed.
+untyped_immutable static
+disk_cache_value_to_immutable(
+    dynamic_type_interface const& type, value const& v)
+{
+    if (v.type() == value_type::MAP)
+    {
+        value_map const& record = cast<value_map>(v);
+        value schema, encoding, fields;
+        if (record.size() ==
+                (get_field(&fields, record, "fields") ? 3 : 2) &&
+            get_field(&schema, record, "binary_schema") &&
+            get_field(&encoding, record, "binary"))
+        {
+            if (cast<integer>(schema) != integer(type.binary_schema_hash()))
+                throw corrupt_binary_data();
+            // If the entry is mapped rather than decompressed, the blobs and
+            // arrays in the result reference the mapping directly.
+            blob const& b = cast<blob>(encoding);
+            binary_reader r(b.data, b.size, &b.ownership);
+            untyped_immutable result = type.binary_to_immutable(r);
+            if (r.position != r.end)
+                throw corrupt_binary_data();
+            return result;
+        }
+    }
+    return type.value_to_immutable(v);
+}
+
+// Get a single field of a record from a value read from the disk cache.
+// If the value is an envelope with an entry for the field in its index, only
+// the field's encoding is decoded. Otherwise (e.g., if the field is
+// inherited from a super type), the whole record is decoded and the field is
+// extracted from it.
+// If the envelope was read through 'view' (without checking its binary
+// encoding), the parts of the encoding that are decoded are checked first.
+untyped_immutable static
+disk_cache_value_to_field(
+    dynamic_type_interface const& record_type,
+    dynamic_type_interface const& field_type,
+    field_extractor_interface const& extractor,
+    string const& field,
+    value const& v,
+    value_view const* view = 0)
+{
+    if (v.type() == value_type::MAP)
+    {
+        value_map const& record = cast<value_map>(v);
+        value schema, encoding, fields, range;
+        if (record.size() == 3 &&
+            get_field(&schema, record, "binary_schema") &&
+            get_field(&encoding, record, "binary") &&
+            get_field(&fields, record, "fields") &&
+            get_field(&range, cast<value_map>(fields), field))
+        {
+            if (cast<integer>(schema) !=
+                integer(record_type.binary_schema_hash()))
+            {
+                throw corrupt_binary_data();
+            }
+            blob const& b = cast<blob>(encoding);
+            value_list const& bounds = cast<value_list>(range);
+            if (bounds.size() != 2)
+                throw corrupt_binary_data();
+            integer begin = cast<integer>(bounds[0]);
+            integer end = cast<integer>(bounds[1]);
+            if (begin < 0 || begin > end || end > integer(b.size))
+                throw corrupt_binary_data();
+            uint8_t const* data = reinterpret_cast<uint8_t const*>(b.data);
+            if (view && !view->check_crcs(data + begin, data + end))
+                throw crc_error();
+            // Blocks are aligned relative to the start of the record's
+            // encoding, so the reader has to start there.
+            binary_reader r(b.data, size_t(end), &b.ownership);
+            r.position = r.start + begin;
+            untyped_immutable result = field_type.binary_to_immutable(r);
+            if (r.position != r.end)
+                throw corrupt_binary_data();
+            return result;
+        }
+        if (view && get_field(&encoding, record, "binary"))
+        {
+            blob const& b = cast<blob>(encoding);
+            uint8_t const* data = reinterpret_cast<uint8_t const*>(b.data);
+            if (!view->check_crcs(data, data + b.size))
+                throw crc_error();
+        }
+    }
+    return extractor.extract(disk_cache_value_to_immutable(record_type, v));
+}
+
+// Read a single field of a record from a view of a disk cache entry.
+// Only the parts of the entry that are needed to get at the field are read
+// (and checked against the entry's chunk CRCs).
+untyped_immutable static
+read_disk_cache_field_in_place(
+    value_view const& view,
+    dynamic_type_interface const& record_type,
+    dynamic_type_interface const& field_type,
+    field_extractor_interface const& extractor,
+    string const& field)
+{
+    if (view.type() == value_type::MAP)
+    {
+        value_view binary;
+        if (view.find(&binary, value("binary")))
+        {
+            // It's an envelope. Its entries are small (and the binary
+            // encoding is read in place), so just read them all. Only the
+            // parts of the binary encoding that are actually decoded need to
+            // be checked, so that's left to disk_cache_value_to_field.
+            value_map envelope;
+            for (size_t i = 0; i != view.size(); ++i)
+            {
+                value key = read_value(view.key(i));
+                view.entry_value(i).read(&envelope[key],
+                    key != value("binary"));
+            }
+            return disk_cache_value_to_field(record_type, field_type,
+                extractor, field, value(envelope), &view);
+        }
+        // Otherwise, it's a dynamic record, so only read the field.
+        return field_type.value_to_immutable(read_value(view.field(field)));
+    }
+    return extractor.extract(
+        disk_cache_value_to_immutable(record_type, read_value(view)));
+}
+
+// Read a single field of a record from a disk cache entry.
+// If the entry was written with value_codec::INDEXED, only the parts of the
+// entry that are needed to get at the field are read and checked. If any of
+// those parts fail their checks, the whole entry is read (and its CRC is
+// checked), just as it would be for any other codec.
+untyped_immutable static
+read_disk_cache_field(
+    disk_cache& cache, int64_t entry, uint32_t expected_crc,
+    dynamic_type_interface const& record_type,
+    dynamic_type_interface const& field_type,
+    field_extractor_interface const& extractor,
+    string const& field)
+{
+    blob data = map_entry(cache, entry);
+    if (data.size == 0)
+        throw crc_error();
+    value_view view;
+    uint32_t crc;
+    if (view_serialized_value(&view, data, &crc))
+    {
+        // The CRC recorded in the entry still has to match the index, so
+        // entries that have been replaced are caught.
+        if (crc != expected_crc)
+            throw crc_error();
+        try
+        {
+            return read_disk_cache_field_in_place(view, record_type,
+                field_type, extractor, field);
+        }
+        catch (crc_error&)
+        {
+        }
+        catch (corrupt_data&)
+        {
+        }
+    }
+    value v;
+    deserialize_value(&v, data, &crc);
+    if (crc != expected_crc)
+        throw crc_error();
+    return disk_cache_value_to_field(record_type, field_type, extractor,
+        field, v);
+}
+
+// If there's a pending write for the given key, this retrieves its data.
+bool static
+find_pending_disk_write(
     background_execution_system& bg,
+    string const& key,
+    untyped_immutable* data)
+{
+    auto& queue = bg.impl_->disk_writes;
+    boost::lock_guard<boost::mutex> lock(queue.mutex);
+    auto i = queue.writes.find(key);
+    if (i == queue.writes.end())
+        return false;
+    *data = i->second.data;
+    i->second.used = true;
+    return true;
+}
+
+// Remove a pending write from the queue (if it's still there).
+// The write is identified by its generation as well as its key, so a later
+// write for the same key is left alone.
+// The return value indicates whether or not its data was used while it was
+// pending.
+bool static
+release_pending_disk_write(background_execution_system& bg, string const& key,
+    uint64_t generation)
+{
+    auto& queue = bg.impl_->disk_writes;
+    bool used = false;
+    {
+        boost::lock_guard<boost::mutex> lock(queue.mutex);
+        auto i = queue.writes.find(key);
+        if (i != queue.writes.end() && i->second.generation == generation)
+        {
+            used = i->second.used;
+            queue.in_flight_bytes -= i->second.size;
+            queue.writes.erase(i);
+        }
+    }
+    queue.cv.notify_all();
+    return used;
+}
+
+// a background job that writes a pending write to the disk cache
+struct disk_write_job : background_job_interface
+{
+    disk_write_job() : generation(0) {}
+
+    ~disk_write_job()
+    {
+        // This is also done here so that the write is released even if the
+        // job never runs.
+        release_pending_disk_write(*bg, key, generation);
+    }
+
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        try
+        {
+            auto& cache = *get_disk_cache(*bg);
+            int64_t entry = initiate_insert(cache, key);
+            if (!description.empty())
+                record_key_description(cache, entry, description);
+            write_disk_cache_value(cache, entry,
+                make_disk_cache_envelope(data));
+            // Lookups that were satisfied while the write was pending didn't
+            // get to record their usage, so it's recorded now. Otherwise, the
+            // entry would look as if it had only been used once.
+            if (release_pending_disk_write(*bg, key, generation))
+                record_usage(cache, entry);
+        }
+        catch (...)
+        {
+            // If writing to the disk cache fails, it doesn't really matter.
+        }
+    }
+
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "disk cache write";
+        return info;
+    }
+
+    alia__shared_ptr<background_execution_system> bg;
+    string key;
+    uint64_t generation;
+    untyped_immutable data;
+    // only set if the disk cache is recording key descriptions
+    string description;
+};
+
+// Queue a result to be written to the disk cache.
+// If there's already a write pending for the same request, this does
+// nothing. If the pending writes have used up their byte budget, this blocks
+// until there's room. While it's blocked, it gives up the calling job's cores
+// and checks in periodically, so the job can still be canceled.
+void static
+write_to_disk_cache(
+    check_in_interface& check_in,
+    alia__shared_ptr<background_execution_system> const& bg,
     framework_context const& context,
     request_object const& object,
-    value const& v)
+    untyped_immutable const& data)
 {
     try
     {
-        auto key =
-            context.context_id + "/" +
-            value_to_base64_string(to_value(object));
-        auto& cache = *get_disk_cache(bg);
-        int64_t entry = initiate_insert(cache, key);
-        uint32_t crc;
-        write_value_file(get_path_for_id(cache, entry), v, &crc);
-        finish_insert(cache, entry, crc);
+        auto identity = to_value(object);
+        auto key = get_disk_cache_key(context, "/", identity);
+        size_t size = data.ptr->deep_size();
+
+        auto& queue = bg->impl_->disk_writes;
+        uint64_t generation;
+        {
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            if (queue.writes.find(key) != queue.writes.end())
+                return;
+            // A write that's bigger than the entire budget is still allowed
+            // through once nothing else is pending.
+            if (queue.in_flight_bytes != 0 &&
+                queue.in_flight_bytes + size > queue.byte_budget)
+            {
+                blocking_wait_scope blocking;
+                do
+                {
+                    queue.cv.timed_wait(lock,
+                        boost::posix_time::milliseconds(100));
+                    lock.unlock();
+                    check_in();
+                    lock.lock();
+                }
+                while (queue.in_flight_bytes != 0 &&
+                    queue.in_flight_bytes + size > queue.byte_budget);
+            }
+            // Another thread may have queued the same key while we waited.
+            if (queue.writes.find(key) != queue.writes.end())
+                return;
+            pending_disk_write write;
+            write.data = data;
+            write.size = size;
+            write.generation = generation = queue.next_generation++;
+            queue.writes[key] = write;
+            queue.in_flight_bytes += size;
+        }
+
+        auto* job = new disk_write_job;
+        job->bg = bg;
+        job->key = key;
+        job->generation = generation;
+        job->data = data;
+        if (key_descriptions_enabled(*get_disk_cache(*bg)))
+            job->description = value_to_json(identity);
+        // Reads from the disk cache are more urgent than writes, so writes
+        // are given a lower priority.
+        add_background_job(*bg, background_job_queue_type::DISK, 0, job,
+            BACKGROUND_JOB_HIDDEN, -1);
+    }
+    catch (background_job_canceled&)
+    {
+        throw;
     }
     catch (...)
     {
@@ -285,28 +693,42 @@ write_to_disk_cache(
 
 struct untyped_disk_read_job : background_job_interface
 {
+    untyped_disk_read_job() : record_interface(0), extractor(0) {}
+
     void execute(check_in_interface& check_in,
         progress_reporter_interface& reporter)
     {
-        uint32_t file_crc;
+        if (extractor)
+        {
+            set_cached_data(*bg, id.get(),
+                read_disk_cache_field(*get_disk_cache(*bg), entry,
+                    expected_crc, *record_interface, *result_interface,
+                    *extractor, field));
+            return;
+        }
         value v;
-        read_value_file(&v, path, &file_crc);
-        if (file_crc != expected_crc)
-            throw crc_error();
+        read_disk_cache_value(&v, *get_disk_cache(*bg), entry,
+            expected_crc);
         set_cached_data(*bg, id.get(),
-            result_interface->value_to_immutable(v));
+            disk_cache_value_to_immutable(*result_interface, v));
     }
     background_job_info get_info() const
     {
         background_job_info info;
-        info.description = to_string(path);
+        info.description = "disk cache entry " + to_string(entry);
         return info;
     }
     alia__shared_ptr<background_execution_system> bg;
     dynamic_type_interface const* result_interface;
     owned_id id;
-    file_path path;
+    int64_t entry;
     uint32_t expected_crc;
+    // If extractor is set, the entry holds a record (of the type described
+    // by record_interface), and only the named field is read from it.
+    // (result_interface then describes the field.)
+    dynamic_type_interface const* record_interface;
+    field_extractor_interface const* extractor;
+    string field;
 };
 
 bool static
@@ -316,7 +738,7 @@ is_failed_disk_read(untyped_background_data_ptr& ptr)
         return false;
 
     auto* record = ptr.record();
-    boost::lock_guard<boost::mutex> lock(record->owner_cache->mutex);
+    boost::lock_guard<boost::mutex> lock(record->owner_segment->mutex);
     auto* job = record->job.get();
     return job->state() == background_job_state::FAILED &&
         dynamic_cast<untyped_disk_read_job*>(job->data_->job->job);
@@ -349,20 +771,28 @@ update_background_pointer(
     // If the result's not available, try loading it from the disk cache.
     if (ptr.is_nowhere() && use_disk_cache)
     {
-        auto key = context.context_id + "/" +
-            value_to_base64_string(to_value(object_generator()));
+        auto key =
+            get_disk_cache_key(context, "/", to_value(object_generator()));
 
         auto& disk_cache = *get_disk_cache(*bg);
         int64_t entry;
         uint32_t entry_crc;
-        if (entry_exists(disk_cache, key, &entry, &entry_crc))
+        untyped_immutable pending_data;
+        if (find_pending_disk_write(*bg, key, &pending_data))
+        {
+            // The data is still waiting to be written to the disk cache, so
+            // just use it directly.
+            set_cached_data(*bg, ptr.key(), pending_data);
+            ptr.update();
+        }
+        else if (entry_exists(disk_cache, key, &entry, &entry_crc))
         {
             record_usage(disk_cache, entry);
             untyped_disk_read_job* job = new untyped_disk_read_job;
             job->bg = bg;
             job->result_interface = result_interface;
             job->id.store(ptr.key());
-            job->path = get_path_for_id(disk_cache, entry);
+            job->entry = entry;
             job->expected_crc = entry_crc;
             add_untyped_background_job(ptr, *bg,
                 background_job_queue_type::DISK, job);
@@ -682,8 +1112,8 @@ struct local_calculation_job : background_job_interface
         // Also cache the result to disk if desired.
         if (is_disk_cached(*calc.function))
         {
-            write_to_disk_cache(*bg_, context_, as_request_object(request_),
-                request_.result_interface->immutable_to_value(result));
+            write_to_disk_cache(check_in, bg_, context_,
+                as_request_object(request_), result);
         }
     }
 
@@ -694,6 +1124,11 @@ struct local_calculation_job : background_job_interface
         return info;
     }
 
+    unsigned get_core_count() const
+    {
+        return cradle::get_core_count(*as_function(request_).function);
+    }
+
  private:
     alia__shared_ptr<background_execution_system> bg_;
     framework_context context_;
@@ -1296,6 +1731,181 @@ get_structure_objectified_form(
     return replace_request_contents(request, objectified_info);
 }
 
+// PROPERTY REQUEST - resolving a property request
+
+// Usually, a property request is resolved by resolving its record and then
+// extracting the field. However, if the record is a disk-cached calculation
+// whose result isn't already in memory, the field can be read from the disk
+// cache entry on its own, which is much cheaper than reading a large record.
+// In that case, the field gets its own data pointer, and the record is only
+// resolved if that doesn't work out (in which case use_record is set).
+struct property_resolution_data
+{
+    untyped_background_data_ptr field;
+    background_request_resolution_data record;
+    bool use_record;
+
+    property_resolution_data() : use_record(false) {}
+};
+
+bool static
+is_field_readable_from_disk(property_request_info const& property)
+{
+    if (property.record.type != request_type::FUNCTION)
+        return false;
+    auto const& calc = as_function(property.record);
+    return !is_foreground_calc(calc) && is_disk_cached(*calc.function);
+}
+
+// Is the result of the given request already in memory (or on its way)?
+bool static
+is_in_memory(
+    alia__shared_ptr<background_execution_system> const& bg,
+    untyped_request const& request)
+{
+    untyped_background_data_ptr ptr(*bg, make_request_id(request));
+    return !ptr.is_nowhere();
+}
+
+// Try to get the field for a property request directly from the disk cache
+// entry of its record. If this returns false, the record has to be resolved
+// instead.
+bool static
+update_field_pointer(
+    alia__shared_ptr<background_execution_system> const& bg,
+    framework_context const& context,
+    untyped_background_data_ptr& ptr,
+    untyped_request const& request)
+{
+    auto const& property = as_property(request);
+    if (ptr.is_nowhere())
+    {
+        auto key =
+            get_disk_cache_key(context, "/",
+                to_value(as_request_object(property.record)));
+
+        // If the record is waiting to be written, resolving it will just
+        // pick up the pending data.
+        untyped_immutable pending_data;
+        if (find_pending_disk_write(*bg, key, &pending_data))
+            return false;
+
+        auto& disk_cache = *get_disk_cache(*bg);
+        int64_t entry;
+        uint32_t entry_crc;
+        if (!entry_exists(disk_cache, key, &entry, &entry_crc))
+            return false;
+
+        record_usage(disk_cache, entry);
+        untyped_disk_read_job* job = new untyped_disk_read_job;
+        job->bg = bg;
+        job->result_interface = request.result_interface;
+        job->record_interface = property.record.result_interface;
+        job->extractor = property.extractor;
+        job->field = property.field;
+        job->id.store(ptr.key());
+        job->entry = entry;
+        job->expected_crc = entry_crc;
+        add_untyped_background_job(ptr, *bg,
+            background_job_queue_type::DISK, job);
+    }
+
+    if (is_failed_disk_read(ptr))
+        return false;
+
+    ptr.update();
+
+    return true;
+}
+
+void static
+update_property_request(
+    alia__shared_ptr<background_execution_system> const& bg,
+    framework_context const& context,
+    background_request_resolution_data* resolution,
+    untyped_request const& request,
+    bool foreground_only,
+    background_request_interest_type interest)
+{
+    auto const& property = as_property(request);
+    if (!is_field_readable_from_disk(property))
+    {
+        update_resolution(bg, context, resolution, property.record,
+            foreground_only, interest);
+        return;
+    }
+
+    auto& data =
+        cast_resolution_data<property_resolution_data>(*resolution);
+    // The field's data pointer is only useful for getting the result.
+    if (interest != background_request_interest_type::RESULT)
+        data.use_record = true;
+    if (!data.use_record)
+    {
+        initialize_if_needed(bg, data.field, request);
+        // If the record is already in memory, there's nothing to gain.
+        if (!(data.field.is_nowhere() && is_in_memory(bg, property.record)))
+        {
+            if (foreground_only ||
+                update_field_pointer(bg, context, data.field, request))
+            {
+                return;
+            }
+        }
+        data.use_record = true;
+        data.field.reset();
+    }
+    update_resolution(bg, context, &data.record, property.record,
+        foreground_only, interest);
+}
+
+bool static
+property_request_result_is_resolved(
+    background_request_resolution_data* resolution,
+    untyped_request const& request)
+{
+    auto const& property = as_property(request);
+    if (!is_field_readable_from_disk(property))
+        return result_is_resolved(resolution, property.record);
+
+    auto& data =
+        cast_resolution_data<property_resolution_data>(*resolution);
+    return data.use_record ?
+        result_is_resolved(&data.record, property.record) :
+        data.field.is_ready();
+}
+
+untyped_immutable static
+get_property_request_result(
+    background_request_resolution_data* resolution,
+    untyped_request const& request)
+{
+    auto const& property = as_property(request);
+    if (!is_field_readable_from_disk(property))
+    {
+        return property.extractor->extract(
+            get_result(resolution, property.record));
+    }
+
+    auto& data =
+        cast_resolution_data<property_resolution_data>(*resolution);
+    return data.use_record ?
+        property.extractor->extract(get_result(&data.record, property.record)) :
+        data.field.data();
+}
+
+// Get the resolution data for the record of a property request.
+// (Objectification always goes through the record.)
+static background_request_resolution_data*
+get_property_record_resolution(
+    background_request_resolution_data* resolution,
+    property_request_info const& property)
+{
+    if (!is_field_readable_from_disk(property))
+        return resolution;
+    return &cast_resolution_data<property_resolution_data>(*resolution).record;
+}
+
 
 // DATA - resolving ids for objects (thinknode iss objects) to immutable ids
 //                  when resolving object ids the
@@ -1486,8 +2096,8 @@ struct immutable_id_resolve_request : background_web_job
         set_cached_data(*this->system, this->id.get(), erase_type(tmp));
 
         check_in();
-        write_to_disk_cache(*this->system, this->context,
-            as_request_object(request), to_value(get(tmp)));
+        write_to_disk_cache(check_in, this->system, this->context,
+            as_request_object(request), erase_type(tmp));
     }
 
     background_job_info get_info() const
@@ -1550,8 +2160,8 @@ struct immutable_data_request : background_web_job
         set_cached_data(*this->system, this->id.get(), immutable);
 
         check_in();
-        write_to_disk_cache(*this->system, this->context,
-            as_request_object(request), value);
+        write_to_disk_cache(check_in, this->system, this->context,
+            as_request_object(request), immutable);
     }
 
     background_job_info get_info() const
@@ -1744,10 +2354,10 @@ struct remote_calc_id_request : background_web_job
         swap_in(tmp, remote_id);
         set_cached_data(*this->system, this->id.get(), erase_type(tmp));
 
-        write_to_disk_cache(*this->system, this->context,
+        write_to_disk_cache(check_in, this->system, this->context,
             make_request_object_with_remote(
                 thinknode_request_as_request_object(calculation)),
-            to_value(get(tmp)));
+            erase_type(tmp));
     }
 
     background_job_info get_info() const
@@ -2304,8 +2914,8 @@ update_resolution(
             foreground_only, interest);
         break;
      case request_type::PROPERTY:
-        update_resolution(bg, context, resolution,
-            as_property(request).record, foreground_only, interest);
+        update_property_request(bg, context, resolution, request,
+            foreground_only, interest);
         break;
      case request_type::UNION:
         update_resolution(bg, context, resolution,
@@ -2358,7 +2968,7 @@ result_is_resolved(
      case request_type::STRUCTURE:
         return structure_request_result_is_resolved(resolution, request);
      case request_type::PROPERTY:
-        return result_is_resolved(resolution, as_property(request).record);
+        return property_request_result_is_resolved(resolution, request);
      case request_type::UNION:
         return result_is_resolved(resolution, as_union(request).member_request);
      case request_type::SOME:
@@ -2403,11 +3013,7 @@ get_result(
      case request_type::STRUCTURE:
         return get_structure_request_result(resolution, request);
      case request_type::PROPERTY:
-      {
-        auto const& property = as_property(request);
-        return property.extractor->extract(
-            get_result(resolution, property.record));
-      }
+        return get_property_request_result(resolution, request);
      case request_type::UNION:
       {
         return as_union(request).constructor->construct(
@@ -2539,9 +3145,13 @@ objectification_complete(
      case request_type::STRUCTURE:
         return structure_objectification_complete(resolution, request);
      case request_type::PROPERTY:
+      {
+        auto const& property = as_property(request);
         return
-            objectification_complete(resolution,
-                as_property(request).record);
+            objectification_complete(
+                get_property_record_resolution(resolution, property),
+                property.record);
+      }
      case request_type::UNION:
         return
             objectification_complete(resolution,
@@ -2608,7 +3218,9 @@ get_objectified_form(
         new_info.extractor = info.extractor;
         new_info.field = info.field;
         new_info.record =
-            get_objectified_form(resolution, info.record);
+            get_objectified_form(
+                get_property_record_resolution(resolution, info),
+                info.record);
         return replace_request_contents(request, new_info);
       }
      case request_type::UNION:
@@ -2996,12 +3608,8 @@ perform_meta_request_by_id(
             {
                 record_usage(disk_cache, entry);
                 value cached_value;
-                uint32_t file_crc;
-                read_value_file(&cached_value,
-                    get_path_for_id(disk_cache, entry),
-                    &file_crc);
-                if (file_crc != entry_crc)
-                    throw crc_error();
+                read_disk_cache_value(&cached_value, disk_cache, entry,
+                    entry_crc);
                 return some(from_value<string>(cached_value));
             }
             catch (...)
@@ -3046,10 +3654,8 @@ perform_meta_request_by_id(
     {
         auto& disk_cache = *get_disk_cache(*bg);
         int64_t entry = initiate_insert(disk_cache, disk_cache_key);
-        uint32_t crc;
-        write_value_file(get_path_for_id(disk_cache, entry),
-            to_value(string(get(calculation_id))), &crc);
-        finish_insert(disk_cache, entry, crc);
+        write_disk_cache_value(disk_cache, entry,
+            to_value(string(get(calculation_id))));
     }
 
     return calculation_id;
@@ -3087,8 +3693,8 @@ get_thinknode_calculation_id(
     }
 
     // Otherwise, try loading it from the disk cache.
-    auto disk_cache_key = context.context_id + "/calc/" +
-        value_to_base64_string(to_value(request));
+    auto disk_cache_key =
+        get_disk_cache_key(context, "/calc/", to_value(request));
     auto& disk_cache = *get_disk_cache(*bg);
     {
         int64_t entry;
@@ -3099,12 +3705,8 @@ get_thinknode_calculation_id(
             {
                 record_usage(disk_cache, entry);
                 value cached_value;
-                uint32_t file_crc;
-                read_value_file(&cached_value,
-                    get_path_for_id(disk_cache, entry),
-                    &file_crc);
-                if (file_crc != entry_crc)
-                    throw crc_error();
+                read_disk_cache_value(&cached_value, disk_cache, entry,
+                    entry_crc);
                 auto calculation_id = from_value<string>(cached_value);
                 // Write it to the memory cache.
                 set_cached_data(*bg, memory_cache_id,
@@ -3136,10 +3738,13 @@ get_thinknode_calculation_id(
             erase_type(make_immutable(string(get(calculation_id)))));
         // Write it to the disk cache.
         int64_t entry = initiate_insert(disk_cache, disk_cache_key);
-        uint32_t crc;
-        write_value_file(get_path_for_id(disk_cache, entry),
-            to_value(string(get(calculation_id))), &crc);
-        finish_insert(disk_cache, entry, crc);
+        if (key_descriptions_enabled(disk_cache))
+        {
+            record_key_description(disk_cache, entry,
+                value_to_json(to_value(request)));
+        }
+        write_disk_cache_value(disk_cache, entry,
+            to_value(string(get(calculation_id))));
     }
 
     return calculation_id;
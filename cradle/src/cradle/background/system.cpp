@@ -1,9 +1,14 @@
 #include <cradle/background/system.hpp>
 
+#include <algorithm>
+#include <exception>
+
 #include <boost/algorithm/string.hpp>
+#include <boost/thread/tss.hpp>
 
 #include <cradle/background/internals.hpp>
 #include <cradle/io/web_io.hpp>
+#include <cradle/simple_concurrency.hpp>
 
 namespace cradle {
 
@@ -19,6 +24,17 @@ get_disk_cache(background_execution_system& system)
     return system.impl_->disk_cache;
 }
 
+void set_disk_write_budget(background_execution_system& system,
+    size_t bytes)
+{
+    auto& queue = system.impl_->disk_writes;
+    {
+        boost::lock_guard<boost::mutex> lock(queue.mutex);
+        queue.byte_budget = bytes;
+    }
+    queue.cv.notify_all();
+}
+
 void record_failure(background_job_queue& queue, background_job_ptr& job,
     string msg, bool is_transient)
 {
@@ -32,6 +48,47 @@ void record_failure(background_job_queue& queue, background_job_ptr& job,
     queue.failed_jobs.push_back(failure);
 }
 
+// Execute a job whose inputs are ready, recording its failure (in 'queue')
+// if it fails. If 'parallel' is specified, it's supplied to the job through
+// its check_in object.
+void static
+execute_background_job(background_job_queue& queue, background_job_ptr& job,
+    parallel_executor_interface* parallel = 0)
+{
+    try
+    {
+        job->state = background_job_state::RUNNING;
+        background_job_check_in check_in(job);
+        check_in.parallel = parallel;
+        background_job_progress_reporter reporter(job);
+        job->job->execute(check_in, reporter);
+        job->state = background_job_state::FINISHED;
+    }
+    catch (background_job_canceled&)
+    {
+    }
+    catch (cradle::exception& e)
+    {
+        string msg = "(bjc) " + job->job->get_info().description + string("\n") + string(e.what());
+        record_failure(queue, job, msg, e.is_transient());
+    }
+    catch (std::bad_alloc&)
+    {
+        string msg = "(bj) " + job->job->get_info().description + string("\n") + string(" out of memory");
+        record_failure(queue, job, msg, true);
+    }
+    catch (std::exception& e)
+    {
+        string msg = "(bjs) " + job->job->get_info().description + string("\n") + string(e.what());
+        record_failure(queue, job, msg, false);
+    }
+    catch (...)
+    {
+        string msg = "(bj) " + job->job->get_info().description;
+        record_failure(queue, job, msg, false);
+    }
+}
+
 void background_job_execution_loop::operator()()
 {
     while (1)
@@ -102,43 +159,667 @@ void background_job_execution_loop::operator()()
             data_proxy_->active_job = job;
         }
 
-        try
+        execute_background_job(queue, job);
+
         {
-            job->state = background_job_state::RUNNING;
-            background_job_check_in check_in(job);
-            background_job_progress_reporter reporter(job);
-            job->job->execute(check_in, reporter);
-            job->state = background_job_state::FINISHED;
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            queue.job_info.erase(&*job);
+            inc_version(queue.version);
         }
-        catch (background_job_canceled&)
+
         {
+            boost::lock_guard<boost::mutex> lock(data_proxy_->mutex);
+            data_proxy_->active_job.reset();
         }
-        catch (cradle::exception& e)
+    }
+}
+
+// WORK STEALING
+
+// the executor (and deque) that the current thread works for, if any
+struct work_stealing_thread_info
+{
+    work_stealing_executor* executor;
+    unsigned index;
+    // the number of cores held by the job that the thread is executing
+    unsigned held_cores;
+};
+static boost::thread_specific_ptr<work_stealing_thread_info>
+    the_current_work_stealing_thread;
+
+void static
+push_job(background_job_deque& deque, background_job_ptr const& job)
+{
+    boost::lock_guard<boost::mutex> lock(deque.mutex);
+    deque.bands[get_priority_band(job->priority)].push_back(job);
+    ++deque.size;
+}
+
+// Take a job from the given band of a deque, either from the back (for the
+// thread that owns it) or the front (for anyone else).
+bool static
+pop_job(background_job_ptr* job, background_job_deque& deque, unsigned band,
+    bool from_back)
+{
+    if (deque.size == 0)
+        return false;
+    boost::lock_guard<boost::mutex> lock(deque.mutex);
+    auto& jobs = deque.bands[band];
+    if (jobs.empty())
+        return false;
+    if (from_back)
+    {
+        *job = jobs.back();
+        jobs.pop_back();
+    }
+    else
+    {
+        *job = jobs.front();
+        jobs.pop_front();
+    }
+    --deque.size;
+    return true;
+}
+
+// Find a job for the thread with the given index to execute.
+bool static
+find_job(background_job_ptr* job, work_stealing_executor& executor,
+    unsigned index)
+{
+    size_t n_deques = executor.deques.size();
+    for (unsigned band = 0; band != background_job_priority_band_count;
+        ++band)
+    {
+        if (pop_job(job, *executor.deques[index], band, true) ||
+            pop_job(job, executor.injection, band, false))
         {
-            string msg = "(bjc) " + job->job->get_info().description + string("\n") + string(e.what());
-            record_failure(queue, job, msg, e.is_transient());
+            return true;
         }
-        catch (std::bad_alloc&)
+        for (size_t i = 1; i < n_deques; ++i)
         {
-            string msg = "(bj) " + job->job->get_info().description + string("\n") + string(" out of memory");
-            record_failure(queue, job, msg, true);
+            if (pop_job(job, *executor.deques[(index + i) % n_deques], band,
+                    false))
+            {
+                return true;
+            }
         }
-        catch (std::exception& e)
+    }
+    return false;
+}
+
+bool static
+has_queued_jobs(work_stealing_executor& executor)
+{
+    if (executor.injection.size != 0)
+        return true;
+    for (auto const& deque : executor.deques)
+    {
+        if (deque->size != 0)
+            return true;
+    }
+    return false;
+}
+
+void static
+notify_idle_thread(work_stealing_executor& executor)
+{
+    if (executor.n_sleeping_threads != 0)
+    {
+        boost::lock_guard<boost::mutex> lock(executor.idle_mutex);
+        executor.idle_cv.notify_one();
+    }
+}
+
+void static
+notify_all_idle_threads(work_stealing_executor& executor)
+{
+    if (executor.n_sleeping_threads != 0)
+    {
+        boost::lock_guard<boost::mutex> lock(executor.idle_mutex);
+        executor.idle_cv.notify_all();
+    }
+}
+
+// CORE RESERVATIONS
+
+// Take a core for a job, unless there are none free or another thread is
+// gathering cores for a multi-core job.
+bool static
+take_core(work_stealing_executor& executor)
+{
+    int free_cores = executor.free_cores;
+    while (free_cores > 0 && !executor.reservation_pending)
+    {
+        if (executor.free_cores.compare_exchange_weak(free_cores,
+                free_cores - 1))
         {
-            string msg = "(bjs) " + job->job->get_info().description + string("\n") + string(e.what());
-            record_failure(queue, job, msg, false);
+            return true;
         }
-        catch (...)
+    }
+    return false;
+}
+
+bool static
+can_take_core(work_stealing_executor& executor)
+{
+    return executor.free_cores > 0 && !executor.reservation_pending;
+}
+
+void static
+release_cores(work_stealing_executor& executor, unsigned count)
+{
+    executor.free_cores += count;
+    if (executor.reservation_pending)
+    {
+        boost::lock_guard<boost::mutex> lock(executor.core_mutex);
+        executor.core_cv.notify_one();
+    }
+    // Threads may have gone to sleep because there were no cores for the
+    // queued jobs.
+    else if (executor.n_sleeping_threads != 0 && has_queued_jobs(executor))
+    {
+        if (count > 1)
+            notify_all_idle_threads(executor);
+        else
+            notify_idle_thread(executor);
+    }
+}
+
+// Gather the given number of cores. The calling thread must hold the
+// executor's reservation_mutex.
+void static
+gather_cores(work_stealing_executor& executor, unsigned count)
+{
+    executor.reservation_pending = true;
+    while (count != 0)
+    {
+        int free_cores = executor.free_cores;
+        if (free_cores > 0)
         {
-            string msg = "(bj) " + job->job->get_info().description;
-            record_failure(queue, job, msg, false);
+            int taken = (std::min)(free_cores, int(count));
+            if (executor.free_cores.compare_exchange_weak(free_cores,
+                    free_cores - taken))
+            {
+                count -= taken;
+            }
+            continue;
         }
+        boost::unique_lock<boost::mutex> lock(executor.core_mutex);
+        while (executor.free_cores <= 0)
+            executor.core_cv.wait(lock);
+    }
+    executor.reservation_pending = false;
+    // Other threads may have held off on starting jobs while this was
+    // pending.
+    notify_all_idle_threads(executor);
+}
 
+// Gather the additional cores for a multi-core job. The calling thread
+// already holds one.
+void static
+reserve_additional_cores(work_stealing_executor& executor, unsigned count)
+{
+    boost::unique_lock<boost::mutex>
+        reservation_lock(executor.reservation_mutex, boost::try_to_lock);
+    if (!reservation_lock.owns_lock())
+    {
+        // Another thread is gathering cores, and it might need the one that
+        // this thread holds, so this gives it up while waiting.
+        release_cores(executor, 1);
+        ++count;
+        reservation_lock.lock();
+    }
+    gather_cores(executor, count);
+}
+
+blocking_wait_scope::blocking_wait_scope()
+  : executor_(0), core_count_(0)
+{
+    auto* thread = the_current_work_stealing_thread.get();
+    if (thread && thread->held_cores != 0)
+    {
+        executor_ = thread->executor;
+        core_count_ = thread->held_cores;
+        thread->held_cores = 0;
+        release_cores(*executor_, core_count_);
+    }
+}
+
+blocking_wait_scope::~blocking_wait_scope()
+{
+    if (executor_)
+    {
         {
-            boost::unique_lock<boost::mutex> lock(queue.mutex);
-            queue.job_info.erase(&*job);
-            inc_version(queue.version);
+            boost::lock_guard<boost::mutex>
+                reservation_lock(executor_->reservation_mutex);
+            gather_cores(*executor_, core_count_);
+        }
+        the_current_work_stealing_thread->held_cores = core_count_;
+    }
+}
+
+// PARALLEL TASKS
+
+// a group of tasks that a multi-core job is executing in parallel
+struct parallel_task_group
+{
+    std::function<void(size_t)> const* task;
+    size_t n_tasks;
+    // the index of the next task to start
+    std::atomic<size_t> next_task;
+    // set if any task has failed
+    std::atomic<bool> failed;
+
+    // All of the following are protected by the executor's parallel_mutex.
+
+    // the number of additional threads that can still join in
+    size_t open_slots;
+    // the number of additional threads that are working on the tasks
+    size_t n_helpers;
+    // set once there's no point in additional threads joining in
+    bool closed;
+    // the first exception that a task threw
+    std::exception_ptr failure;
+    // The job's own thread waits on this for the other threads to finish.
+    boost::condition_variable helpers_done;
+};
+
+// Run the group's tasks until they've all been started.
+void static
+run_parallel_tasks(work_stealing_executor& executor,
+    parallel_task_group& group)
+{
+    try
+    {
+        size_t i;
+        while (!group.failed && (i = group.next_task++) < group.n_tasks)
+            (*group.task)(i);
+    }
+    catch (...)
+    {
+        boost::lock_guard<boost::mutex> lock(executor.parallel_mutex);
+        if (!group.failure)
+            group.failure = std::current_exception();
+        group.failed = true;
+    }
+}
+
+// Close a group to additional threads. parallel_mutex must be held.
+void static
+close_parallel_task_group(work_stealing_executor& executor,
+    parallel_task_group& group)
+{
+    if (!group.closed)
+    {
+        executor.open_parallel_slots -= group.open_slots;
+        group.open_slots = 0;
+        group.closed = true;
+    }
+}
+
+// If any multi-core job has tasks that the calling thread can help with,
+// help with them and return true.
+bool static
+help_with_parallel_tasks(work_stealing_executor& executor)
+{
+    if (executor.open_parallel_slots == 0)
+        return false;
+    parallel_task_group* group = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(executor.parallel_mutex);
+        for (auto* g : executor.parallel_groups)
+        {
+            if (g->open_slots != 0)
+            {
+                group = g;
+                break;
+            }
+        }
+        if (!group)
+            return false;
+        --group->open_slots;
+        --executor.open_parallel_slots;
+        ++group->n_helpers;
+    }
+    run_parallel_tasks(executor, *group);
+    {
+        boost::lock_guard<boost::mutex> lock(executor.parallel_mutex);
+        // All the tasks have been started, so there's nothing left for
+        // anyone else to do.
+        close_parallel_task_group(executor, *group);
+        if (--group->n_helpers == 0)
+            group->helpers_done.notify_all();
+    }
+    return true;
+}
+
+// the parallel executor for a job in the CALCULATION pool - If the job holds
+// more than one core, its tasks run on the job's own thread plus as many
+// other threads as the job has additional cores. If it only holds one, it
+// borrows whatever cores are free when it starts a group of tasks (unless
+// there are jobs waiting for them), and if there aren't any, the tasks just
+// run on the job's own thread.
+struct work_stealing_parallel_executor : parallel_executor_interface
+{
+    work_stealing_parallel_executor(work_stealing_executor& executor,
+        unsigned core_count)
+      : executor_(executor), core_count_(core_count), busy_(false)
+    {}
+
+    unsigned thread_count() const
+    {
+        return core_count_ > 1 ? core_count_ :
+            unsigned(executor_.deques.size());
+    }
+
+    void execute(size_t n_tasks, std::function<void(size_t)> const& task);
+
+ private:
+    work_stealing_executor& executor_;
+    unsigned core_count_;
+    // set while a group of tasks is executing - Only the job's own thread
+    // sets this, but it's read by the threads that help with the tasks.
+    std::atomic<bool> busy_;
+};
+
+void work_stealing_parallel_executor::execute(size_t n_tasks,
+    std::function<void(size_t)> const& task)
+{
+    auto& executor = executor_;
+
+    // Nested calls just run on the calling thread, since the job's other
+    // cores are already in use.
+    size_t n_helpers = 0;
+    unsigned borrowed_cores = 0;
+    if (n_tasks >= 2 && !busy_)
+    {
+        if (core_count_ > 1)
+            n_helpers = (std::min)(size_t(core_count_ - 1), n_tasks - 1);
+        else
+        {
+            while (borrowed_cores + 1 < n_tasks &&
+                !has_queued_jobs(executor) && take_core(executor))
+            {
+                ++borrowed_cores;
+            }
+            n_helpers = borrowed_cores;
+        }
+    }
+    if (n_helpers == 0)
+    {
+        for (size_t i = 0; i != n_tasks; ++i)
+            task(i);
+        return;
+    }
+
+    busy_ = true;
+    parallel_task_group group;
+    group.task = &task;
+    group.n_tasks = n_tasks;
+    group.next_task = 0;
+    group.failed = false;
+    group.open_slots = n_helpers;
+    group.n_helpers = 0;
+    group.closed = false;
+    {
+        boost::lock_guard<boost::mutex> lock(executor.parallel_mutex);
+        executor.parallel_groups.push_back(&group);
+        executor.open_parallel_slots += group.open_slots;
+    }
+    notify_all_idle_threads(executor);
+
+    run_parallel_tasks(executor, group);
+
+    {
+        boost::unique_lock<boost::mutex> lock(executor.parallel_mutex);
+        close_parallel_task_group(executor, group);
+        executor.parallel_groups.erase(
+            std::find(executor.parallel_groups.begin(),
+                executor.parallel_groups.end(), &group));
+        while (group.n_helpers != 0)
+            group.helpers_done.wait(lock);
+    }
+    busy_ = false;
+    if (borrowed_cores != 0)
+        release_cores(executor, borrowed_cores);
+
+    if (group.failure)
+        std::rethrow_exception(group.failure);
+}
+
+// Is there anything that an idle thread could do?
+bool static
+has_work(work_stealing_executor& executor)
+{
+    return
+        executor.open_parallel_slots != 0 ||
+        (can_take_core(executor) && has_queued_jobs(executor));
+}
+
+// Wait until there's a job for the thread with the given index to execute
+// and a core to execute it on. (The thread holds the core when this
+// returns.) While it's waiting, the thread helps with parallel tasks.
+background_job_ptr static
+wait_for_job(work_stealing_executor& executor, unsigned index)
+{
+    background_job_ptr job;
+    while (1)
+    {
+        if (take_core(executor))
+        {
+            if (find_job(&job, executor, index))
+                return job;
+            release_cores(executor, 1);
+        }
+        if (help_with_parallel_tasks(executor))
+            continue;
+        boost::unique_lock<boost::mutex> lock(executor.idle_mutex);
+        // Since threads that queue jobs only signal idle_cv if they see that
+        // a thread is sleeping, this has to check for work again after
+        // registering itself as sleeping.
+        ++executor.n_sleeping_threads;
+        if (!has_work(executor))
+            executor.idle_cv.wait(lock);
+        --executor.n_sleeping_threads;
+    }
+}
+
+void queue_background_job(work_stealing_executor& executor,
+    background_job_ptr const& job)
+{
+    if (!job->hidden)
+    {
+        job->info = job->job->get_info();
+        ++executor.reported_size;
+        ++executor.status_version;
+    }
+    job->core_count =
+        (std::min)((std::max)(job->job->get_core_count(), 1u),
+            unsigned(executor.deques.size()));
+    // Jobs that are created within the pool go on the creating thread's own
+    // deque.
+    auto* thread = the_current_work_stealing_thread.get();
+    if (thread && thread->executor == &executor)
+        push_job(*executor.deques[thread->index], job);
+    else
+        push_job(executor.injection, job);
+    notify_idle_thread(executor);
+}
+
+// Add a job whose inputs aren't ready to the waiting list.
+// If data has become available since *wake_up_counter was read, this
+// instead updates *wake_up_counter and returns false, so that the job can
+// check its inputs again.
+bool static
+add_waiting_job(work_stealing_executor& executor, background_job_ptr const& job,
+    size_t* wake_up_counter)
+{
+    boost::lock_guard<boost::mutex> lock(executor.waiting_mutex);
+    // waiting_count is incremented before checking the counter so that
+    // wake_up_waiting_jobs can't miss this job.
+    ++executor.waiting_count;
+    size_t current_counter = executor.wake_up_counter;
+    if (current_counter != *wake_up_counter)
+    {
+        --executor.waiting_count;
+        *wake_up_counter = current_counter;
+        return false;
+    }
+    executor.waiting_jobs.push_back(job);
+    if (!job->hidden)
+        ++executor.reported_size;
+    return true;
+}
+
+void static
+wake_up_waiting_jobs(work_stealing_executor& executor)
+{
+    ++executor.wake_up_counter;
+    if (executor.waiting_count == 0)
+        return;
+    std::vector<background_job_ptr> jobs;
+    {
+        boost::lock_guard<boost::mutex> lock(executor.waiting_mutex);
+        swap(jobs, executor.waiting_jobs);
+        executor.waiting_count = 0;
+    }
+    // These are still counted in reported_size, so they're just pushed.
+    executor.woken_job_count += jobs.size();
+    for (auto const& job : jobs)
+    {
+        push_job(executor.injection, job);
+        notify_idle_thread(executor);
+    }
+}
+
+void release_dependent_jobs(work_stealing_executor& executor,
+    std::vector<background_job_ptr> const& jobs)
+{
+    auto* thread = the_current_work_stealing_thread.get();
+    for (auto const& job : jobs)
+    {
+        if (--job->pending_inputs != 0)
+            continue;
+        // The job is still counted in reported_size, so it's just pushed.
+        // If this is a worker thread, the job goes on its own deque, since
+        // the inputs that the job needs are likely to be in its cache.
+        ++executor.woken_job_count;
+        if (thread && thread->executor == &executor)
+            push_job(*executor.deques[thread->index], job);
+        else
+            push_job(executor.injection, job);
+        notify_idle_thread(executor);
+    }
+}
+
+// Park a job whose inputs aren't ready until they are. If the job can be
+// registered as a dependent of the records that it's waiting on, it's
+// requeued when they're resolved. Otherwise, it goes on the untracked
+// waiting list.
+// The return value is false if the job should check its inputs again
+// instead.
+bool static
+park_waiting_job(work_stealing_executor& executor,
+    background_input_collector& inputs, background_job_ptr const& job,
+    size_t* wake_up_counter)
+{
+    // pending_inputs starts with an extra count so that the job can't be
+    // requeued until it's done registering.
+    job->pending_inputs = 1;
+    if (add_dependent_job(inputs, job) == 0)
+    {
+        job->pending_inputs = 0;
+        return add_waiting_job(executor, job, wake_up_counter);
+    }
+    if (!job->hidden)
+        ++executor.reported_size;
+    if (--job->pending_inputs == 0)
+    {
+        // Everything that the job was registered with was resolved in the
+        // meantime.
+        if (!job->hidden)
+            --executor.reported_size;
+        return false;
+    }
+    return true;
+}
+
+void work_stealing_execution_loop::operator()()
+{
+    auto& executor = *executor_;
+    auto& queue = *queue_;
+
+    {
+        auto* info = new work_stealing_thread_info;
+        info->executor = &executor;
+        info->index = index_;
+        info->held_cores = 0;
+        the_current_work_stealing_thread.reset(info);
+    }
+
+    background_input_collector inputs;
+
+    while (1)
+    {
+        ++executor.n_idle_threads;
+        background_job_ptr job = wait_for_job(executor, index_);
+        --executor.n_idle_threads;
+        size_t wake_up_counter = executor.wake_up_counter;
+        if (!job->hidden)
+            --executor.reported_size;
+
+        // If it's already been instructed to cancel, cancel it.
+        if (job->cancel)
+        {
+            job->state = background_job_state::CANCELED;
+            if (!job->hidden)
+                ++executor.status_version;
+            release_cores(executor, 1);
+            continue;
+        }
+
+        while (1)
+        {
+            // Instruct the job to gather its inputs, keeping track of the
+            // ones that aren't ready.
+            set_background_input_collector(&inputs);
+            job->job->gather_inputs();
+            bool ready = job->job->inputs_ready();
+            set_background_input_collector(0);
+
+            if (ready)
+            {
+                release_collected_inputs(inputs);
+                goto job_inputs_ready;
+            }
+
+            if (park_waiting_job(executor, inputs, job, &wake_up_counter))
+                break;
         }
+        release_cores(executor, 1);
+        continue;
+
+      job_inputs_ready:
+
+        {
+            boost::lock_guard<boost::mutex> lock(data_proxy_->mutex);
+            data_proxy_->active_job = job;
+        }
+
+        if (job->core_count > 1)
+            reserve_additional_cores(executor, job->core_count - 1);
+        {
+            work_stealing_parallel_executor parallel(executor,
+                job->core_count);
+            auto& thread = *the_current_work_stealing_thread;
+            thread.held_cores = job->core_count;
+            execute_background_job(queue, job, &parallel);
+            thread.held_cores = 0;
+        }
+        release_cores(executor, job->core_count);
+
+        if (!job->hidden)
+            ++executor.status_version;
 
         {
             boost::lock_guard<boost::mutex> lock(data_proxy_->mutex);
@@ -290,7 +971,33 @@ void initialize_pool(
 }
 
 void static
-initialize_system(background_execution_system_impl& system)
+initialize_work_stealing_pool(
+    background_execution_pool& pool, unsigned thread_count)
+{
+    pool.queue.reset(new background_job_queue);
+    pool.executor.reset(new work_stealing_executor);
+    pool.executor->free_cores = int(thread_count);
+    // All the deques have to exist before any of the threads start.
+    for (unsigned i = 0; i != thread_count; ++i)
+    {
+        pool.executor->deques.push_back(
+            alia__shared_ptr<background_job_deque>(new background_job_deque));
+    }
+    for (unsigned i = 0; i != thread_count; ++i)
+    {
+        alia__shared_ptr<background_thread_data_proxy> data_proxy(
+            new background_thread_data_proxy);
+        work_stealing_execution_loop fn(pool.executor, i, pool.queue,
+            data_proxy);
+        pool.threads.push_back(
+            alia__shared_ptr<background_execution_thread>(
+                new background_execution_thread(fn, data_proxy)));
+    }
+}
+
+void static
+initialize_system(background_execution_system_impl& system,
+    unsigned calculation_thread_count)
 {
     // Only enable full concurrency in release mode.
     // I've had issues with running inside the debugger with too many threads,
@@ -302,9 +1009,17 @@ initialize_system(background_execution_system_impl& system)
     bool const full_concurrency = true;
   #endif
     // Initialize all the queues.
-    initialize_pool<background_job_execution_loop>(
-        system.pools[int(background_job_queue_type::CALCULATION)],
-        full_concurrency ? boost::thread::hardware_concurrency() : 1);
+    if (calculation_thread_count == 0)
+    {
+        calculation_thread_count =
+            full_concurrency ?
+                (std::max)(boost::thread::hardware_concurrency(), 1u) : 1;
+    }
+    auto& calculation_pool =
+        system.pools[int(background_job_queue_type::CALCULATION)];
+    initialize_work_stealing_pool(calculation_pool, calculation_thread_count);
+    calculation_pool.executor->cache = &system.cache;
+    system.cache.executor = calculation_pool.executor.get();
     initialize_pool<web_request_processing_loop>(
         system.pools[int(background_job_queue_type::WEB_READ)],
         full_concurrency ? 16 : 1);
@@ -339,6 +1054,14 @@ shut_down_pool(background_execution_pool& pool)
 bool static
 is_pool_idle(background_execution_pool& pool)
 {
+    if (pool.executor)
+    {
+        auto& executor = *pool.executor;
+        return
+            executor.n_idle_threads == pool.threads.size() &&
+            !has_queued_jobs(executor) &&
+            executor.waiting_count == 0;
+    }
     background_job_queue& queue = *pool.queue;
     boost::mutex::scoped_lock lock(queue.mutex);
     return
@@ -393,10 +1116,24 @@ void wake_up_waiting_jobs(background_job_queue& queue)
     }
 }
 
+void wake_up_waiting_jobs(background_execution_pool& pool)
+{
+    if (pool.executor)
+        wake_up_waiting_jobs(*pool.executor);
+    else
+        wake_up_waiting_jobs(*pool.queue);
+}
+
 background_execution_system::background_execution_system()
 {
     impl_ = new background_execution_system_impl;
-    initialize_system(*impl_);
+    initialize_system(*impl_, 0);
+}
+background_execution_system::background_execution_system(
+    unsigned calculation_thread_count)
+{
+    impl_ = new background_execution_system_impl;
+    initialize_system(*impl_, calculation_thread_count);
 }
 background_execution_system::~background_execution_system()
 {
@@ -404,10 +1141,106 @@ background_execution_system::~background_execution_system()
     delete impl_;
 }
 
+void static
+add_job_info(
+    std::map<background_job_execution_data*,background_job_info>& job_info,
+    background_job_ptr const& job)
+{
+    if (!job->hidden)
+        job_info[&*job] = job->info;
+}
+
+void static
+add_job_info(
+    std::map<background_job_execution_data*,background_job_info>& job_info,
+    background_job_deque& deque)
+{
+    boost::lock_guard<boost::mutex> lock(deque.mutex);
+    for (auto const& band : deque.bands)
+    {
+        for (auto const& job : band)
+            add_job_info(job_info, job);
+    }
+}
+
+void static
+add_job_info(
+    std::map<background_job_execution_data*,background_job_info>& job_info,
+    background_cache& cache)
+{
+    for (auto& segment : cache.segments)
+    {
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
+        for (auto const& record : segment.records)
+        {
+            for (auto const& job : record.second.dependent_jobs)
+                add_job_info(job_info, job);
+        }
+    }
+}
+
+// For pools with executors, the status is assembled on demand from the
+// executor's counters and the contents of its deques.
+void static
+update_executor_status(
+    keyed_data<background_execution_pool_status>& status,
+    background_execution_pool& pool)
+{
+    auto& executor = *pool.executor;
+    background_job_queue& queue = *pool.queue;
+    boost::mutex::scoped_lock lock(queue.mutex);
+    auto thread_count = pool.threads.size();
+    size_t idle_thread_count = executor.n_idle_threads;
+    size_t queued_job_count = executor.reported_size;
+    refresh_keyed_data(status,
+        combine_ids(get_id(queue.version),
+            make_id(size_t(executor.status_version)),
+            make_id(idle_thread_count), make_id(queued_job_count),
+            make_id(thread_count)));
+    if (!is_valid(status))
+    {
+        background_execution_pool_status new_status;
+        new_status.thread_count = thread_count;
+        for (auto const& f : queue.failed_jobs)
+        {
+            background_job_failure_report report;
+            report.job = f.job.get();
+            report.message = f.message;
+            new_status.transient_failures.push_back(report);
+        }
+        // (The cache mutex can't be acquired while the queue mutex is held.)
+        lock.unlock();
+        new_status.queued_job_count = queued_job_count;
+        new_status.idle_thread_count = idle_thread_count;
+        add_job_info(new_status.job_info, *executor.cache);
+        for (auto const& deque : executor.deques)
+            add_job_info(new_status.job_info, *deque);
+        add_job_info(new_status.job_info, executor.injection);
+        {
+            boost::lock_guard<boost::mutex> lock(executor.waiting_mutex);
+            for (auto const& job : executor.waiting_jobs)
+                add_job_info(new_status.job_info, job);
+        }
+        for (auto const& thread : pool.threads)
+        {
+            auto& proxy = *thread->data_proxy;
+            boost::lock_guard<boost::mutex> lock(proxy.mutex);
+            if (proxy.active_job)
+                add_job_info(new_status.job_info, proxy.active_job);
+        }
+        set(status, new_status);
+    }
+}
+
 void static
 update_status(keyed_data<background_execution_pool_status>& status,
     background_execution_pool& pool)
 {
+    if (pool.executor)
+    {
+        update_executor_status(status, pool);
+        return;
+    }
     background_job_queue& queue = *pool.queue;
     boost::mutex::scoped_lock lock(queue.mutex);
     auto thread_count = pool.threads.size();
@@ -485,8 +1318,57 @@ size_t canceled_job_count(background_job_queue& queue)
     return count;
 }
 
+// Count the jobs in the given list that aren't hidden.
+template<class Jobs>
+size_t static
+count_reported_jobs(Jobs const& jobs)
+{
+    size_t count = 0;
+    for (auto const& job : jobs)
+    {
+        if (!job->hidden)
+            ++count;
+    }
+    return count;
+}
+
+// Clear out a deque and return how many of its jobs weren't hidden.
+size_t static
+clear_deque(background_job_deque& deque)
+{
+    boost::lock_guard<boost::mutex> lock(deque.mutex);
+    size_t reported = 0;
+    for (auto& band : deque.bands)
+    {
+        reported += count_reported_jobs(band);
+        band.clear();
+    }
+    deque.size = 0;
+    return reported;
+}
+
+void static
+clear_pending_jobs(work_stealing_executor& executor)
+{
+    size_t reported = 0;
+    for (auto const& deque : executor.deques)
+        reported += clear_deque(*deque);
+    reported += clear_deque(executor.injection);
+    {
+        boost::lock_guard<boost::mutex> lock(executor.waiting_mutex);
+        reported += count_reported_jobs(executor.waiting_jobs);
+        executor.waiting_jobs.clear();
+        executor.waiting_count = 0;
+    }
+    reported += clear_dependent_jobs(*executor.cache, false);
+    executor.reported_size -= reported;
+    ++executor.status_version;
+}
+
 void clear_pending_jobs(background_execution_pool& pool)
 {
+    if (pool.executor)
+        clear_pending_jobs(*pool.executor);
     auto& queue = *pool.queue;
     boost::mutex::scoped_lock lock(queue.mutex);
     inc_version(queue.version);
@@ -557,8 +1439,61 @@ void clear_canceled_jobs(
     pqueue = filtered;
 }
 
+// Remove the canceled jobs from the given list and return how many of them
+// weren't hidden.
+template<class Jobs>
+size_t static
+remove_canceled_jobs(Jobs& jobs)
+{
+    auto canceled =
+        std::partition(jobs.begin(), jobs.end(),
+            [](background_job_ptr const& job) { return !job->cancel; });
+    size_t reported = 0;
+    for (auto i = canceled; i != jobs.end(); ++i)
+    {
+        if (!(*i)->hidden)
+            ++reported;
+    }
+    jobs.erase(canceled, jobs.end());
+    return reported;
+}
+
+void static
+clear_canceled_jobs(work_stealing_executor& executor)
+{
+    size_t reported = 0;
+    auto filter_deque =
+        [&](background_job_deque& deque)
+        {
+            boost::lock_guard<boost::mutex> lock(deque.mutex);
+            size_t size = 0;
+            for (auto& band : deque.bands)
+            {
+                reported += remove_canceled_jobs(band);
+                size += band.size();
+            }
+            deque.size = size;
+        };
+    for (auto const& deque : executor.deques)
+        filter_deque(*deque);
+    filter_deque(executor.injection);
+    {
+        boost::lock_guard<boost::mutex> lock(executor.waiting_mutex);
+        reported += remove_canceled_jobs(executor.waiting_jobs);
+        executor.waiting_count = executor.waiting_jobs.size();
+    }
+    reported += clear_dependent_jobs(*executor.cache, true);
+    executor.reported_size -= reported;
+    ++executor.status_version;
+}
+
 void clear_canceled_jobs(background_execution_pool& pool)
 {
+    if (pool.executor)
+    {
+        clear_canceled_jobs(*pool.executor);
+        return;
+    }
     auto& queue = *pool.queue;
     boost::mutex::scoped_lock lock(queue.mutex);
     clear_canceled_jobs(queue, queue.jobs);
@@ -585,27 +1520,29 @@ memory_cache_snapshot
 get_memory_cache_snapshot(background_execution_system& system)
 {
     auto& cache = system.impl_->cache;
-    boost::lock_guard<boost::mutex> lock(cache.mutex);
     memory_cache_snapshot snapshot;
-    snapshot.in_use.reserve(cache.records.size());
-    for (auto const& record : cache.records)
+    for (auto& segment : cache.segments)
     {
-        auto const& data = record.second.data;
-        if (is_initialized(data))
+        boost::lock_guard<boost::mutex> lock(segment.mutex);
+        for (auto const& record : segment.records)
         {
-            memory_cache_entry_info info;
-            info.type = data.ptr->type_info();
-            info.data_size = data.ptr->deep_size();
-            // Put the entry's info the appropriate list depending on whether
-            // or not its in the eviction list.
-            if (record.second.eviction_list_iterator !=
-                cache.eviction_list.records.end())
+            auto const& data = record.second.data;
+            if (is_initialized(data))
             {
-                snapshot.pending_eviction.push_back(info);
-            }
-            else
-            {
-                snapshot.in_use.push_back(info);
+                memory_cache_entry_info info;
+                info.type = data.ptr->type_info();
+                info.data_size = data.ptr->deep_size();
+                // Put the entry's info the appropriate list depending on
+                // whether or not its in the eviction list.
+                if (record.second.eviction_list_iterator !=
+                    segment.eviction_list.records.end())
+                {
+                    snapshot.pending_eviction.push_back(info);
+                }
+                else
+                {
+                    snapshot.in_use.push_back(info);
+                }
             }
         }
     }
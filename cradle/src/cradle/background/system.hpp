@@ -17,8 +17,9 @@
 //
 // For pure calculations, it maintains a pool of worker threads (one for each
 // processor core in the system). Individual jobs are assumed to be
-// single-threaded, so each worker thread simply grabs jobs off the queue and
-// executes them one at a time.
+// single-threaded, so each worker thread simply executes jobs one at a time.
+// Each thread has its own queue of jobs, and threads that run out of work
+// steal it from the others. (See work_stealing_executor in internals.hpp.)
 //
 // For web queries, it's assumed that more concurrency is always better, so
 // the system allocates threads as needed to ensure that all pending queries
@@ -42,6 +43,9 @@ struct background_execution_system_impl;
 struct background_execution_system : noncopyable
 {
     background_execution_system();
+    // This allows the number of threads in the calculation pool to be
+    // specified explicitly (e.g., for benchmarking). 0 means the default.
+    explicit background_execution_system(unsigned calculation_thread_count);
     ~background_execution_system();
 
     background_execution_system_impl* impl_;
@@ -131,6 +135,13 @@ void set_disk_cache(background_execution_system& system,
 alia__shared_ptr<disk_cache> const&
 get_disk_cache(background_execution_system& system);
 
+// Results are written to the disk cache in the background.
+// This sets the maximum number of bytes of data that can be waiting to be
+// written at any one time. When it's exceeded, threads that are producing
+// disk-cached results are blocked until the backlog clears.
+void set_disk_write_budget(background_execution_system& system,
+    size_t bytes);
+
 // AUTHENTICATION MANAGEMENT INTERFACE
 
 // Set the authentication info for web requests.
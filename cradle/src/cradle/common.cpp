@@ -2,8 +2,13 @@
 
 #include <cctype>
 #include <cstring>
+#include <memory>
+#include <unordered_map>
 
 #include <boost/format.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
 
 #include <cradle/api.hpp>
 #include <cradle/date_time.hpp>
@@ -44,17 +49,17 @@ void check_index_bounds(char const* label, size_t index, size_t upper_bound)
 
 // MAPS
 
-value get_field(value_map const& r, string const& field)
+value get_field(value_map const& r, field_key const& field)
 {
     value v;
     if (!get_field(&v, r, field))
-        throw cradle::exception("missing field: " + field);
+        throw cradle::exception("missing field: " + field.name());
     return v;
 }
 
-bool get_field(value* v, value_map const& r, string const& field)
+bool get_field(value* v, value_map const& r, field_key const& field)
 {
-    auto i = r.find(value(field));
+    auto i = r.find(field.key());
     if (i == r.end())
         return false;
     *v = i->second;
@@ -68,6 +73,28 @@ value const& get_union_value_type(value_map const& map)
     return map.begin()->first;
 }
 
+void build_value_map(value_map* map, value_map::sequence_type& entries)
+{
+    auto key_less =
+        [ ](value_map::value_type const& a, value_map::value_type const& b)
+        { return a.first < b.first; };
+    if (!std::is_sorted(entries.begin(), entries.end(), key_less))
+        std::stable_sort(entries.begin(), entries.end(), key_less);
+    // Collapse runs of equal keys, keeping the last value for each.
+    auto out = entries.begin();
+    for (auto i = entries.begin(); i != entries.end(); ++i)
+    {
+        if (i + 1 != entries.end() && !(i->first < (i + 1)->first))
+            continue;
+        if (out != i)
+            *out = std::move(*i);
+        ++out;
+    }
+    entries.erase(out, entries.end());
+    map->adopt_sequence(boost::container::ordered_unique_range,
+        std::move(entries));
+}
+
 // VALUES
 
 std::ostream& operator<<(std::ostream& s, value_type t)
@@ -227,7 +254,7 @@ void value::swap_with(value& other)
 {
     using cradle::swap;
     swap(type_, other.type_);
-    swap(value_, other.value_);
+    swap(storage_, other.storage_);
 }
 
 static void check_type(value_type got, value_type expected)
@@ -239,113 +266,132 @@ static void check_type(value_type got, value_type expected)
 void value::get(bool const** v) const
 {
     check_type(type_, value_type::BOOLEAN);
-    *v = &unsafe_any_cast<bool>(value_);
+    *v = &storage_.boolean;
 }
 void value::get(integer const** v) const
 {
     check_type(type_, value_type::INTEGER);
-    *v = &unsafe_any_cast<integer>(value_);
+    *v = &storage_.integer_value;
 }
 void value::get(double const** v) const
 {
     check_type(type_, value_type::FLOAT);
-    *v = &unsafe_any_cast<double>(value_);
+    *v = &storage_.float_value;
 }
 void value::get(string const** v) const
 {
     check_type(type_, value_type::STRING);
-    *v = &unsafe_any_cast<string>(value_);
+    *v = &node_contents<string>();
 }
 void value::get(blob const** v) const
 {
     check_type(type_, value_type::BLOB);
-    *v = &unsafe_any_cast<blob>(value_);
+    *v = &node_contents<blob>();
 }
 void value::get(boost::posix_time::ptime const** v) const
 {
     check_type(type_, value_type::DATETIME);
-    *v = &unsafe_any_cast<boost::posix_time::ptime>(value_);
+    *v = &node_contents<boost::posix_time::ptime>();
 }
 void value::get(value_list const** v) const
 {
     // Certain ways of encoding values (e.g., JSON) have the same
     // representation for empty arrays and empty maps, so if we encounter an
     // empty map here, we should treat it as an empty list.
-    if (type_ == value_type::MAP && unsafe_any_cast<value_map>(value_).empty())
+    if (type_ == value_type::MAP && node_contents<value_map>().empty())
     {
         static const value_list empty_list;
         *v = &empty_list;
         return;
     }
     check_type(type_, value_type::LIST);
-    *v = &unsafe_any_cast<value_list>(value_);
+    *v = &node_contents<value_list>();
 }
 void value::get(value_map const** v) const
 {
     // Same logic as in the list case.
-    if (type_ == value_type::LIST &&
-        unsafe_any_cast<value_list>(value_).empty())
+    if (type_ == value_type::LIST && node_contents<value_list>().empty())
     {
         static const value_map empty_map;
         *v = &empty_map;
         return;
     }
     check_type(type_, value_type::MAP);
-    *v = &unsafe_any_cast<value_map>(value_);
+    *v = &node_contents<value_map>();
+}
+
+// The node is created before the old one is released, since the new contents
+// may be part of the old ones.
+template<class T>
+void value::set_node(value_type type, T&& contents)
+{
+    typedef typename std::decay<T>::type contents_type;
+    value_node* node =
+        new typed_value_node<contents_type>(std::forward<T>(contents));
+    release();
+    type_ = type;
+    storage_.node = node;
 }
 
 void value::set(nil_type _)
 {
-    type_ = value_type::NIL;
+    release();
 }
 void value::set(bool v)
 {
+    release();
     type_ = value_type::BOOLEAN;
-    value_ = v;
+    storage_.boolean = v;
 }
 void value::set(integer v)
 {
+    release();
     type_ = value_type::INTEGER;
-    value_ = v;
+    storage_.integer_value = v;
 }
 void value::set(double v)
 {
+    release();
     type_ = value_type::FLOAT;
-    value_ = v;
+    storage_.float_value = v;
 }
 void value::set(string const& v)
 {
-    type_ = value_type::STRING;
-    value_ = v;
+    set_node(value_type::STRING, v);
 }
 void value::set(blob const& v)
 {
-    type_ = value_type::BLOB;
-    value_ = v;
+    set_node(value_type::BLOB, v);
 }
 void value::set(boost::posix_time::ptime const& v)
 {
-    type_ = value_type::DATETIME;
-    value_ = v;
+    set_node(value_type::DATETIME, v);
 }
 void value::set(value_list const& v)
 {
-    type_ = value_type::LIST;
-    value_ = v;
+    set_node(value_type::LIST, v);
 }
 void value::set(value_map const& v)
 {
-    type_ = value_type::MAP;
-    value_ = v;
+    set_node(value_type::MAP, v);
 }
 
+// These move the argument into a new node, so the contents are never copied.
+// The argument is left empty.
+void value::swap_in(string& v)
+{
+    set_node(value_type::STRING, std::move(v));
+    v.clear();
+}
 void value::swap_in(value_list& v)
 {
-    this->set(v);
+    set_node(value_type::LIST, std::move(v));
+    v.clear();
 }
 void value::swap_in(value_map& v)
 {
-    this->set(v);
+    set_node(value_type::MAP, std::move(v));
+    v.clear();
 }
 
 struct value_deep_sizeof_operator
@@ -366,6 +412,15 @@ size_t deep_sizeof(value const& v)
     return fn.result;
 }
 
+size_t deep_sizeof(value_map const& m)
+{
+    size_t size = sizeof(value_map) +
+        (m.capacity() - m.size()) * sizeof(value_map::value_type);
+    for (auto const& i : m)
+        size += deep_sizeof(i.first) + deep_sizeof(i.second);
+    return size;
+}
+
 struct hash_fn
 {
     template<class T>
@@ -383,8 +438,160 @@ struct hash_fn
         apply_fn_to_value(fn, x);
         return fn.result;
     }
+    size_t hash<cradle::value_map>::operator()(
+        cradle::value_map const& x) const
+    {
+        size_t h = 0;
+        for (auto const& i : x)
+        {
+            h = alia::combine_hashes(h,
+                    alia::combine_hashes(
+                        alia::invoke_hash(i.first),
+                        alia::invoke_hash(i.second)));
+        }
+        return h;
+    }
 } namespace cradle {
 
+// FIELD KEYS
+
+// The interned field names live in a fixed-size open-addressing hash table.
+// Entries are never removed (or freed), so lookups don't need a lock. Only
+// insertions do, and those are capped at half the table's capacity, so
+// probing always ends at an empty slot.
+
+static size_t const field_key_table_size = 0x4000;
+
+static std::atomic<value const*> field_key_table[field_key_table_size];
+
+static size_t field_key_count = 0;
+
+static boost::mutex field_key_table_mutex;
+
+// Each interned name also gets a rank that follows the order of the names, so
+// interned keys can usually be ordered without comparing their names. A new
+// name's rank goes between its neighbors' ranks. If there's no room left
+// there, it gets a rank of 0 and is ordered by its name instead. Ranks are
+// indexed by atom and never change once they're assigned.
+
+static uint64_t field_key_ranks[field_key_table_size / 2 + 1];
+
+static std::map<string,uint64_t> ranked_field_names;
+
+static uint64_t assign_field_key_rank(string const& name)
+{
+    uint64_t const spacing = uint64_t(1) << 40;
+    auto next = ranked_field_names.lower_bound(name);
+    bool has_next = next != ranked_field_names.end();
+    bool has_prev = next != ranked_field_names.begin();
+    // Both bounds are exclusive.
+    uint64_t lo = has_prev ? std::prev(next)->second : 0;
+    uint64_t hi = has_next ? next->second : ~uint64_t(0);
+    uint64_t rank;
+    if (!has_prev && !has_next)
+        rank = uint64_t(1) << 63;
+    else if (!has_next && hi - lo > spacing)
+        rank = lo + spacing;
+    else if (!has_prev && hi - lo > spacing)
+        rank = hi - spacing;
+    else if (hi - lo >= 2)
+        rank = lo + (hi - lo) / 2;
+    else
+        return 0;
+    ranked_field_names.emplace_hint(next, name, rank);
+    return rank;
+}
+
+static size_t hash_field_name(char const* name, size_t length)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i != length; ++i)
+        h = (h ^ uint8_t(name[i])) * 16777619u;
+    return h;
+}
+
+// Get the slot for the given name. This is either the slot that holds it or
+// the empty slot where it would go.
+static std::atomic<value const*>*
+find_field_key_slot(char const* name, size_t length)
+{
+    size_t i = hash_field_name(name, length) & (field_key_table_size - 1);
+    while (true)
+    {
+        value const* entry =
+            field_key_table[i].load(std::memory_order_acquire);
+        if (!entry)
+            return &field_key_table[i];
+        string const& entry_name = cast<string>(*entry);
+        if (entry_name.length() == length &&
+            std::memcmp(entry_name.data(), name, length) == 0)
+        {
+            return &field_key_table[i];
+        }
+        i = (i + 1) & (field_key_table_size - 1);
+    }
+}
+
+bool find_interned_field_key(value* key, char const* name, size_t length)
+{
+    value const* entry =
+        find_field_key_slot(name, length)->load(std::memory_order_acquire);
+    if (!entry)
+        return false;
+    *key = *entry;
+    return true;
+}
+
+void share_interned_field_key(value& key)
+{
+    if (key.type() == value_type::STRING)
+    {
+        string const& name = cast<string>(key);
+        find_interned_field_key(&key, name.data(), name.length());
+    }
+}
+
+field_key intern_field_name(char const* name)
+{
+    size_t length = std::strlen(name);
+    field_key key;
+    if (!find_interned_field_key(&key.key_, name, length))
+    {
+        boost::lock_guard<boost::mutex> lock(field_key_table_mutex);
+        auto slot = find_field_key_slot(name, length);
+        value const* entry = slot->load(std::memory_order_relaxed);
+        if (!entry && field_key_count < field_key_table_size / 2)
+        {
+            value* new_entry = new value(string(name, length));
+            unsigned atom = unsigned(++field_key_count);
+            new_entry->storage_.node->atom = atom;
+            field_key_ranks[atom] =
+                assign_field_key_rank(cast<string>(*new_entry));
+            slot->store(new_entry, std::memory_order_release);
+            entry = new_entry;
+        }
+        key.key_ = entry ? *entry : value(string(name, length));
+    }
+    return key;
+}
+
+field_key::field_key(string const& name)
+{
+    if (!find_interned_field_key(&key_, name.data(), name.length()))
+        key_ = value(name);
+}
+field_key::field_key(char const* name)
+{
+    if (!find_interned_field_key(&key_, name, std::strlen(name)))
+        key_ = value(name);
+}
+
+string const& field_key::name() const
+{
+    return cast<string>(key_);
+}
+
 // COMPARISON OPERATORS
 
 struct equality_test
@@ -401,6 +608,11 @@ bool operator==(value const& a, value const& b)
 {
     if (a.type() != b.type())
         return false;
+    if (a.shares_contents_with(b))
+        return true;
+    // Distinct interned keys never have the same name.
+    if (a.interned_atom() && b.interned_atom())
+        return false;
     equality_test fn;
     apply_fn_to_value_pair(fn, a, b);
     return fn.result;
@@ -422,6 +634,16 @@ bool operator<(value const& a, value const& b)
 {
     if (a.type() != b.type())
         return a.type() < b.type();
+    if (a.shares_contents_with(b))
+        return false;
+    unsigned a_atom = a.interned_atom(), b_atom = b.interned_atom();
+    if (a_atom && b_atom)
+    {
+        uint64_t a_rank = field_key_ranks[a_atom];
+        uint64_t b_rank = field_key_ranks[b_atom];
+        if (a_rank && b_rank)
+            return a_rank < b_rank;
+    }
     less_than_test fn;
     apply_fn_to_value_pair(fn, a, b);
     return fn.result;
@@ -590,6 +812,290 @@ std::ostream& operator<<(std::ostream& s, resolved_function_uid const& id)
     return s;
 }
 
+// BINARY ENCODING
+
+void write_binary_size(binary_writer& w, size_t size)
+{
+    uint64_t n = size;
+    write_binary_bytes(w, &n, sizeof(n));
+}
+size_t read_binary_size(binary_reader& r)
+{
+    uint64_t n;
+    read_binary_bytes(r, &n, sizeof(n));
+    return size_t(n);
+}
+
+void write_binary_block(binary_writer& w, void const* data, size_t size)
+{
+    write_binary_size(w, size);
+    size_t padding =
+        (binary_block_alignment - w.buffer->size() % binary_block_alignment) %
+        binary_block_alignment;
+    w.buffer->resize(w.buffer->size() + padding, 0);
+    write_binary_bytes(w, data, size);
+}
+void read_binary_block(binary_reader& r, blob* block)
+{
+    size_t size = read_binary_size(r);
+    size_t padding =
+        (binary_block_alignment -
+            size_t(r.position - r.start) % binary_block_alignment) %
+        binary_block_alignment;
+    if (size_t(r.end - r.position) < padding ||
+        size_t(r.end - r.position) - padding < size)
+    {
+        throw corrupt_binary_data();
+    }
+    r.position += padding;
+    if (r.ownership &&
+        reinterpret_cast<uintptr_t>(r.position) % binary_block_alignment == 0)
+    {
+        block->ownership = *r.ownership;
+        block->data = r.position;
+    }
+    else
+    {
+        alia__shared_ptr<uint8_t> ptr(new uint8_t[size],
+            array_deleter<uint8_t>());
+        std::memcpy(ptr.get(), r.position, size);
+        block->ownership = ptr;
+        block->data = ptr.get();
+    }
+    block->size = size;
+    block->hash_cache = buffer_hash_cache();
+    r.position += size;
+}
+
+// All schema hash computations happen under this lock, since they share
+// the in_progress flags in the caches.
+static boost::recursive_mutex binary_schema_mutex;
+// the number of computations currently active (protected by the mutex)
+static unsigned binary_schema_depth = 0;
+
+binary_schema_hash_computation::binary_schema_hash_computation(
+    binary_schema_hash_cache& cache, char const* description)
+  : active_(0), locked_(false)
+{
+    hash_ = cache.hash.load(std::memory_order_acquire);
+    if (hash_ != 0)
+        return;
+    binary_schema_mutex.lock();
+    locked_ = true;
+    hash_ = cache.hash.load(std::memory_order_acquire);
+    if (hash_ != 0)
+        return;
+    hash_ = hash_binary_schema_description(description);
+    // If the type is already being computed further up the stack, this is a
+    // recursive reference, so it's represented by its description alone.
+    if (cache.in_progress)
+        return;
+    cache.in_progress = true;
+    active_ = &cache;
+    ++binary_schema_depth;
+}
+binary_schema_hash_computation::~binary_schema_hash_computation()
+{
+    if (active_)
+    {
+        active_->in_progress = false;
+        --binary_schema_depth;
+    }
+    if (locked_)
+        binary_schema_mutex.unlock();
+}
+uint64_t binary_schema_hash_computation::result()
+{
+    // 0 is reserved to mean 'not computed'.
+    if (hash_ == 0)
+        hash_ = 1;
+    if (active_)
+    {
+        active_->in_progress = false;
+        --binary_schema_depth;
+        // Only results that were computed from the top are complete. Below
+        // that, a recursive reference may have been cut short.
+        if (binary_schema_depth == 0)
+            active_->hash.store(hash_, std::memory_order_release);
+        active_ = 0;
+    }
+    return hash_;
+}
+
+static boost::posix_time::ptime const
+binary_epoch(boost::gregorian::date(1970, 1, 1));
+
+static void write_binary(binary_writer& w, value_map const& x)
+{
+    write_binary_size(w, x.size());
+    for (auto const& i : x)
+    {
+        write_binary(w, i.first);
+        write_binary(w, i.second);
+    }
+}
+static void read_binary(binary_reader& r, value_map* x)
+{
+    size_t n_fields = read_binary_size(r);
+    value_map::sequence_type entries;
+    entries.reserve(n_fields);
+    for (size_t i = 0; i != n_fields; ++i)
+    {
+        entries.emplace_back();
+        auto& entry = entries.back();
+        read_binary(r, &entry.first);
+        share_interned_field_key(entry.first);
+        read_binary(r, &entry.second);
+    }
+    build_value_map(x, entries);
+}
+
+void write_binary(binary_writer& w, value const& x)
+{
+    uint8_t type = uint8_t(x.type());
+    write_binary_bytes(w, &type, 1);
+    switch (x.type())
+    {
+     case value_type::NIL:
+        break;
+     case value_type::BOOLEAN:
+        write_binary(w, cast<bool>(x));
+        break;
+     case value_type::INTEGER:
+        write_binary(w, cast<integer>(x));
+        break;
+     case value_type::FLOAT:
+        write_binary(w, cast<double>(x));
+        break;
+     case value_type::STRING:
+        write_binary(w, cast<string>(x));
+        break;
+     case value_type::BLOB:
+        write_binary(w, cast<blob>(x));
+        break;
+     case value_type::DATETIME:
+        write_binary(w,
+            int64_t((cast<time>(x) - binary_epoch).total_milliseconds()));
+        break;
+     case value_type::LIST:
+        write_binary(w, cast<value_list>(x));
+        break;
+     case value_type::MAP:
+        write_binary(w, cast<value_map>(x));
+        break;
+    }
+}
+void read_binary(binary_reader& r, value* x)
+{
+    uint8_t type;
+    read_binary_bytes(r, &type, 1);
+    switch (value_type(type))
+    {
+     case value_type::NIL:
+        x->set(nil);
+        break;
+     case value_type::BOOLEAN:
+      {
+        bool b;
+        read_binary(r, &b);
+        x->set(b);
+        break;
+      }
+     case value_type::INTEGER:
+      {
+        integer n;
+        read_binary(r, &n);
+        x->set(n);
+        break;
+      }
+     case value_type::FLOAT:
+      {
+        double d;
+        read_binary(r, &d);
+        x->set(d);
+        break;
+      }
+     case value_type::STRING:
+      {
+        string s;
+        read_binary(r, &s);
+        x->swap_in(s);
+        break;
+      }
+     case value_type::BLOB:
+      {
+        blob b;
+        read_binary(r, &b);
+        x->set(b);
+        break;
+      }
+     case value_type::DATETIME:
+      {
+        int64_t t;
+        read_binary(r, &t);
+        x->set(binary_epoch + boost::posix_time::milliseconds(t));
+        break;
+      }
+     case value_type::LIST:
+      {
+        value_list l;
+        read_binary(r, &l);
+        x->swap_in(l);
+        break;
+      }
+     case value_type::MAP:
+      {
+        value_map m;
+        read_binary(r, &m);
+        x->swap_in(m);
+        break;
+      }
+     default:
+        throw corrupt_binary_data();
+    }
+}
+uint64_t get_binary_schema_hash(value const& x)
+{
+    return hash_binary_schema_description("dynamic");
+}
+
+void write_binary(binary_writer& w, string const& x)
+{
+    write_binary_size(w, x.length());
+    write_binary_bytes(w, x.data(), x.length());
+}
+void read_binary(binary_reader& r, string* x)
+{
+    size_t length = read_binary_size(r);
+    if (size_t(r.end - r.position) < length)
+        throw corrupt_binary_data();
+    x->assign(reinterpret_cast<char const*>(r.position), length);
+    r.position += length;
+}
+
+void write_binary(binary_writer& w, blob const& x)
+{
+    write_binary_block(w, x.data, x.size);
+}
+void read_binary(binary_reader& r, blob* x)
+{
+    read_binary_block(r, x);
+}
+
+void read_binary(binary_reader& r, std::vector<bool>* x)
+{
+    size_t n_elements = read_binary_size(r);
+    if (size_t(r.end - r.position) < n_elements)
+        throw corrupt_binary_data();
+    x->resize(n_elements);
+    for (size_t i = 0; i != n_elements; ++i)
+    {
+        bool b;
+        read_binary(r, &b);
+        (*x)[i] = b;
+    }
+}
+
 // IMMUTABLES
 
 immutable_data_type_mismatch::immutable_data_type_mismatch(
@@ -692,18 +1198,6 @@ hash_request(untyped_request const& request)
     return combine_hashes(size_t(request.type), content_hash);
 }
 
-untyped_request
-make_untyped_request(request_type type, any_by_ref const& contents,
-    dynamic_type_interface const* result_interface)
-{
-    untyped_request request;
-    request.type = type;
-    request.contents = contents;
-    request.result_interface = result_interface;
-    request.hash = hash_request(request);
-    return request;
-}
-
 untyped_request
 force_foreground_resolution(untyped_request const& request)
 {
@@ -789,4 +1283,180 @@ bool operator==(untyped_request const& a, untyped_request const& b)
     }
 }
 
+// REQUEST INTERNING
+
+// Requests are interned as they're constructed, so that structurally
+// identical requests share their contents. Subrequests are always
+// constructed (and interned) before the requests that contain them, so
+// checking a new request against an existing one only involves comparing
+// its own contents: any subrequests that match are already shared and
+// compare equal by pointer. Thus, a request that's recomposed from the same
+// pieces (as the GUI does on every pass) is recognized in time proportional
+// to what's new in it, and comparisons between equivalent requests (e.g., in
+// the caches) come down to pointer comparisons.
+
+// The table only holds weak references, so it never keeps requests alive.
+// It's split into shards (by hash), each with its own lock, and a shard's
+// lock is never held while requests are compared, since comparing requests
+// that carry large values can be expensive.
+struct interned_request
+{
+    request_type type;
+    dynamic_type_interface const* result_interface;
+    std::weak_ptr<untyped_value_holder> contents;
+    // the value of the shard's insertion_count when this was inserted
+    uint64_t serial;
+};
+
+struct request_interning_shard
+{
+    boost::mutex mutex;
+    // interned requests, indexed by hash
+    std::unordered_multimap<size_t,interned_request> requests;
+    // the number of requests that have ever been inserted into the shard
+    uint64_t insertion_count;
+    // When the shard reaches this size, expired entries are purged from it.
+    size_t purge_threshold;
+
+    request_interning_shard() : insertion_count(0), purge_threshold(0x100) {}
+};
+
+static unsigned const request_interning_shard_count = 64;
+
+struct request_interning_table
+{
+    request_interning_shard shards[request_interning_shard_count];
+};
+
+static request_interning_table&
+get_request_interning_table()
+{
+    static request_interning_table the_table;
+    return the_table;
+}
+
+static request_interning_shard&
+get_request_interning_shard(size_t hash)
+{
+    // The hash is mixed first, since its low bits also select the bucket
+    // within the shard.
+    uint64_t mixed = uint64_t(hash) * 0x9e3779b97f4a7c15ull;
+    return get_request_interning_table().shards[mixed >> 58];
+}
+
+// Can b be used in place of a? This is stricter than ==, which ignores
+// options that don't affect the result.
+static bool
+requests_interchangeable(untyped_request const& a, untyped_request const& b)
+{
+    return a == b &&
+        (a.type != request_type::FUNCTION ||
+            as_function(a).force_foreground_resolution ==
+            as_function(b).force_foreground_resolution);
+}
+
+// Get the live requests in the shard with the given hash that were inserted
+// at or after the given serial number. Expired entries are removed along the
+// way. The shard's mutex must be held.
+static void
+get_interning_candidates(std::vector<untyped_request>& candidates,
+    request_interning_shard& shard, size_t hash, uint64_t first_serial)
+{
+    candidates.clear();
+    auto range = shard.requests.equal_range(hash);
+    for (auto i = range.first; i != range.second; )
+    {
+        if (i->second.contents.expired())
+        {
+            i = shard.requests.erase(i);
+            continue;
+        }
+        if (i->second.serial >= first_serial)
+        {
+            untyped_request existing;
+            existing.contents.holder_ = i->second.contents.lock();
+            if (existing.contents.holder_)
+            {
+                existing.type = i->second.type;
+                existing.result_interface = i->second.result_interface;
+                existing.hash = hash;
+                candidates.push_back(existing);
+            }
+        }
+        ++i;
+    }
+}
+
+// If there's already an equivalent request in the table, this switches
+// 'request' over to its contents. Otherwise, 'request' is added.
+static void
+intern_request(untyped_request& request)
+{
+    auto& shard = get_request_interning_shard(request.hash);
+
+    // The candidates are gathered with the lock held and compared without
+    // it. If other requests with the same hash were inserted in the
+    // meantime, those have to be checked as well before this one is
+    // inserted.
+    std::vector<untyped_request> candidates;
+    uint64_t checked_serial = 0;
+    boost::unique_lock<boost::mutex> lock(shard.mutex);
+    while (1)
+    {
+        get_interning_candidates(candidates, shard, request.hash,
+            checked_serial);
+        if (candidates.empty())
+            break;
+        checked_serial = shard.insertion_count;
+        lock.unlock();
+        for (auto const& existing : candidates)
+        {
+            if (requests_interchangeable(request, existing))
+            {
+                request.contents = existing.contents;
+                return;
+            }
+        }
+        // The candidates are released without the lock, since that may
+        // destroy their contents.
+        candidates.clear();
+        lock.lock();
+    }
+
+    interned_request entry;
+    entry.type = request.type;
+    entry.result_interface = request.result_interface;
+    entry.contents = request.contents.holder_;
+    entry.serial = shard.insertion_count++;
+    shard.requests.insert(std::make_pair(request.hash, entry));
+
+    if (shard.requests.size() >= shard.purge_threshold)
+    {
+        for (auto i = shard.requests.begin(); i != shard.requests.end(); )
+        {
+            if (i->second.contents.expired())
+                i = shard.requests.erase(i);
+            else
+                ++i;
+        }
+        shard.purge_threshold =
+            (std::max)(size_t(0x100), shard.requests.size() * 2);
+    }
+}
+
+untyped_request
+make_untyped_request(request_type type, any_by_ref const& contents,
+    dynamic_type_interface const* result_interface)
+{
+    untyped_request request;
+    request.type = type;
+    request.contents = contents;
+    request.result_interface = result_interface;
+    // The hash is derived from the (precomputed) hashes of any subrequests,
+    // so this doesn't have to look beyond the request's own contents.
+    request.hash = hash_request(request);
+    intern_request(request);
+    return request;
+}
+
 }
@@ -7,12 +7,15 @@
 #include <map>
 #include <sstream>
 #include <cassert>
+#include <cstring>
 #include <algorithm>
+#include <atomic>
 #include <type_traits>
 #include <typeinfo>
 #include <typeindex>
 
 #include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/container/flat_map.hpp>
 
 #ifndef _WIN32
     // ignore warnings for GCC
@@ -135,11 +138,19 @@ struct sub_progress_reporter : progress_reporter_interface
     float scale_;
 };
 
+struct parallel_executor_interface;
+
 // Algorithms call this to check in with the caller every few milliseconds.
 // This can be used to abort the algorithm by throwing an exception.
+// The caller can also use it to control which threads the algorithm runs on
+// (see parallel_for in simple_concurrency.hpp).
 struct check_in_interface
 {
     virtual void operator()() = 0;
+    // If the caller has its own threads for the algorithm to run on, this
+    // returns an executor that runs tasks on them. Otherwise, it's 0, and
+    // the algorithm uses the shared thread pool.
+    virtual parallel_executor_interface* parallel_executor() { return 0; }
 };
 // If you don't need the algorithm to check in, pass one of these.
 struct null_check_in : check_in_interface
@@ -157,6 +168,12 @@ struct merged_check_in : check_in_interface
 
     void operator()() { (*a)(); (*b)(); }
 
+    parallel_executor_interface* parallel_executor()
+    {
+        auto* executor = a->parallel_executor();
+        return executor ? executor : b->parallel_executor();
+    }
+
  private:
     check_in_interface* a;
     check_in_interface* b;
@@ -676,6 +693,36 @@ static inline size_t deep_sizeof(nil_type)
 } namespace cradle {
 static nil_type nil;
 
+// BUFFER HASHES
+
+// Blobs, arrays and shared images all reference immutable buffers of data,
+// and hashing them means hashing the contents of those buffers. That's
+// expensive for large buffers, so each of them carries a buffer_hash_cache
+// alongside its ownership holder to remember the hash once it's computed.
+// The cache is passed along wherever the ownership is, so copies that are
+// made after the hash is computed don't have to compute it again.
+
+struct buffer_hash
+{
+    // the buffer that the hash was computed for
+    void const* data;
+    std::size_t size;
+    // the hash itself
+    std::size_t hash;
+};
+
+struct buffer_hash_cache
+{
+    mutable alia__shared_ptr<buffer_hash const> cached;
+};
+
+// Get the hash of the contents of the given buffer.
+// The cached hash is only used if it was computed for the same buffer, so
+// it's harmless for the cache to outlive the buffer it was filled in for.
+// This can be called on the same cache from multiple threads.
+size_t get_buffer_hash(buffer_hash_cache const& cache,
+    void const* data, std::size_t size);
+
 // BLOBS
 
 struct blob
@@ -683,6 +730,7 @@ struct blob
     ownership_holder ownership;
     void const* data;
     std::size_t size;
+    buffer_hash_cache hash_cache;
 
     blob() : data(0), size(0) {}
 };
@@ -705,8 +753,7 @@ static inline size_t deep_sizeof(blob const& b)
     {
         size_t operator()(cradle::blob const& x) const
         {
-            // TODO: hash for real?
-            return 0;
+            return cradle::get_buffer_hash(x.hash_cache, x.data, x.size);
         }
     };
 } namespace cradle {
@@ -718,19 +765,26 @@ typedef std::vector<value> value_list;
 
 // MAPS
 
-// Maps are represented as std::maps and can be manipulated as such.
-typedef std::map<value,value> value_map;
+// Maps are represented as flat_maps (sorted vectors of key/value pairs) and
+// can be manipulated as such. Almost all maps are records with a handful of
+// fields, and for those a single contiguous array is both smaller and faster
+// to search than a tree. Inserting out of key order is linear per insertion,
+// though, so code that builds a map from arbitrary input (e.g., a decoder)
+// should collect its entries and use build_value_map (below).
+typedef boost::container::flat_map<value,value> value_map;
 
 // Note that many of these functions talk about record. A record is just a map
 // where the keys are all strings.
 
-// This queries a record for a field with a key matching the given string.
+struct field_key;
+
+// This queries a record for a field with a key matching the given name.
 // If the field is not present in the map, an exception is thrown.
-value get_field(value_map const& r, string const& field);
+value get_field(value_map const& r, field_key const& field);
 
 // This is the same as above, but its return value indicates whether or not
 // the field is in the record.
-bool get_field(value* v, value_map const& r, string const& field);
+bool get_field(value* v, value_map const& r, field_key const& field);
 
 
 // Given a value_map that's meant to represent a union value, this checks that
@@ -740,17 +794,72 @@ value const& get_union_value_type(value_map const& map);
 
 // VALUES
 
+// Scalar values (nil, booleans, integers and floats) are stored inline.
+// Anything else lives in a reference-counted value_node. A node is never
+// modified once it's been created, so copying a value only has to share its
+// node, and setting a value replaces its node rather than altering one that
+// other values may be sharing.
+struct value_node
+{
+    value_node() : reference_count(1), atom(0) {}
+    virtual ~value_node() {}
+    std::atomic<unsigned> reference_count;
+    // If this node holds an interned field name, this identifies it within
+    // the field key table. Otherwise, it's 0.
+    unsigned atom;
+};
+template<class T>
+struct typed_value_node : value_node
+{
+    explicit typed_value_node(T const& contents) : contents(contents) {}
+    explicit typed_value_node(T&& contents)
+      : contents(static_cast<T&&>(contents))
+    {}
+    T contents;
+};
+
 struct value
 {
     // STRUCTORS
 
     // Default construction creates a nil value.
-    value() { set(nil); }
+    value() : type_(value_type::NIL) { storage_.node = 0; }
 
     // v must be one of the supported types or this will yield a compile-time
     // error.
     template<class T>
-    explicit value(T const& v) { set(v); }
+    explicit value(T const& v) : type_(value_type::NIL)
+    {
+        storage_.node = 0;
+        set(v);
+    }
+
+    // Copies share the original's node, so copying is O(1).
+    value(value const& other)
+      : type_(other.type_), storage_(other.storage_)
+    {
+        if (has_node())
+            storage_.node->reference_count.fetch_add(1,
+                std::memory_order_relaxed);
+    }
+    value(value&& other) noexcept
+      : type_(other.type_), storage_(other.storage_)
+    {
+        other.type_ = value_type::NIL;
+    }
+
+    ~value() { release(); }
+
+    value& operator=(value const& other)
+    {
+        value(other).swap_with(*this);
+        return *this;
+    }
+    value& operator=(value&& other) noexcept
+    {
+        value(static_cast<value&&>(other)).swap_with(*this);
+        return *this;
+    }
 
     // GETTERS
 
@@ -782,21 +891,114 @@ struct value
     void set(value_map const& v);
 
     // potentially more efficient setters which consume their arguments
+    void swap_in(string& v);
     void swap_in(value_list& v);
     void swap_in(value_map& v);
 
     void swap_with(value& other);
 
+    // Does this value share its contents with other? (This is a cheap test
+    // that implies equality, and interned field names rely on it.)
+    bool shares_contents_with(value const& other) const
+    {
+        return type_ == other.type_ && has_node() &&
+            storage_.node == other.storage_.node;
+    }
+
+    // If this is an interned field name, this is its atom. Otherwise, it's 0.
+    unsigned interned_atom() const
+    { return type_ == value_type::STRING ? storage_.node->atom : 0; }
+
  private:
+    friend field_key intern_field_name(char const* name);
+
+    bool has_node() const { return type_ > value_type::FLOAT; }
+
+    // Drop this value's reference to its node (if it has one) and leave it
+    // nil.
+    void release()
+    {
+        if (has_node() &&
+            storage_.node->reference_count.fetch_sub(1,
+                std::memory_order_acq_rel) == 1)
+        {
+            delete storage_.node;
+        }
+        type_ = value_type::NIL;
+    }
+
+    template<class T>
+    void set_node(value_type type, T&& contents);
+
+    template<class T>
+    T const& node_contents() const
+    {
+        return static_cast<typed_value_node<T> const*>(storage_.node)->
+            contents;
+    }
+
     value_type type_;
-    any value_;
+    union storage
+    {
+        bool boolean;
+        integer integer_value;
+        double float_value;
+        value_node* node;
+    } storage_;
+};
+
+// Replace the contents of *map with the given entries, which can be in any
+// order. (They're only sorted if they're not already in order.) If a key
+// appears more than once, its last value is the one that's kept.
+void build_value_map(value_map* map, value_map::sequence_type& entries);
+
+// FIELD KEYS
+
+// Field names are interned in a global table, so all the records that have a
+// field with a given name share a single copy of that name, and a key that's
+// been interned can be matched against another interned key just by
+// comparing atoms (and usually ordered without looking at the names). Note
+// that keys are still ordinary string values, so records can be built and
+// searched with any string as well.
+
+// A field_key is the key that's used to look up a field in a record.
+// Converting a name to a field_key only consults the table; it never adds to
+// it. Code that looks up the same field over and over (e.g., generated code)
+// should hold onto a key from intern_field_name instead.
+struct field_key
+{
+    field_key(string const& name);
+    field_key(char const* name);
+
+    value const& key() const { return key_; }
+
+    string const& name() const;
+
+ private:
+    friend field_key intern_field_name(char const* name);
+    field_key() {}
+    value key_;
 };
 
+// Get the interned key for the given field name, adding it to the table if
+// it's not already there. (The table has a fixed capacity. Once it's full,
+// this still works, but the key that it returns isn't shared.)
+field_key intern_field_name(char const* name);
+
+// If the given name has been interned, this sets *key to its interned key and
+// returns true. This is meant for decoders, so the name doesn't need to be a
+// string yet.
+bool find_interned_field_key(value* key, char const* name, size_t length);
+
+// If key is a string that's been interned, this replaces it with its interned
+// copy.
+void share_interned_field_key(value& key);
+
 // This is a generic function for reading a field from a record.
 // It exists primarily so that omissible types can override it.
 template<class Field>
 void read_field_from_record(Field* field_value,
-    value_map const& record, string const& field_name)
+    value_map const& record, field_key const& field_name)
 {
     auto dynamic_field_value = get_field(record, field_name);
     try
@@ -805,7 +1007,7 @@ void read_field_from_record(Field* field_value,
     }
     catch (cradle::exception& e)
     {
-        e.add_context("in field " + field_name);
+        e.add_context("in field " + field_name.name());
         throw;
     }
 }
@@ -813,15 +1015,16 @@ void read_field_from_record(Field* field_value,
 // This is a generic function for writing a field to a record.
 // It exists primarily so that omissible types can override it.
 template<class Field>
-void write_field_to_record(value_map& record, string const& field_name,
+void write_field_to_record(value_map& record, field_key const& field_name,
     Field const& field_value)
 {
-    to_value(&record[value(field_name)], field_value);
+    to_value(&record[field_name.key()], field_value);
 }
 
 static inline raw_type_info get_type_info(value const&)
 { return raw_type_info(raw_kind::SIMPLE, any(raw_simple_type::DYNAMIC)); }
 size_t deep_sizeof(value const& v);
+size_t deep_sizeof(value_map const& m);
 static inline void swap(value& a, value& b)
 { a.swap_with(b); }
 
@@ -1011,6 +1214,11 @@ void apply_fn_to_value_pair(Fn& fn, value const& a, value const& b)
     {
         size_t operator()(cradle::value const& x) const;
     };
+    template<>
+    struct hash<cradle::value_map>
+    {
+        size_t operator()(cradle::value_map const& x) const;
+    };
 } namespace cradle {
 
 // text I/O
@@ -1020,6 +1228,218 @@ std::ostream& operator<<(std::ostream& s, value const& v);
 void parse_value_string(value* v, string const& s);
 void value_to_string(string* s, value const& v);
 
+// BINARY ENCODING - Regular CRADLE types can also be written directly to a
+// compact binary form, without building a dynamic value along the way.
+// Fields and elements are written positionally and in native byte order, so
+// an encoding can only be read back as the same type on the same platform.
+// To detect encodings that no longer match their types, each type also
+// provides get_binary_schema_hash(x), which identifies the layout of its
+// encoding. Anything that stores encodings should store that alongside them.
+//
+// The preprocessor generates write_binary(), read_binary() and
+// get_binary_schema_hash() for API structures, unions and enums, and the
+// built-in types are covered below. Any other type falls back to encoding
+// its dynamic value.
+
+struct binary_writer
+{
+    binary_writer(std::vector<uint8_t>& buffer) : buffer(&buffer) {}
+    std::vector<uint8_t>* buffer;
+};
+
+// If a reader is given an ownership holder for its data, the blobs and arrays
+// that it reads will share that rather than copying their contents.
+struct binary_reader
+{
+    binary_reader(void const* data, size_t size,
+        ownership_holder const* ownership = 0)
+      : start(reinterpret_cast<uint8_t const*>(data))
+      , position(start), end(start + size)
+      , ownership(ownership)
+    {}
+    uint8_t const* start;
+    uint8_t const* position;
+    uint8_t const* end;
+    ownership_holder const* ownership;
+};
+
+struct corrupt_binary_data : exception
+{
+    corrupt_binary_data()
+      : exception("corrupt binary data")
+    {}
+    ~corrupt_binary_data() throw() {}
+};
+
+static inline void
+write_binary_bytes(binary_writer& w, void const* data, size_t size)
+{
+    uint8_t const* bytes = reinterpret_cast<uint8_t const*>(data);
+    w.buffer->insert(w.buffer->end(), bytes, bytes + size);
+}
+
+static inline void
+read_binary_bytes(binary_reader& r, void* data, size_t size)
+{
+    if (size_t(r.end - r.position) < size)
+        throw corrupt_binary_data();
+    std::memcpy(data, r.position, size);
+    r.position += size;
+}
+
+// Sizes and counts are always written as 64-bit integers.
+void write_binary_size(binary_writer& w, size_t size);
+size_t read_binary_size(binary_reader& r);
+
+// Blocks of raw data (the contents of blobs and arrays) are written with
+// their sizes and aligned to binary_block_alignment relative to the start of
+// the encoding, so that a reader can reference them in place.
+size_t const binary_block_alignment = 16;
+void write_binary_block(binary_writer& w, void const* data, size_t size);
+// The resulting blob references the reader's data if the reader has
+// ownership of it and the block is actually aligned in memory.
+void read_binary_block(binary_reader& r, blob* block);
+
+// Schema hashes are built from FNV-1a hashes of type descriptions, so
+// they're the same from one run to the next.
+uint64_t static inline
+hash_binary_schema_description(char const* description)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *description; ++description)
+        h = (h ^ uint8_t(*description)) * 0x100000001b3ull;
+    return h;
+}
+uint64_t static inline
+combine_binary_schema_hashes(uint64_t a, uint64_t b)
+{
+    return (a * 0x100000001b3ull) ^
+        (b + 0x9e3779b97f4a7c15ull + (a << 6) + (a >> 2));
+}
+
+// The schema hash of a named type (e.g., a structure) combines a description
+// of the type itself with the schema hashes of its parts. Since a type can
+// refer to itself (indirectly), the computation for a type that's already in
+// progress only includes its description. Top-level results are cached, so
+// the full computation only happens once per type.
+//
+// This is used by the preprocessor as follows...
+//
+//  static binary_schema_hash_cache cache;
+//  binary_schema_hash_computation computation(cache, "description");
+//  if (computation.needs_parts())
+//  {
+//      computation.add(get_binary_schema_hash(x.field));
+//      ...
+//  }
+//  return computation.result();
+//
+struct binary_schema_hash_cache
+{
+    // 0 if not yet computed
+    std::atomic<uint64_t> hash;
+    bool in_progress;
+};
+struct binary_schema_hash_computation : noncopyable
+{
+    binary_schema_hash_computation(binary_schema_hash_cache& cache,
+        char const* description);
+    ~binary_schema_hash_computation();
+    bool needs_parts() const { return active_ != 0; }
+    void add(uint64_t part)
+    { hash_ = combine_binary_schema_hashes(hash_, part); }
+    uint64_t result();
+ private:
+    uint64_t hash_;
+    binary_schema_hash_cache* active_;
+    bool locked_;
+};
+
+// Anything without a binary encoding of its own is encoded as its dynamic
+// value. Dynamic values describe their own structure, so they all share the
+// same schema hash.
+
+void write_binary(binary_writer& w, value const& x);
+void read_binary(binary_reader& r, value* x);
+uint64_t get_binary_schema_hash(value const& x);
+
+template<class T>
+void write_binary(binary_writer& w, T const& x)
+{
+    write_binary(w, to_value(x));
+}
+template<class T>
+void read_binary(binary_reader& r, T* x)
+{
+    value v;
+    read_binary(r, &v);
+    from_value(x, v);
+}
+template<class T>
+uint64_t get_binary_schema_hash(T const& x)
+{
+    return get_binary_schema_hash(value());
+}
+
+// Encode x as a byte vector.
+template<class T>
+std::vector<uint8_t> binary_encoding_of(T const& x)
+{
+    std::vector<uint8_t> buffer;
+    binary_writer w(buffer);
+    write_binary(w, x);
+    return buffer;
+}
+
+// Decode a complete encoding of x.
+// If ownership is provided, x may reference the encoded data.
+template<class T>
+void decode_binary(T* x, void const* data, size_t size,
+    ownership_holder const* ownership = 0)
+{
+    binary_reader r(data, size, ownership);
+    read_binary(r, x);
+    if (r.position != r.end)
+        throw corrupt_binary_data();
+}
+
+// A binary_field_index records where the encodings of a structure's fields
+// lie within the encoding of the structure (as offsets from its start), so
+// that a single field can be decoded without decoding the others.
+// (Since blocks are aligned relative to the start of the encoding, the
+// reader for a field should still start there, with its position set to
+// the beginning of the field.)
+// Fields that are inherited from a super type aren't included.
+struct binary_field_range
+{
+    string name;
+    size_t begin, end;
+};
+typedef std::vector<binary_field_range> binary_field_index;
+
+static inline void
+add_binary_field(binary_field_index* index, char const* name, size_t begin,
+    binary_writer const& w)
+{
+    binary_field_range range;
+    range.name = name;
+    range.begin = begin;
+    range.end = w.buffer->size();
+    index->push_back(range);
+}
+
+// write_binary_fields(w, x, index) writes the same encoding as
+// write_binary(w, x), but it also adds the ranges of x's fields to *index.
+// The preprocessor generates this for API structures. For anything else, the
+// return value is false and *index is left alone.
+template<class T>
+bool write_binary_fields(binary_writer& w, T const& x,
+    binary_field_index* index)
+{
+    write_binary(w, x);
+    return false;
+}
+
 // CRADLE type interface for various built-in types
 
 static inline raw_type_info get_type_info(bool)
@@ -1028,6 +1448,12 @@ static inline size_t deep_sizeof(bool)
 { return sizeof(bool); }
 void to_value(value* v, bool x);
 void from_value(bool* x, value const& v);
+static inline void write_binary(binary_writer& w, bool x)
+{ uint8_t b = x ? 1 : 0; write_binary_bytes(w, &b, 1); }
+static inline void read_binary(binary_reader& r, bool* x)
+{ uint8_t b; read_binary_bytes(r, &b, 1); *x = b != 0; }
+static inline uint64_t get_binary_schema_hash(bool)
+{ return hash_binary_schema_description("bool"); }
 
 static inline raw_type_info get_type_info(string const&)
 { return raw_type_info(raw_kind::SIMPLE, any(raw_simple_type::STRING)); }
@@ -1035,17 +1461,49 @@ static inline size_t deep_sizeof(string const& x)
 { return sizeof(string) + sizeof(char) * x.length(); }
 void to_value(value* v, string const& x);
 void from_value(string* x, value const& v);
+void write_binary(binary_writer& w, string const& x);
+void read_binary(binary_reader& r, string* x);
+static inline uint64_t get_binary_schema_hash(string const&)
+{ return hash_binary_schema_description("string"); }
 
 static inline void to_value(value* v, nil_type n) { v->set(n); }
 static inline void from_value(nil_type* n, value const& v) {}
+static inline void write_binary(binary_writer& w, nil_type n) {}
+static inline void read_binary(binary_reader& r, nil_type* n) {}
+static inline uint64_t get_binary_schema_hash(nil_type)
+{ return hash_binary_schema_description("nil"); }
 
 void to_value(value* v, blob const& x);
 void from_value(blob* x, value const& v);
+void write_binary(binary_writer& w, blob const& x);
+void read_binary(binary_reader& r, blob* x);
+static inline uint64_t get_binary_schema_hash(blob const&)
+{ return hash_binary_schema_description("blob"); }
+
+// Numbers are identified by their representations rather than their C++
+// types, so, e.g., long and long long are interchangeable where they're the
+// same size.
+template<class T>
+uint64_t get_number_binary_schema_hash()
+{
+    return combine_binary_schema_hashes(
+        hash_binary_schema_description(
+            std::is_integral<T>::value ?
+                (std::is_signed<T>::value ? "signed" : "unsigned") :
+                "float"),
+        sizeof(T));
+}
 
 #define CRADLE_DECLARE_NUMBER_INTERFACE(T) \
     void to_value(value* v, T x); \
     void from_value(T* x, value const& v); \
-    static inline size_t deep_sizeof(T) { return sizeof(T); }
+    static inline size_t deep_sizeof(T) { return sizeof(T); } \
+    static inline void write_binary(binary_writer& w, T x) \
+    { write_binary_bytes(w, &x, sizeof(T)); } \
+    static inline void read_binary(binary_reader& r, T* x) \
+    { read_binary_bytes(r, x, sizeof(T)); } \
+    static inline uint64_t get_binary_schema_hash(T) \
+    { return get_number_binary_schema_hash<T>(); }
 
 #define CRADLE_DECLARE_INTEGER_INTERFACE(T) \
     integer to_integer(T x); \
@@ -1093,6 +1551,76 @@ void from_value(std::vector<T>* x, value const& v)
         from_value(&(*x)[i], l[i]);
 }
 
+// Vectors of numbers are written and read as single blocks of memory.
+template<class T>
+struct is_binary_block_type
+  : std::integral_constant<bool,
+        std::is_arithmetic<T>::value && !std::is_same<T,bool>::value>
+{};
+template<class T>
+void write_binary_elements(binary_writer& w, std::vector<T> const& x,
+    std::true_type)
+{
+    if (!x.empty())
+        write_binary_bytes(w, &x[0], x.size() * sizeof(T));
+}
+template<class T>
+void write_binary_elements(binary_writer& w, std::vector<T> const& x,
+    std::false_type)
+{
+    for (auto const& i : x)
+        write_binary(w, i);
+}
+template<class T>
+void read_binary_elements(binary_reader& r, std::vector<T>* x,
+    size_t n_elements, std::true_type)
+{
+    if (size_t(r.end - r.position) / sizeof(T) < n_elements)
+        throw corrupt_binary_data();
+    x->resize(n_elements);
+    if (n_elements != 0)
+        read_binary_bytes(r, &(*x)[0], n_elements * sizeof(T));
+}
+template<class T>
+void read_binary_elements(binary_reader& r, std::vector<T>* x,
+    size_t n_elements, std::false_type)
+{
+    // Corrupt data could have an absurd count, so don't reserve more than
+    // the remaining data could possibly hold.
+    x->clear();
+    x->reserve((std::min)(n_elements, size_t(r.end - r.position)));
+    for (size_t i = 0; i != n_elements; ++i)
+    {
+        x->emplace_back();
+        read_binary(r, &x->back());
+    }
+}
+template<class T>
+void write_binary(binary_writer& w, std::vector<T> const& x)
+{
+    write_binary_size(w, x.size());
+    write_binary_elements(w, x, typename is_binary_block_type<T>::type());
+}
+template<class T>
+void read_binary(binary_reader& r, std::vector<T>* x)
+{
+    size_t n_elements = read_binary_size(r);
+    read_binary_elements(r, x, n_elements,
+        typename is_binary_block_type<T>::type());
+}
+// std::vector<bool> doesn't provide references to its elements.
+void read_binary(binary_reader& r, std::vector<bool>* x);
+// declared here so that it's visible for vectors of maps
+template<class Key, class Value>
+uint64_t get_binary_schema_hash(std::map<Key,Value> const&);
+template<class T>
+uint64_t get_binary_schema_hash(std::vector<T> const&)
+{
+    return combine_binary_schema_hashes(
+        hash_binary_schema_description("list"),
+        get_binary_schema_hash(T()));
+}
+
 } namespace std {
     template<class Item>
     struct hash<vector<Item> >
@@ -1135,6 +1663,9 @@ std::ostream& operator<<(std::ostream& s, std::vector<T> const& x)
 // trump the polyset version way over in geometry/clipper.hpp/.cpp
 typedef ClipperLib::Polygons clipper_polyset;
 raw_type_info get_type_info(clipper_polyset);
+void write_binary(binary_writer& w, clipper_polyset const& x);
+void read_binary(binary_reader& r, clipper_polyset* x);
+uint64_t get_binary_schema_hash(clipper_polyset const& x);
 
 template<class T>
 raw_type_info get_type_info(std::vector<T> const&)
@@ -1170,6 +1701,39 @@ void from_value(std::map<Key,Value>* x, value const& v)
     for (auto const& i : record)
         from_value(&(*x)[from_value<Key>(i.first)], i.second);
 }
+template<class Key, class Value>
+void write_binary(binary_writer& w, std::map<Key,Value> const& x)
+{
+    write_binary_size(w, x.size());
+    for (auto const& i : x)
+    {
+        write_binary(w, i.first);
+        write_binary(w, i.second);
+    }
+}
+template<class Key, class Value>
+void read_binary(binary_reader& r, std::map<Key,Value>* x)
+{
+    x->clear();
+    size_t n_elements = read_binary_size(r);
+    for (size_t i = 0; i != n_elements; ++i)
+    {
+        Key key;
+        read_binary(r, &key);
+        // The entries were written in order, so each one goes at the end.
+        auto entry = x->emplace_hint(x->end(), std::move(key), Value());
+        read_binary(r, &entry->second);
+    }
+}
+template<class Key, class Value>
+uint64_t get_binary_schema_hash(std::map<Key,Value> const&)
+{
+    return combine_binary_schema_hashes(
+        combine_binary_schema_hashes(
+            hash_binary_schema_description("map"),
+            get_binary_schema_hash(Key())),
+        get_binary_schema_hash(Value()));
+}
 
 } namespace std {
     template<class Key, class Value>
@@ -1301,6 +1865,36 @@ void from_value(optional<T>* x, cradle::value const& v)
         throw cradle::exception("invalid optional type");
 }
 template<class T>
+void write_binary(cradle::binary_writer& w, optional<T> const& x)
+{
+    using cradle::write_binary;
+    write_binary(w, x ? true : false);
+    if (x)
+        write_binary(w, get(x));
+}
+template<class T>
+void read_binary(cradle::binary_reader& r, optional<T>* x)
+{
+    using cradle::read_binary;
+    bool valid;
+    read_binary(r, &valid);
+    if (valid)
+    {
+        *x = T();
+        read_binary(r, &get(*x));
+    }
+    else
+        *x = none;
+}
+template<class T>
+uint64_t get_binary_schema_hash(optional<T> const&)
+{
+    using cradle::get_binary_schema_hash;
+    return cradle::combine_binary_schema_hashes(
+        cradle::hash_binary_schema_description("optional"),
+        get_binary_schema_hash(T()));
+}
+template<class T>
 std::ostream& operator<<(std::ostream& s, optional<T> const& x)
 {
     if (x)
@@ -1353,11 +1947,40 @@ void to_value(cradle::value* v, vector<N,T> const& x)
         to_value(&l[i], x[i]);
     v->swap_in(l);
 }
+template<unsigned N, class T>
+void write_binary(cradle::binary_writer& w, vector<N,T> const& x)
+{
+    using cradle::write_binary;
+    for (unsigned i = 0; i != N; ++i)
+        write_binary(w, x[i]);
+}
+template<unsigned N, class T>
+void read_binary(cradle::binary_reader& r, vector<N,T>* x)
+{
+    using cradle::read_binary;
+    for (unsigned i = 0; i != N; ++i)
+        read_binary(r, &(*x)[i]);
+}
+template<unsigned N, class T>
+uint64_t get_binary_schema_hash(vector<N,T> const&)
+{
+    using cradle::get_binary_schema_hash;
+    return cradle::combine_binary_schema_hashes(
+        cradle::combine_binary_schema_hashes(
+            cradle::hash_binary_schema_description("array"), N),
+        get_binary_schema_hash(T()));
+}
 
 }
 
 namespace cradle {
 
+// Geometric vectors of numbers are just blocks of numbers themselves, so
+// std::vectors of them can be written as single blocks too.
+template<unsigned N, class T>
+struct is_binary_block_type<alia::vector<N,T> > : is_binary_block_type<T>
+{};
+
 // OTHER UTILITIES
 
 // omissible<T> is the same as optional<T>, but it obeys thinknode's behavior
@@ -1434,7 +2057,7 @@ size_t deep_sizeof(omissible<T> const& x)
 }
 template<class T>
 void read_field_from_record(omissible<T>* field_value,
-    value_map const& record, string const& field_name)
+    value_map const& record, field_key const& field_name)
 {
     // If the field doesn't appear in the record, just set it to none.
     value dynamic_field_value;
@@ -1448,7 +2071,7 @@ void read_field_from_record(omissible<T>* field_value,
         }
         catch (cradle::exception& e)
         {
-            e.add_context("in field " + field_name);
+            e.add_context("in field " + field_name.name());
             throw;
         }
     }
@@ -1456,7 +2079,7 @@ void read_field_from_record(omissible<T>* field_value,
         *field_value = none;
 }
 template<class T>
-void write_field_to_record(value_map& record, string const& field_name,
+void write_field_to_record(value_map& record, field_key const& field_name,
     omissible<T> const& field_value)
 {
     // Only write the field to the record if it has a value.
@@ -1495,6 +2118,34 @@ void from_value(omissible<T>* x, cradle::value const& v)
     else
         throw cradle::exception("invalid omissible type");
 }
+// omissibles are encoded the same way as optionals.
+template<class T>
+void write_binary(binary_writer& w, omissible<T> const& x)
+{
+    write_binary(w, x ? true : false);
+    if (x)
+        write_binary(w, get(x));
+}
+template<class T>
+void read_binary(binary_reader& r, omissible<T>* x)
+{
+    bool valid;
+    read_binary(r, &valid);
+    if (valid)
+    {
+        *x = T();
+        read_binary(r, &get(*x));
+    }
+    else
+        *x = none;
+}
+template<class T>
+uint64_t get_binary_schema_hash(omissible<T> const&)
+{
+    return combine_binary_schema_hashes(
+        hash_binary_schema_description("optional"),
+        get_binary_schema_hash(T()));
+}
 template<class T>
 std::ostream& operator<<(std::ostream& s, omissible<T> const& x)
 {
@@ -1601,6 +2252,26 @@ void to_value(value* v, c_array<N,T> const& x)
     v->swap_in(l);
 }
 template<unsigned N, class T>
+void write_binary(binary_writer& w, c_array<N,T> const& x)
+{
+    for (unsigned i = 0; i != N; ++i)
+        write_binary(w, x[i]);
+}
+template<unsigned N, class T>
+void read_binary(binary_reader& r, c_array<N,T>* x)
+{
+    for (unsigned i = 0; i != N; ++i)
+        read_binary(r, &(*x)[i]);
+}
+template<unsigned N, class T>
+uint64_t get_binary_schema_hash(c_array<N,T> const&)
+{
+    return combine_binary_schema_hashes(
+        combine_binary_schema_hashes(
+            hash_binary_schema_description("array"), N),
+        get_binary_schema_hash(T()));
+}
+template<unsigned N, class T>
 std::ostream& operator<<(std::ostream& s, c_array<N,T> const& x)
 {
     s << "{";
@@ -1646,6 +2317,7 @@ struct array
     T const* elements;
     size_t n_elements;
     ownership_holder ownership;
+    buffer_hash_cache hash_cache;
 
     // STL-like interface
     typedef T value_type;
@@ -1671,6 +2343,7 @@ T* allocate(array<T>* array, size_t n_elements)
 {
     alia__shared_ptr<T> ptr(new T[n_elements], array_deleter<T>());
     array->ownership = ptr;
+    array->hash_cache = buffer_hash_cache();
     array->elements = ptr.get();
     array->n_elements = n_elements;
     return ptr.get();
@@ -1682,6 +2355,7 @@ void clear(array<T>* array)
     array->elements = 0;
     array->n_elements = 0;
     array->ownership = ownership_holder();
+    array->hash_cache = buffer_hash_cache();
 }
 
 template<class T>
@@ -1690,6 +2364,7 @@ void initialize(array<T>* array, std::vector<T> const& vector)
     size_t n_elements = vector.size();
     alia__shared_ptr<T> ptr(new T[n_elements], array_deleter<T>());
     array->ownership = ptr;
+    array->hash_cache = buffer_hash_cache();
     T* elements = ptr.get();
     array->elements = elements;
     array->n_elements = n_elements;
@@ -1717,6 +2392,7 @@ void swap(array<T>& a, array<T>& b)
     swap(a.elements, b.elements);
     swap(a.n_elements, b.n_elements);
     swap(a.ownership, b.ownership);
+    swap(a.hash_cache.cached, b.hash_cache.cached);
 }
 
 template<class T>
@@ -1760,6 +2436,7 @@ void from_value(array<T>* x, value const& v)
     x->n_elements = b.size / sizeof(T);
     x->elements = reinterpret_cast<T const*>(b.data);
     x->ownership = b.ownership;
+    x->hash_cache = b.hash_cache;
 }
 template<class T>
 void to_value(value* v, array<T> const& x)
@@ -1768,8 +2445,34 @@ void to_value(value* v, array<T> const& x)
     b.size = x.n_elements * sizeof(T);
     b.data = reinterpret_cast<void const*>(x.elements);
     b.ownership = x.ownership;
+    b.hash_cache = x.hash_cache;
     set(*v, b);
 }
+// Like blobs, arrays reference the encoded data if they can.
+template<class T>
+void write_binary(binary_writer& w, array<T> const& x)
+{
+    write_binary_block(w, x.elements, x.n_elements * sizeof(T));
+}
+template<class T>
+void read_binary(binary_reader& r, array<T>* x)
+{
+    blob b;
+    read_binary_block(r, &b);
+    if (b.size % sizeof(T) != 0)
+        throw corrupt_binary_data();
+    x->n_elements = b.size / sizeof(T);
+    x->elements = reinterpret_cast<T const*>(b.data);
+    x->ownership = b.ownership;
+    x->hash_cache = buffer_hash_cache();
+}
+template<class T>
+uint64_t get_binary_schema_hash(array<T> const&)
+{
+    return combine_binary_schema_hashes(
+        hash_binary_schema_description("packed_array"),
+        get_binary_schema_hash(T()));
+}
 
 template<class T>
 std::ostream& operator<<(std::ostream& s, array<T> const& x)
@@ -1791,10 +2494,10 @@ std::ostream& operator<<(std::ostream& s, array<T> const& x)
     {
         size_t operator()(cradle::array<T> const& x) const
         {
-            size_t h = 0;
-            for (auto const& i : x)
-                h = alia::combine_hashes(h, alia::invoke_hash(i));
-            return h;
+            // Since array elements are POD, the array can be hashed as a
+            // block of memory (just as it would be as a blob).
+            return cradle::get_buffer_hash(x.hash_cache, x.elements,
+                x.n_elements * sizeof(T));
         }
     };
 } namespace cradle {
@@ -1812,6 +2515,12 @@ struct untyped_immutable_value : noncopyable
     virtual size_t hash() const = 0;
     virtual value as_value() const = 0;
     virtual bool equals(untyped_immutable_value const* other) const = 0;
+    virtual uint64_t binary_schema_hash() const = 0;
+    virtual void encode_binary(binary_writer& w) const = 0;
+    // This is the same as encode_binary, but if the value is a structure,
+    // it also fills in *index (and returns true).
+    virtual bool encode_binary_fields(binary_writer& w,
+        binary_field_index* index) const = 0;
 };
 
 struct untyped_immutable
@@ -1845,6 +2554,13 @@ struct immutable_value : untyped_immutable_value
             dynamic_cast<immutable_value<T> const*>(other);
         return typed_other && this->value == typed_other->value;
     }
+    uint64_t binary_schema_hash() const
+    { return get_binary_schema_hash(this->value); }
+    void encode_binary(binary_writer& w) const
+    { write_binary(w, this->value); }
+    bool encode_binary_fields(binary_writer& w,
+        binary_field_index* index) const
+    { return write_binary_fields(w, this->value, index); }
 };
 
 template<class T>
@@ -1946,6 +2662,26 @@ void to_value(cradle::value* v, immutable<T> const& x)
         to_value(v, T());
 }
 
+template<class T>
+void write_binary(binary_writer& w, immutable<T> const& x)
+{
+    if (x.ptr)
+        write_binary(w, get(x));
+    else
+        write_binary(w, T());
+}
+template<class T>
+void read_binary(binary_reader& r, immutable<T>* x)
+{
+    x->ptr.reset(new immutable_value<T>);
+    read_binary(r, &x->ptr->value);
+}
+template<class T>
+uint64_t get_binary_schema_hash(immutable<T> const&)
+{
+    return get_binary_schema_hash(T());
+}
+
 template<class T>
 std::ostream& operator<<(std::ostream& s, immutable<T> const& x)
 {
@@ -2299,6 +3035,12 @@ struct dynamic_type_interface
 
     virtual value
     immutable_to_value(untyped_immutable const& immutable) const = 0;
+
+    // the schema hash of the type's binary encoding
+    virtual uint64_t binary_schema_hash() const = 0;
+
+    virtual untyped_immutable
+    binary_to_immutable(binary_reader& r) const = 0;
 };
 
 template<class Value>
@@ -2329,6 +3071,19 @@ struct dynamic_type_implementation : dynamic_type_interface
         cast_immutable_value(&typed_value, get_value_pointer(immutable));
         return to_value(*typed_value);
     }
+
+    uint64_t binary_schema_hash() const
+    {
+        return get_binary_schema_hash(Value());
+    }
+
+    untyped_immutable
+    binary_to_immutable(binary_reader& r) const
+    {
+        Value typed_value;
+        read_binary(r, &typed_value);
+        return swap_in_and_erase_type(typed_value);
+    }
 };
 
 template<class Value>
@@ -0,0 +1,175 @@
+#include <cradle/digest.hpp>
+#include <cradle/endian.hpp>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+
+namespace cradle {
+
+std::ostream& operator<<(std::ostream& s, digest const& d)
+{
+    return s << to_hex_string(d);
+}
+
+string to_hex_string(digest const& d)
+{
+    static char const digits[] = "0123456789abcdef";
+    string s(32, '0');
+    for (int i = 0; i != 16; ++i)
+    {
+        s[15 - i] = digits[(d.h1 >> (i * 4)) & 0xf];
+        s[31 - i] = digits[(d.h2 >> (i * 4)) & 0xf];
+    }
+    return s;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static uint64_t const c1 = 0x87c37b91114253d5ULL;
+static uint64_t const c2 = 0x4cf5ad432745937fULL;
+
+static inline uint64_t load_uint64(uint8_t const* p)
+{
+    uint64_t x;
+    std::memcpy(&x, p, 8);
+    swap_on_big_endian(&x);
+    return x;
+}
+
+// Mix a full 16-byte block into the hash state.
+static inline void mix_block(uint64_t& h1, uint64_t& h2, uint8_t const* block)
+{
+    uint64_t k1 = load_uint64(block);
+    uint64_t k2 = load_uint64(block + 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+}
+
+void digest_generator::initialize(uint64_t seed)
+{
+    h1 = h2 = seed;
+    tail_size = 0;
+    total_size = 0;
+}
+
+void feed(digest_generator& generator, void const* data, size_t size)
+{
+    uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+    generator.total_size += size;
+
+    // If there's a partial block left over from before, try to complete it.
+    if (generator.tail_size != 0)
+    {
+        size_t n = (std::min)(size, 16 - generator.tail_size);
+        std::memcpy(generator.tail + generator.tail_size, p, n);
+        generator.tail_size += n;
+        p += n;
+        size -= n;
+        if (generator.tail_size != 16)
+            return;
+        mix_block(generator.h1, generator.h2, generator.tail);
+        generator.tail_size = 0;
+    }
+
+    // Process all the full blocks directly from the source.
+    uint64_t h1 = generator.h1, h2 = generator.h2;
+    while (size >= 16)
+    {
+        mix_block(h1, h2, p);
+        p += 16;
+        size -= 16;
+    }
+    generator.h1 = h1;
+    generator.h2 = h2;
+
+    // Save whatever's left for later.
+    std::memcpy(generator.tail, p, size);
+    generator.tail_size = size;
+}
+
+digest get_digest(digest_generator const& generator)
+{
+    uint64_t h1 = generator.h1, h2 = generator.h2;
+
+    uint8_t const* tail = generator.tail;
+    uint64_t k1 = 0, k2 = 0;
+    switch (generator.tail_size)
+    {
+     case 15: k2 ^= uint64_t(tail[14]) << 48;
+     case 14: k2 ^= uint64_t(tail[13]) << 40;
+     case 13: k2 ^= uint64_t(tail[12]) << 32;
+     case 12: k2 ^= uint64_t(tail[11]) << 24;
+     case 11: k2 ^= uint64_t(tail[10]) << 16;
+     case 10: k2 ^= uint64_t(tail[ 9]) << 8;
+     case  9: k2 ^= uint64_t(tail[ 8]) << 0;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+     case  8: k1 ^= uint64_t(tail[ 7]) << 56;
+     case  7: k1 ^= uint64_t(tail[ 6]) << 48;
+     case  6: k1 ^= uint64_t(tail[ 5]) << 40;
+     case  5: k1 ^= uint64_t(tail[ 4]) << 32;
+     case  4: k1 ^= uint64_t(tail[ 3]) << 24;
+     case  3: k1 ^= uint64_t(tail[ 2]) << 16;
+     case  2: k1 ^= uint64_t(tail[ 1]) << 8;
+     case  1: k1 ^= uint64_t(tail[ 0]) << 0;
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= generator.total_size;
+    h2 ^= generator.total_size;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    return digest(h1, h2);
+}
+
+digest compute_digest(void const* data, size_t size, uint64_t seed)
+{
+    digest_generator generator(seed);
+    feed(generator, data, size);
+    return get_digest(generator);
+}
+
+// This is declared in common.hpp (since blobs need it), but it belongs with
+// the other hashing code.
+
+size_t get_buffer_hash(buffer_hash_cache const& cache,
+    void const* data, size_t size)
+{
+    auto cached = std::atomic_load(&cache.cached);
+    if (cached && cached->data == data && cached->size == size)
+        return cached->hash;
+    digest d = compute_digest(data, size);
+    buffer_hash* computed = new buffer_hash;
+    computed->data = data;
+    computed->size = size;
+    computed->hash = size_t(d.h1 ^ d.h2);
+    std::atomic_store(&cache.cached,
+        alia__shared_ptr<buffer_hash const>(computed));
+    return computed->hash;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef CRADLE_DIGEST_HPP
+#define CRADLE_DIGEST_HPP
+
+#include <cradle/common.hpp>
+
+// This file provides utilities for computing digests of data.
+// A digest is a fixed-size (128-bit) hash of an arbitrary block of data.
+// Digests are NOT cryptographically secure, but collisions between digests of
+// different data are so unlikely that, for all practical purposes, a digest
+// can be used to identify its data by content (e.g., as a cache key).
+//
+// The current implementation is MurmurHash3 (x64, 128-bit variant).
+
+namespace cradle {
+
+struct digest
+{
+    uint64_t h1, h2;
+
+    digest() : h1(0), h2(0) {}
+    digest(uint64_t h1, uint64_t h2) : h1(h1), h2(h2) {}
+};
+
+static inline bool operator==(digest const& a, digest const& b)
+{ return a.h1 == b.h1 && a.h2 == b.h2; }
+static inline bool operator!=(digest const& a, digest const& b)
+{ return !(a == b); }
+static inline bool operator<(digest const& a, digest const& b)
+{ return a.h1 < b.h1 || (a.h1 == b.h1 && a.h2 < b.h2); }
+
+std::ostream& operator<<(std::ostream& s, digest const& d);
+
+// Get the 32-character hexadecimal representation of a digest.
+string to_hex_string(digest const& d);
+
+// A digest_generator computes a digest incrementally, so that the data
+// doesn't have to be stored contiguously (or all at once) in memory.
+// Feeding the same sequence of bytes always produces the same digest,
+// regardless of how the sequence is split up across calls.
+struct digest_generator
+{
+    uint64_t h1, h2;
+    // bytes that have been fed but don't yet form a complete 16-byte block
+    uint8_t tail[16];
+    size_t tail_size;
+    // total number of bytes fed so far
+    uint64_t total_size;
+
+    digest_generator() { initialize(0); }
+    explicit digest_generator(uint64_t seed) { initialize(seed); }
+
+    void initialize(uint64_t seed);
+};
+
+void feed(digest_generator& generator, void const* data, size_t size);
+
+// Get the digest of all data fed into the generator so far.
+// (This doesn't alter the state of the generator.)
+digest get_digest(digest_generator const& generator);
+
+// Compute the digest of a contiguous block of data.
+digest compute_digest(void const* data, size_t size, uint64_t seed = 0);
+
+}
+
+namespace std {
+    template<>
+    struct hash<cradle::digest>
+    {
+        size_t operator()(cradle::digest const& d) const
+        {
+            return size_t(d.h1 ^ d.h2);
+        }
+    };
+}
+
+#endif
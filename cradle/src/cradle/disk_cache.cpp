@@ -1,11 +1,13 @@
 #include <cradle/disk_cache.hpp>
 #include <cradle/io/file.hpp>
-#include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <sqlite3.h>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <fstream>
 
 #ifdef WIN32
 #include <cradle/external/windows.hpp>
@@ -17,6 +19,94 @@
 
 namespace cradle {
 
+// SQLITE UTILITIES
+
+// A prepared_statement holds a compiled SQL statement that's kept around for
+// the life of the database connection, so that frequent queries don't have to
+// be reparsed and replanned every time they're executed.
+struct prepared_statement
+{
+    sqlite3_stmt* stmt;
+    char const* sql;
+
+    prepared_statement() : stmt(0), sql(0) {}
+};
+
+// the set of prepared statements associated with a cache's connection
+struct disk_cache_statements
+{
+    prepared_statement
+        lookup_entry,
+        insert_entry,
+        finish_insert,
+        record_usage,
+        remove_entry,
+        get_cache_size,
+        get_entry_count,
+        get_entry_list,
+        get_lru_entries,
+        get_all_entry_ids,
+        record_description,
+        remove_description,
+        get_description,
+        get_entry_location,
+        relocate_entry,
+        create_segment,
+        seal_segment,
+        remove_segment,
+        get_sealed_segments,
+        get_segment_usage,
+        get_segment_entries,
+        segment_exists;
+};
+
+// Entries that are smaller than max_packed_entry_size are packed together
+// into segment files rather than being stored in individual files.
+// Each process appends to its own active segment until the segment reaches
+// max_segment_size, at which point the segment is sealed and a new one is
+// started. Once a sealed segment is less than half full of live entries,
+// compaction moves its live entries to a separate active segment (which only
+// the compacting thread appends to) and deletes it.
+static int64_t const max_packed_entry_size = 0x10000;
+static int64_t const max_segment_size = 0x4000000;
+
+// A process stops appending to a segment once it's this old, so segments
+// that are left unsealed for much longer than this must belong to processes
+// that have died, and they're sealed when the cache is initialized (by the
+// SQL in initialize()).
+static boost::posix_time::time_duration const max_active_segment_age =
+    boost::posix_time::hours(1);
+
+// the location of an entry's data
+struct entry_location
+{
+    // the segment containing the entry, or 0 if it's in its own file
+    int64_t segment;
+    // the offset of the entry within the segment
+    int64_t offset;
+    int64_t size;
+};
+
+// a finish_insert() call that hasn't been written to the database yet
+struct pending_insert
+{
+    entry_location location;
+    uint32_t crc32;
+};
+
+// the segment that this process is currently appending to
+struct active_segment
+{
+    // 0 if there's no active segment
+    int64_t id;
+    int64_t size;
+    std::ofstream file;
+    // when this process started the segment
+    boost::posix_time::ptime created;
+
+    active_segment() : id(0), size(0) {}
+};
+
 struct disk_cache_impl
 {
     file_path dir;
@@ -25,21 +115,66 @@ struct disk_cache_impl
 
     sqlite3* db;
 
+    disk_cache_statements statements;
+
     int64_t size_limit;
 
     // used to track when we need to check if the cache is too big
     int64_t bytes_inserted_since_last_sweep;
 
+    // Enforcing the size limit and compacting segments is done by a
+    // background thread, which works in small batches so that other threads
+    // never have to wait long for the mutex.
+    boost::thread sweeper;
+    // signaled (under the mutex) when a sweep is requested or the sweeper
+    // should stop
+    boost::condition_variable sweep_signal;
+    bool sweep_requested;
+    bool stopping_sweeper;
+    // set if the sweeper still needs to look for segment files that have
+    // been left behind (which it does once per initialization)
+    bool orphaned_segment_check_pending;
+
     // list of IDs that whose usage needs to be recorded
     std::vector<int64_t> usage_record_buffer;
 
+    // entries that have been written to disk but whose completion hasn't
+    // been recorded in the database yet
+    std::map<int64_t,pending_insert> pending_inserts;
+
+    active_segment segment;
+
+    // the segment that compaction moves entries to - This is only accessed
+    // by the thread that holds compaction_mutex, and its file is written
+    // without holding the main mutex.
+    active_segment compaction_segment;
+    // Only one thread at a time compacts segments. If this is held along
+    // with the main mutex, it must be acquired first.
+    boost::mutex compaction_mutex;
+
     boost::posix_time::ptime latest_activity;
 
+    // whether or not key descriptions are being recorded
+    bool record_descriptions;
+
     // protects all access to the cache
     boost::mutex mutex;
 };
 
-// SQLITE UTILITIES
+// If more than this many updates are buffered, they're written out
+// immediately rather than waiting for the cache to become idle.
+static size_t const max_buffered_updates = 256;
+
+// A sweep is requested each time this many bytes have been inserted.
+static int64_t const bytes_between_sweeps = 0x4000000;
+
+// the maximum number of entries that are evicted while holding the mutex
+static int64_t const eviction_batch_size = 32;
+
+// Compaction copies entries in batches of at most this many entries or bytes.
+// (The mutex is only held while each batch's relocations are recorded.)
+static size_t const compaction_batch_entry_count = 64;
+static int64_t const compaction_batch_size = 0x100000;
 
 static void open_db(sqlite3** db, file_path const& file)
 {
@@ -47,11 +182,6 @@ static void open_db(sqlite3** db, file_path const& file)
         throw file_error(file, "error creating disk cache index file");
 }
 
-static string escape_string(string const& s)
-{
-    return boost::replace_all_copy(s, "'", "''");
-}
-
 static void throw_query_error(disk_cache_impl const& cache, string const& sql,
     string const& error)
 {
@@ -83,6 +213,214 @@ static void exec_sql(disk_cache_impl const& cache, string const& sql)
         throw_query_error(cache, sql, error);
 }
 
+// Check if the given column exists in the given table.
+static bool column_exists(disk_cache_impl const& cache, string const& table,
+    string const& column)
+{
+    string sql = "select " + column + " from " + table + " limit 0;";
+    sqlite3_stmt* stmt;
+    bool exists =
+        sqlite3_prepare_v2(cache.db, sql.c_str(), -1, &stmt, 0) == SQLITE_OK;
+    sqlite3_finalize(stmt);
+    return exists;
+}
+
+static void prepare_statement(disk_cache_impl const& cache,
+    prepared_statement& statement, char const* sql)
+{
+    statement.sql = sql;
+    if (sqlite3_prepare_v2(cache.db, sql, -1, &statement.stmt, 0) !=
+        SQLITE_OK)
+    {
+        throw_query_error(cache, sql, sqlite3_errmsg(cache.db));
+    }
+}
+
+static void finalize_statement(prepared_statement& statement)
+{
+    // Note that it's harmless to call sqlite3_finalize() on a null pointer.
+    sqlite3_finalize(statement.stmt);
+    statement.stmt = 0;
+}
+
+static void prepare_statements(disk_cache_impl& cache)
+{
+    auto& s = cache.statements;
+    prepare_statement(cache, s.lookup_entry,
+        "select id, valid, crc32 from entries where key=?1;");
+    prepare_statement(cache, s.insert_entry,
+        "insert into entries(key, valid) values (?1, 0);");
+    prepare_statement(cache, s.finish_insert,
+        "update entries set valid=1, size=?2, crc32=?3, segment=?4,"
+        " offset=?5, last_accessed=datetime('now') where id=?1;");
+    prepare_statement(cache, s.record_usage,
+        "update entries set last_accessed=datetime('now') where id=?1;");
+    prepare_statement(cache, s.remove_entry,
+        "delete from entries where id=?1;");
+    prepare_statement(cache, s.get_cache_size,
+        "select size from totals where id=0;");
+    prepare_statement(cache, s.get_entry_count,
+        "select count(id) from entries where valid = 1;");
+    prepare_statement(cache, s.get_entry_list,
+        "select id, size, crc32 from entries where valid = 1"
+        " order by last_accessed;");
+    prepare_statement(cache, s.get_lru_entries,
+        "select id, size from entries order by valid, last_accessed"
+        " limit ?1;");
+    prepare_statement(cache, s.get_all_entry_ids,
+        "select id from entries;");
+    prepare_statement(cache, s.record_description,
+        "insert or replace into descriptions(id, description)"
+        " values (?1, ?2);");
+    prepare_statement(cache, s.remove_description,
+        "delete from descriptions where id=?1;");
+    prepare_statement(cache, s.get_description,
+        "select description from descriptions where id=?1;");
+    prepare_statement(cache, s.get_entry_location,
+        "select segment, offset, size from entries"
+        " where id=?1 and valid=1;");
+    prepare_statement(cache, s.relocate_entry,
+        "update entries set segment=?2, offset=?3 where id=?1;");
+    prepare_statement(cache, s.create_segment,
+        "insert into segments(sealed, created)"
+        " values (0, datetime('now'));");
+    prepare_statement(cache, s.seal_segment,
+        "update segments set sealed=1 where id=?1;");
+    prepare_statement(cache, s.remove_segment,
+        "delete from segments where id=?1;");
+    prepare_statement(cache, s.get_sealed_segments,
+        "select id from segments where sealed=1;");
+    prepare_statement(cache, s.get_segment_usage,
+        "select sum(size) from entries where segment=?1 and valid=1;");
+    prepare_statement(cache, s.get_segment_entries,
+        "select id, offset, size from entries"
+        " where segment=?1 and valid=1;");
+    prepare_statement(cache, s.segment_exists,
+        "select 1 from segments where id=?1;");
+}
+
+static void finalize_statements(disk_cache_impl& cache)
+{
+    auto& s = cache.statements;
+    finalize_statement(s.lookup_entry);
+    finalize_statement(s.insert_entry);
+    finalize_statement(s.finish_insert);
+    finalize_statement(s.record_usage);
+    finalize_statement(s.remove_entry);
+    finalize_statement(s.get_cache_size);
+    finalize_statement(s.get_entry_count);
+    finalize_statement(s.get_entry_list);
+    finalize_statement(s.get_lru_entries);
+    finalize_statement(s.get_all_entry_ids);
+    finalize_statement(s.record_description);
+    finalize_statement(s.remove_description);
+    finalize_statement(s.get_description);
+    finalize_statement(s.get_entry_location);
+    finalize_statement(s.relocate_entry);
+    finalize_statement(s.create_segment);
+    finalize_statement(s.seal_segment);
+    finalize_statement(s.remove_segment);
+    finalize_statement(s.get_sealed_segments);
+    finalize_statement(s.get_segment_usage);
+    finalize_statement(s.get_segment_entries);
+    finalize_statement(s.segment_exists);
+}
+
+// statement_execution manages a single execution of a prepared statement.
+// It takes care of resetting the statement (and clearing its bindings) when
+// the execution is done, regardless of how it ends.
+struct statement_execution : noncopyable
+{
+    statement_execution(disk_cache_impl const& cache,
+        prepared_statement const& statement)
+      : cache_(&cache), statement_(&statement)
+    {}
+    ~statement_execution()
+    {
+        sqlite3_reset(statement_->stmt);
+        sqlite3_clear_bindings(statement_->stmt);
+    }
+
+    void bind(int index, int64_t value)
+    {
+        check(sqlite3_bind_int64(statement_->stmt, index, value));
+    }
+    void bind(int index, string const& value)
+    {
+        check(sqlite3_bind_text(statement_->stmt, index, value.c_str(),
+            int(value.length()), SQLITE_TRANSIENT));
+    }
+
+    // Step the statement.
+    // The return value indicates whether or not a row is available.
+    bool step()
+    {
+        int code = sqlite3_step(statement_->stmt);
+        switch (code)
+        {
+         case SQLITE_ROW:
+            return true;
+         case SQLITE_DONE:
+            return false;
+         default:
+            check(code);
+            return false;
+        }
+    }
+
+    // Run a statement that isn't expected to produce any rows.
+    void run()
+    {
+        while (step())
+            ;
+    }
+
+    // This is the same as run(), but if the statement violates a constraint,
+    // it returns false rather than throwing an exception.
+    bool try_run()
+    {
+        while (1)
+        {
+            int code = sqlite3_step(statement_->stmt);
+            if (code == SQLITE_DONE)
+                return true;
+            if (code == SQLITE_CONSTRAINT)
+                return false;
+            if (code != SQLITE_ROW)
+                check(code);
+        }
+    }
+
+    bool is_null(int column) const
+    {
+        return sqlite3_column_type(statement_->stmt, column) == SQLITE_NULL;
+    }
+    int64_t get_int64(int column) const
+    {
+        return sqlite3_column_int64(statement_->stmt, column);
+    }
+    string get_string(int column) const
+    {
+        auto text = reinterpret_cast<char const*>(
+            sqlite3_column_text(statement_->stmt, column));
+        return text ? string(text,
+            size_t(sqlite3_column_bytes(statement_->stmt, column))) : "";
+    }
+
+ private:
+    void check(int code)
+    {
+        if (code != SQLITE_OK && code != SQLITE_ROW && code != SQLITE_DONE)
+        {
+            throw_query_error(*cache_, statement_->sql,
+                sqlite3_errmsg(cache_->db));
+        }
+    }
+
+    disk_cache_impl const* cache_;
+    prepared_statement const* statement_;
+};
+
 struct db_transaction
 {
     db_transaction(disk_cache_impl& cache)
@@ -98,7 +436,15 @@ struct db_transaction
     ~db_transaction()
     {
         if (!committed_)
-            exec_sql(*cache_, "rollback transaction;");
+        {
+            try
+            {
+                exec_sql(*cache_, "rollback transaction;");
+            }
+            catch (...)
+            {
+            }
+        }
     }
     disk_cache_impl* cache_;
     bool committed_;
@@ -107,237 +453,99 @@ struct db_transaction
 // QUERIES
 
 // Get the total size of all entries in the cache.
-struct size_result
-{
-    int64_t size;
-    bool success;
-};
-static int size_callback(void* data, int n_columns, char** columns,
-    char** types)
-{
-    if (n_columns != 1)
-        return -1;
-
-    size_result* r = reinterpret_cast<size_result*>(data);
-
-    if (!columns[0])
-    {
-        // Apparently if there are no entries, it triggers this case.
-        r->size = 0;
-        r->success = true;
-        return 0;
-    }
-
-    try
-    {
-        r->size = boost::lexical_cast<int64_t>(columns[0]);
-        r->success = true;
-        return 0;
-    }
-    catch (...)
-    {
-        return -1;
-    }
-}
+// This is maintained by triggers in the database, so it's cheap.
 static int64_t get_cache_size(disk_cache_impl& cache)
 {
-    size_result result;
-    result.success = false;
-
-    string sql = "select sum(size) from entries;";
-
-    char* msg;
-    int code = sqlite3_exec(cache.db, sql.c_str(), size_callback, &result,
-        &msg);
-    string error = copy_and_free_message(msg);
-    if (code != SQLITE_OK)
-        throw_query_error(cache, sql, error);
-
-    if (!result.success)
-        throw_query_error(cache, sql, "no result");
-
-    return result.size;
+    statement_execution q(cache, cache.statements.get_cache_size);
+    if (!q.step())
+        throw_query_error(cache, cache.statements.get_cache_size.sql,
+            "no result");
+    return q.get_int64(0);
 }
 
 // Get the total number of valid entries in the cache.
-struct entry_count_result
-{
-    int64_t n_entries;
-    bool success;
-};
-static int entry_count_callback(void* data, int n_columns, char** columns,
-    char** types)
-{
-    if (n_columns != 1 || !columns[0])
-        return -1;
-
-    entry_count_result* r = reinterpret_cast<entry_count_result*>(data);
-
-    try
-    {
-        r->n_entries = boost::lexical_cast<int64_t>(columns[0]);
-        r->success = true;
-        return 0;
-    }
-    catch (...)
-    {
-        return -1;
-    }
-}
 static int64_t get_cache_entry_count(disk_cache_impl& cache)
 {
-    entry_count_result result;
-    result.success = false;
-
-    string sql = "select count(id) from entries where valid = 1;";
-
-    char* msg;
-    int code = sqlite3_exec(cache.db, sql.c_str(), entry_count_callback,
-        &result, &msg);
-    string error = copy_and_free_message(msg);
-    if (code != SQLITE_OK)
-        throw_query_error(cache, sql, error);
-
-    if (!result.success)
-        throw_query_error(cache, sql, "no result");
-
-    return result.n_entries;
+    statement_execution q(cache, cache.statements.get_entry_count);
+    if (!q.step())
+        throw_query_error(cache, cache.statements.get_entry_count.sql,
+            "no result");
+    return q.get_int64(0);
 }
 
 // Get a list of entries in the cache.
-static int cache_entries_callback(void* data, int n_columns, char** columns,
-    char** types)
-{
-    if (n_columns != 3)
-        return -1;
-
-    auto r = reinterpret_cast<std::vector<disk_cache_entry>*>(data);
-
-    try
-    {
-        disk_cache_entry e;
-        e.id = boost::lexical_cast<int64_t>(columns[0]);
-        e.size = columns[1] ? boost::lexical_cast<int64_t>(columns[1]) : 0;
-        e.crc32 = columns[2] ? boost::lexical_cast<uint32_t>(columns[2]) : 0;
-        r->push_back(e);
-        return 0;
-    }
-    catch (...)
-    {
-        return -1;
-    }
-}
 static void get_entry_list(std::vector<disk_cache_entry>& entries,
     disk_cache_impl& cache)
 {
     entries.clear();
 
-    string sql =
-        "select id, size, crc32 from entries where valid = 1"
-        " order by last_accessed;";
-
-    char* msg;
-    int code = sqlite3_exec(cache.db, sql.c_str(), cache_entries_callback,
-        &entries, &msg);
-    string error = copy_and_free_message(msg);
-    if (code != SQLITE_OK)
-        throw_query_error(cache, sql, error);
+    statement_execution q(cache, cache.statements.get_entry_list);
+    while (q.step())
+    {
+        disk_cache_entry e;
+        e.id = q.get_int64(0);
+        e.size = q.is_null(1) ? 0 : q.get_int64(1);
+        e.crc32 = q.is_null(2) ? 0 : uint32_t(q.get_int64(2));
+        entries.push_back(e);
+    }
 }
 
-// Get a list of entries in the cache in LRU order.
+// Get the first n entries in the cache in LRU order.
+// (Invalid entries are considered least recently used.)
 struct lru_entry
 {
     int64_t id, size;
 };
-struct lru_entry_list
-{
-    std::vector<lru_entry> entries;
-};
-static int lru_entries_callback(void* data, int n_columns, char** columns,
-    char** types)
+static void get_lru_entries(std::vector<lru_entry>& entries,
+    disk_cache_impl& cache, int64_t n)
 {
-    if (n_columns != 2)
-        return -1;
-
-    lru_entry_list* r = reinterpret_cast<lru_entry_list*>(data);
+    entries.clear();
 
-    try
+    statement_execution q(cache, cache.statements.get_lru_entries);
+    q.bind(1, n);
+    while (q.step())
     {
         lru_entry e;
-        e.id = boost::lexical_cast<int64_t>(columns[0]);
-        e.size = columns[1] ? boost::lexical_cast<int64_t>(columns[1]) : 0;
-        r->entries.push_back(e);
-        return 0;
-    }
-    catch (...)
-    {
-        return -1;
+        e.id = q.get_int64(0);
+        e.size = q.is_null(1) ? 0 : q.get_int64(1);
+        entries.push_back(e);
     }
 }
-static void get_lru_entries(lru_entry_list& entries, disk_cache_impl& cache)
-{
-    entries.entries.clear();
-
-    string sql =
-        "select id, size from entries order by valid, last_accessed;";
-
-    char* msg;
-    int code = sqlite3_exec(cache.db, sql.c_str(), lru_entries_callback,
-        &entries, &msg);
-    string error = copy_and_free_message(msg);
-    if (code != SQLITE_OK)
-        throw_query_error(cache, sql, error);
-}
 
 // Check if a particular key exists in the cache.
-struct exists_result
+static bool exists(disk_cache_impl const& cache, string const& key,
+    int64_t* id, uint32_t* crc32, bool only_if_valid)
 {
-    bool exists;
-    int64_t id;
+    int64_t entry_id;
     bool valid;
-    uint32_t crc32;
-};
-static int exists_callback(void* data, int n_columns, char** columns,
-    char** types)
-{
-    if (n_columns != 3)
-        return -1;
-
-    exists_result* r = reinterpret_cast<exists_result*>(data);
-
-    try
+    uint32_t entry_crc32;
     {
-        r->id = boost::lexical_cast<int64_t>(columns[0]);
-        r->valid = boost::lexical_cast<int>(columns[1]) != 0;
-        r->crc32 = columns[2] ? boost::lexical_cast<uint32_t>(columns[2]) : 0;
-        r->exists = true;
-        return 0;
+        statement_execution q(cache, cache.statements.lookup_entry);
+        q.bind(1, cache.key_prefix + key);
+        if (!q.step())
+            return false;
+        entry_id = q.get_int64(0);
+        valid = q.get_int64(1) != 0;
+        entry_crc32 = q.is_null(2) ? 0 : uint32_t(q.get_int64(2));
     }
-    catch (...)
+
+    // If the entry isn't marked as valid in the database, it may still have
+    // been finished by this process and be waiting to be recorded.
+    if (!valid)
     {
-        return -1;
+        auto pending = cache.pending_inserts.find(entry_id);
+        if (pending != cache.pending_inserts.end())
+        {
+            valid = true;
+            entry_crc32 = pending->second.crc32;
+        }
     }
-}
-static bool exists(disk_cache_impl const& cache, string const& key,
-    int64_t* id, uint32_t* crc32, bool only_if_valid)
-{
-    string sql = "select id, valid, crc32 from entries where key='" +
-        escape_string(cache.key_prefix + key) + "';";
-
-    exists_result result;
-    result.exists = false;
-    char* msg;
-    int code = sqlite3_exec(cache.db, sql.c_str(), exists_callback, &result,
-        &msg);
-    string error = copy_and_free_message(msg);
-    if (code != SQLITE_OK)
-        throw_query_error(cache, sql, error);
 
-    if (result.exists && (!only_if_valid || result.valid))
+    if (!only_if_valid || valid)
     {
-        *id = result.id;
+        *id = entry_id;
         if (crc32)
-            *crc32 = result.crc32;
+            *crc32 = entry_crc32;
         return true;
     }
     else
@@ -449,87 +657,624 @@ static file_path get_path_for_id(disk_cache_impl& cache, int64_t id)
     return cache.dir / boost::lexical_cast<string>(id);
 }
 
-static void remove_entry(disk_cache_impl& cache, int64_t id)
+static file_path get_path_for_segment(disk_cache_impl& cache, int64_t id)
 {
-    file_path path = get_path_for_id(cache, id);
-    if (exists(path))
-        remove(path);
+    return cache.dir / ("segment-" + boost::lexical_cast<string>(id));
+}
 
-    string sql = "delete from entries where id=" +
-        boost::lexical_cast<string>(id) + ";";
+// Get the location of a valid entry's data.
+// The return value indicates whether or not the entry was found.
+static bool get_entry_location(disk_cache_impl& cache, int64_t id,
+    entry_location* location)
+{
+    auto pending = cache.pending_inserts.find(id);
+    if (pending != cache.pending_inserts.end())
+    {
+        *location = pending->second.location;
+        return true;
+    }
 
-    char* msg;
-    int code = sqlite3_exec(cache.db, sql.c_str(), 0, 0, &msg);
-    string error = copy_and_free_message(msg);
-    if (code != SQLITE_OK)
-        throw_query_error(cache, sql, error);
+    statement_execution q(cache, cache.statements.get_entry_location);
+    q.bind(1, id);
+    if (!q.step())
+        return false;
+    location->segment = q.is_null(0) ? 0 : q.get_int64(0);
+    location->offset = q.is_null(1) ? 0 : q.get_int64(1);
+    location->size = q.is_null(2) ? 0 : q.get_int64(2);
+    return true;
 }
 
-void static
-enforce_cache_size_limit(disk_cache_impl& cache)
+// Stop appending to an active segment and mark it as sealed so that it can
+// be compacted.
+static void seal_active_segment(disk_cache_impl& cache,
+    active_segment& segment)
 {
-    try
+    if (segment.id != 0)
     {
-        int64_t size = get_cache_size(cache);
-        lru_entry_list lru_entries;
-        if (size > cache.size_limit)
-        {
-            get_lru_entries(lru_entries, cache);
-            std::vector<lru_entry>::const_iterator
-                i = lru_entries.entries.begin(),
-                end_i = lru_entries.entries.end();
-            while (size > cache.size_limit && i != end_i)
-            {
-                try
-                {
-                    remove_entry(cache, i->id);
-                    size -= i->size;
-                    ++i;
-                }
-                catch (...)
-                {
-                }
-            }
-        }
-        cache.bytes_inserted_since_last_sweep = 0;
+        int64_t id = segment.id;
+        segment.file.close();
+        segment.file.clear();
+        segment.id = 0;
+        segment.size = 0;
+
+        statement_execution q(cache, cache.statements.seal_segment);
+        q.bind(1, id);
+        q.run();
     }
-    catch (...)
+}
+
+// Make sure that an active segment has room for the given number of bytes,
+// starting a new one if necessary.
+static void reserve_segment_space(disk_cache_impl& cache,
+    active_segment& segment, int64_t size)
+{
+    if (segment.id != 0 &&
+        (segment.size + size > max_segment_size ||
+            boost::posix_time::microsec_clock::universal_time() -
+                segment.created > max_active_segment_age))
+    {
+        seal_active_segment(cache, segment);
+    }
+    if (segment.id == 0)
     {
+        int64_t id;
+        {
+            statement_execution q(cache, cache.statements.create_segment);
+            q.run();
+            id = sqlite3_last_insert_rowid(cache.db);
+        }
+        open(segment.file, get_path_for_segment(cache, id),
+            std::ios::out | std::ios::binary | std::ios::trunc);
+        segment.id = id;
+        segment.size = 0;
+        segment.created = boost::posix_time::microsec_clock::universal_time();
     }
 }
 
-static void record_activity(disk_cache_impl& cache)
+// Write data to the end of an active segment's file and get its location.
+// This only touches the segment itself, so it doesn't need the mutex if no
+// other thread uses the segment. If it fails, the segment has to be sealed
+// (with the mutex held), since its state is unknown.
+static bool
+write_to_segment(active_segment& segment, void const* data, int64_t size,
+    entry_location* location)
 {
-    cache.latest_activity = boost::posix_time::microsec_clock::local_time();
+    location->segment = segment.id;
+    location->offset = segment.size;
+    location->size = size;
+
+    // The data is flushed immediately so that other threads can read it as
+    // soon as the entry is visible.
+    segment.file.write(reinterpret_cast<char const*>(data), size);
+    segment.file.flush();
+    if (!segment.file)
+        return false;
+    segment.size += size;
+    return true;
 }
 
-void static
-initialize(disk_cache_impl& cache, file_path const& dir,
-    string const& key_prefix, int64_t size_limit)
+static void throw_segment_write_error(disk_cache_impl& cache,
+    active_segment& segment)
 {
-    cache.db = 0;
-
-    sqlite3_enable_shared_cache(1);
+    file_path path = get_path_for_segment(cache, segment.id);
+    seal_active_segment(cache, segment);
+    throw file_error(path, "error writing to disk cache segment");
+}
 
-    create_directory_if_needed(dir);
+// Append data to an active segment and return its location.
+// reserve_segment_space() must be called first.
+static entry_location
+append_to_segment(disk_cache_impl& cache, active_segment& segment,
+    void const* data, int64_t size)
+{
+    entry_location location;
+    if (!write_to_segment(segment, data, size, &location))
+        throw_segment_write_error(cache, segment);
+    return location;
+}
 
-    cache.dir = dir;
-    cache.key_prefix = key_prefix;
-    cache.size_limit = size_limit;
-    cache.bytes_inserted_since_last_sweep = 0;
+static void read_file_block(file_path const& path, int64_t offset,
+    int64_t size, std::vector<uint8_t>* data)
+{
+    std::ifstream f;
+    open(f, path, std::ios::in | std::ios::binary);
+    data->resize(boost::numeric_cast<size_t>(size));
+    if (size != 0)
+    {
+        f.seekg(offset);
+        f.read(reinterpret_cast<char*>(&(*data)[0]), size);
+    }
+    if (!f)
+        throw file_error(path, "error reading disk cache entry");
+}
 
-    open_db(&cache.db, dir / "index.db");
+// Write out all buffered usage records and pending inserts in a single
+// transaction.
+static void write_buffered_updates(disk_cache_impl& cache)
+{
+    if (cache.usage_record_buffer.empty() && cache.pending_inserts.empty())
+        return;
 
-    exec_sql(cache,
-        "create table if not exists entries(\n"
-        "   id integer primary key,\n"
-        "   key text unique not null,\n"
-        "   valid boolean not null,\n"
-        "   last_accessed datetime,\n"
-        "   size integer, crc32 integer);");
+    {
+        db_transaction t(cache);
+        for (auto const& insert : cache.pending_inserts)
+        {
+            auto const& location = insert.second.location;
+            statement_execution q(cache, cache.statements.finish_insert);
+            q.bind(1, insert.first);
+            q.bind(2, location.size);
+            q.bind(3, int64_t(insert.second.crc32));
+            // Entries that have their own files leave these as NULL.
+            if (location.segment != 0)
+            {
+                q.bind(4, location.segment);
+                q.bind(5, location.offset);
+            }
+            q.run();
+        }
+        for (auto const& id : cache.usage_record_buffer)
+        {
+            statement_execution q(cache, cache.statements.record_usage);
+            q.bind(1, id);
+            q.run();
+        }
+        t.commit();
+    }
+    cache.pending_inserts.clear();
+    cache.usage_record_buffer.clear();
+}
+
+static size_t count_buffered_updates(disk_cache_impl const& cache)
+{
+    return cache.usage_record_buffer.size() + cache.pending_inserts.size();
+}
+
+struct segment_entry
+{
+    int64_t id, offset, size;
+};
+
+// Move the live entries in a sealed segment to the compaction segment and
+// delete the sealed one.
+// 'lock' must hold the cache's mutex, and the caller must hold the
+// compaction_mutex. The entries are copied in small batches. The copying is
+// done without the mutex, which is only held while each batch's relocations
+// are recorded, so lookups and inserts are never held up for long. Entries
+// that are removed or moved (by another process) while their batch is being
+// copied are left alone, and their copies are just dead space.
+// The segment's row is deleted in the same transaction that relocates the
+// last batch, so if anything fails, the segment is left intact. Segment IDs
+// are never reused, so any locations that other threads still have for the
+// segment just fail to read once its file is gone.
+static void compact_segment(disk_cache_impl& cache,
+    boost::unique_lock<boost::mutex>& lock, int64_t segment_id)
+{
+    file_path path = get_path_for_segment(cache, segment_id);
+    auto& target = cache.compaction_segment;
+
+    std::vector<segment_entry> entries;
+    {
+        statement_execution q(cache, cache.statements.get_segment_entries);
+        q.bind(1, segment_id);
+        while (q.step())
+        {
+            segment_entry e;
+            e.id = q.get_int64(0);
+            e.offset = q.is_null(1) ? 0 : q.get_int64(1);
+            e.size = q.is_null(2) ? 0 : q.get_int64(2);
+            entries.push_back(e);
+        }
+    }
+
+    std::vector<uint8_t> data;
+    std::vector<entry_location> locations;
+    size_t batch_start = 0;
+    do
+    {
+        if (cache.stopping_sweeper)
+            return;
+
+        size_t batch_end = batch_start;
+        int64_t batch_size = 0;
+        while (batch_end != entries.size() &&
+            batch_end - batch_start < compaction_batch_entry_count &&
+            batch_size < compaction_batch_size)
+        {
+            batch_size += entries[batch_end].size;
+            ++batch_end;
+        }
+
+        // Copy the batch.
+        locations.clear();
+        if (batch_end != batch_start)
+        {
+            reserve_segment_space(cache, target, batch_size);
+            bool write_failed = false;
+            lock.unlock();
+            try
+            {
+                for (size_t i = batch_start; i != batch_end; ++i)
+                {
+                    auto const& e = entries[i];
+                    read_file_block(path, e.offset, e.size, &data);
+                    entry_location location;
+                    if (!write_to_segment(target,
+                            data.empty() ? 0 : &data[0], e.size, &location))
+                    {
+                        write_failed = true;
+                        break;
+                    }
+                    locations.push_back(location);
+                }
+            }
+            catch (...)
+            {
+                lock.lock();
+                throw;
+            }
+            lock.lock();
+            if (write_failed)
+                throw_segment_write_error(cache, target);
+        }
+
+        // Record the relocations.
+        db_transaction t(cache);
+        for (size_t i = batch_start; i != batch_end; ++i)
+        {
+            auto const& e = entries[i];
+            entry_location current;
+            if (!get_entry_location(cache, e.id, &current) ||
+                current.segment != segment_id || current.offset != e.offset)
+            {
+                continue;
+            }
+            auto const& location = locations[i - batch_start];
+            statement_execution q(cache, cache.statements.relocate_entry);
+            q.bind(1, e.id);
+            q.bind(2, location.segment);
+            q.bind(3, location.offset);
+            q.run();
+        }
+        batch_start = batch_end;
+        if (batch_start == entries.size())
+        {
+            statement_execution q(cache, cache.statements.remove_segment);
+            q.bind(1, segment_id);
+            q.run();
+        }
+        t.commit();
+    }
+    while (batch_start != entries.size());
+
+    // If this fails, the file is picked up by
+    // remove_orphaned_segment_files().
+    if (exists(path))
+        remove(path);
+}
+
+static std::vector<int64_t> get_sealed_segments(disk_cache_impl& cache)
+{
+    std::vector<int64_t> segments;
+    statement_execution q(cache, cache.statements.get_sealed_segments);
+    while (q.step())
+        segments.push_back(q.get_int64(0));
+    return segments;
+}
+
+// Compact a sealed segment if it's mostly dead space.
+// Small segments are also merged into the compaction segment so that they
+// don't accumulate (e.g., from lots of short-lived processes).
+// This has the same requirements as compact_segment().
+static void compact_segment_if_needed(disk_cache_impl& cache,
+    boost::unique_lock<boost::mutex>& lock, int64_t segment)
+{
+    try
+    {
+        int64_t live_size;
+        {
+            statement_execution q(cache,
+                cache.statements.get_segment_usage);
+            q.bind(1, segment);
+            q.step();
+            live_size = q.is_null(0) ? 0 : q.get_int64(0);
+        }
+        file_path path = get_path_for_segment(cache, segment);
+        int64_t total_size =
+            exists(path) ? int64_t(file_size(path)) : 0;
+        if (live_size * 2 < total_size ||
+            total_size < max_segment_size / 64)
+        {
+            compact_segment(cache, lock, segment);
+        }
+    }
+    catch (...)
+    {
+        // Another process may be compacting the same segment, so just
+        // leave it for now.
+    }
+}
+
+// Compact all sealed segments that need it.
+// This has the same requirements as compact_segment().
+static void compact_segments(disk_cache_impl& cache,
+    boost::unique_lock<boost::mutex>& lock)
+{
+    // Make sure the database reflects everything that's been inserted.
+    write_buffered_updates(cache);
+
+    for (auto const& segment : get_sealed_segments(cache))
+        compact_segment_if_needed(cache, lock, segment);
+}
+
+static void remove_entry(disk_cache_impl& cache, int64_t id)
+{
+    file_path path = get_path_for_id(cache, id);
+    if (exists(path))
+        remove(path);
+
+    cache.pending_inserts.erase(id);
+
+    {
+        statement_execution q(cache, cache.statements.remove_entry);
+        q.bind(1, id);
+        q.run();
+    }
+    {
+        statement_execution q(cache, cache.statements.remove_description);
+        q.bind(1, id);
+        q.run();
+    }
+}
+
+// Evict a batch of the least recently used entries if the cache is over its
+// size limit.
+// The return value indicates whether or not there may be more to evict.
+static bool evict_lru_batch(disk_cache_impl& cache)
+{
+    // Make sure the database reflects everything that's been inserted.
+    write_buffered_updates(cache);
 
+    int64_t size = get_cache_size(cache);
+    if (size <= cache.size_limit)
+        return false;
+
+    std::vector<lru_entry> lru_entries;
+    get_lru_entries(lru_entries, cache, eviction_batch_size);
+    bool progress = false;
+    db_transaction t(cache);
+    for (auto const& entry : lru_entries)
+    {
+        if (size <= cache.size_limit)
+            break;
+        try
+        {
+            remove_entry(cache, entry.id);
+            size -= entry.size;
+            progress = true;
+        }
+        catch (...)
+        {
+        }
+    }
+    t.commit();
+    // If nothing could be removed, the next batch would be the same, so
+    // give up until the next sweep.
+    return progress && size > cache.size_limit;
+}
+
+// Remove any segment files that don't have rows in the segments table.
+// These are left behind if deleting a compacted segment's file fails.
+// 'lock' must hold the cache's mutex, and it's released while the directory
+// is scanned, since the directory may hold lots of entry files.
+static void remove_orphaned_segment_files(disk_cache_impl& cache,
+    boost::unique_lock<boost::mutex>& lock)
+{
+    string const prefix = "segment-";
+    std::vector<int64_t> ids;
+    lock.unlock();
+    try
+    {
+        for (boost::filesystem::directory_iterator i(cache.dir), end;
+            i != end; ++i)
+        {
+            string name = i->path().filename().string();
+            if (name.compare(0, prefix.length(), prefix) != 0)
+                continue;
+            try
+            {
+                ids.push_back(boost::lexical_cast<int64_t>(
+                    name.substr(prefix.length())));
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+            }
+        }
+    }
+    catch (...)
+    {
+        lock.lock();
+        throw;
+    }
+    lock.lock();
+
+    // Since segment rows are created before their files, and IDs are never
+    // reused, a file without a row can't be in use.
+    for (auto const& id : ids)
+    {
+        {
+            statement_execution q(cache, cache.statements.segment_exists);
+            q.bind(1, id);
+            if (q.step())
+                continue;
+        }
+        try
+        {
+            file_path path = get_path_for_segment(cache, id);
+            if (exists(path))
+                remove(path);
+        }
+        catch (...)
+        {
+        }
+    }
+}
+
+// Let any other threads that are waiting on the mutex have a turn.
+static void yield_mutex(boost::unique_lock<boost::mutex>& lock)
+{
+    lock.unlock();
+    boost::this_thread::yield();
+    lock.lock();
+}
+
+// Enforce the size limit and compact segments.
+// 'lock' must hold the cache's mutex. It's released between batches, so the
+// cache may be used by other threads while this is in progress.
+static void sweep(disk_cache_impl& cache,
+    boost::unique_lock<boost::mutex>& lock)
+{
+    try
+    {
+        cache.bytes_inserted_since_last_sweep = 0;
+
+        if (cache.orphaned_segment_check_pending)
+        {
+            remove_orphaned_segment_files(cache, lock);
+            cache.orphaned_segment_check_pending = false;
+        }
+
+        while (!cache.stopping_sweeper && evict_lru_batch(cache))
+            yield_mutex(lock);
+
+        lock.unlock();
+        boost::lock_guard<boost::mutex> compaction_lock(cache.compaction_mutex);
+        lock.lock();
+        write_buffered_updates(cache);
+        for (auto const& segment : get_sealed_segments(cache))
+        {
+            if (cache.stopping_sweeper)
+                break;
+            yield_mutex(lock);
+            compact_segment_if_needed(cache, lock, segment);
+        }
+    }
+    catch (...)
+    {
+    }
+}
+
+static void run_sweeper(disk_cache_impl* cache)
+{
+    boost::unique_lock<boost::mutex> lock(cache->mutex);
+    while (1)
+    {
+        while (!cache->sweep_requested && !cache->stopping_sweeper)
+            cache->sweep_signal.wait(lock);
+        if (cache->stopping_sweeper)
+            return;
+        cache->sweep_requested = false;
+        sweep(*cache, lock);
+    }
+}
+
+static void start_sweeper(disk_cache_impl& cache)
+{
+    cache.stopping_sweeper = false;
+    cache.sweeper = boost::thread(run_sweeper, &cache);
+}
+
+// This must be called without holding the mutex.
+static void stop_sweeper(disk_cache_impl& cache)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cache.mutex);
+        cache.stopping_sweeper = true;
+    }
+    cache.sweep_signal.notify_all();
+    if (cache.sweeper.joinable())
+        cache.sweeper.join();
+}
+
+// Ask the sweeper to run. The mutex must be held.
+static void request_sweep(disk_cache_impl& cache)
+{
+    cache.sweep_requested = true;
+    cache.sweep_signal.notify_all();
+}
+
+static void record_activity(disk_cache_impl& cache)
+{
+    cache.latest_activity = boost::posix_time::microsec_clock::local_time();
+}
+
+// The total size of the cache is kept in the totals table, and triggers keep
+// it up to date as entries change (even if they're changed by other
+// processes). Indexes that were created before this was added need to be
+// summed up once.
+static void initialize_total_size(disk_cache_impl& cache)
+{
+    db_transaction t(cache);
     exec_sql(cache,
-        "pragma synchronous = off;");
+        "create table if not exists totals(\n"
+        "   id integer primary key,\n"
+        "   size integer not null);");
+    exec_sql(cache,
+        "create trigger if not exists entries_insert_size\n"
+        "   after insert on entries begin\n"
+        "   update totals set size = size + coalesce(new.size, 0)\n"
+        "      where id = 0;\n"
+        "   end;");
+    exec_sql(cache,
+        "create trigger if not exists entries_update_size\n"
+        "   after update of size on entries begin\n"
+        "   update totals set size = size - coalesce(old.size, 0) +\n"
+        "      coalesce(new.size, 0) where id = 0;\n"
+        "   end;");
+    exec_sql(cache,
+        "create trigger if not exists entries_delete_size\n"
+        "   after delete on entries begin\n"
+        "   update totals set size = size - coalesce(old.size, 0)\n"
+        "      where id = 0;\n"
+        "   end;");
+    bool initialized;
+    {
+        prepared_statement check;
+        prepare_statement(cache, check, "select 1 from totals where id=0;");
+        {
+            statement_execution q(cache, check);
+            initialized = q.step();
+        }
+        finalize_statement(check);
+    }
+    if (!initialized)
+    {
+        exec_sql(cache,
+            "insert or ignore into totals(id, size)\n"
+            "   select 0, coalesce(sum(size), 0) from entries;");
+    }
+    t.commit();
+}
+
+void static
+initialize(disk_cache_impl& cache, file_path const& dir,
+    string const& key_prefix, int64_t size_limit)
+{
+    cache.db = 0;
+
+    sqlite3_enable_shared_cache(1);
+
+    create_directory_if_needed(dir);
+
+    cache.dir = dir;
+    cache.key_prefix = key_prefix;
+    cache.size_limit = size_limit;
+    cache.bytes_inserted_since_last_sweep = 0;
+    cache.sweep_requested = false;
+    cache.stopping_sweeper = false;
+    cache.orphaned_segment_check_pending = true;
+    cache.record_descriptions = false;
+
+    open_db(&cache.db, dir / "index.db");
 
     // The disk cache database will be accessed concurrently from multiple
     // threads and even multiple processes, but each access should be very
@@ -537,9 +1282,78 @@ initialize(disk_cache_impl& cache, file_path const& dir,
     // to keep trying for a while before it gives up.
     sqlite3_busy_timeout(cache.db, 1000);
 
+    exec_sql(cache,
+        "create table if not exists entries(\n"
+        "   id integer primary key,\n"
+        "   key text unique not null,\n"
+        "   valid boolean not null,\n"
+        "   last_accessed datetime,\n"
+        "   size integer, crc32 integer,\n"
+        "   segment integer, offset integer);");
+
+    // Indexes created before packed storage was added won't have the
+    // segment columns, so add them if necessary.
+    if (!column_exists(cache, "entries", "segment"))
+    {
+        exec_sql(cache,
+            "alter table entries add column segment integer;");
+        exec_sql(cache,
+            "alter table entries add column offset integer;");
+    }
+
+    exec_sql(cache,
+        "create index if not exists entries_by_segment\n"
+        "   on entries(segment);");
+
+    // This is the order in which entries are evicted.
+    exec_sql(cache,
+        "create index if not exists entries_by_lru\n"
+        "   on entries(valid, last_accessed);");
+
+    initialize_total_size(cache);
+
+    // Segment IDs are never reused (hence the autoincrement), so a stale
+    // location can never refer to the wrong segment.
+    exec_sql(cache,
+        "create table if not exists segments(\n"
+        "   id integer primary key autoincrement,\n"
+        "   sealed boolean not null,\n"
+        "   created datetime);");
+    if (!column_exists(cache, "segments", "created"))
+    {
+        exec_sql(cache,
+            "alter table segments add column created datetime;");
+    }
+
+    // Seal any segments that were left active by processes that died, so
+    // that they get compacted. (Live processes never append to segments this
+    // old. See max_active_segment_age.)
+    exec_sql(cache,
+        "update segments set sealed=1 where sealed=0 and\n"
+        "   (created is null or created < datetime('now', '-1 day'));");
+
+    // Keys are generally digests, so this optionally records a
+    // human-readable description of what each entry actually contains.
+    exec_sql(cache,
+        "create table if not exists descriptions(\n"
+        "   id integer primary key,\n"
+        "   description text not null);");
+
+    // In WAL mode, readers (in this process or others) don't block writers
+    // and vice versa. The mode is persistent, so this is really only needed
+    // the first time the index is created.
+    exec_sql(cache,
+        "pragma journal_mode = wal;");
+
+    exec_sql(cache,
+        "pragma synchronous = off;");
+
+    prepare_statements(cache);
+
     record_activity(cache);
 
-    enforce_cache_size_limit(cache);
+    // Check the size limit once the sweeper is running.
+    cache.sweep_requested = true;
 }
 
 void static
@@ -547,9 +1361,31 @@ shut_down(disk_cache_impl& cache)
 {
     if (cache.db)
     {
+        try
+        {
+            write_buffered_updates(cache);
+        }
+        catch (...)
+        {
+            // The buffered updates are only an optimization, so it's not a
+            // big deal if they're lost.
+        }
+        try
+        {
+            seal_active_segment(cache, cache.segment);
+            seal_active_segment(cache, cache.compaction_segment);
+        }
+        catch (...)
+        {
+            // If this fails, the segment will never be compacted, but its
+            // entries are still valid.
+        }
+        finalize_statements(cache);
         sqlite3_close(cache.db);
         cache.db = 0;
     }
+    cache.usage_record_buffer.clear();
+    cache.pending_inserts.clear();
 }
 
 // API
@@ -558,6 +1394,7 @@ disk_cache::~disk_cache()
 {
     if (impl)
     {
+        stop_sweeper(*impl);
         shut_down(*impl);
         delete impl;
         impl = 0;
@@ -570,15 +1407,20 @@ void initialize(disk_cache& cache_ref, file_path const& dir,
     cache_ref.impl = new disk_cache_impl;
     disk_cache_impl& cache = *cache_ref.impl;
     initialize(cache, dir, key_prefix, size_limit);
+    start_sweeper(cache);
 }
 
 void reset(disk_cache& cache_ref, file_path const& dir,
     string const& key_prefix, int64_t size_limit)
 {
     disk_cache_impl& cache = *cache_ref.impl;
-    boost::lock_guard<boost::mutex> lock(cache.mutex);
-    shut_down(cache);
-    initialize(cache, dir, key_prefix, size_limit);
+    stop_sweeper(cache);
+    {
+        boost::lock_guard<boost::mutex> lock(cache.mutex);
+        shut_down(cache);
+        initialize(cache, dir, key_prefix, size_limit);
+    }
+    start_sweeper(cache);
 }
 
 bool is_initialized(disk_cache const& cache)
@@ -591,6 +1433,8 @@ disk_cache_info get_summary_info(disk_cache const& cache_ref)
     disk_cache_impl& cache = *cache_ref.impl;
     boost::lock_guard<boost::mutex> lock(cache.mutex);
 
+    write_buffered_updates(cache);
+
     // Note that these are actually inconsistent since the size includes
     // invalid entries, while the entry count does not, but I think that's
     // reasonable behavior and in any case not a big deal.
@@ -605,6 +1449,8 @@ std::vector<disk_cache_entry> get_entry_list(disk_cache const& cache_ref)
     disk_cache_impl& cache = *cache_ref.impl;
     boost::lock_guard<boost::mutex> lock(cache.mutex);
 
+    write_buffered_updates(cache);
+
     std::vector<disk_cache_entry> entries;
     get_entry_list(entries, cache);
     return entries;
@@ -613,9 +1459,9 @@ std::vector<disk_cache_entry> get_entry_list(disk_cache const& cache_ref)
 void enforce_cache_size_limit(disk_cache& cache_ref)
 {
     disk_cache_impl& cache = *cache_ref.impl;
-    boost::lock_guard<boost::mutex> lock(cache.mutex);
+    boost::unique_lock<boost::mutex> lock(cache.mutex);
 
-    enforce_cache_size_limit(cache);
+    sweep(cache, lock);
 }
 
 void remove_entry(disk_cache& cache_ref, int64_t id)
@@ -626,25 +1472,49 @@ void remove_entry(disk_cache& cache_ref, int64_t id)
     remove_entry(cache, id);
 }
 
+void compact(disk_cache& cache_ref)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
+    boost::lock_guard<boost::mutex> compaction_lock(cache.compaction_mutex);
+    boost::unique_lock<boost::mutex> lock(cache.mutex);
+
+    // Include the active segments, since they may have dead space as well.
+    seal_active_segment(cache, cache.segment);
+    seal_active_segment(cache, cache.compaction_segment);
+    compact_segments(cache, lock);
+}
+
 void clear(disk_cache& cache_ref)
 {
     disk_cache_impl& cache = *cache_ref.impl;
-    boost::lock_guard<boost::mutex> lock(cache.mutex);
+    boost::lock_guard<boost::mutex> compaction_lock(cache.compaction_mutex);
+    boost::unique_lock<boost::mutex> lock(cache.mutex);
 
-    lru_entry_list lru_entries;
-    get_lru_entries(lru_entries, cache);
-    auto i = lru_entries.entries.begin(), end_i = lru_entries.entries.end();
-    while (i != end_i)
+    write_buffered_updates(cache);
+
+    std::vector<int64_t> ids;
+    {
+        statement_execution q(cache, cache.statements.get_all_entry_ids);
+        while (q.step())
+            ids.push_back(q.get_int64(0));
+    }
+    db_transaction t(cache);
+    for (auto const& id : ids)
     {
         try
         {
-            remove_entry(cache, i->id);
-            ++i;
+            remove_entry(cache, id);
         }
         catch (...)
         {
         }
     }
+    t.commit();
+
+    // All segments are dead space now, so get rid of them.
+    seal_active_segment(cache, cache.segment);
+    seal_active_segment(cache, cache.compaction_segment);
+    compact_segments(cache, lock);
 }
 
 bool entry_exists(disk_cache const& cache_ref, string const& key,
@@ -669,10 +1539,16 @@ int64_t initiate_insert(disk_cache const& cache_ref, string const& key)
     if (exists(cache, key, &id, 0, false))
         return id;
 
-    exec_sql(cache, "insert into entries(key, valid) values ('" +
-        escape_string(cache.key_prefix + key) + "', 0);");
+    {
+        statement_execution q(cache, cache.statements.insert_entry);
+        q.bind(1, cache.key_prefix + key);
+        if (q.try_run())
+            return sqlite3_last_insert_rowid(cache.db);
+    }
 
-    // Get the ID that was inserted.
+    // The insert violated the uniqueness constraint on the key, so another
+    // process must have inserted the same key since we checked, and we can
+    // just use that entry.
     if (!exists(cache, key, &id, 0, false))
     {
         // If the insert succceeded, we really shouldn't get here.
@@ -683,6 +1559,25 @@ int64_t initiate_insert(disk_cache const& cache_ref, string const& key)
     return id;
 }
 
+// Record a finished insert (whose data is already on disk).
+static void add_pending_insert(disk_cache_impl& cache, int64_t id,
+    pending_insert const& insert)
+{
+    cache.pending_inserts[id] = insert;
+
+    cache.bytes_inserted_since_last_sweep += insert.location.size;
+
+    // The sweep itself happens in the background, so this never makes the
+    // caller wait for it.
+    if (cache.bytes_inserted_since_last_sweep > bytes_between_sweeps)
+    {
+        cache.bytes_inserted_since_last_sweep = 0;
+        request_sweep(cache);
+    }
+    if (count_buffered_updates(cache) > max_buffered_updates)
+        write_buffered_updates(cache);
+}
+
 void finish_insert(disk_cache const& cache_ref, int64_t id, uint32_t crc32)
 {
     disk_cache_impl& cache = *cache_ref.impl;
@@ -690,17 +1585,102 @@ void finish_insert(disk_cache const& cache_ref, int64_t id, uint32_t crc32)
 
     record_activity(cache);
 
-    int64_t size = file_size(get_path_for_id(cache, id));
+    pending_insert insert;
+    insert.location.segment = 0;
+    insert.location.offset = 0;
+    insert.location.size = file_size(get_path_for_id(cache, id));
+    insert.crc32 = crc32;
+    add_pending_insert(cache, id, insert);
+}
+
+void finish_insert(disk_cache const& cache_ref, int64_t id,
+    void const* data, size_t size, uint32_t crc32)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
+
+    if (int64_t(size) >= max_packed_entry_size)
+    {
+        // Large entries get their own files. Writing them doesn't involve
+        // the cache's internal state, so it's done outside the lock.
+        file_path path = get_path_for_id(cache, id);
+        {
+            std::ofstream f;
+            open(f, path, std::ios::out | std::ios::binary | std::ios::trunc);
+            f.write(reinterpret_cast<char const*>(data), size);
+            if (!f)
+                throw file_error(path, "error writing disk cache entry");
+        }
+        finish_insert(cache_ref, id, crc32);
+        return;
+    }
+
+    boost::lock_guard<boost::mutex> lock(cache.mutex);
+
+    record_activity(cache);
+
+    pending_insert insert;
+    reserve_segment_space(cache, cache.segment, int64_t(size));
+    insert.location =
+        append_to_segment(cache, cache.segment, data, int64_t(size));
+    insert.crc32 = crc32;
+    add_pending_insert(cache, id, insert);
+}
+
+static entry_location
+get_valid_entry_location(disk_cache_impl& cache, int64_t id)
+{
+    entry_location location;
+    boost::lock_guard<boost::mutex> lock(cache.mutex);
+    record_activity(cache);
+    if (!get_entry_location(cache, id, &location))
+    {
+        throw exception(cache.dir.string() + ": " +
+            "no valid entry with ID " + to_string(id));
+    }
+    return location;
+}
+
+void read_entry(std::vector<uint8_t>* data, disk_cache const& cache_ref,
+    int64_t id)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
+
+    entry_location location = get_valid_entry_location(cache, id);
+
+    // The actual read is done outside the lock so that other threads can
+    // use the cache while this one waits on the disk.
+    if (location.segment != 0)
+    {
+        read_file_block(get_path_for_segment(cache, location.segment),
+            location.offset, location.size, data);
+    }
+    else
+    {
+        read_file_block(get_path_for_id(cache, id), 0, location.size, data);
+    }
+}
+
+blob map_entry(disk_cache const& cache_ref, int64_t id)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
 
-    exec_sql(cache, "update entries set valid=1,"
-        " size=" + boost::lexical_cast<string>(size) + ","
-        " crc32=" + boost::lexical_cast<string>(crc32) + ","
-        " last_accessed=datetime('now')"
-        " where id=" + boost::lexical_cast<string>(id) + ";");
+    entry_location location = get_valid_entry_location(cache, id);
 
-    cache.bytes_inserted_since_last_sweep += size;
-    if (cache.bytes_inserted_since_last_sweep > 0x40000000)
-        enforce_cache_size_limit(cache);
+    if (location.segment != 0)
+    {
+        // Packed entries are small, so there's little to gain by mapping
+        // them, and mapping a segment would keep it from being compacted.
+        auto data = std::make_shared<std::vector<uint8_t> >();
+        read_file_block(get_path_for_segment(cache, location.segment),
+            location.offset, location.size, data.get());
+        blob b;
+        b.size = data->size();
+        b.data = b.size != 0 ? &(*data)[0] : 0;
+        b.ownership = data;
+        return b;
+    }
+    else
+        return map_file(get_path_for_id(cache, id));
 }
 
 file_path get_path_for_id(disk_cache const& cache_ref, int64_t id)
@@ -719,12 +1699,61 @@ void record_usage(disk_cache& cache_ref, int64_t id)
     boost::lock_guard<boost::mutex> lock(cache.mutex);
 
     cache.usage_record_buffer.push_back(id);
+
+    if (count_buffered_updates(cache) > max_buffered_updates)
+    {
+        try
+        {
+            write_buffered_updates(cache);
+        }
+        catch (...)
+        {
+            // If the database is busy, just try again later.
+        }
+    }
+}
+
+void enable_key_descriptions(disk_cache& cache_ref, bool enabled)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
+    boost::lock_guard<boost::mutex> lock(cache.mutex);
+
+    cache.record_descriptions = enabled;
 }
 
-static void record_usage_to_db(disk_cache_impl const& cache, int64_t id)
+bool key_descriptions_enabled(disk_cache const& cache_ref)
 {
-    exec_sql(cache, "update entries set last_accessed=datetime('now')"
-        " where id=" + boost::lexical_cast<string>(id) + ";");
+    disk_cache_impl& cache = *cache_ref.impl;
+    boost::lock_guard<boost::mutex> lock(cache.mutex);
+
+    return cache.record_descriptions;
+}
+
+void record_key_description(disk_cache const& cache_ref, int64_t id,
+    string const& description)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
+    boost::lock_guard<boost::mutex> lock(cache.mutex);
+
+    if (!cache.record_descriptions)
+        return;
+
+    statement_execution q(cache, cache.statements.record_description);
+    q.bind(1, id);
+    q.bind(2, description);
+    q.run();
+}
+
+optional<string> get_key_description(disk_cache const& cache_ref, int64_t id)
+{
+    disk_cache_impl& cache = *cache_ref.impl;
+    boost::lock_guard<boost::mutex> lock(cache.mutex);
+
+    statement_execution q(cache, cache.statements.get_description);
+    q.bind(1, id);
+    if (!q.step())
+        return none;
+    return some(q.get_string(0));
 }
 
 void write_usage_records(disk_cache& cache_ref)
@@ -732,12 +1761,7 @@ void write_usage_records(disk_cache& cache_ref)
     disk_cache_impl& cache = *cache_ref.impl;
     boost::lock_guard<boost::mutex> lock(cache.mutex);
 
-    {
-        db_transaction t(cache);
-        for (auto const& record : cache.usage_record_buffer)
-            record_usage_to_db(cache, record);
-        cache.usage_record_buffer.clear();
-    }
+    write_buffered_updates(cache);
 }
 
 void do_idle_processing(disk_cache& cache_ref)
@@ -748,8 +1772,8 @@ void do_idle_processing(disk_cache& cache_ref)
     if ((boost::posix_time::microsec_clock::local_time() -
             cache.latest_activity).total_milliseconds() > 1000)
     {
-        write_usage_records(cache_ref);
+        write_buffered_updates(cache);
     }
 }
 
-}
\ No newline at end of file
+}
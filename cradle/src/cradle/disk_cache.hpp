@@ -12,6 +12,15 @@ namespace cradle {
 
 // The cache is implemented as a directory of files with an SQLite index
 // database file that aids in tracking usage information.
+// Large entries are stored in individual files, but small ones are packed
+// together into larger segment files to avoid the per-file overhead.
+// The index also keeps a running total of the size of the cache (maintained
+// by triggers), so checking the size limit doesn't require scanning it.
+// The index is kept in WAL mode so that processes reading from the cache
+// don't block the process that's writing to it. Each cache keeps its queries
+// compiled for the life of its connection, and updates that don't need to be
+// visible immediately (usage records and insert completions) are buffered and
+// written in batches.
 
 // Note that a disk cache will generate exceptions any time an operation fails.
 // Of course, since caching is by definition not essential to the correct
@@ -68,6 +77,19 @@ std::vector<disk_cache_entry> get_entry_list(disk_cache const& cache);
 // Remove an individual entry from the cache.
 void remove_entry(disk_cache& cache, int64_t id);
 
+// Evict the least recently used entries until the cache is within its size
+// limit and compact any segments that need it.
+// This is normally done automatically by a background thread, which is woken
+// up periodically as entries are inserted, but this does it immediately.
+// Either way, entries are evicted in small batches, so other threads can
+// continue to use the cache while it's happening.
+void enforce_cache_size_limit(disk_cache& cache);
+
+// Reclaim the space left behind in segment files by removed entries.
+// (This is done automatically when the cache enforces its size limit, but
+// only for segments that are no longer being written to.)
+void compact(disk_cache& cache);
+
 // Clear the cache of all data.
 void clear(disk_cache& cache);
 
@@ -82,13 +104,47 @@ bool entry_exists(disk_cache const& cache, string const& key, int64_t* id,
 // Then, once the entry is written to disk, you finish the insert.
 // (If an error occurs, it's OK to simply abandon the entry, as it will be
 // marked as invalid initially.)
+// Finished inserts are immediately visible to this cache, but they're only
+// written to the index along with the buffered usage records (see below), so
+// other processes may not see them until then.
 int64_t initiate_insert(disk_cache const& cache, string const& key);
 void finish_insert(disk_cache const& cache, int64_t id, uint32_t crc32);
 
+// Alternatively, if the entry's data is in memory, it can be passed directly
+// to finish_insert(), which takes care of writing it to disk. This is the
+// preferred method, since it allows small entries to be packed into segment
+// files.
+void finish_insert(disk_cache const& cache, int64_t id,
+    void const* data, size_t size, uint32_t crc32);
+
+// Read the data associated with a valid entry, regardless of how it's stored.
+void read_entry(std::vector<uint8_t>* data, disk_cache const& cache,
+    int64_t id);
+
+// Get the data associated with a valid entry as a blob.
+// Where possible, the blob references a memory mapping of the entry's file
+// rather than a copy of its contents.
+// Note that an entry can't be removed while it's mapped on Windows, so the
+// blob shouldn't be held longer than necessary.
+blob map_entry(disk_cache const& cache, int64_t id);
+
 // Given an ID within the cache, this computes the path of the file that would
-// store the data associated with that ID.
+// store the data associated with that ID (if it were stored in its own file).
 file_path get_path_for_id(disk_cache const& cache, int64_t id);
 
+// Since keys are usually digests of the information that identifies an
+// entry, they don't say much about what the entry actually is. For debugging
+// purposes, the cache can optionally record a description of each entry
+// alongside it. This is disabled by default.
+// When disabled, record_key_description() does nothing.
+void enable_key_descriptions(disk_cache& cache, bool enabled);
+bool key_descriptions_enabled(disk_cache const& cache);
+void record_key_description(disk_cache const& cache, int64_t id,
+    string const& description);
+
+// Get the description recorded for the given ID (if any).
+optional<string> get_key_description(disk_cache const& cache, int64_t id);
+
 // Record that an ID within the cache was just used.
 // When a lot of small objects are being read from the cache, the calls to
 // record_usage() can significantly slow down the loading process, as they
@@ -98,7 +154,7 @@ file_path get_path_for_id(disk_cache const& cache, int64_t id);
 void record_usage(disk_cache& cache, int64_t id);
 
 // If you know that the cache is idle, you can call this to force the cache to
-// write out its buffered usage records.
+// write out its buffered usage records (and finished inserts).
 // (This is automatically called when the cache is destructed.)
 void write_usage_records(disk_cache& cache);
 
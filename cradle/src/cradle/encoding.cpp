@@ -1,9 +1,17 @@
 #include <cradle/encoding.hpp>
 #include <boost/scoped_array.hpp>
+#include <cstring>
 #include <sstream>
 #include <cradle/math/common.hpp>
+#include <cradle/system.hpp>
 #include <iomanip>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+  #define CRADLE_BASE64_SIMD
+  #include <immintrin.h>
+#endif
+
 namespace cradle {
 
 size_t get_base64_encoded_length(size_t raw_length)
@@ -16,12 +24,300 @@ size_t get_base64_decoded_length(size_t encoded_length)
     return (encoded_length + 3) / 4 * 3;
 }
 
+// SIMD
+//
+// When the CPU supports it, the bulk of the data is encoded and decoded in
+// blocks with SSSE3 or AVX2 (using the techniques described by Wojciech Mula
+// and Daniel Lemire in "Faster Base64 Encoding and Decoding Using AVX2
+// Instructions"). The scalar code handles whatever's left, including any
+// padding and any invalid characters, so the results (and errors) are exactly
+// the same either way.
+//
+// This only works for character sets that start with the usual A-Z, a-z and
+// 0-9, which includes both of the standard sets. The last two digits can be
+// anything.
+
+#ifdef CRADLE_BASE64_SIMD
+
+static char const standard_base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+static bool
+has_standard_base64_digits(base64_character_set const& character_set)
+{
+    return std::memcmp(character_set.digits, standard_base64_digits, 62) == 0;
+}
+
+// Convert 6-bit values to their digits. The values are mapped to one of 14
+// ranges (A-Z, a-z, each individual digit from 0-9, and the last two digits),
+// and each range has its own offset from value to digit. shift_lut holds those
+// offsets.
+#define CRADLE_BASE64_SHIFT_LUT(character_set) \
+    char('a' - 26), char('0' - 52), char('0' - 52), char('0' - 52), \
+    char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), \
+    char('0' - 52), char('0' - 52), char('0' - 52), \
+    char(character_set.digits[62] - 62), char(character_set.digits[63] - 63), \
+    char('A'), 0, 0
+
+CRADLE_TARGET("ssse3")
+static void
+encode_base64_ssse3(char** dst, uint8_t const** src, size_t* src_size,
+    base64_character_set const& character_set)
+{
+    __m128i const shift_lut =
+        _mm_setr_epi8(CRADLE_BASE64_SHIFT_LUT(character_set));
+    // Each iteration reads 16 bytes but only encodes the first 12.
+    while (*src_size >= 16)
+    {
+        __m128i in =
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(*src));
+        // Arrange each group of three bytes so that its four 6-bit values
+        // can be shifted into separate bytes.
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i values = _mm_or_si128(
+            _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                _mm_set1_epi32(0x01000010)));
+        // Map each value to its range (0-13) and look up that range's
+        // offset.
+        __m128i ranges = _mm_or_si128(
+            _mm_subs_epu8(values, _mm_set1_epi8(51)),
+            _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values),
+                _mm_set1_epi8(13)));
+        __m128i digits =
+            _mm_add_epi8(values, _mm_shuffle_epi8(shift_lut, ranges));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(*dst), digits);
+        *src += 12;
+        *src_size -= 12;
+        *dst += 16;
+    }
+}
+
+CRADLE_TARGET("avx2")
+static void
+encode_base64_avx2(char** dst, uint8_t const** src, size_t* src_size,
+    base64_character_set const& character_set)
+{
+    __m256i const shift_lut = _mm256_broadcastsi128_si256(
+        _mm_setr_epi8(CRADLE_BASE64_SHIFT_LUT(character_set)));
+    // This is the same as the SSSE3 version, but with 12 bytes in each half.
+    while (*src_size >= 28)
+    {
+        __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<__m128i const*>(*src))),
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(*src + 12)),
+            1);
+        in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        __m256i values = _mm256_or_si256(
+            _mm256_mulhi_epu16(
+                _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                _mm256_set1_epi32(0x04000040)),
+            _mm256_mullo_epi16(
+                _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                _mm256_set1_epi32(0x01000010)));
+        __m256i ranges = _mm256_or_si256(
+            _mm256_subs_epu8(values, _mm256_set1_epi8(51)),
+            _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values),
+                _mm256_set1_epi8(13)));
+        __m256i digits =
+            _mm256_add_epi8(values, _mm256_shuffle_epi8(shift_lut, ranges));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(*dst), digits);
+        *src += 24;
+        *src_size -= 24;
+        *dst += 32;
+    }
+}
+
+// Convert digits back to 6-bit values. Each digit is classified by range,
+// and if any of them isn't a valid digit, the whole block is left to the
+// scalar code. (Bytes above 0x7f compare as negative, so they don't fall in
+// any of the ranges.) Each valid digit gets the offset for its range.
+// The packing of the resulting values into bytes is done with multiply-adds
+// that combine pairs of values and then pairs of pairs.
+
+CRADLE_TARGET("ssse3")
+static void
+decode_base64_ssse3(uint8_t** dst, char const** src, size_t* src_size,
+    base64_character_set const& character_set)
+{
+    char const digit62 = character_set.digits[62];
+    char const digit63 = character_set.digits[63];
+    // Each iteration writes 16 bytes but only 12 of them are decoded data,
+    // so it stops while the destination is still known to have room.
+    while (*src_size >= 24)
+    {
+        __m128i in =
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(*src));
+        __m128i upper = _mm_and_si128(
+            _mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+            _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+        __m128i lower = _mm_and_si128(
+            _mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+        __m128i numeral = _mm_and_si128(
+            _mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+        __m128i is62 = _mm_cmpeq_epi8(in, _mm_set1_epi8(digit62));
+        __m128i is63 = _mm_cmpeq_epi8(in, _mm_set1_epi8(digit63));
+        __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+            _mm_or_si128(numeral, _mm_or_si128(is62, is63)));
+        if (_mm_movemask_epi8(valid) != 0xffff)
+            break;
+        __m128i offsets = _mm_or_si128(
+            _mm_or_si128(
+                _mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+            _mm_or_si128(
+                _mm_and_si128(numeral, _mm_set1_epi8(52 - '0')),
+                _mm_or_si128(
+                    _mm_and_si128(is62, _mm_set1_epi8(char(62 - digit62))),
+                    _mm_and_si128(is63,
+                        _mm_set1_epi8(char(63 - digit63))))));
+        __m128i values = _mm_add_epi8(in, offsets);
+        __m128i packed = _mm_madd_epi16(
+            _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)),
+            _mm_set1_epi32(0x00011000));
+        packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(*dst), packed);
+        *src += 16;
+        *src_size -= 16;
+        *dst += 12;
+    }
+}
+
+CRADLE_TARGET("avx2")
+static void
+decode_base64_avx2(uint8_t** dst, char const** src, size_t* src_size,
+    base64_character_set const& character_set)
+{
+    char const digit62 = character_set.digits[62];
+    char const digit63 = character_set.digits[63];
+    // This is the same as the SSSE3 version, but the two halves of the
+    // packed output have to be brought together at the end.
+    while (*src_size >= 48)
+    {
+        __m256i in =
+            _mm256_loadu_si256(reinterpret_cast<__m256i const*>(*src));
+        __m256i upper = _mm256_andnot_si256(
+            _mm256_cmpgt_epi8(in, _mm256_set1_epi8('Z')),
+            _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)));
+        __m256i lower = _mm256_andnot_si256(
+            _mm256_cmpgt_epi8(in, _mm256_set1_epi8('z')),
+            _mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)));
+        __m256i numeral = _mm256_andnot_si256(
+            _mm256_cmpgt_epi8(in, _mm256_set1_epi8('9')),
+            _mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)));
+        __m256i is62 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(digit62));
+        __m256i is63 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(digit63));
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+            _mm256_or_si256(numeral, _mm256_or_si256(is62, is63)));
+        if (_mm256_movemask_epi8(valid) != -1)
+            break;
+        __m256i offsets = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+            _mm256_or_si256(
+                _mm256_and_si256(numeral, _mm256_set1_epi8(52 - '0')),
+                _mm256_or_si256(
+                    _mm256_and_si256(is62,
+                        _mm256_set1_epi8(char(62 - digit62))),
+                    _mm256_and_si256(is63,
+                        _mm256_set1_epi8(char(63 - digit63))))));
+        __m256i values = _mm256_add_epi8(in, offsets);
+        __m256i packed = _mm256_madd_epi16(
+            _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)),
+            _mm256_set1_epi32(0x00011000));
+        packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        packed = _mm256_permutevar8x32_epi32(packed,
+            _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(*dst), packed);
+        *src += 32;
+        *src_size -= 32;
+        *dst += 24;
+    }
+}
+
+#endif
+
+// METHOD SELECTION
+
+bool is_base64_method_supported(base64_method method)
+{
+    switch (method)
+    {
+     case base64_method::SCALAR:
+        return true;
+     case base64_method::SSSE3:
+      #ifdef CRADLE_BASE64_SIMD
+        return get_cpu_features().ssse3;
+      #else
+        return false;
+      #endif
+     case base64_method::AVX2:
+      #ifdef CRADLE_BASE64_SIMD
+        return get_cpu_features().avx2;
+      #else
+        return false;
+      #endif
+    }
+    return false;
+}
+
+base64_method get_preferred_base64_method()
+{
+    static base64_method const preferred =
+        is_base64_method_supported(base64_method::AVX2) ?
+            base64_method::AVX2 :
+        is_base64_method_supported(base64_method::SSSE3) ?
+            base64_method::SSSE3 :
+            base64_method::SCALAR;
+    return preferred;
+}
+
+static void check_base64_method_supported(base64_method method)
+{
+    if (!is_base64_method_supported(method))
+        throw exception("base64 method not supported on this CPU");
+}
+
+// ENCODING AND DECODING
+
 void base64_encode(
     char* dst, size_t* dst_size, uint8_t const* src, size_t src_size,
     base64_character_set const& character_set)
 {
-    uint8_t const* src_end = src + src_size;
+    base64_encode(get_preferred_base64_method(), dst, dst_size, src,
+        src_size, character_set);
+}
+
+void base64_encode(base64_method method,
+    char* dst, size_t* dst_size, uint8_t const* src, size_t src_size,
+    base64_character_set const& character_set)
+{
+    check_base64_method_supported(method);
     char const* dst_start = dst;
+  #ifdef CRADLE_BASE64_SIMD
+    if (method != base64_method::SCALAR &&
+        has_standard_base64_digits(character_set))
+    {
+        // The AVX2 loop leaves up to 27 bytes, which SSSE3 can still chip
+        // away at.
+        if (method == base64_method::AVX2)
+            encode_base64_avx2(&dst, &src, &src_size, character_set);
+        encode_base64_ssse3(&dst, &src, &src_size, character_set);
+    }
+  #endif
+    // The scalar code handles whatever's left.
+    uint8_t const* src_end = src + src_size;
     while (1)
     {
         if (src == src_end)
@@ -66,18 +362,85 @@ string base64_encode(uint8_t const* src, size_t src_size,
     return string(dst.get());
 }
 
-void base64_decode(
-    uint8_t* dst, size_t* dst_size, char const* src, size_t src_size,
+// reverse_mapping[c] is the 6-bit value of the digit c, or 0xff if c isn't a
+// digit.
+struct base64_reverse_mapping
+{
+    uint8_t values[0x100];
+};
+
+static void
+initialize_reverse_mapping(base64_reverse_mapping* mapping,
     base64_character_set const& character_set)
 {
-    uint8_t reverse_mapping[0x100];
     for (int i = 0; i != 0x100; ++i)
-        reverse_mapping[i] = 0xff;
+        mapping->values[i] = 0xff;
     for (uint8_t i = 0; i != 64; ++i)
-        reverse_mapping[uint8_t(character_set.digits[i])] = i;
+        mapping->values[uint8_t(character_set.digits[i])] = i;
+}
 
-    char const* src_end = src + src_size;
+// The mappings for the standard character sets are only built once, since
+// short strings (like cache keys) would otherwise spend most of their time
+// building them. For anything else, the mapping is built in *scratch.
+static base64_reverse_mapping const&
+get_reverse_mapping(base64_reverse_mapping* scratch,
+    base64_character_set const& character_set)
+{
+    if (std::strcmp(character_set.digits,
+            get_mime_base64_character_set().digits) == 0)
+    {
+        static base64_reverse_mapping const mime_mapping = [] {
+            base64_reverse_mapping mapping;
+            initialize_reverse_mapping(&mapping,
+                get_mime_base64_character_set());
+            return mapping;
+        }();
+        return mime_mapping;
+    }
+    if (std::strcmp(character_set.digits,
+            get_url_friendly_base64_character_set().digits) == 0)
+    {
+        static base64_reverse_mapping const url_friendly_mapping = [] {
+            base64_reverse_mapping mapping;
+            initialize_reverse_mapping(&mapping,
+                get_url_friendly_base64_character_set());
+            return mapping;
+        }();
+        return url_friendly_mapping;
+    }
+    initialize_reverse_mapping(scratch, character_set);
+    return *scratch;
+}
+
+void base64_decode(
+    uint8_t* dst, size_t* dst_size, char const* src, size_t src_size,
+    base64_character_set const& character_set)
+{
+    base64_decode(get_preferred_base64_method(), dst, dst_size, src,
+        src_size, character_set);
+}
+
+void base64_decode(base64_method method,
+    uint8_t* dst, size_t* dst_size, char const* src, size_t src_size,
+    base64_character_set const& character_set)
+{
+    check_base64_method_supported(method);
     uint8_t const* dst_start = dst;
+  #ifdef CRADLE_BASE64_SIMD
+    if (method != base64_method::SCALAR &&
+        has_standard_base64_digits(character_set))
+    {
+        if (method == base64_method::AVX2)
+            decode_base64_avx2(&dst, &src, &src_size, character_set);
+        decode_base64_ssse3(&dst, &src, &src_size, character_set);
+    }
+  #endif
+
+    base64_reverse_mapping scratch;
+    uint8_t const* reverse_mapping =
+        get_reverse_mapping(&scratch, character_set).values;
+
+    char const* src_end = src + src_size;
 
     while (1)
     {
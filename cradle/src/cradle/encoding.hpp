@@ -70,6 +70,37 @@ void base64_decode(
     uint8_t* dst, size_t* dst_size, char const* src, size_t src_size,
     base64_character_set const& character_set);
 
+// The methods that are available for base64 encoding and decoding. They all
+// produce the same results (and the same errors). The functions above select
+// one based on what the CPU supports, but they can also be invoked
+// individually (for testing and benchmarking). The SIMD methods only apply to
+// character sets whose first 62 digits are A-Z, a-z and 0-9 (which includes
+// both of the sets above). Other sets always use the scalar code.
+enum class base64_method
+{
+    // one group of three bytes at a time (supported everywhere)
+    SCALAR,
+    // 12 bytes at a time (x86 with SSSE3)
+    SSSE3,
+    // 24 bytes at a time (x86 with AVX2)
+    AVX2
+};
+
+// Is the given method supported on this CPU?
+bool is_base64_method_supported(base64_method method);
+
+// Get the method that the above functions use.
+base64_method get_preferred_base64_method();
+
+// Encode/decode with a specific method.
+// The method must be supported.
+void base64_encode(base64_method method,
+    char* dst, size_t* dst_size, uint8_t const* src, size_t src_size,
+    base64_character_set const& character_set);
+void base64_decode(base64_method method,
+    uint8_t* dst, size_t* dst_size, char const* src, size_t src_size,
+    base64_character_set const& character_set);
+
 // BASE-36
 
 // The following provides base-36 encoding and decoding of 64-bit integers.
@@ -133,6 +133,35 @@ void from_value(clipper_polyset* x, value const& v)
     to_clipper(x, p);
 }
 
+void write_binary(binary_writer& w, clipper_poly const& x)
+{
+    write_binary(w, from_clipper(x));
+}
+void read_binary(binary_reader& r, clipper_poly* x)
+{
+    polygon2 p;
+    read_binary(r, &p);
+    to_clipper(x, p);
+}
+uint64_t get_binary_schema_hash(clipper_poly const& x)
+{
+    return get_binary_schema_hash(polygon2());
+}
+void write_binary(binary_writer& w, clipper_polyset const& x)
+{
+    write_binary(w, from_clipper(x));
+}
+void read_binary(binary_reader& r, clipper_polyset* x)
+{
+    polyset p;
+    read_binary(r, &p);
+    to_clipper(x, p);
+}
+uint64_t get_binary_schema_hash(clipper_polyset const& x)
+{
+    return get_binary_schema_hash(polyset());
+}
+
 double static
 get_area(clipper_polygon2 const& poly)
 {
@@ -63,6 +63,14 @@ void from_value(clipper_poly* x, value const& v);
 void to_value(value* v, clipper_polyset const& x);
 void from_value(clipper_polyset* x, value const& v);
 
+// Binary encodings go through the CRADLE equivalents as well.
+void write_binary(binary_writer& w, clipper_poly const& x);
+void read_binary(binary_reader& r, clipper_poly* x);
+uint64_t get_binary_schema_hash(clipper_poly const& x);
+void write_binary(binary_writer& w, clipper_polyset const& x);
+void read_binary(binary_reader& r, clipper_polyset* x);
+uint64_t get_binary_schema_hash(clipper_polyset const& x);
+
 // hash function
 } namespace std {
     template<>
@@ -17,6 +17,7 @@ struct shared_pointer
 {
     ownership_holder ownership;
     Pixel const* view;
+    buffer_hash_cache hash_cache;
 };
 
 template<unsigned N, class Pixel>
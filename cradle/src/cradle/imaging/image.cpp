@@ -43,7 +43,10 @@ namespace cradle {
     } namespace std { \
     size_t hash<cradle::image<N,T,cradle::shared> >:: \
         operator()(cradle::image<N,T,cradle::shared> const& x) const \
-    { return alia::invoke_hash(as_variant(x)); } \
+    { \
+        return cradle::hash_variant_image(as_variant(x), \
+            x.pixels.hash_cache); \
+    } \
     } namespace cradle {
 
 #define CRADLE_DEFINE_REGULAR_IMAGE_INTERFACE_FOR_TYPE(T) \
@@ -8,6 +8,7 @@
 #include <vector>
 #include <algorithm>
 #include <cradle/imaging/utilities.hpp>
+#include <cradle/simple_concurrency.hpp>
 
 namespace cradle {
 
@@ -68,9 +69,12 @@ namespace impl {
         return sorted_slices;
     }
 
+    // If check_in supplies a parallel executor, the merged slices are
+    // computed in parallel.
     template<unsigned N, class T, class SP>
     image<N + 1,T,shared>
     merge_sorted_slices(
+        check_in_interface& check_in,
         std::vector<image_slice<N,T,SP> > const& slices,
         regular_grid<1,double> const& interpolation_grid)
     {
@@ -111,55 +115,74 @@ namespace impl {
             uniform_vector<N,double>(0), axis,
             interpolation_grid.spacing[0]);
 
-        // While interpolating, prev_real_slice is the real slice immediately
-        // before our interpolation position.  next_real_slice is the slice
-        // immediately after.
-        typename std::vector<image_slice<N,T,SP> >::const_iterator
-            prev_real_slice = slices.begin();
-        typename std::vector<image_slice<N,T,SP> >::const_iterator
-            next_real_slice = slices.begin();
-        double interpolated_position = interpolation_grid.p0[0];
-
-        // Interpolate.
-        for (unsigned i = 0; i < interpolation_grid.n_points[0]; ++i)
+        // First, find the real slices on either side of each interpolation
+        // position. While interpolating, prev_real_slice is the real slice
+        // immediately before our interpolation position.  next_real_slice is
+        // the slice immediately after.
+        unsigned n_merged_slices = interpolation_grid.n_points[0];
+        std::vector<size_t> prev_real_slices(n_merged_slices);
+        std::vector<size_t> next_real_slices(n_merged_slices);
+        std::vector<double> interpolated_positions(n_merged_slices);
         {
-            // Get a view of the merged slice.
-            image_slice<N,T,view> merged_slice =
-                sliced_view(cast_storage_type<view>(tmp), axis, i);
-
-            // Update the real slice pointers if necessary.
-            while (interpolated_position > next_real_slice->position)
+            size_t prev_real_slice = 0;
+            size_t next_real_slice = 0;
+            double interpolated_position = interpolation_grid.p0[0];
+            for (unsigned i = 0; i < n_merged_slices; ++i)
             {
-                prev_real_slice = next_real_slice;
-                ++next_real_slice;
-                if (next_real_slice == slices.end())
+                // Update the real slice indices if necessary.
+                while (interpolated_position >
+                    slices[next_real_slice].position)
                 {
-                    next_real_slice = prev_real_slice;
-                    break;
+                    prev_real_slice = next_real_slice;
+                    ++next_real_slice;
+                    if (next_real_slice == slices.size())
+                    {
+                        next_real_slice = prev_real_slice;
+                        break;
+                    }
                 }
-            }
+                prev_real_slices[i] = prev_real_slice;
+                next_real_slices[i] = next_real_slice;
+                interpolated_positions[i] = interpolated_position;
 
-            // This is true before the first real slice and after the last one.
-            if (next_real_slice == prev_real_slice)
-            {
-                copy_pixels(merged_slice.content, next_real_slice->content);
+                // Increment the interpolated position.
+                interpolated_position += interpolation_grid.spacing[0];
             }
-            // Otherwise, we are in between two real slices, so interpolate.
-            else
+        }
+
+        // Interpolate. Each merged slice is independent of the others.
+        parallel_for(check_in, 0, n_merged_slices,
+            [&](size_t i)
             {
-                double fraction =
-                    (next_real_slice->position - interpolated_position) /
-                    (next_real_slice->position - prev_real_slice->position);
-                // Don't extrapolate!
-                fraction = clamp(fraction, 0., 1.);
-                raw_blend_images(merged_slice.content,
-                    prev_real_slice->content, next_real_slice->content,
-                    fraction);
-            }
+                // Get a view of the merged slice.
+                image_slice<N,T,view> merged_slice =
+                    sliced_view(cast_storage_type<view>(tmp), axis,
+                        unsigned(i));
 
-            // Increment the interpolated position.
-            interpolated_position += interpolation_grid.spacing[0];
-        }
+                auto const& prev_real_slice = slices[prev_real_slices[i]];
+                auto const& next_real_slice = slices[next_real_slices[i]];
+
+                // This is true before the first real slice and after the
+                // last one.
+                if (next_real_slices[i] == prev_real_slices[i])
+                {
+                    copy_pixels(merged_slice.content, next_real_slice.content);
+                }
+                // Otherwise, we are in between two real slices, so
+                // interpolate.
+                else
+                {
+                    double fraction =
+                        (next_real_slice.position -
+                            interpolated_positions[i]) /
+                        (next_real_slice.position - prev_real_slice.position);
+                    // Don't extrapolate!
+                    fraction = clamp(fraction, 0., 1.);
+                    raw_blend_images(merged_slice.content,
+                        prev_real_slice.content, next_real_slice.content,
+                        fraction);
+                }
+            });
 
         return share(tmp);
     }
@@ -188,7 +211,8 @@ merge_slices(
 
         progress_reporter(0.8f);
 
-    return impl::merge_sorted_slices(sorted_slices, interpolation_grid);
+    return impl::merge_sorted_slices(check_in, sorted_slices,
+        interpolation_grid);
 }
 
 template<unsigned N, class T, class SP>
@@ -201,7 +225,9 @@ merge_slices(
 
     auto sorted_slices = impl::sort_slices(slices);
 
-    return impl::merge_sorted_slices(sorted_slices, interpolation_grid);
+    null_check_in check_in;
+    return impl::merge_sorted_slices(check_in, sorted_slices,
+        interpolation_grid);
 }
 
 namespace impl {
@@ -210,6 +236,7 @@ namespace impl {
     struct merge_images_fn
     {
         image<N + 1,variant,shared> merged_image;
+        check_in_interface* check_in;
         std::vector<image_slice<N,variant,SP> > const* slices;
         template<class Pixel>
         void operator()(Pixel)
@@ -224,7 +251,9 @@ namespace impl {
                     cast_image<image<N,Pixel,const_view> >(src.content);
                 copy_slice_properties(dst, src);
             }
-            merged_image = as_variant(merge_slices(views));
+            null_progress_reporter reporter;
+            merged_image =
+                as_variant(merge_slices(*check_in, reporter, views));
         }
     };
 }
@@ -246,6 +275,7 @@ merge_slices(
     progress_reporter(0.5f);
 
     impl::merge_images_fn<N,SP> fn;
+    fn.check_in = &check_in;
     fn.slices = &slices;
     dispatch_gray_variant(slices.front().content.pixels.type_info, fn);
     return fn.merged_image;
@@ -222,6 +222,7 @@ void variant_from_value(image<N,variant,shared>* x, value const& v)
     check_array_size(expected_size, b.size);
     x->pixels.ownership = b.ownership;
     x->pixels.view = b.data;
+    x->pixels.hash_cache = b.hash_cache;
 }
 
 template<unsigned N>
@@ -238,6 +239,7 @@ void variant_to_value(value* v, image<N,variant,shared> const& y)
     blob b;
     b.ownership = x.pixels.ownership;
     b.data = x.pixels.view;
+    b.hash_cache = x.pixels.hash_cache;
     b.size =
         product(x.size) * get_channel_size(x.pixels.type_info.type) *
         get_channel_count(x.pixels.type_info.format);
@@ -265,6 +267,7 @@ void read_variant_fields_from_immutable_map(
     check_array_size(expected_size, b.size);
     x->pixels.ownership = b.ownership;
     x->pixels.view = b.data;
+    x->pixels.hash_cache = b.hash_cache;
 }
 
 template<unsigned N>
@@ -306,12 +309,24 @@ get_variant_type_info(image<N,variant,shared> const& x)
         cradle::any(cradle::raw_structure_info(name, description, fields)));
 }
 
+// Images are hashed by the contents of their (contiguous) pixel buffers,
+// along with their format and size. The hash of the pixels is cached in the
+// given cache.
 template<unsigned N>
 size_t
-hash_variant_image(image<N,variant,shared> const& x)
+compute_variant_image_hash(image<N,variant,shared> const& x,
+    buffer_hash_cache const& cache)
 {
-    // TODO: hash for real?
-    return 0;
+    image<N,variant,shared> contiguous = get_contiguous_version(x);
+    size_t h = get_buffer_hash(cache, contiguous.pixels.view,
+        product(contiguous.size) *
+        get_channel_size(contiguous.pixels.type_info.type) *
+        get_channel_count(contiguous.pixels.type_info.format));
+    h = alia::combine_hashes(h, size_t(x.pixels.type_info.format));
+    h = alia::combine_hashes(h, size_t(x.pixels.type_info.type));
+    for (unsigned i = 0; i != N; ++i)
+        h = alia::combine_hashes(h, size_t(x.size[i]));
+    return h;
 }
 
 #define CRADLE_DEFINE_REGULAR_IMAGE_INTERFACE(T) \
@@ -334,9 +349,11 @@ hash_variant_image(image<N,variant,shared> const& x)
     { value v; variant_to_value(&v, x); return s << v; } \
     raw_type_info get_proper_type_info(T const& x) \
     { return get_variant_type_info(x); } \
+    size_t hash_variant_image(T const& x, buffer_hash_cache const& cache) \
+    { return compute_variant_image_hash(x, cache); } \
     } namespace std { \
     size_t hash<T>::operator()(T const& x) const \
-    { return cradle::hash_variant_image(x); } \
+    { return cradle::hash_variant_image(x, x.pixels.hash_cache); } \
     } namespace cradle {
 
 CRADLE_DEFINE_REGULAR_IMAGE_INTERFACE(cradle::image1)
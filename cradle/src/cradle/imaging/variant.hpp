@@ -517,6 +517,7 @@ struct variant_shared_pointer
     ownership_holder ownership;
     void const* view;
     variant_type_info type_info;
+    buffer_hash_cache hash_cache;
 };
 static inline bool operator==(variant_shared_pointer const& a,
     variant_shared_pointer const& b)
@@ -539,6 +540,7 @@ static inline void swap(variant_shared_pointer& a, variant_shared_pointer& b)
     swap(a.ownership, b.ownership);
     swap(a.view, b.view);
     swap(a.type_info, b.type_info);
+    swap(a.hash_cache.cached, b.hash_cache.cached);
 }
 template<class Pixel>
 void cast_pointer(variant_shared_pointer& dst,
@@ -546,6 +548,7 @@ void cast_pointer(variant_shared_pointer& dst,
 {
     dst.ownership = src.ownership;
     dst.view = src.view;
+    dst.hash_cache = src.hash_cache;
     set_type_info<Pixel>(dst.type_info);
 }
 template<class Pixel>
@@ -555,6 +558,7 @@ void cast_pointer(shared_pointer<Pixel>& dst,
     match_type_info<Pixel>(src.type_info);
     dst.ownership = src.ownership;
     dst.view = reinterpret_cast<Pixel const*>(src.view);
+    dst.hash_cache = src.hash_cache;
 }
 static inline void cast_pointer(variant_const_view_pointer& dst,
     variant_shared_pointer const& src)
@@ -620,6 +624,12 @@ CRADLE_DECLARE_REGULAR_IMAGE_INTERFACE(1,cradle::variant)
 CRADLE_DECLARE_REGULAR_IMAGE_INTERFACE(2,cradle::variant)
 CRADLE_DECLARE_REGULAR_IMAGE_INTERFACE(3,cradle::variant)
 
+// Get the hash of a variant image, using the given cache for the hash of its
+// pixels. (Typed images use this to hash themselves with their own caches.)
+size_t hash_variant_image(image1 const& x, buffer_hash_cache const& cache);
+size_t hash_variant_image(image2 const& x, buffer_hash_cache const& cache);
+size_t hash_variant_image(image3 const& x, buffer_hash_cache const& cache);
+
 // BOXING / UNBOXING
 
 // Gray images have an 'unboxed' form, which stores the pixel array as a
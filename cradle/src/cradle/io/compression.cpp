@@ -1,9 +1,17 @@
 #include <cradle/io/compression.hpp>
 #include <cradle/io/file.hpp>
+#include <cradle/simple_concurrency.hpp>
+#include <boost/numeric/conversion/cast.hpp>
+#include <boost/thread/thread.hpp>
 #include <zlib.h>
+#include <lz4.h>
+#include <zstd.h>
+#include <cstring>
 
 #ifdef _WIN32
     #pragma comment (lib, "zlib.lib")
+    #pragma comment (lib, "lz4.lib")
+    #pragma comment (lib, "zstd.lib")
 #endif
 
 namespace cradle {
@@ -266,6 +274,1042 @@ void compress(c_file& dst, void const* src, std::size_t src_size)
     deflateEnd(&strm);
 }
 
+// LZ4's block API works with int sizes, so data is compressed in blocks of
+// (at most) block_size bytes. Each compressed block is preceded by its
+// compressed size (as a 32-bit integer in native byte order).
+
+void lz4_compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
+    void const* src, std::size_t src_size)
+{
+    std::size_t n_blocks = (src_size + block_size - 1) / block_size;
+    std::size_t max_compressed_size =
+        n_blocks * (4 + LZ4_compressBound(int(block_size)));
+    dst->reset(new uint8_t[max_compressed_size]);
+
+    uint8_t* p = dst->get();
+    uint8_t const* s = reinterpret_cast<uint8_t const*>(src);
+    std::size_t remaining_src_size = src_size;
+    while (remaining_src_size != 0)
+    {
+        int size = int((std::min)(remaining_src_size, block_size));
+        int compressed_size = LZ4_compress_default(
+            reinterpret_cast<char const*>(s), reinterpret_cast<char*>(p + 4),
+            size, LZ4_compressBound(size));
+        if (compressed_size <= 0)
+            throw compression_error("LZ4 compression failed");
+        uint32_t recorded_size = uint32_t(compressed_size);
+        std::memcpy(p, &recorded_size, 4);
+        p += 4 + compressed_size;
+        s += size;
+        remaining_src_size -= size;
+    }
+    *dst_size = p - dst->get();
+}
+void lz4_decompress(void* dst, std::size_t dst_size,
+    void const* src, std::size_t src_size)
+{
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    uint8_t const* s = reinterpret_cast<uint8_t const*>(src);
+    std::size_t remaining_dst_size = dst_size;
+    std::size_t remaining_src_size = src_size;
+    while (remaining_dst_size != 0)
+    {
+        uint32_t compressed_size;
+        if (remaining_src_size < 4)
+        {
+            throw decompression_error(
+                "compressed data is corrupt; data ends unexpectedly");
+        }
+        std::memcpy(&compressed_size, s, 4);
+        s += 4;
+        remaining_src_size -= 4;
+        if (compressed_size > remaining_src_size)
+        {
+            throw decompression_error(
+                "compressed data is corrupt; data ends unexpectedly");
+        }
+        int size = int((std::min)(remaining_dst_size, block_size));
+        if (LZ4_decompress_safe(reinterpret_cast<char const*>(s),
+                reinterpret_cast<char*>(d), int(compressed_size), size) !=
+            size)
+        {
+            throw decompression_error("compressed data is corrupt");
+        }
+        s += compressed_size;
+        remaining_src_size -= compressed_size;
+        d += size;
+        remaining_dst_size -= size;
+    }
+    if (remaining_src_size != 0)
+    {
+        throw decompression_error(
+            "compressed data is corrupt; excess data at end");
+    }
+}
+
+void zstd_compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
+    void const* src, std::size_t src_size, int level)
+{
+    std::size_t max_compressed_size = ZSTD_compressBound(src_size);
+    dst->reset(new uint8_t[max_compressed_size]);
+    std::size_t rc = ZSTD_compress(dst->get(), max_compressed_size,
+        src, src_size, level);
+    if (ZSTD_isError(rc))
+    {
+        throw compression_error(
+            string("zstd error: ") + ZSTD_getErrorName(rc));
+    }
+    *dst_size = rc;
+}
+void zstd_decompress(void* dst, std::size_t dst_size,
+    void const* src, std::size_t src_size)
+{
+    std::size_t rc = ZSTD_decompress(dst, dst_size, src, src_size);
+    if (ZSTD_isError(rc))
+    {
+        throw decompression_error(
+            string("compressed data is corrupt; zstd error: ") +
+            ZSTD_getErrorName(rc));
+    }
+    if (rc != dst_size)
+    {
+        throw decompression_error(
+            "decompressed data is smaller than expected");
+    }
+}
+
+// STREAMING
+
+void byte_vector_sink::write(void const* data, std::size_t size)
+{
+    uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+    buffer->insert(buffer->end(), p, p + size);
+}
+
+std::size_t memory_source::read(void* dst, std::size_t dst_size)
+{
+    std::size_t n = (std::min)(dst_size, size);
+    std::memcpy(dst, data, n);
+    data += n;
+    size -= n;
+    return n;
+}
+
+void c_file_sink::write(void const* data, std::size_t size)
+{
+    file->write(data, size);
+}
+
+std::size_t c_file_source::read(void* data, std::size_t size)
+{
+    std::size_t n = fread(data, 1, size, *file);
+    if (n != size && ferror(*file))
+        file->throw_error("fread failed");
+    return n;
+}
+
+// Read exactly 'size' bytes from a source.
+static void read_exactly(byte_source& src, void* data, std::size_t size)
+{
+    uint8_t* p = reinterpret_cast<uint8_t*>(data);
+    while (size != 0)
+    {
+        std::size_t n = src.read(p, size);
+        if (n == 0)
+        {
+            throw decompression_error(
+                "compressed data is corrupt; data ends unexpectedly");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+// Check that a source has nothing left in it.
+static void check_source_exhausted(byte_source& src)
+{
+    uint8_t extra;
+    if (src.read(&extra, 1) != 0)
+    {
+        throw decompression_error(
+            "compressed data is corrupt; excess data at end");
+    }
+}
+
+struct zlib_stream_compressor : stream_compressor
+{
+    zlib_stream_compressor(byte_sink& dst)
+      : dst_(&dst), out_buffer_(new uint8_t[buffer_size])
+    {
+        strm_.zalloc = Z_NULL;
+        strm_.zfree = Z_NULL;
+        strm_.opaque = Z_NULL;
+        int rc = deflateInit(&strm_, Z_DEFAULT_COMPRESSION);
+        if (rc != Z_OK)
+            throw zlib_error(rc);
+    }
+    ~zlib_stream_compressor()
+    { deflateEnd(&strm_); }
+
+    void write(void const* data, std::size_t size)
+    {
+        uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+        while (size != 0)
+        {
+            strm_.avail_in = uInt((std::min)(size, block_size));
+            strm_.next_in = (Bytef*)(p);
+            p += strm_.avail_in;
+            size -= strm_.avail_in;
+            deflate_input(Z_NO_FLUSH);
+        }
+    }
+
+    void finish()
+    {
+        strm_.avail_in = 0;
+        deflate_input(Z_FINISH);
+    }
+
+ private:
+    // Run deflate until it's consumed all its input (or, if flush is
+    // Z_FINISH, until the stream is complete).
+    void deflate_input(int flush)
+    {
+        int rc;
+        do
+        {
+            strm_.avail_out = buffer_size;
+            strm_.next_out = out_buffer_.get();
+            rc = deflate(&strm_, flush);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+                throw zlib_error(rc);
+            std::size_t size_written = buffer_size - strm_.avail_out;
+            if (size_written != 0)
+                dst_->write(out_buffer_.get(), size_written);
+        }
+        while (flush == Z_FINISH ? rc != Z_STREAM_END : strm_.avail_out == 0);
+    }
+
+    z_stream strm_;
+    byte_sink* dst_;
+    boost::scoped_array<uint8_t> out_buffer_;
+};
+
+alia__shared_ptr<stream_compressor>
+create_zlib_compressor(byte_sink& dst)
+{
+    return alia__shared_ptr<stream_compressor>(
+        new zlib_stream_compressor(dst));
+}
+
+struct zlib_stream_decompressor : stream_decompressor
+{
+    zlib_stream_decompressor(byte_source& src)
+      : src_(&src), in_buffer_(new uint8_t[buffer_size]), ended_(false)
+    {
+        strm_.zalloc = Z_NULL;
+        strm_.zfree = Z_NULL;
+        strm_.opaque = Z_NULL;
+        strm_.avail_in = 0;
+        strm_.next_in = Z_NULL;
+        int rc = inflateInit(&strm_);
+        if (rc != Z_OK)
+            throw zlib_error(rc);
+    }
+    ~zlib_stream_decompressor()
+    { inflateEnd(&strm_); }
+
+    void read(void* dst, std::size_t size)
+    {
+        uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+        while (size != 0)
+        {
+            if (ended_)
+            {
+                throw decompression_error(
+                    "decompressed data is smaller than expected");
+            }
+            uInt chunk_size = uInt((std::min)(size, block_size));
+            strm_.avail_out = chunk_size;
+            strm_.next_out = d;
+            inflate_some();
+            std::size_t produced = chunk_size - strm_.avail_out;
+            d += produced;
+            size -= produced;
+        }
+    }
+
+    void finish()
+    {
+        // The stream may not have seen its own end yet, so drive it there,
+        // checking that it doesn't produce any more data along the way.
+        while (!ended_)
+        {
+            uint8_t extra;
+            strm_.avail_out = 1;
+            strm_.next_out = &extra;
+            inflate_some();
+            if (strm_.avail_out == 0)
+            {
+                throw decompression_error(
+                    "decompressed data is larger than expected");
+            }
+        }
+        if (strm_.avail_in != 0)
+        {
+            throw decompression_error(
+                "compressed data is corrupt; excess data at end");
+        }
+        check_source_exhausted(*src_);
+    }
+
+ private:
+    void inflate_some()
+    {
+        if (strm_.avail_in == 0)
+        {
+            strm_.avail_in = uInt(src_->read(in_buffer_.get(), buffer_size));
+            strm_.next_in = in_buffer_.get();
+            if (strm_.avail_in == 0)
+            {
+                throw decompression_error(
+                    "compressed data is corrupt; data ends unexpectedly");
+            }
+        }
+        int rc = inflate(&strm_, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END)
+            ended_ = true;
+        else if (rc != Z_OK)
+            throw zlib_error(rc);
+    }
+
+    z_stream strm_;
+    byte_source* src_;
+    boost::scoped_array<uint8_t> in_buffer_;
+    bool ended_;
+};
+
+alia__shared_ptr<stream_decompressor>
+create_zlib_decompressor(byte_source& src)
+{
+    return alia__shared_ptr<stream_decompressor>(
+        new zlib_stream_decompressor(src));
+}
+
+// The LZ4 streams buffer up to a full block at a time, so they produce the
+// same block structure as lz4_compress().
+
+struct lz4_stream_compressor : stream_compressor
+{
+    lz4_stream_compressor(byte_sink& dst) : dst_(&dst) {}
+
+    void write(void const* data, std::size_t size)
+    {
+        uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+        while (size != 0)
+        {
+            if (block_.size() == block_size)
+                write_block();
+            std::size_t n = (std::min)(size, block_size - block_.size());
+            block_.insert(block_.end(), p, p + n);
+            p += n;
+            size -= n;
+        }
+    }
+
+    void finish()
+    {
+        if (!block_.empty())
+            write_block();
+    }
+
+ private:
+    void write_block()
+    {
+        int size = int(block_.size());
+        compressed_.resize(4 + LZ4_compressBound(size));
+        int compressed_size = LZ4_compress_default(
+            reinterpret_cast<char const*>(&block_[0]),
+            reinterpret_cast<char*>(&compressed_[4]),
+            size, LZ4_compressBound(size));
+        if (compressed_size <= 0)
+            throw compression_error("LZ4 compression failed");
+        uint32_t recorded_size = uint32_t(compressed_size);
+        std::memcpy(&compressed_[0], &recorded_size, 4);
+        dst_->write(&compressed_[0], 4 + compressed_size);
+        block_.clear();
+    }
+
+    byte_sink* dst_;
+    std::vector<uint8_t> block_, compressed_;
+};
+
+alia__shared_ptr<stream_compressor>
+create_lz4_compressor(byte_sink& dst)
+{
+    return alia__shared_ptr<stream_compressor>(new lz4_stream_compressor(dst));
+}
+
+struct lz4_stream_decompressor : stream_decompressor
+{
+    lz4_stream_decompressor(byte_source& src)
+      : src_(&src), block_(new uint8_t[block_size]), block_pos_(0),
+        block_end_(0)
+    {}
+
+    void read(void* dst, std::size_t size)
+    {
+        uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+        while (size != 0)
+        {
+            if (block_pos_ == block_end_)
+                read_block();
+            std::size_t n = (std::min)(size, block_end_ - block_pos_);
+            std::memcpy(d, block_.get() + block_pos_, n);
+            block_pos_ += n;
+            d += n;
+            size -= n;
+        }
+    }
+
+    void finish()
+    {
+        if (block_pos_ != block_end_)
+        {
+            throw decompression_error(
+                "decompressed data is larger than expected");
+        }
+        check_source_exhausted(*src_);
+    }
+
+ private:
+    void read_block()
+    {
+        uint32_t compressed_size;
+        uint8_t* p = reinterpret_cast<uint8_t*>(&compressed_size);
+        std::size_t n = src_->read(p, 4);
+        if (n == 0)
+        {
+            throw decompression_error(
+                "decompressed data is smaller than expected");
+        }
+        read_exactly(*src_, p + n, 4 - n);
+        if (compressed_size >
+            uint32_t(LZ4_compressBound(int(block_size))))
+        {
+            throw decompression_error("compressed data is corrupt");
+        }
+        compressed_.resize(compressed_size);
+        read_exactly(*src_, compressed_.empty() ? 0 : &compressed_[0],
+            compressed_size);
+        int size = LZ4_decompress_safe(
+            reinterpret_cast<char const*>(
+                compressed_.empty() ? 0 : &compressed_[0]),
+            reinterpret_cast<char*>(block_.get()), int(compressed_size),
+            int(block_size));
+        if (size <= 0)
+            throw decompression_error("compressed data is corrupt");
+        block_pos_ = 0;
+        block_end_ = std::size_t(size);
+    }
+
+    byte_source* src_;
+    std::vector<uint8_t> compressed_;
+    boost::scoped_array<uint8_t> block_;
+    std::size_t block_pos_, block_end_;
+};
+
+alia__shared_ptr<stream_decompressor>
+create_lz4_decompressor(byte_source& src)
+{
+    return alia__shared_ptr<stream_decompressor>(
+        new lz4_stream_decompressor(src));
+}
+
+struct zstd_stream_compressor : stream_compressor
+{
+    zstd_stream_compressor(byte_sink& dst, int level)
+      : dst_(&dst), out_buffer_(new uint8_t[buffer_size])
+    {
+        ctx_ = ZSTD_createCCtx();
+        if (!ctx_)
+            throw compression_error("unable to create zstd context");
+        check_result(
+            ZSTD_CCtx_setParameter(ctx_, ZSTD_c_compressionLevel, level));
+    }
+    ~zstd_stream_compressor()
+    { ZSTD_freeCCtx(ctx_); }
+
+    void write(void const* data, std::size_t size)
+    {
+        ZSTD_inBuffer in = { data, size, 0 };
+        while (in.pos != in.size)
+            compress_some(in, ZSTD_e_continue);
+    }
+
+    void finish()
+    {
+        ZSTD_inBuffer in = { 0, 0, 0 };
+        while (compress_some(in, ZSTD_e_end) != 0)
+            ;
+    }
+
+ private:
+    std::size_t compress_some(ZSTD_inBuffer& in, ZSTD_EndDirective mode)
+    {
+        ZSTD_outBuffer out = { out_buffer_.get(), buffer_size, 0 };
+        std::size_t rc =
+            check_result(ZSTD_compressStream2(ctx_, &out, &in, mode));
+        if (out.pos != 0)
+            dst_->write(out_buffer_.get(), out.pos);
+        return rc;
+    }
+
+    static std::size_t check_result(std::size_t rc)
+    {
+        if (ZSTD_isError(rc))
+        {
+            throw compression_error(
+                string("zstd error: ") + ZSTD_getErrorName(rc));
+        }
+        return rc;
+    }
+
+    ZSTD_CCtx* ctx_;
+    byte_sink* dst_;
+    boost::scoped_array<uint8_t> out_buffer_;
+};
+
+alia__shared_ptr<stream_compressor>
+create_zstd_compressor(byte_sink& dst, int level)
+{
+    return alia__shared_ptr<stream_compressor>(
+        new zstd_stream_compressor(dst, level));
+}
+
+struct zstd_stream_decompressor : stream_decompressor
+{
+    zstd_stream_decompressor(byte_source& src)
+      : src_(&src), in_buffer_(new uint8_t[buffer_size]), ended_(false)
+    {
+        ctx_ = ZSTD_createDCtx();
+        if (!ctx_)
+            throw decompression_error("unable to create zstd context");
+        in_.src = in_buffer_.get();
+        in_.size = 0;
+        in_.pos = 0;
+    }
+    ~zstd_stream_decompressor()
+    { ZSTD_freeDCtx(ctx_); }
+
+    void read(void* dst, std::size_t size)
+    {
+        ZSTD_outBuffer out = { dst, size, 0 };
+        while (out.pos != out.size)
+        {
+            if (ended_)
+            {
+                throw decompression_error(
+                    "decompressed data is smaller than expected");
+            }
+            decompress_some(out);
+        }
+    }
+
+    void finish()
+    {
+        // As with zlib, the frame may not be complete yet.
+        while (!ended_)
+        {
+            uint8_t extra;
+            ZSTD_outBuffer out = { &extra, 1, 0 };
+            decompress_some(out);
+            if (out.pos != 0)
+            {
+                throw decompression_error(
+                    "decompressed data is larger than expected");
+            }
+        }
+        if (in_.pos != in_.size)
+        {
+            throw decompression_error(
+                "compressed data is corrupt; excess data at end");
+        }
+        check_source_exhausted(*src_);
+    }
+
+ private:
+    void decompress_some(ZSTD_outBuffer& out)
+    {
+        if (in_.pos == in_.size)
+        {
+            in_.size = src_->read(in_buffer_.get(), buffer_size);
+            in_.pos = 0;
+        }
+        std::size_t initial_pos = out.pos;
+        std::size_t rc = ZSTD_decompressStream(ctx_, &out, &in_);
+        if (ZSTD_isError(rc))
+        {
+            throw decompression_error(
+                string("compressed data is corrupt; zstd error: ") +
+                ZSTD_getErrorName(rc));
+        }
+        // A return value of 0 means the frame is complete.
+        ended_ = rc == 0;
+        // zstd may still be flushing data that it's already consumed, so
+        // running out of input is only an error once it stops making
+        // progress.
+        if (!ended_ && in_.size == 0 && out.pos == initial_pos)
+        {
+            throw decompression_error(
+                "compressed data is corrupt; data ends unexpectedly");
+        }
+    }
+
+    ZSTD_DCtx* ctx_;
+    byte_source* src_;
+    boost::scoped_array<uint8_t> in_buffer_;
+    ZSTD_inBuffer in_;
+    bool ended_;
+};
+
+alia__shared_ptr<stream_decompressor>
+create_zstd_decompressor(byte_source& src)
+{
+    return alia__shared_ptr<stream_decompressor>(
+        new zstd_stream_decompressor(src));
+}
+
+// CHUNKED
+//
+// The chunked format consists of...
+// - for each chunk, its compressed size (as a 32-bit integer) followed by
+//   the compressed chunk (a zstd frame)
+// - a 32-bit 0, marking the end of the chunks
+// - an index of the chunks, giving the offset of each one (as a 64-bit
+//   integer, relative to the start of the data)
+// - a footer, giving the total uncompressed size (64-bit), the number of
+//   chunks (64-bit) and the chunk size (32-bit)
+// All integers are in native byte order. Every chunk except the last
+// contains exactly 'chunk size' bytes of the original data.
+
+static std::size_t const chunk_size = 0x200000;
+static std::size_t const chunk_footer_size = 20;
+
+struct chunk_compression_job : simple_job_interface
+{
+    uint8_t const* src;
+    std::size_t src_size;
+    int level;
+    std::vector<uint8_t> compressed;
+    string error;
+
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        compressed.resize(ZSTD_compressBound(src_size));
+        std::size_t rc = ZSTD_compress(&compressed[0], compressed.size(),
+            src, src_size, level);
+        if (ZSTD_isError(rc))
+            error = string("zstd error: ") + ZSTD_getErrorName(rc);
+        else
+            compressed.resize(rc);
+    }
+};
+
+struct chunk_decompression_job : simple_job_interface
+{
+    uint8_t const* src;
+    std::size_t src_size;
+    uint8_t* dst;
+    std::size_t dst_size;
+    string error;
+
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        std::size_t rc = ZSTD_decompress(dst, dst_size, src, src_size);
+        if (ZSTD_isError(rc))
+        {
+            error = string("compressed data is corrupt; zstd error: ") +
+                ZSTD_getErrorName(rc);
+        }
+        else if (rc != dst_size)
+            error = "compressed data is corrupt; chunk has the wrong size";
+    }
+};
+
+// Run a batch of chunk jobs, in parallel if there's more than one.
+// The jobs record their own errors, so that the caller can report them with
+// the appropriate exception type.
+template<class Job>
+static void run_chunk_jobs(std::vector<Job>& jobs)
+{
+    null_check_in check_in;
+    null_progress_reporter reporter;
+    if (jobs.size() == 1)
+        jobs[0].execute(check_in, reporter);
+    else if (jobs.size() > 1)
+        execute_jobs_concurrently(check_in, reporter, jobs.size(), &jobs[0]);
+}
+
+// The streams process this many chunks at a time.
+static std::size_t get_chunk_batch_size()
+{
+    return (std::max)(std::size_t(boost::thread::hardware_concurrency()),
+        std::size_t(1));
+}
+
+struct chunked_stream_compressor : stream_compressor
+{
+    chunked_stream_compressor(byte_sink& dst, int level)
+      : dst_(&dst), level_(level), offset_(0), size_(0)
+    {}
+
+    void write(void const* data, std::size_t size)
+    {
+        std::size_t batch_bytes = get_chunk_batch_size() * chunk_size;
+        uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+        while (size != 0)
+        {
+            if (batch_.size() == batch_bytes)
+                write_batch();
+            std::size_t n = (std::min)(size, batch_bytes - batch_.size());
+            batch_.insert(batch_.end(), p, p + n);
+            p += n;
+            size -= n;
+        }
+    }
+
+    void finish()
+    {
+        write_batch();
+        uint32_t end_marker = 0;
+        dst_->write(&end_marker, 4);
+        if (!chunk_offsets_.empty())
+        {
+            dst_->write(&chunk_offsets_[0],
+                chunk_offsets_.size() * sizeof(uint64_t));
+        }
+        uint64_t n_chunks = chunk_offsets_.size();
+        uint32_t recorded_chunk_size = uint32_t(chunk_size);
+        dst_->write(&size_, 8);
+        dst_->write(&n_chunks, 8);
+        dst_->write(&recorded_chunk_size, 4);
+    }
+
+ private:
+    void write_batch()
+    {
+        std::size_t n_chunks = (batch_.size() + chunk_size - 1) / chunk_size;
+        std::vector<chunk_compression_job> jobs(n_chunks);
+        for (std::size_t i = 0; i != n_chunks; ++i)
+        {
+            jobs[i].src = &batch_[0] + i * chunk_size;
+            jobs[i].src_size =
+                (std::min)(chunk_size, batch_.size() - i * chunk_size);
+            jobs[i].level = level_;
+        }
+        run_chunk_jobs(jobs);
+        for (auto const& job : jobs)
+        {
+            if (!job.error.empty())
+                throw compression_error(job.error);
+            uint32_t compressed_size = uint32_t(job.compressed.size());
+            dst_->write(&compressed_size, 4);
+            dst_->write(&job.compressed[0], compressed_size);
+            chunk_offsets_.push_back(offset_);
+            offset_ += 4 + compressed_size;
+        }
+        size_ += batch_.size();
+        batch_.clear();
+    }
+
+    byte_sink* dst_;
+    int level_;
+    std::vector<uint8_t> batch_;
+    std::vector<uint64_t> chunk_offsets_;
+    // the compressed and uncompressed sizes of what's been written so far
+    uint64_t offset_, size_;
+};
+
+alia__shared_ptr<stream_compressor>
+create_chunked_compressor(byte_sink& dst, int level)
+{
+    return alia__shared_ptr<stream_compressor>(
+        new chunked_stream_compressor(dst, level));
+}
+
+struct chunked_stream_decompressor : stream_decompressor
+{
+    chunked_stream_decompressor(byte_source& src)
+      : src_(&src), batch_pos_(0), offset_(0), size_(0), ended_(false)
+    {}
+
+    void read(void* dst, std::size_t size)
+    {
+        uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+        while (size != 0)
+        {
+            if (batch_pos_ == batch_.size())
+                read_batch();
+            std::size_t n = (std::min)(size, batch_.size() - batch_pos_);
+            std::memcpy(d, &batch_[batch_pos_], n);
+            batch_pos_ += n;
+            d += n;
+            size -= n;
+        }
+    }
+
+    void finish()
+    {
+        if (batch_pos_ != batch_.size() || (!ended_ && read_chunk()))
+        {
+            throw decompression_error(
+                "decompressed data is larger than expected");
+        }
+
+        // Check that the index and footer agree with what was read.
+        std::vector<uint64_t> index(chunk_offsets_.size());
+        if (!index.empty())
+            read_exactly(*src_, &index[0], index.size() * sizeof(uint64_t));
+        uint64_t recorded_size, n_chunks;
+        uint32_t recorded_chunk_size;
+        read_exactly(*src_, &recorded_size, 8);
+        read_exactly(*src_, &n_chunks, 8);
+        read_exactly(*src_, &recorded_chunk_size, 4);
+        if (index != chunk_offsets_ || recorded_size != size_ ||
+            n_chunks != chunk_offsets_.size() ||
+            recorded_chunk_size != chunk_size)
+        {
+            throw decompression_error("compressed data is corrupt");
+        }
+        check_source_exhausted(*src_);
+    }
+
+ private:
+    // Read the next chunk's compressed data into the next job.
+    // Returns false if the end of the chunks has been reached instead.
+    bool read_chunk()
+    {
+        uint32_t compressed_size;
+        read_exactly(*src_, &compressed_size, 4);
+        if (compressed_size == 0)
+        {
+            ended_ = true;
+            return false;
+        }
+        if (compressed_size > ZSTD_compressBound(chunk_size))
+            throw decompression_error("compressed data is corrupt");
+        compressed_.resize(compressed_.size() + 1);
+        auto& compressed = compressed_.back();
+        compressed.resize(compressed_size);
+        read_exactly(*src_, &compressed[0], compressed_size);
+        chunk_offsets_.push_back(offset_);
+        offset_ += 4 + compressed_size;
+        return true;
+    }
+
+    void read_batch()
+    {
+        compressed_.clear();
+        std::size_t batch_size = get_chunk_batch_size();
+        while (!ended_ && compressed_.size() != batch_size && read_chunk())
+            ;
+        if (compressed_.empty())
+        {
+            throw decompression_error(
+                "decompressed data is smaller than expected");
+        }
+
+        // The frames record their own sizes, so use those to lay out the
+        // batch.
+        std::size_t n_chunks = compressed_.size();
+        std::vector<chunk_decompression_job> jobs(n_chunks);
+        std::size_t batch_bytes = 0;
+        for (std::size_t i = 0; i != n_chunks; ++i)
+        {
+            auto const& compressed = compressed_[i];
+            unsigned long long chunk_bytes =
+                ZSTD_getFrameContentSize(&compressed[0], compressed.size());
+            if (chunk_bytes == ZSTD_CONTENTSIZE_UNKNOWN ||
+                chunk_bytes == ZSTD_CONTENTSIZE_ERROR ||
+                chunk_bytes > chunk_size)
+            {
+                throw decompression_error("compressed data is corrupt");
+            }
+            jobs[i].src = &compressed[0];
+            jobs[i].src_size = compressed.size();
+            jobs[i].dst_size = std::size_t(chunk_bytes);
+            batch_bytes += std::size_t(chunk_bytes);
+        }
+        batch_.resize(batch_bytes);
+        std::size_t offset = 0;
+        for (auto& job : jobs)
+        {
+            job.dst = &batch_[0] + offset;
+            offset += job.dst_size;
+        }
+        run_chunk_jobs(jobs);
+        for (auto const& job : jobs)
+        {
+            if (!job.error.empty())
+                throw decompression_error(job.error);
+        }
+        batch_pos_ = 0;
+        size_ += batch_bytes;
+    }
+
+    byte_source* src_;
+    std::vector<std::vector<uint8_t> > compressed_;
+    std::vector<uint8_t> batch_;
+    std::size_t batch_pos_;
+    std::vector<uint64_t> chunk_offsets_;
+    // the compressed and uncompressed sizes of what's been read so far
+    uint64_t offset_, size_;
+    bool ended_;
+};
+
+alia__shared_ptr<stream_decompressor>
+create_chunked_decompressor(byte_source& src)
+{
+    return alia__shared_ptr<stream_decompressor>(
+        new chunked_stream_decompressor(src));
+}
+
+void chunked_compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
+    void const* src, std::size_t src_size, int level)
+{
+    std::vector<uint8_t> compressed;
+    {
+        byte_vector_sink sink(compressed);
+        chunked_stream_compressor compressor(sink, level);
+        compressor.write(src, src_size);
+        compressor.finish();
+    }
+    dst->reset(new uint8_t[compressed.size()]);
+    std::memcpy(dst->get(), &compressed[0], compressed.size());
+    *dst_size = compressed.size();
+}
+
+// the information in the footer of chunked data
+struct chunked_data_info
+{
+    uint64_t size;
+    uint64_t n_chunks;
+    // the index of chunk offsets
+    uint8_t const* index;
+};
+
+static chunked_data_info
+get_chunked_data_info(void const* src, std::size_t src_size)
+{
+    uint8_t const* s = reinterpret_cast<uint8_t const*>(src);
+    if (src_size < chunk_footer_size)
+    {
+        throw decompression_error(
+            "compressed data is corrupt; data ends unexpectedly");
+    }
+    uint8_t const* footer = s + src_size - chunk_footer_size;
+    chunked_data_info info;
+    uint32_t recorded_chunk_size;
+    std::memcpy(&info.size, footer, 8);
+    std::memcpy(&info.n_chunks, footer + 8, 8);
+    std::memcpy(&recorded_chunk_size, footer + 16, 4);
+    if (recorded_chunk_size != chunk_size ||
+        info.n_chunks != (info.size + chunk_size - 1) / chunk_size ||
+        info.n_chunks > (src_size - chunk_footer_size) / 8)
+    {
+        throw decompression_error("compressed data is corrupt");
+    }
+    info.index = footer - info.n_chunks * 8;
+    return info;
+}
+
+std::size_t get_chunked_size(void const* src, std::size_t src_size)
+{
+    return boost::numeric_cast<std::size_t>(
+        get_chunked_data_info(src, src_size).size);
+}
+
+void chunked_decompress_range(void* dst, std::size_t offset, std::size_t size,
+    void const* src, std::size_t src_size)
+{
+    if (size == 0)
+        return;
+    chunked_data_info info = get_chunked_data_info(src, src_size);
+    if (offset > info.size || size > info.size - offset)
+        throw decompression_error("requested range is out of bounds");
+
+    uint8_t const* s = reinterpret_cast<uint8_t const*>(src);
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    std::size_t first_chunk = offset / chunk_size;
+    std::size_t end_chunk = (offset + size - 1) / chunk_size + 1;
+
+    // Chunks that are entirely within the range are decompressed directly
+    // into place. The ones at the edges are decompressed into temporary
+    // buffers so that just the requested part can be copied out.
+    std::vector<chunk_decompression_job> jobs(end_chunk - first_chunk);
+    std::vector<uint8_t> edge_buffers[2];
+    for (std::size_t i = first_chunk; i != end_chunk; ++i)
+    {
+        auto& job = jobs[i - first_chunk];
+        uint64_t chunk_offset;
+        std::memcpy(&chunk_offset, info.index + i * 8, 8);
+        uint32_t compressed_size;
+        if (chunk_offset > src_size - 4)
+            throw decompression_error("compressed data is corrupt");
+        std::memcpy(&compressed_size, s + chunk_offset, 4);
+        if (compressed_size > src_size - 4 - chunk_offset)
+            throw decompression_error("compressed data is corrupt");
+        job.src = s + chunk_offset + 4;
+        job.src_size = compressed_size;
+
+        std::size_t chunk_begin = i * chunk_size;
+        job.dst_size = std::size_t((std::min)(uint64_t(chunk_size),
+            info.size - chunk_begin));
+        if (chunk_begin >= offset &&
+            chunk_begin + job.dst_size <= offset + size)
+        {
+            job.dst = d + (chunk_begin - offset);
+        }
+        else
+        {
+            auto& buffer = edge_buffers[i == first_chunk ? 0 : 1];
+            buffer.resize(job.dst_size);
+            job.dst = &buffer[0];
+        }
+    }
+    run_chunk_jobs(jobs);
+    for (std::size_t i = first_chunk; i != end_chunk; ++i)
+    {
+        auto const& job = jobs[i - first_chunk];
+        if (!job.error.empty())
+            throw decompression_error(job.error);
+        std::size_t chunk_begin = i * chunk_size;
+        if (chunk_begin < offset ||
+            chunk_begin + job.dst_size > offset + size)
+        {
+            std::size_t begin = (std::max)(chunk_begin, offset);
+            std::size_t end =
+                (std::min)(chunk_begin + job.dst_size, offset + size);
+            std::memcpy(d + (begin - offset),
+                job.dst + (begin - chunk_begin), end - begin);
+        }
+    }
+}
+
+void chunked_decompress(void* dst, std::size_t dst_size,
+    void const* src, std::size_t src_size)
+{
+    if (get_chunked_size(src, src_size) != dst_size)
+    {
+        throw decompression_error(
+            "decompressed data is not the expected size");
+    }
+    chunked_decompress_range(dst, 0, dst_size, src, src_size);
+}
+
 string zlib_error_code_to_string(int error_code)
 {
     switch (error_code)
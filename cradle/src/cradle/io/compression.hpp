@@ -23,6 +23,134 @@ void compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
 // Compress to a file.
 void compress(c_file& dst, void const* src, std::size_t src_size);
 
+// The following provide the same interface for other compression libraries.
+// Unlike the zlib functions above, these only work in memory.
+
+// LZ4 - much faster than zlib (especially when decompressing), but with a
+// lower compression ratio
+void lz4_compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
+    void const* src, std::size_t src_size);
+void lz4_decompress(void* dst, std::size_t dst_size,
+    void const* src, std::size_t src_size);
+
+// Zstandard - typically both faster and better than zlib
+// level ranges from 1 (fastest) to 22 (smallest).
+void zstd_compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
+    void const* src, std::size_t src_size, int level);
+void zstd_decompress(void* dst, std::size_t dst_size,
+    void const* src, std::size_t src_size);
+
+// STREAMING - The following compress and decompress data incrementally, so
+// neither the compressed nor the uncompressed form ever has to be held in
+// memory all at once. They produce and consume the same formats as the
+// corresponding functions above.
+
+// byte_sink is a destination for a stream of bytes.
+struct byte_sink
+{
+    virtual ~byte_sink() {}
+    virtual void write(void const* data, std::size_t size) = 0;
+};
+
+// byte_source is a source of a stream of bytes.
+struct byte_source
+{
+    virtual ~byte_source() {}
+    // Read up to 'size' bytes into 'data' and return the number actually
+    // read. A return value of 0 indicates the end of the stream.
+    virtual std::size_t read(void* data, std::size_t size) = 0;
+};
+
+// sinks and sources for memory and files
+struct byte_vector_sink : byte_sink
+{
+    byte_vector_sink(std::vector<uint8_t>& buffer) : buffer(&buffer) {}
+    void write(void const* data, std::size_t size);
+    std::vector<uint8_t>* buffer;
+};
+struct memory_source : byte_source
+{
+    memory_source(void const* data, std::size_t size)
+      : data(reinterpret_cast<uint8_t const*>(data)), size(size) {}
+    std::size_t read(void* data, std::size_t size);
+    uint8_t const* data;
+    std::size_t size;
+};
+struct c_file_sink : byte_sink
+{
+    c_file_sink(c_file& file) : file(&file) {}
+    void write(void const* data, std::size_t size);
+    c_file* file;
+};
+struct c_file_source : byte_source
+{
+    c_file_source(c_file& file) : file(&file) {}
+    std::size_t read(void* data, std::size_t size);
+    c_file* file;
+};
+
+// stream_compressor accepts data incrementally and writes its compressed
+// form to a sink as it goes.
+struct stream_compressor
+{
+    virtual ~stream_compressor() {}
+    virtual void write(void const* data, std::size_t size) = 0;
+    // Write out the rest of the compressed data.
+    // Nothing else can be written after this.
+    virtual void finish() = 0;
+};
+
+// stream_decompressor reads compressed data incrementally from a source.
+struct stream_decompressor
+{
+    virtual ~stream_decompressor() {}
+    // Read exactly 'size' bytes of decompressed data.
+    // A decompression_error is thrown if the data ends first.
+    virtual void read(void* dst, std::size_t size) = 0;
+    // Check that the compressed data has been completely consumed.
+    virtual void finish() = 0;
+};
+
+// The sink or source must outlive the returned object.
+alia__shared_ptr<stream_compressor>
+create_zlib_compressor(byte_sink& dst);
+alia__shared_ptr<stream_decompressor>
+create_zlib_decompressor(byte_source& src);
+alia__shared_ptr<stream_compressor>
+create_lz4_compressor(byte_sink& dst);
+alia__shared_ptr<stream_decompressor>
+create_lz4_decompressor(byte_source& src);
+alia__shared_ptr<stream_compressor>
+create_zstd_compressor(byte_sink& dst, int level);
+alia__shared_ptr<stream_decompressor>
+create_zstd_decompressor(byte_source& src);
+
+// CHUNKED - This is a container format for large blocks of data. The data is
+// split into fixed-size chunks that are compressed independently (with
+// zstd), so they can be compressed and decompressed in parallel, and any
+// range of the original data can be extracted without decompressing the
+// rest of it.
+
+void chunked_compress(boost::scoped_array<uint8_t>* dst, std::size_t* dst_size,
+    void const* src, std::size_t src_size, int level);
+void chunked_decompress(void* dst, std::size_t dst_size,
+    void const* src, std::size_t src_size);
+
+// Get the original size of data in the chunked format.
+std::size_t get_chunked_size(void const* src, std::size_t src_size);
+
+// Decompress only the part of the original data that starts at 'offset'.
+void chunked_decompress_range(void* dst, std::size_t offset, std::size_t size,
+    void const* src, std::size_t src_size);
+
+// The stream compressor works on batches of chunks, so its memory usage is
+// proportional to the number of processor cores rather than the size of the
+// data.
+alia__shared_ptr<stream_compressor>
+create_chunked_compressor(byte_sink& dst, int level);
+alia__shared_ptr<stream_decompressor>
+create_chunked_decompressor(byte_source& src);
+
 // This is thrown when zlib reports an error.
 class zlib_error : public exception
 {
@@ -34,6 +162,15 @@ class zlib_error : public exception
     int error_code_;
 };
 
+// This is thrown when a compression library other than zlib reports an
+// error.
+class compression_error : public exception
+{
+ public:
+    compression_error(string const& message) : exception(message) {}
+    ~compression_error() throw() {}
+};
+
 class decompression_error : public exception
 {
  public:
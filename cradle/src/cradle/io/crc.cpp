@@ -1,7 +1,27 @@
 #include <cradle/io/crc.hpp>
+#include <cstring>
+#include <cradle/system.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+  #define CRADLE_CRC32_PCLMUL
+  #include <emmintrin.h>
+  #include <smmintrin.h>
+  #include <wmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+  #define CRADLE_CRC32_ARMV8
+  #include <arm_acle.h>
+#endif
 
 namespace cradle {
 
+// All the methods below work on the internal state of the CRC, which is the
+// bitwise inverse of the CRC itself.
+
+// BYTEWISE
+
 static uint32_t crc32_table[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
     0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -48,17 +68,326 @@ static uint32_t crc32_table[] = {
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t compute_crc32(uint32_t crc, void const* data, size_t size)
+static uint32_t
+update_crc32_bytewise(uint32_t state, uint8_t const* p, size_t size)
+{
+    while (size--)
+        state = crc32_table[(state ^ *p++) & 0xff] ^ (state >> 8);
+    return state;
+}
+
+// SLICING-BY-8
+
+// tables[k][i] is the effect of byte i followed by k zero bytes.
+struct crc32_slicing_tables
+{
+    uint32_t tables[8][256];
+};
+
+static crc32_slicing_tables
+make_crc32_slicing_tables()
+{
+    crc32_slicing_tables t;
+    for (unsigned i = 0; i != 256; ++i)
+    {
+        t.tables[0][i] = crc32_table[i];
+        for (unsigned k = 1; k != 8; ++k)
+        {
+            uint32_t previous = t.tables[k - 1][i];
+            t.tables[k][i] = crc32_table[previous & 0xff] ^ (previous >> 8);
+        }
+    }
+    return t;
+}
+
+static crc32_slicing_tables const&
+get_crc32_slicing_tables()
+{
+    static crc32_slicing_tables const tables = make_crc32_slicing_tables();
+    return tables;
+}
+
+// Read four bytes in little-endian order.
+static inline uint32_t
+read_crc32_word(uint8_t const* p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+        (uint32_t(p[3]) << 24);
+}
+
+static uint32_t
+update_crc32_slicing_by_8(uint32_t state, uint8_t const* p, size_t size)
+{
+    auto const& t = get_crc32_slicing_tables().tables;
+    while (size >= 8)
+    {
+        uint32_t low = state ^ read_crc32_word(p);
+        uint32_t high = read_crc32_word(p + 4);
+        state =
+            t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+            t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+            t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^
+            t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+        p += 8;
+        size -= 8;
+    }
+    return update_crc32_bytewise(state, p, size);
+}
+
+// PCLMUL
+
+#ifdef CRADLE_CRC32_PCLMUL
+
+// This folds the data into four 128-bit accumulators, 64 bytes at a time,
+// using carry-less multiplication by the appropriate powers of x, then folds
+// those down to 32 bits and does a Barrett reduction. (The technique and the
+// constants are from Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction".) Only whole 16-byte blocks are handled this
+// way, and at least 64 bytes are required, so the rest is left to slicing.
+CRADLE_TARGET("pclmul,sse4.1")
+static uint32_t
+update_crc32_pclmul(uint32_t state, uint8_t const* p, size_t size)
 {
-    uint8_t const* p;
+    if (size < 64)
+        return update_crc32_slicing_by_8(state, p, size);
+
+    __m128i const k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    __m128i const k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    __m128i const k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    __m128i const poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    __m128i const mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 16));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 32));
+    __m128i x4 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(int(state)));
+    p += 64;
+    size -= 64;
+
+    // Fold 64 bytes at a time.
+    while (size >= 64)
+    {
+        __m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, y1),
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, y2),
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, y3),
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, y4),
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 48)));
+        p += 64;
+        size -= 64;
+    }
+
+    // Fold the four accumulators into one.
+    __m128i y;
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), y);
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), y);
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), y);
+
+    // Fold in any remaining 16-byte blocks.
+    while (size >= 16)
+    {
+        y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, y),
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+        p += 16;
+        size -= 16;
+    }
+
+    // Fold 128 bits down to 64.
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), y);
+    y = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, y);
+
+    // Barrett reduction to 32 bits
+    y = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    y = _mm_clmulepi64_si128(_mm_and_si128(y, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, y);
+    state = uint32_t(_mm_extract_epi32(x1, 1));
+
+    return update_crc32_slicing_by_8(state, p, size);
+}
 
-    p = reinterpret_cast<uint8_t const*>(data);
-    crc = crc ^ ~0U;
+#endif
 
+// ARMV8
+
+#ifdef CRADLE_CRC32_ARMV8
+
+// The CRC32 instructions use the same (reflected) polynomial as zlib and
+// operate directly on the internal state.
+#ifdef __clang__
+CRADLE_TARGET("crc")
+#else
+CRADLE_TARGET("+crc")
+#endif
+static uint32_t
+update_crc32_armv8(uint32_t state, uint8_t const* p, size_t size)
+{
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        state = __crc32d(state, word);
+        p += 8;
+        size -= 8;
+    }
     while (size--)
-        crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        state = __crc32b(state, *p++);
+    return state;
+}
+
+#endif
+
+// DISPATCH
+
+bool is_crc32_method_supported(crc32_method method)
+{
+    switch (method)
+    {
+     case crc32_method::BYTEWISE:
+     case crc32_method::SLICING_BY_8:
+        return true;
+     case crc32_method::PCLMUL:
+      #ifdef CRADLE_CRC32_PCLMUL
+        return get_cpu_features().pclmul && get_cpu_features().sse41;
+      #else
+        return false;
+      #endif
+     case crc32_method::ARMV8:
+      #ifdef CRADLE_CRC32_ARMV8
+        return get_cpu_features().armv8_crc32;
+      #else
+        return false;
+      #endif
+    }
+    return false;
+}
+
+static crc32_method
+select_crc32_method()
+{
+    if (is_crc32_method_supported(crc32_method::PCLMUL))
+        return crc32_method::PCLMUL;
+    if (is_crc32_method_supported(crc32_method::ARMV8))
+        return crc32_method::ARMV8;
+    return crc32_method::SLICING_BY_8;
+}
+
+crc32_method get_preferred_crc32_method()
+{
+    static crc32_method const method = select_crc32_method();
+    return method;
+}
+
+uint32_t compute_crc32(crc32_method method, uint32_t crc,
+    void const* data, size_t size)
+{
+    uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+    uint32_t state = ~crc;
+    switch (method)
+    {
+     case crc32_method::BYTEWISE:
+        state = update_crc32_bytewise(state, p, size);
+        break;
+     case crc32_method::SLICING_BY_8:
+        state = update_crc32_slicing_by_8(state, p, size);
+        break;
+   #ifdef CRADLE_CRC32_PCLMUL
+     case crc32_method::PCLMUL:
+        state = update_crc32_pclmul(state, p, size);
+        break;
+   #endif
+   #ifdef CRADLE_CRC32_ARMV8
+     case crc32_method::ARMV8:
+        state = update_crc32_armv8(state, p, size);
+        break;
+   #endif
+     default:
+        throw exception("unsupported CRC method");
+    }
+    return ~state;
+}
 
-    return crc ^ ~0U;
+uint32_t compute_crc32(uint32_t crc, void const* data, size_t size)
+{
+    return compute_crc32(get_preferred_crc32_method(), crc, data, size);
+}
+
+// COMBINING
+
+// Appending n zero bytes to a block multiplies its CRC by x^(8n) (modulo the
+// CRC polynomial), so the CRC of two blocks together is crc1 * x^(8 * size2)
+// + crc2. (This is the same approach that zlib's crc32_combine takes.)
+
+static uint32_t const crc32_polynomial = 0xedb88320;
+
+// Multiply a and b modulo the CRC polynomial. Polynomials are bit-reflected,
+// so the high bit holds the coefficient of x^0.
+static uint32_t
+multiply_crc32_polynomials(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t m = uint32_t(1) << 31; m != 0; m >>= 1)
+    {
+        if (a & m)
+            product ^= b;
+        b = (b & 1) ? (b >> 1) ^ crc32_polynomial : b >> 1;
+    }
+    return product;
+}
+
+// powers[n] is x^(2^n) modulo the CRC polynomial.
+struct crc32_power_table
+{
+    uint32_t powers[67];
+};
+
+static crc32_power_table
+make_crc32_power_table()
+{
+    crc32_power_table t;
+    // x^1
+    uint32_t p = uint32_t(1) << 30;
+    for (unsigned n = 0; n != 67; ++n)
+    {
+        t.powers[n] = p;
+        p = multiply_crc32_polynomials(p, p);
+    }
+    return t;
+}
+
+uint32_t combine_crc32s(uint32_t crc1, uint32_t crc2, size_t size2)
+{
+    static crc32_power_table const table = make_crc32_power_table();
+    // Compute x^(8 * size2) from the powers of x that make it up.
+    uint32_t shift = uint32_t(1) << 31;
+    unsigned n = 3;
+    for (uint64_t bits = size2; bits != 0; bits >>= 1, ++n)
+    {
+        if (bits & 1)
+            shift = multiply_crc32_polynomials(table.powers[n], shift);
+    }
+    return multiply_crc32_polynomials(shift, crc1) ^ crc2;
 }
 
 }
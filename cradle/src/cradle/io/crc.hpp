@@ -5,8 +5,44 @@
 
 namespace cradle {
 
+// Compute the (zlib-compatible) CRC-32 of the given data.
+// crc is the CRC of any data that precedes it (or 0 if there is none), so a
+// CRC can be computed incrementally.
+// This uses the fastest method that the CPU supports.
 uint32_t compute_crc32(uint32_t crc, void const* data, size_t size);
 
+// Given crc1, the CRC of one block of data, and crc2, the CRC of the block
+// that follows it (which is size2 bytes long), this computes the CRC of both
+// blocks together. This allows blocks to be CRC'd independently (e.g., in
+// parallel) and then merged.
+uint32_t combine_crc32s(uint32_t crc1, uint32_t crc2, size_t size2);
+
+// The methods that are available for computing CRCs. They all produce the
+// same results. compute_crc32 selects one based on what the CPU supports,
+// but they can also be invoked individually (for testing and benchmarking).
+enum class crc32_method
+{
+    // byte-at-a-time table lookup (supported everywhere)
+    BYTEWISE,
+    // eight bytes at a time with eight tables (supported everywhere)
+    SLICING_BY_8,
+    // folding with carry-less multiplication (x86 with PCLMULQDQ and SSE4.1)
+    PCLMUL,
+    // the ARMv8 CRC32 instructions
+    ARMV8
+};
+
+// Is the given method supported on this CPU?
+bool is_crc32_method_supported(crc32_method method);
+
+// Get the method that compute_crc32 uses.
+crc32_method get_preferred_crc32_method();
+
+// Compute a CRC with a specific method.
+// The method must be supported.
+uint32_t compute_crc32(crc32_method method, uint32_t crc,
+    void const* data, size_t size);
+
 }
 
 #endif
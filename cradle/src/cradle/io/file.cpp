@@ -5,6 +5,16 @@
 #include <cstring>
 #include <boost/format.hpp>
 
+#ifdef WIN32
+#include <cradle/external/windows.hpp>
+#include <cradle/external/clean.hpp>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace boost { namespace CRADLE_IO_BOOST_FILESYSTEM_NAMESPACE {
 
 size_t deep_sizeof(path const& x)
@@ -455,4 +465,116 @@ string get_file_contents(file_path const& path)
     throw(errno);
 }
 
+// MEMORY MAPPING
+
+namespace {
+
+// file_mapping owns a read-only view of a file.
+struct file_mapping : noncopyable
+{
+    void const* data;
+    size_t size;
+
+    file_mapping() : data(0), size(0) {}
+    ~file_mapping()
+    {
+        if (data)
+        {
+#ifdef WIN32
+            UnmapViewOfFile(data);
+#else
+            munmap(const_cast<void*>(data), size);
+#endif
+        }
+    }
+};
+
+}
+
+#ifdef WIN32
+
+blob map_file(file_path const& path)
+{
+    alia__shared_ptr<file_mapping> mapping(new file_mapping);
+
+    HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw open_file_error(path);
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        CloseHandle(file);
+        throw file_error(path, "unable to get file size");
+    }
+    mapping->size = boost::numeric_cast<size_t>(file_size.QuadPart);
+
+    // Empty files can't be mapped, but there's nothing to map anyway.
+    if (mapping->size != 0)
+    {
+        HANDLE file_mapping_object =
+            CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (!file_mapping_object)
+            throw file_error(path, "unable to map file");
+        // The view keeps its own reference to the mapping object.
+        mapping->data =
+            MapViewOfFile(file_mapping_object, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(file_mapping_object);
+        if (!mapping->data)
+            throw file_error(path, "unable to map file");
+    }
+    else
+        CloseHandle(file);
+
+    blob b;
+    b.data = mapping->data;
+    b.size = mapping->size;
+    b.ownership = mapping;
+    return b;
+}
+
+#else
+
+blob map_file(file_path const& path)
+{
+    alia__shared_ptr<file_mapping> mapping(new file_mapping);
+
+    int fd = ::open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        throw open_file_error(path);
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0)
+    {
+        ::close(fd);
+        throw file_error(path, "unable to get file size");
+    }
+    mapping->size = boost::numeric_cast<size_t>(file_info.st_size);
+
+    // Empty files can't be mapped, but there's nothing to map anyway.
+    if (mapping->size != 0)
+    {
+        void* data =
+            mmap(0, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping keeps its own reference to the file.
+        ::close(fd);
+        if (data == MAP_FAILED)
+            throw file_error(path, "unable to map file");
+        mapping->data = data;
+    }
+    else
+        ::close(fd);
+
+    blob b;
+    b.data = mapping->data;
+    b.size = mapping->size;
+    b.ownership = mapping;
+    return b;
+}
+
+#endif
+
 }
@@ -273,6 +273,13 @@ inline simple_file_parser& operator >> (simple_file_parser& p, double& d)
 // Get the contents of a file as a string.
 string get_file_contents(file_path const& path);
 
+// MEMORY MAPPING
+
+// Map the contents of a file into memory (read-only) and return them as a
+// blob. The blob's ownership holder keeps the mapping alive, so the data
+// remains valid for as long as anything shares that ownership.
+blob map_file(file_path const& path);
+
 }
 
 #endif
@@ -21,6 +21,9 @@ typedef boost::CRADLE_IO_BOOST_FILESYSTEM_NAMESPACE::path file_path;
 
 struct c_file;
 
+struct byte_sink;
+struct byte_source;
+
 namespace impl { namespace config {
     class structure;
     template<typename T>
@@ -3,11 +3,16 @@
 #include <boost/numeric/conversion/cast.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/thread/tss.hpp>
 
-#include <json/json.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 #include <cradle/date_time.hpp>
 #include <cradle/encoding.hpp>
+#include <cradle/endian.hpp>
 #include <cradle/io/compression.hpp>
 #include <cradle/io/crc.hpp>
 #include <cradle/io/file.hpp>
@@ -47,289 +52,1083 @@ blob string_to_blob(string const& s)
 
 // JSON I/O
 
-// Check if a JSON list is actually an encoded map.
-// This is the case if the list contains only key/value pairs.
-bool static
-list_resembles_map(Json::Value const& json)
+// JSON is read and written directly from/to the text, without building an
+// intermediate document. The inner loops (string scanning and digit parsing)
+// work on eight bytes at a time, packed into a 64-bit word.
+
+static inline uint64_t
+load_json_word(char const* p)
+{
+    uint64_t word;
+    memcpy(&word, p, 8);
+    return word;
+}
+
+// Does any byte in the given word equal the byte replicated in pattern?
+static inline bool
+word_has_byte(uint64_t word, uint64_t pattern)
+{
+    uint64_t x = word ^ pattern;
+    return ((x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull) != 0;
+}
+
+// Are all eight bytes in the given word ASCII digits?
+static inline bool
+word_is_eight_digits(uint64_t word)
+{
+    return ((word & 0xf0f0f0f0f0f0f0f0ull) |
+        (((word + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) >> 4)) ==
+        0x3333333333333333ull;
+}
+
+// Convert a word of eight ASCII digits (in memory order) to its value.
+static inline uint32_t
+parse_eight_digits(uint64_t word)
+{
+#ifdef CRADLE_LITTLE_ENDIAN
+    word = ((word & 0x0f0f0f0f0f0f0f0full) * 2561) >> 8;
+    word = ((word & 0x00ff00ff00ff00ffull) * 6553601) >> 16;
+    return uint32_t(
+        ((word & 0x0000ffff0000ffffull) * 42949672960001ull) >> 32);
+#else
+    uint32_t n = 0;
+    for (int i = 0; i != 8; ++i)
+        n = n * 10 + uint32_t((word >> (56 - i * 8)) & 0x0f);
+    return n;
+#endif
+}
+
+struct json_reader
+{
+    char const* begin;
+    char const* p;
+    char const* end;
+};
+
+// Throw a json_parse_error for the given position, in the same form that
+// jsoncpp used to report them.
+static void
+throw_json_error(json_reader const& r, char const* position,
+    string const& message)
 {
-    assert(json.type() == Json::arrayValue);
-    Json::Value::ArrayIndex n_elements = json.size();
-    for (Json::Value::ArrayIndex i = 0; i != n_elements; ++i)
+    int line = 1;
+    char const* line_start = r.begin;
+    for (char const* i = r.begin; i != position; ++i)
     {
-        auto const& element = json[i];
-        if (element.type() != Json::objectValue || element.size() != 2 ||
-            !element.isMember("key") || !element.isMember("value"))
+        if (*i == '\n')
         {
-            return false;
+            ++line;
+            line_start = i + 1;
         }
     }
-    return true;
+    throw json_parse_error(
+        "* Line " + to_string(line) + ", Column " +
+        to_string(position - line_start + 1) + "\n  " + message + "\n");
 }
 
-// Read a JSON value into a CRADLE value.
-void static
-read_json_value(
-    value* v,
-    check_in_interface& check_in,
-    Json::Value const& json)
+// Skip whitespace and comments.
+static void
+skip_json_whitespace(json_reader& r)
 {
-    switch (json.type())
+    while (r.p != r.end)
     {
-     case Json::nullValue:
-        set(*v, nil);
-        break;
-     case Json::intValue:
-        set(*v, integer(json.asInt()));
-        break;
-     case Json::uintValue:
-        set(*v, integer(json.asUInt()));
-        break;
-     case Json::realValue:
-        set(*v, double(json.asDouble()));
-        break;
-     case Json::stringValue:
-      {
-        auto s = json.asString();
-        // Times are also encoded as JSON strings, so this checks to see if
-        // the string parses as a time. If so, it just assumes it's actually a
-        // time.
-        // First check if it looks anything like a time string.
-        if (s.length() > 16 &&
-            isdigit(s[0]) &&
-            isdigit(s[1]) &&
-            isdigit(s[2]) &&
-            isdigit(s[3]) &&
-            s[4] == '-')
+        char c = *r.p;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
         {
-            try
+            ++r.p;
+        }
+        else if (c == '/')
+        {
+            char const* start = r.p++;
+            if (r.p != r.end && *r.p == '/')
+            {
+                while (r.p != r.end && *r.p != '\n' && *r.p != '\r')
+                    ++r.p;
+            }
+            else if (r.p != r.end && *r.p == '*')
             {
-                auto t = parse_time(s);
-                // Check that it can be converted back without changing its
-                // value. This could be necessary if we actually expected a
-                // string here.
-                if (to_value_string(t) == s)
+                ++r.p;
+                for (;;)
                 {
-                    set(*v, parse_time(s));
-                    break;
+                    if (r.end - r.p < 2)
+                        throw_json_error(r, start, "Unterminated comment");
+                    if (r.p[0] == '*' && r.p[1] == '/')
+                        break;
+                    ++r.p;
                 }
+                r.p += 2;
             }
-            catch (...)
+            else
+                throw_json_error(r, start, "Syntax error: bad comment");
+        }
+        else
+            break;
+    }
+}
+
+static void
+expect_json_char(json_reader& r, char c, char const* message)
+{
+    skip_json_whitespace(r);
+    if (r.p == r.end || *r.p != c)
+        throw_json_error(r, r.p, message);
+    ++r.p;
+}
+
+static void
+append_utf8(string& s, unsigned code_point)
+{
+    if (code_point < 0x80)
+    {
+        s += char(code_point);
+    }
+    else if (code_point < 0x800)
+    {
+        s += char(0xc0 | (code_point >> 6));
+        s += char(0x80 | (code_point & 0x3f));
+    }
+    else if (code_point < 0x10000)
+    {
+        s += char(0xe0 | (code_point >> 12));
+        s += char(0x80 | ((code_point >> 6) & 0x3f));
+        s += char(0x80 | (code_point & 0x3f));
+    }
+    else
+    {
+        s += char(0xf0 | (code_point >> 18));
+        s += char(0x80 | ((code_point >> 12) & 0x3f));
+        s += char(0x80 | ((code_point >> 6) & 0x3f));
+        s += char(0x80 | (code_point & 0x3f));
+    }
+}
+
+// Read the four hex digits of a \u escape.
+static unsigned
+read_json_hex_escape(json_reader& r, char const* escape)
+{
+    if (r.end - r.p < 4)
+    {
+        throw_json_error(r, escape,
+            "Bad unicode escape sequence in string: four digits expected.");
+    }
+    unsigned code = 0;
+    for (int i = 0; i != 4; ++i)
+    {
+        char c = *r.p++;
+        code *= 16;
+        if (c >= '0' && c <= '9')
+            code += c - '0';
+        else if (c >= 'a' && c <= 'f')
+            code += c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            code += c - 'A' + 10;
+        else
+        {
+            throw_json_error(r, escape,
+                "Bad unicode escape sequence in string: hexadecimal digit "
+                "expected.");
+        }
+    }
+    return code;
+}
+
+// Read a JSON string. r.p should be just past the opening quote.
+static void
+read_json_string(json_reader& r, string* s)
+{
+    char const* start = r.p - 1;
+    s->clear();
+    for (;;)
+    {
+        // Find the next quote or backslash, a word at a time where possible.
+        char const* run = r.p;
+        while (r.end - r.p >= 8)
+        {
+            uint64_t word = load_json_word(r.p);
+            if (word_has_byte(word, 0x2222222222222222ull) ||
+                word_has_byte(word, 0x5c5c5c5c5c5c5c5cull))
             {
+                break;
             }
+            r.p += 8;
         }
-        set(*v, s);
-        break;
-      }
-     case Json::booleanValue:
-        set(*v, json.asBool());
-        break;
-     case Json::arrayValue:
-      {
-        Json::Value::ArrayIndex n_elements = json.size();
-        // If this resembles an encoded map, read it as that.
-        if (!json.empty() && list_resembles_map(json))
+        while (r.p != r.end && *r.p != '"' && *r.p != '\\')
+            ++r.p;
+        if (r.p == r.end)
+            throw_json_error(r, start, "Missing '\"' at end of string");
+        s->append(run, r.p);
+        if (*r.p++ == '"')
+            return;
+
+        // Decode the escape sequence.
+        char const* escape = r.p - 1;
+        if (r.p == r.end)
+            throw_json_error(r, start, "Missing '\"' at end of string");
+        switch (*r.p++)
         {
-            value_map map;
-            for (Json::Value::ArrayIndex i = 0; i != n_elements; ++i)
+         case '"': *s += '"'; break;
+         case '/': *s += '/'; break;
+         case '\\': *s += '\\'; break;
+         case 'b': *s += '\b'; break;
+         case 'f': *s += '\f'; break;
+         case 'n': *s += '\n'; break;
+         case 'r': *s += '\r'; break;
+         case 't': *s += '\t'; break;
+         case 'u':
+          {
+            unsigned code_point = read_json_hex_escape(r, escape);
+            // Combine surrogate pairs.
+            if (code_point >= 0xd800 && code_point <= 0xdbff)
             {
-                auto const& element = json[i];
-                value k;
-                read_json_value(&k, check_in, element["key"]);
-                value v;
-                read_json_value(&v, check_in, element["value"]);
-                map[k] = v;
+                if (r.end - r.p < 2 || r.p[0] != '\\' || r.p[1] != 'u')
+                {
+                    throw_json_error(r, escape,
+                        "additional six characters expected to parse "
+                        "unicode surrogate pair.");
+                }
+                r.p += 2;
+                unsigned low = read_json_hex_escape(r, escape);
+                code_point =
+                    0x10000 + ((code_point & 0x3ff) << 10) + (low & 0x3ff);
             }
-            v->swap_in(map);
+            append_utf8(*s, code_point);
+            break;
+          }
+         default:
+            throw_json_error(r, escape, "Bad escape sequence in string");
         }
-        // Otherwise, read it as an actual list.
-        else
+    }
+}
+
+// Add a run of digits to *mantissa, counting them in *n_digits.
+// This returns false if there are too many digits for the mantissa to hold.
+static bool
+accumulate_json_digits(json_reader& r, uint64_t* mantissa, int* n_digits)
+{
+    while (r.end - r.p >= 8 && *n_digits <= 11)
+    {
+        uint64_t word = load_json_word(r.p);
+        if (!word_is_eight_digits(word))
+            break;
+        *mantissa = *mantissa * 100000000 + parse_eight_digits(word);
+        *n_digits += 8;
+        r.p += 8;
+    }
+    while (r.p != r.end && *r.p >= '0' && *r.p <= '9')
+    {
+        if (++*n_digits > 19)
+            return false;
+        *mantissa = *mantissa * 10 + unsigned(*r.p++ - '0');
+    }
+    return true;
+}
+
+// Try to read a number that's in one of the usual forms (up to 19
+// significant digits, with an optional fraction and exponent).
+// If this returns false, the caller must fall back to the general case.
+static bool
+read_simple_json_number(json_reader& r, value* v)
+{
+    bool negative = *r.p == '-';
+    if (negative)
+        ++r.p;
+
+    // Read the digits of the mantissa, noting where the decimal point falls.
+    // Leading zeros don't count toward the limit on digits.
+    uint64_t mantissa = 0;
+    int n_digits = 0, exponent = 0;
+    bool is_float = false;
+    char const* digits_start = r.p;
+    while (r.p != r.end && *r.p == '0')
+        ++r.p;
+    if (!accumulate_json_digits(r, &mantissa, &n_digits))
+        return false;
+    bool has_digits = r.p != digits_start;
+    if (r.p != r.end && *r.p == '.')
+    {
+        is_float = true;
+        ++r.p;
+        char const* fraction_start = r.p;
+        if (mantissa == 0)
         {
-            value_list values(n_elements);
-            for (Json::Value::ArrayIndex i = 0; i != n_elements; ++i)
-                read_json_value(&values[i], check_in, json[i]);
-            v->swap_in(values);
+            while (r.p != r.end && *r.p == '0')
+                ++r.p;
         }
-        break;
-      }
-     case Json::objectValue:
-      {
-        // An object is analagous to a record, but blobs and references
-        // are also encoded as JSON objects, so we have to check here if
-        // it's actually one of those.
-        Json::Value const& type = json["type"];
-        if (type.type() == Json::stringValue &&
-            type.asString() == "base64-encoded-blob")
+        if (!accumulate_json_digits(r, &mantissa, &n_digits))
+            return false;
+        exponent = -int(r.p - fraction_start);
+        has_digits = has_digits || r.p != fraction_start;
+    }
+    if (!has_digits)
+        return false;
+    if (r.p != r.end && (*r.p == 'e' || *r.p == 'E'))
+    {
+        is_float = true;
+        ++r.p;
+        bool negative_exponent = false;
+        if (r.p != r.end && (*r.p == '+' || *r.p == '-'))
+            negative_exponent = *r.p++ == '-';
+        char const* exponent_start = r.p;
+        int explicit_exponent = 0;
+        while (r.p != r.end && *r.p >= '0' && *r.p <= '9' &&
+            explicit_exponent < 10000)
         {
-            Json::Value const& json_blob = json["blob"];
-            if (json_blob.type() == Json::stringValue)
-            {
-                string encoded = json_blob.asString();
-                blob x;
-                text_parser p;
-                initialize(p, encoded, encoded.c_str(), encoded.length());
-                size_t decoded_size =
-                    get_base64_decoded_length(encoded.length());
-                alia__shared_ptr<uint8_t> ptr(new uint8_t[decoded_size],
-                    array_deleter<uint8_t>());
-                x.ownership = ptr;
-                x.data = reinterpret_cast<void const*>(ptr.get());
-                base64_decode(ptr.get(), &x.size, encoded.c_str(),
-                    encoded.length(), get_mime_base64_character_set());
-                set(*v, x);
-                break;
-            }
-            throw json_parse_error(
-                "incorrectly formatted base64-encoded-blob");
+            explicit_exponent = explicit_exponent * 10 + (*r.p++ - '0');
         }
-        // Otherwise, interpret it as a record.
-        value_map map;
-        Json::Value::Members members = json.getMemberNames();
-        for (Json::Value::Members::const_iterator i = members.begin();
-            i != members.end(); ++i)
+        if (r.p == exponent_start)
+            return false;
+        exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+    }
+    // Anything else that jsoncpp would have considered part of the token
+    // (e.g., a second sign) is left to the general case.
+    if (r.p != r.end && (*r.p == '.' || *r.p == 'e' || *r.p == 'E' ||
+            *r.p == '+' || *r.p == '-' || (*r.p >= '0' && *r.p <= '9')))
+    {
+        return false;
+    }
+
+    if (!is_float)
+    {
+        // jsoncpp gave up on integers once the digits before the last one
+        // reached a tenth of the 32-bit limit.
+        if (negative ? mantissa / 10 < 214748364 : mantissa / 10 < 429496729)
         {
-            read_json_value(&map[value(*i)], check_in,
-                json.get(*i, Json::Value::null));
+            set(*v, negative ? -integer(mantissa) : integer(mantissa));
+            return true;
         }
-        v->swap_in(map);
-        break;
-      }
     }
+
+    // If the mantissa and the power of ten are both exactly representable,
+    // their product (or quotient) is correctly rounded.
+    if (mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22)
+        return false;
+    static double const powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+        1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    double x = double(mantissa);
+    if (exponent < 0)
+        x /= powers_of_ten[-exponent];
+    else
+        x *= powers_of_ten[exponent];
+    set(*v, negative ? -x : x);
+    return true;
 }
 
-void parse_json_value(value* v, char const* json, size_t length)
+// Read a JSON number.
+// Numbers are interpreted the way jsoncpp interpreted them: anything with a
+// fraction or exponent is a float, and so is any integer that doesn't fit in
+// 32 bits (signed or unsigned).
+static void
+read_json_number(json_reader& r, value* v)
 {
-    Json::Value root;
-    Json::Reader reader;
-    if (!reader.parse(json, json + length, root))
-        throw json_parse_error(reader.getFormatedErrorMessages());
-    null_check_in check_in;
-    read_json_value(v, check_in, root);
+    char const* start = r.p;
+    if (read_simple_json_number(r, v))
+        return;
+
+    // Find the end of the token and let the C library convert it.
+    r.p = start;
+    while (r.p != r.end && ((*r.p >= '0' && *r.p <= '9') || *r.p == '.' ||
+        *r.p == 'e' || *r.p == 'E' || *r.p == '+' || *r.p == '-'))
+    {
+        ++r.p;
+    }
+    string token(start, r.p);
+    char* token_end;
+    double x = strtod(token.c_str(), &token_end);
+    if (token_end == token.c_str())
+        throw_json_error(r, start, "'" + token + "' is not a number.");
+    set(*v, x);
 }
 
-bool static
-has_only_string_keys(value_map const& map)
+// Times are encoded as JSON strings in Thinknode's format (the one that
+// to_value_string produces): YYYY-MM-DDTHH:MM:SS.mmmZ. This parses that
+// format directly, since going through parse_time for every string that
+// might be a time is expensive.
+static bool
+parse_json_time(boost::posix_time::ptime* t, string const& s)
 {
-    for (auto const& i : map)
+    static char const pattern[] = "dddd-dd-ddTdd:dd:dd.dddZ";
+    if (s.length() != sizeof(pattern) - 1)
+        return false;
+    for (size_t i = 0; i != s.length(); ++i)
     {
-        if (i.first.type() != value_type::STRING)
+        if (pattern[i] == 'd' ? !(s[i] >= '0' && s[i] <= '9') :
+            s[i] != pattern[i])
+        {
+            return false;
+        }
+    }
+    auto field = [&](size_t offset, size_t length)
+    {
+        int n = 0;
+        for (size_t i = 0; i != length; ++i)
+            n = n * 10 + (s[offset + i] - '0');
+        return n;
+    };
+    int hours = field(11, 2), minutes = field(14, 2), seconds = field(17, 2);
+    if (hours > 23 || minutes > 59 || seconds > 59)
+        return false;
+    try
+    {
+        namespace bt = boost::posix_time;
+        *t = bt::ptime(
+            boost::gregorian::date(field(0, 4), field(5, 2), field(8, 2)),
+            bt::hours(hours) + bt::minutes(minutes) + bt::seconds(seconds) +
+            bt::milliseconds(field(20, 3)));
+        return true;
+    }
+    catch (...)
+    {
+        // The date is invalid.
+        return false;
+    }
+}
+
+// If a string parses as a time, it's assumed to actually be a time.
+static void
+set_json_string_value(value* v, string& s)
+{
+    boost::posix_time::ptime t;
+    if (parse_json_time(&t, s))
+        set(*v, t);
+    else
+        v->swap_in(s);
+}
+
+// Is v a record with exactly the fields 'key' and 'value'?
+static bool
+is_key_value_pair(value const& v)
+{
+    if (v.type() != value_type::MAP)
+        return false;
+    value_map const& fields = cast<value_map>(v);
+    if (fields.size() != 2)
+        return false;
+    auto i = fields.begin();
+    if (i->first.type() != value_type::STRING ||
+        cast<string>(i->first) != "key")
+    {
+        return false;
+    }
+    ++i;
+    return i->first.type() == value_type::STRING &&
+        cast<string>(i->first) == "value";
+}
+
+static bool
+read_json_value(json_reader& r, value* v);
+
+// Read a JSON array. r.p should be just past the '['.
+static void
+read_json_array(json_reader& r, value* v)
+{
+    value_list items;
+    // A list that contains only key/value pairs is actually an encoded map.
+    bool resembles_map = true;
+    skip_json_whitespace(r);
+    if (r.p != r.end && *r.p == ']')
+    {
+        ++r.p;
+        v->swap_in(items);
+        return;
+    }
+    for (;;)
+    {
+        items.push_back(value());
+        bool is_record = read_json_value(r, &items.back());
+        if (!is_record || !is_key_value_pair(items.back()))
+            resembles_map = false;
+        skip_json_whitespace(r);
+        if (r.p != r.end && *r.p == ',')
+        {
+            ++r.p;
+            continue;
+        }
+        if (r.p != r.end && *r.p == ']')
+        {
+            ++r.p;
+            break;
+        }
+        throw_json_error(r, r.p,
+            "Missing ',' or ']' in array declaration");
+    }
+    if (resembles_map)
+    {
+        value_map::sequence_type entries;
+        entries.reserve(items.size());
+        for (auto const& item : items)
+        {
+            value_map const& pair = cast<value_map>(item);
+            entries.emplace_back(
+                get_field(pair, "key"), get_field(pair, "value"));
+        }
+        value_map map;
+        build_value_map(&map, entries);
+        v->swap_in(map);
+    }
+    else
+        v->swap_in(items);
+}
+
+// Read a JSON object. r.p should be just past the '{'.
+// An object is analagous to a record, but blobs are also encoded as JSON
+// objects, so this checks if it's actually one of those.
+static bool
+read_json_object(json_reader& r, value* v)
+{
+    value_map map;
+    bool has_type_field = false;
+    skip_json_whitespace(r);
+    if (r.p != r.end && *r.p == '}')
+    {
+        ++r.p;
+        v->swap_in(map);
+        return true;
+    }
+    value_map::sequence_type members;
+    string name;
+    for (;;)
+    {
+        skip_json_whitespace(r);
+        if (r.p == r.end || *r.p != '"')
+            throw_json_error(r, r.p, "Missing '}' or object member name");
+        ++r.p;
+        read_json_string(r, &name);
+        if (name == "type")
+            has_type_field = true;
+        expect_json_char(r, ':', "Missing ':' after object member name");
+        // Most member names are field names, so use the interned copy if
+        // there is one.
+        value key;
+        if (!find_interned_field_key(&key, name.data(), name.length()))
+            key.swap_in(name);
+        // The members are collected as they come and sorted at the end.
+        // (If a name is repeated, the last value wins.)
+        members.emplace_back(std::move(key), value());
+        read_json_value(r, &members.back().second);
+        skip_json_whitespace(r);
+        if (r.p != r.end && *r.p == ',')
+        {
+            ++r.p;
+            continue;
+        }
+        if (r.p != r.end && *r.p == '}')
+        {
+            ++r.p;
+            break;
+        }
+        throw_json_error(r, r.p,
+            "Missing ',' or '}' in object declaration");
+    }
+    build_value_map(&map, members);
+
+    if (has_type_field)
+    {
+        value const& type = map[value("type")];
+        if (type.type() == value_type::STRING &&
+            cast<string>(type) == "base64-encoded-blob")
+        {
+            auto json_blob = map.find(value("blob"));
+            if (json_blob == map.end() ||
+                json_blob->second.type() != value_type::STRING)
+            {
+                throw json_parse_error(
+                    "incorrectly formatted base64-encoded-blob");
+            }
+            string const& encoded = cast<string>(json_blob->second);
+            blob x;
+            size_t decoded_size = get_base64_decoded_length(encoded.length());
+            alia__shared_ptr<uint8_t> ptr(new uint8_t[decoded_size],
+                array_deleter<uint8_t>());
+            x.ownership = ptr;
+            x.data = reinterpret_cast<void const*>(ptr.get());
+            base64_decode(ptr.get(), &x.size, encoded.c_str(),
+                encoded.length(), get_mime_base64_character_set());
+            set(*v, x);
             return false;
+        }
     }
+
+    v->swap_in(map);
     return true;
 }
 
-static void write_json_value(Json::Value* json, value const& v)
+// Read a JSON value into a CRADLE value.
+// The return value indicates whether or not the value was read from a plain
+// JSON object (i.e., a record).
+static bool
+read_json_value(json_reader& r, value* v)
 {
-    switch (v.type())
+    skip_json_whitespace(r);
+    if (r.p == r.end)
     {
-     case value_type::NIL:
-        *json = Json::Value::null;
-        break;
-     case value_type::BOOLEAN:
-        *json = cast<bool>(v);
-        break;
-     case value_type::INTEGER:
-        *json = double(cast<integer>(v));
-        break;
-     case value_type::FLOAT:
-        *json = cast<double>(v);
-        break;
-     case value_type::STRING:
-        *json = cast<string>(v);
-        break;
-     case value_type::BLOB:
-      {
-        blob const& x = cast<blob>(v);
-        (*json)["type"] = "base64-encoded-blob";
-        (*json)["blob"] =
-            base64_encode(static_cast<uint8_t const*>(x.data), x.size,
-                get_mime_base64_character_set());
-        break;
-      }
-     case value_type::DATETIME:
+        throw_json_error(r, r.p,
+            "Syntax error: value, object or array expected.");
+    }
+    switch (*r.p)
+    {
+     case '{':
+        ++r.p;
+        return read_json_object(r, v);
+     case '[':
+        ++r.p;
+        read_json_array(r, v);
+        return false;
+     case '"':
       {
-        *json = to_value_string(cast<boost::posix_time::ptime>(v));
-        break;
+        ++r.p;
+        string s;
+        read_json_string(r, &s);
+        set_json_string_value(v, s);
+        return false;
       }
-     case value_type::LIST:
-      {
-        *json = Json::Value(Json::arrayValue);
-        value_list const& x = cast<value_list>(v);
-        Json::Value::ArrayIndex size =
-            boost::numeric_cast<Json::Value::ArrayIndex>(x.size());
-        json->resize(size);
-        for (Json::Value::ArrayIndex i = 0; i != size; ++i)
-            write_json_value(&(*json)[i], x[i]);
+     case '-':
+     case '0': case '1': case '2': case '3': case '4':
+     case '5': case '6': case '7': case '8': case '9':
+        read_json_number(r, v);
+        return false;
+     case 't':
+        if (r.end - r.p >= 4 && memcmp(r.p, "true", 4) == 0)
+        {
+            r.p += 4;
+            set(*v, true);
+            return false;
+        }
         break;
-      }
-     case value_type::MAP:
-      {
-        value_map const& x = cast<value_map>(v);
-        // If the map has only key strings, encode it directly as a JSON
-        // object.
-        if (has_only_string_keys(x))
+     case 'f':
+        if (r.end - r.p >= 5 && memcmp(r.p, "false", 5) == 0)
         {
-            *json = Json::Value(Json::objectValue);
-            for (value_map::const_iterator i = x.begin(); i != x.end(); ++i)
-                write_json_value(&(*json)[cast<string>(i->first)], i->second);
+            r.p += 5;
+            set(*v, false);
+            return false;
         }
-        // Otherwise, encode it as a list of key/value pairs.
-        else
+        break;
+     case 'n':
+        if (r.end - r.p >= 4 && memcmp(r.p, "null", 4) == 0)
         {
-            *json = Json::Value(Json::arrayValue);
-            Json::Value::ArrayIndex size =
-                boost::numeric_cast<Json::Value::ArrayIndex>(x.size());
-            json->resize(size);
-            Json::Value::ArrayIndex index = 0;
-            for (value_map::const_iterator i = x.begin(); i != x.end(); ++i)
-            {
-                write_json_value(&(*json)[index]["key"], i->first);
-                write_json_value(&(*json)[index]["value"], i->second);
-                ++index;
-            }
+            r.p += 4;
+            set(*v, nil);
+            return false;
         }
         break;
-      }
     }
+    throw_json_error(r, r.p,
+        "Syntax error: value, object or array expected.");
+    return false;
 }
 
-void value_to_json(string* json, value const& v)
+void parse_json_value(value* v, char const* json, size_t length)
 {
-    Json::Value root;
-    write_json_value(&root, v);
-    Json::StyledWriter writer;
-    *json = writer.write(root);
+    json_reader r;
+    r.begin = r.p = json;
+    r.end = json + length;
+    read_json_value(r, v);
 }
 
-blob value_to_json_blob(value const& v)
+bool static
+has_only_string_keys(value_map const& map)
 {
-    string json = value_to_json(v);
-    blob blob;
-    // Don't include the terminating '\0'.
-    alia__shared_ptr<char> ptr(
-        new char[json.length()], array_deleter<char>());
-    blob.ownership = ptr;
-    blob.data = ptr.get();
-    memcpy(ptr.get(), json.c_str(), json.length());
-    blob.size = json.length();
-    return blob;
+    for (auto const& i : map)
+    {
+        if (i.first.type() != value_type::STRING)
+            return false;
+    }
+    return true;
 }
 
-// MSGPACK I/O
+// The writer produces exactly the same text as the jsoncpp StyledWriter
+// that it replaced, since some IDs (e.g., function UIDs) are derived from
+// the JSON form of values.
 
-void static
-read_msgpack_value(
-    value* v,
-    ownership_holder const& ownership,
-    msgpack::object const& object)
+// jsoncpp wrapped arrays of simple values once they reached this width.
+static int const json_right_margin = 74;
+
+static void
+write_json_string(string& out, char const* s, size_t length)
 {
-    switch (object.type)
+    static char const hex_digits[] = "0123456789ABCDEF";
+    out += '"';
+    char const* end = s + length;
+    while (s != end)
     {
-     case msgpack::type::NIL:
-        set(*v, nil);
-        break;
-     case msgpack::type::BOOLEAN:
-        set(*v, object.via.boolean);
-        break;
+        // Copy over runs of characters that don't need escaping.
+        char const* run = s;
+        while (s != end && *s != '"' && *s != '\\' &&
+            static_cast<unsigned char>(*s) >= 0x20)
+        {
+            ++s;
+        }
+        out.append(run, s);
+        if (s == end)
+            break;
+        char c = *s++;
+        switch (c)
+        {
+         case '"': out += "\\\""; break;
+         case '\\': out += "\\\\"; break;
+         case '\b': out += "\\b"; break;
+         case '\f': out += "\\f"; break;
+         case '\n': out += "\\n"; break;
+         case '\r': out += "\\r"; break;
+         case '\t': out += "\\t"; break;
+         default:
+            out += "\\u00";
+            out += hex_digits[(c >> 4) & 0xf];
+            out += hex_digits[c & 0xf];
+        }
+    }
+    out += '"';
+}
+
+// Numbers are written as doubles, in jsoncpp's format (%#.16g with the
+// trailing zeros trimmed down to one).
+static void
+write_json_number(string& out, double x)
+{
+    // Integral values are by far the most common case, so they're formatted
+    // directly.
+    if (x == std::floor(x) && std::fabs(x) < 1e15 &&
+        !(x == 0 && std::signbit(x)))
+    {
+        char buffer[24];
+        char* p = buffer + sizeof(buffer);
+        uint64_t n = uint64_t(std::fabs(x));
+        do
+        {
+            *--p = char('0' + n % 10);
+            n /= 10;
+        }
+        while (n != 0);
+        if (x < 0)
+            *--p = '-';
+        out.append(p, buffer + sizeof(buffer));
+        out += ".0";
+        return;
+    }
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%#.16g", x);
+    char* p = buffer + strlen(buffer) - 1;
+    if (*p == '0')
+    {
+        while (p > buffer && *p == '0')
+            --p;
+        char* last_nonzero = p;
+        while (p >= buffer && *p >= '0' && *p <= '9')
+            --p;
+        if (p >= buffer && *p == '.')
+            *(last_nonzero + 2) = '\0';
+    }
+    out += buffer;
+}
+
+// Get the number of elements that the JSON form of v has if it's a non-empty
+// array or object (or 0 otherwise).
+static size_t
+json_container_size(value const& v)
+{
+    switch (v.type())
+    {
+     case value_type::BLOB:
+        return 2;
+     case value_type::LIST:
+        return cast<value_list>(v).size();
+     case value_type::MAP:
+        return cast<value_map>(v).size();
+     default:
+        return 0;
+    }
+}
+
+struct json_writer
+{
+    string* out;
+    string indentation;
+};
+
+static void
+write_json_indent(json_writer& w)
+{
+    string& out = *w.out;
+    if (!out.empty())
+    {
+        char last = out[out.length() - 1];
+        // If it's already indented, there's nothing to do.
+        if (last == ' ')
+            return;
+        out += '\n';
+    }
+    out += w.indentation;
+}
+
+// This produces the same format as to_value_string (but much faster).
+static void
+write_json_time(string& out, boost::posix_time::ptime const& t)
+{
+    if (t.is_special())
+    {
+        string s = to_value_string(t);
+        write_json_string(out, s.c_str(), s.length());
+        return;
+    }
+    auto date = t.date().year_month_day();
+    auto time_of_day = t.time_of_day();
+    int fields[] = {
+        int(date.year), int(date.month), int(date.day),
+        int(time_of_day.hours()), int(time_of_day.minutes()),
+        int(time_of_day.seconds()),
+        int(time_of_day.total_milliseconds() % 1000) };
+    char text[] = "\"0000-00-00T00:00:00.000Z\"";
+    int const offsets[] = { 1, 6, 9, 12, 15, 18, 21 };
+    int const lengths[] = { 4, 2, 2, 2, 2, 2, 3 };
+    for (int i = 0; i != 7; ++i)
+    {
+        int n = fields[i];
+        for (int j = lengths[i] - 1; j >= 0; --j)
+        {
+            text[offsets[i] + j] = char('0' + n % 10);
+            n /= 10;
+        }
+    }
+    out.append(text, sizeof(text) - 1);
+}
+
+static void
+write_json_value(json_writer& w, value const& v);
+
+static void
+write_json_member(json_writer& w, char const* name, size_t name_length,
+    value const& v)
+{
+    write_json_indent(w);
+    write_json_string(*w.out, name, name_length);
+    *w.out += ": ";
+    write_json_value(w, v);
+}
+
+// Write a non-empty JSON object whose members are written by
+// write_members(w).
+template<class MemberWriter>
+static void
+write_json_object(json_writer& w, MemberWriter const& write_members)
+{
+    write_json_indent(w);
+    *w.out += '{';
+    w.indentation.append(3, ' ');
+    write_members(w);
+    w.indentation.resize(w.indentation.length() - 3);
+    write_json_indent(w);
+    *w.out += '}';
+}
+
+static void
+write_json_key_value_pair(json_writer& w, value const& key,
+    value const& value)
+{
+    write_json_object(w, [&](json_writer& w) {
+        write_json_member(w, "key", 3, key);
+        *w.out += ',';
+        write_json_member(w, "value", 5, value);
+    });
+}
+
+// Write a non-empty JSON array. Items provides iteration over the items and
+// knows how to write them. As with jsoncpp, the array is written on a single
+// line if it's short and its items are all simple.
+template<class Items>
+static void
+write_json_array(json_writer& w, Items const& items)
+{
+    string& out = *w.out;
+    size_t n_items = items.size();
+    bool multiline = n_items * 3 >= size_t(json_right_margin);
+    for (auto i = items.begin(); !multiline && i != items.end(); ++i)
+        multiline = items.is_container(i);
+    if (!multiline)
+    {
+        size_t start = out.length();
+        out += "[ ";
+        bool first = true;
+        for (auto i = items.begin(); i != items.end(); ++i)
+        {
+            if (!first)
+                out += ", ";
+            items.write(w, i);
+            first = false;
+        }
+        out += " ]";
+        if (out.length() - start < size_t(json_right_margin))
+            return;
+        out.resize(start);
+    }
+    write_json_indent(w);
+    out += '[';
+    w.indentation.append(3, ' ');
+    bool first = true;
+    for (auto i = items.begin(); i != items.end(); ++i)
+    {
+        if (!first)
+            out += ',';
+        write_json_indent(w);
+        items.write(w, i);
+        first = false;
+    }
+    w.indentation.resize(w.indentation.length() - 3);
+    write_json_indent(w);
+    out += ']';
+}
+
+struct json_list_items
+{
+    value_list const& list;
+    size_t size() const { return list.size(); }
+    value_list::const_iterator begin() const { return list.begin(); }
+    value_list::const_iterator end() const { return list.end(); }
+    bool is_container(value_list::const_iterator i) const
+    { return json_container_size(*i) != 0; }
+    void write(json_writer& w, value_list::const_iterator i) const
+    { write_json_value(w, *i); }
+};
+
+// Maps with non-string keys are written as arrays of key/value pairs.
+struct json_map_items
+{
+    value_map const& map;
+    size_t size() const { return map.size(); }
+    value_map::const_iterator begin() const { return map.begin(); }
+    value_map::const_iterator end() const { return map.end(); }
+    bool is_container(value_map::const_iterator i) const
+    { return true; }
+    void write(json_writer& w, value_map::const_iterator i) const
+    { write_json_key_value_pair(w, i->first, i->second); }
+};
+
+static void
+write_json_value(json_writer& w, value const& v)
+{
+    string& out = *w.out;
+    switch (v.type())
+    {
+     case value_type::NIL:
+        out += "null";
+        break;
+     case value_type::BOOLEAN:
+        out += cast<bool>(v) ? "true" : "false";
+        break;
+     case value_type::INTEGER:
+        write_json_number(out, double(cast<integer>(v)));
+        break;
+     case value_type::FLOAT:
+        write_json_number(out, cast<double>(v));
+        break;
+     case value_type::STRING:
+      {
+        string const& s = cast<string>(v);
+        write_json_string(out, s.c_str(), s.length());
+        break;
+      }
+     case value_type::BLOB:
+      {
+        blob const& x = cast<blob>(v);
+        write_json_object(w, [&](json_writer& w) {
+            write_json_indent(w);
+            *w.out += "\"blob\": \"";
+            // Encode directly into the output.
+            size_t start = w.out->length(), encoded_size;
+            w.out->resize(start + get_base64_encoded_length(x.size));
+            base64_encode(&(*w.out)[start], &encoded_size,
+                static_cast<uint8_t const*>(x.data), x.size,
+                get_mime_base64_character_set());
+            w.out->resize(start + encoded_size);
+            *w.out += "\",";
+            write_json_indent(w);
+            *w.out += "\"type\": \"base64-encoded-blob\"";
+        });
+        break;
+      }
+     case value_type::DATETIME:
+        write_json_time(out, cast<boost::posix_time::ptime>(v));
+        break;
+     case value_type::LIST:
+      {
+        value_list const& x = cast<value_list>(v);
+        if (x.empty())
+            out += "[]";
+        else
+            write_json_array(w, json_list_items{ x });
+        break;
+      }
+     case value_type::MAP:
+      {
+        value_map const& x = cast<value_map>(v);
+        if (x.empty())
+        {
+            out += "{}";
+        }
+        // If the map has only key strings, encode it directly as a JSON
+        // object.
+        else if (has_only_string_keys(x))
+        {
+            write_json_object(w, [&](json_writer& w) {
+                bool first = true;
+                for (auto const& i : x)
+                {
+                    if (!first)
+                        *w.out += ',';
+                    string const& name = cast<string>(i.first);
+                    write_json_member(w, name.c_str(), name.length(),
+                        i.second);
+                    first = false;
+                }
+            });
+        }
+        // Otherwise, encode it as a list of key/value pairs.
+        else
+            write_json_array(w, json_map_items{ x });
+        break;
+      }
+    }
+}
+
+void value_to_json(string* json, value const& v)
+{
+    json->clear();
+    json_writer w;
+    w.out = json;
+    write_json_value(w, v);
+    *json += '\n';
+}
+
+blob value_to_json_blob(value const& v)
+{
+    string json = value_to_json(v);
+    blob blob;
+    // Don't include the terminating '\0'.
+    alia__shared_ptr<char> ptr(
+        new char[json.length()], array_deleter<char>());
+    blob.ownership = ptr;
+    blob.data = ptr.get();
+    memcpy(ptr.get(), json.c_str(), json.length());
+    blob.size = json.length();
+    return blob;
+}
+
+// MSGPACK I/O
+
+void static
+read_msgpack_value(
+    value* v,
+    ownership_holder const& ownership,
+    msgpack::object const& object)
+{
+    switch (object.type)
+    {
+     case msgpack::type::NIL:
+        set(*v, nil);
+        break;
+     case msgpack::type::BOOLEAN:
+        set(*v, object.via.boolean);
+        break;
      case msgpack::type::POSITIVE_INTEGER:
         // Maybe we should check for overflow here.
         set(*v, integer(object.via.u64));
@@ -368,14 +1167,27 @@ read_msgpack_value(
       }
      case msgpack::type::MAP:
       {
-        value_map map;
+        value_map::sequence_type entries;
+        entries.reserve(object.via.map.size);
         for (size_t i = 0; i != object.via.map.size; ++i)
         {
             auto const& pair = object.via.map.ptr[i];
+            // Most keys are field names, so use the interned copy if there
+            // is one.
             value key;
-            read_msgpack_value(&key, ownership, pair.key);
-            read_msgpack_value(&map[key], ownership, pair.val);
+            if (pair.key.type != msgpack::type::STR ||
+                !find_interned_field_key(&key, pair.key.via.str.ptr,
+                    pair.key.via.str.size))
+            {
+                read_msgpack_value(&key, ownership, pair.key);
+            }
+            // The keys can come in any order, so the entries are sorted
+            // once at the end.
+            entries.emplace_back(std::move(key), value());
+            read_msgpack_value(&entries.back().second, ownership, pair.val);
         }
+        value_map map;
+        build_value_map(&map, entries);
         v->swap_in(map);
         break;
       }
@@ -468,385 +1280,1747 @@ msgpack_unpack_reference_type(
     return type == msgpack::type::BIN;
 }
 
-void
-parse_msgpack_value(
-    value* v,
-    ownership_holder const& ownership,
-    uint8_t const* data,
-    size_t size)
+void
+parse_msgpack_value(
+    value* v,
+    ownership_holder const& ownership,
+    uint8_t const* data,
+    size_t size)
+{
+    msgpack::object_handle handle =
+        msgpack::unpack(
+            reinterpret_cast<char const*>(data),
+            size,
+            msgpack_unpack_reference_type);
+    read_msgpack_value(v, ownership, handle.get());
+}
+
+// This implements msgpack-c's Buffer concept by just counting the bytes that
+// are written to it.
+struct msgpack_size_counter
+{
+    size_t size;
+    msgpack_size_counter() : size(0) {}
+    void write(char const* data, size_t length)
+    { size += length; }
+};
+
+// This implements the Buffer concept by writing to memory that has already
+// been allocated.
+struct msgpack_fixed_buffer
+{
+    char* position;
+    void write(char const* data, size_t length)
+    {
+        std::memcpy(position, data, length);
+        position += length;
+    }
+};
+
+// Since the packed size of a value is cheap to compute, the contiguous
+// forms allocate their memory up front rather than growing it as they go.
+static size_t
+get_msgpack_size(value const& v)
+{
+    msgpack_size_counter counter;
+    msgpack::packer<msgpack_size_counter> packer(counter);
+    write_msgpack_value(packer, v);
+    return counter.size;
+}
+static void
+write_msgpack_to_memory(char* dst, value const& v)
+{
+    msgpack_fixed_buffer buffer;
+    buffer.position = dst;
+    msgpack::packer<msgpack_fixed_buffer> packer(buffer);
+    write_msgpack_value(packer, v);
+}
+
+string value_to_msgpack_string(value const& v)
+{
+    // Every value packs to at least one byte.
+    string packed(get_msgpack_size(v), '\0');
+    write_msgpack_to_memory(&packed[0], v);
+    return packed;
+}
+
+blob value_to_msgpack_blob(value const& v)
+{
+    size_t size = get_msgpack_size(v);
+    alia__shared_ptr<char> ptr(new char[size], array_deleter<char>());
+    write_msgpack_to_memory(ptr.get(), v);
+    blob b;
+    b.ownership = ptr;
+    b.data = ptr.get();
+    b.size = size;
+    return b;
+}
+
+// Bodies at least this large are referenced by the segmented encoding rather
+// than being copied into its framing buffer.
+static size_t const msgpack_reference_threshold = 0x1000;
+
+// Framing buffers up to this size are kept around for reuse.
+static size_t const max_cached_framing_buffer_size = 0x100000;
+
+// This implements the Buffer concept for the segmented encoding.
+// Segments in the framing buffer are recorded by offset (with a null data
+// pointer) until the encoding is done, since the buffer may move as it grows.
+struct msgpack_segment_writer
+{
+    struct segment
+    {
+        char const* data;
+        size_t offset, size;
+    };
+    std::vector<char>* framing;
+    std::vector<segment> segments;
+
+    void write(char const* data, size_t length)
+    {
+        if (length >= msgpack_reference_threshold)
+        {
+            segment s = { data, 0, length };
+            segments.push_back(s);
+        }
+        else
+        {
+            if (segments.empty() || segments.back().data)
+            {
+                segment s = { 0, framing->size(), 0 };
+                segments.push_back(s);
+            }
+            framing->insert(framing->end(), data, data + length);
+            segments.back().size += length;
+        }
+    }
+};
+
+// Each thread keeps the framing buffer from its last encoding so that it can
+// be reused by the next one (once the segments that reference it are gone).
+static boost::thread_specific_ptr<alia__shared_ptr<std::vector<char> > >
+    the_cached_framing_buffer;
+
+std::vector<blob> value_to_msgpack_segments(value const& v)
+{
+    alia__shared_ptr<std::vector<char> > framing;
+    auto* cached = the_cached_framing_buffer.get();
+    if (cached && cached->use_count() == 1)
+    {
+        framing = *cached;
+        framing->clear();
+    }
+    else
+        framing.reset(new std::vector<char>);
+
+    msgpack_segment_writer writer;
+    writer.framing = framing.get();
+    {
+        msgpack::packer<msgpack_segment_writer> packer(writer);
+        write_msgpack_value(packer, v);
+    }
+
+    // The referenced segments all point into v, so they share ownership of
+    // it.
+    ownership_holder v_ownership(v);
+    ownership_holder framing_ownership(framing);
+    std::vector<blob> segments(writer.segments.size());
+    for (size_t i = 0; i != segments.size(); ++i)
+    {
+        auto const& s = writer.segments[i];
+        blob& b = segments[i];
+        if (s.data)
+        {
+            b.ownership = v_ownership;
+            b.data = s.data;
+        }
+        else
+        {
+            b.ownership = framing_ownership;
+            b.data = &(*framing)[0] + s.offset;
+        }
+        b.size = s.size;
+    }
+
+    if (framing->capacity() <= max_cached_framing_buffer_size)
+    {
+        if (cached)
+            *cached = framing;
+        else
+        {
+            the_cached_framing_buffer.reset(
+                new alia__shared_ptr<std::vector<char> >(framing));
+        }
+    }
+
+    return segments;
+}
+
+// MEMORY I/O
+
+namespace {
+
+// In raw values that are encoded with aligned blobs, the contents of each
+// blob start at a multiple of this (relative to the start of the buffer).
+size_t const blob_alignment = 16;
+
+// Streamed raw values are read and written through buffers of this size.
+size_t const stream_buffer_size = 0x10000;
+
+size_t static
+get_blob_padding(size_t offset)
+{
+    return (blob_alignment - offset % blob_alignment) % blob_alignment;
+}
+
+// raw_blob_layout describes how blobs are handled when reading a raw value.
+struct raw_blob_layout
+{
+    // If this is non-null, the value was encoded with aligned blobs, and
+    // this is the address that their alignment is relative to.
+    uint8_t const* aligned_base;
+    // If this is non-null, blobs reference the buffer directly (sharing
+    // this ownership) rather than being copied out of it.
+    ownership_holder const* ownership;
+
+    raw_blob_layout() : aligned_base(0), ownership(0) {}
+};
+
+// Small blobs are allocated out of shared blocks of up to this size rather
+// than individually. (Values like structure geometry contain lots of them.)
+size_t const blob_arena_block_size = 0x10000;
+// Blobs larger than this always get their own storage.
+size_t const max_arena_blob_size = 0x1000;
+// The first few small blobs in a value also get their own storage, so a
+// value with only a handful of them doesn't hold onto a whole block.
+unsigned const min_arena_blob_count = 4;
+
+// blob_arena hands out storage for the blobs within a value as it's read.
+// Each block is shared by all the blobs within it, so it's freed once
+// they're all gone.
+struct blob_arena
+{
+    blob_arena() : block_used(0), block_size(0), small_blob_count(0) {}
+    alia__shared_ptr<uint8_t> block;
+    size_t block_used, block_size;
+    // the number of small blobs that have been allocated so far
+    unsigned small_blob_count;
+};
+
+// Allocate storage for the contents of x (according to x.size) and point
+// x's data and ownership at it.
+// remaining is the number of encoded bytes left in the value (including x's
+// contents). Since the value's remaining blobs can't be any bigger than
+// that, a new block is never bigger than that either.
+static uint8_t*
+allocate_blob(blob_arena& arena, blob& x, size_t remaining)
+{
+    uint8_t* data;
+    if (x.size > max_arena_blob_size ||
+        arena.small_blob_count++ < min_arena_blob_count)
+    {
+        alia__shared_ptr<uint8_t> ptr(new uint8_t[x.size],
+            array_deleter<uint8_t>());
+        x.ownership = ptr;
+        data = ptr.get();
+    }
+    else
+    {
+        // Blobs are aligned within the block, just as they would be if they
+        // had their own allocations.
+        size_t offset = arena.block_used + get_blob_padding(arena.block_used);
+        if (!arena.block || offset + x.size > arena.block_size)
+        {
+            arena.block_size = (std::max)(x.size,
+                (std::min)(blob_arena_block_size, remaining));
+            arena.block.reset(new uint8_t[arena.block_size],
+                array_deleter<uint8_t>());
+            offset = 0;
+        }
+        arena.block_used = offset + x.size;
+        x.ownership = arena.block;
+        data = arena.block.get() + offset;
+    }
+    x.data = data;
+    return data;
+}
+
+// memory_value_reader reads a raw value that's entirely in memory.
+struct memory_value_reader
+{
+    memory_value_reader(uint8_t const* data, size_t size,
+        raw_blob_layout const& layout, bool indexed)
+      : raw(data, size), layout(layout), indexed(indexed),
+        referenced_blobs(0)
+    {}
+    raw_memory_reader raw;
+    raw_blob_layout layout;
+    // Does the value have item tables (i.e., was it written with
+    // value_codec::INDEXED)?
+    bool indexed;
+    blob_arena arena;
+    // If this is non-null, the ranges occupied by the contents of blobs that
+    // reference the buffer are recorded here (as offsets relative to
+    // layout.aligned_base).
+    std::vector<std::pair<size_t,size_t> >* referenced_blobs;
+};
+
+void static
+raw_read(memory_value_reader& r, void* dst, size_t size)
+{
+    raw_read(r.raw, dst, size);
+}
+
+// Read the contents of a blob whose size has already been read.
+void static
+read_raw_blob(memory_value_reader& r, blob& x)
+{
+    raw_memory_reader& raw = r.raw;
+    if (r.layout.aligned_base)
+    {
+        size_t padding =
+            get_blob_padding(raw.buffer - r.layout.aligned_base);
+        if (padding > raw.size)
+            throw corrupt_data();
+        advance(raw, padding);
+    }
+    if (x.size > raw.size)
+        throw corrupt_data();
+    if (r.layout.ownership)
+    {
+        x.ownership = *r.layout.ownership;
+        x.data = raw.buffer;
+        if (r.referenced_blobs)
+        {
+            size_t offset = raw.buffer - r.layout.aligned_base;
+            r.referenced_blobs->push_back(
+                std::make_pair(offset, offset + x.size));
+        }
+        advance(raw, x.size);
+    }
+    else
+        raw_read(raw, allocate_blob(r.arena, x, raw.size), x.size);
+}
+
+// stream_value_reader reads a raw value incrementally from a
+// stream_decompressor, computing its CRC along the way. Small reads are
+// served from a buffer, but large ones (i.e., blob contents) go directly
+// into their destinations.
+struct stream_value_reader
+{
+    stream_value_reader(stream_decompressor& src, uint64_t size,
+        bool aligned_blobs, bool indexed)
+      : src(&src), remaining(size), buffer(new uint8_t[stream_buffer_size]),
+        buffer_pos(0), buffer_end(0), crc(0), offset(0),
+        aligned_blobs(aligned_blobs), indexed(indexed)
+    {}
+    stream_decompressor* src;
+    // the number of bytes that haven't been read from src yet
+    uint64_t remaining;
+    boost::scoped_array<uint8_t> buffer;
+    size_t buffer_pos, buffer_end;
+    // the CRC of everything that's been read from src
+    uint32_t crc;
+    // the number of bytes that have been read by the value reader
+    uint64_t offset;
+    bool aligned_blobs;
+    bool indexed;
+    blob_arena arena;
+};
+
+void static
+fill_buffer(stream_value_reader& r)
+{
+    size_t size =
+        size_t((std::min)(r.remaining, uint64_t(stream_buffer_size)));
+    if (size == 0)
+        throw corrupt_data();
+    r.src->read(r.buffer.get(), size);
+    r.crc = compute_crc32(r.crc, r.buffer.get(), size);
+    r.remaining -= size;
+    r.buffer_pos = 0;
+    r.buffer_end = size;
+}
+
+void static
+raw_read(stream_value_reader& r, void* dst, size_t size)
+{
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    r.offset += size;
+    while (size != 0)
+    {
+        if (r.buffer_pos == r.buffer_end)
+        {
+            if (size >= stream_buffer_size)
+            {
+                if (size > r.remaining)
+                    throw corrupt_data();
+                r.src->read(d, size);
+                r.crc = compute_crc32(r.crc, d, size);
+                r.remaining -= size;
+                return;
+            }
+            fill_buffer(r);
+        }
+        size_t n = (std::min)(size, r.buffer_end - r.buffer_pos);
+        std::memcpy(d, r.buffer.get() + r.buffer_pos, n);
+        r.buffer_pos += n;
+        d += n;
+        size -= n;
+    }
+}
+
+void static
+read_raw_blob(stream_value_reader& r, blob& x)
+{
+    if (r.aligned_blobs)
+    {
+        uint8_t padding[blob_alignment];
+        raw_read(r, padding, get_blob_padding(r.offset));
+    }
+    // Check the size before trying to allocate it.
+    uint64_t remaining = r.remaining + (r.buffer_end - r.buffer_pos);
+    if (x.size > remaining)
+        throw corrupt_data();
+    raw_read(r,
+        allocate_blob(r.arena, x,
+            size_t((std::min)(remaining, uint64_t(blob_arena_block_size)))),
+        x.size);
+}
+
+// Skip over the item table of a list or map (if the value has them).
+// Since the tables are only needed for random access, reading a whole value
+// just skips them.
+void static
+skip_item_table(memory_value_reader& r, uint64_t n_items)
+{
+    if (!r.indexed)
+        return;
+    if (n_items > r.raw.size / 8)
+        throw corrupt_data();
+    advance(r.raw, size_t(n_items * 8));
+}
+void static
+skip_item_table(stream_value_reader& r, uint64_t n_items)
+{
+    if (!r.indexed)
+        return;
+    if (n_items > (r.remaining + (r.buffer_end - r.buffer_pos)) / 8)
+        throw corrupt_data();
+    uint8_t discarded[0x100];
+    for (uint64_t remaining = n_items * 8; remaining != 0; )
+    {
+        size_t n = size_t((std::min)(remaining, uint64_t(sizeof(discarded))));
+        raw_read(r, discarded, n);
+        remaining -= n;
+    }
+}
+
+// Check that a stream_value_reader has consumed all its input.
+void static
+check_reader_exhausted(stream_value_reader& r)
+{
+    if (r.remaining != 0 || r.buffer_pos != r.buffer_end)
+        throw corrupt_data();
+}
+
+// This reads a string in the same format as read_string<uint32_t>, but it
+// works with any reader type.
+template<class Reader>
+string static
+read_raw_string(Reader& r)
+{
+    uint32_t length;
+    raw_read(r, &length, 4);
+    swap_on_little_endian(&length);
+    string s;
+    s.resize(length);
+    if (length != 0)
+        raw_read(r, &s[0], length);
+    return s;
+}
+
+template<class Reader>
+value_type static
+read_raw_value_type(Reader& r)
+{
+    uint32_t t;
+    raw_read(r, &t, 4);
+    return value_type(t);
+}
+
+template<class Reader>
+void static
+read_raw_value(Reader& r, value& v, value_type type);
+
+template<class Reader>
+void static
+read_raw_value(Reader& r, value& v)
+{
+    read_raw_value(r, v, read_raw_value_type(r));
+}
+
+// Read a map key. Most keys are field names, so if the key is a string that's
+// been interned, this uses the interned copy. (buffer is just scratch space.)
+template<class Reader>
+void static
+read_raw_map_key(Reader& r, value& key, string& buffer)
+{
+    value_type type = read_raw_value_type(r);
+    if (type != value_type::STRING)
+    {
+        read_raw_value(r, key, type);
+        return;
+    }
+    uint32_t length;
+    raw_read(r, &length, 4);
+    swap_on_little_endian(&length);
+    buffer.resize(length);
+    if (length != 0)
+        raw_read(r, &buffer[0], length);
+    if (!find_interned_field_key(&key, buffer.data(), buffer.length()))
+        key.swap_in(buffer);
+}
+
+template<class Reader>
+void static
+read_raw_value(Reader& r, value& v, value_type type)
+{
+    switch (type)
+    {
+     case value_type::NIL:
+        set(v, nil);
+        break;
+     case value_type::BOOLEAN:
+      {
+        uint8_t x;
+        raw_read(r, &x, 1);
+        set(v, bool(x != 0));
+        break;
+      }
+     case value_type::INTEGER:
+      {
+        integer x;
+        raw_read(r, &x, 8);
+        set(v, x);
+        break;
+      }
+     case value_type::FLOAT:
+      {
+        double x;
+        raw_read(r, &x, 8);
+        set(v, x);
+        break;
+      }
+     case value_type::STRING:
+      {
+        string x = read_raw_string(r);
+        v.swap_in(x);
+        break;
+      }
+     case value_type::BLOB:
+      {
+        uint64_t length;
+        raw_read(r, &length, 8);
+        blob x;
+        x.size = boost::numeric_cast<size_t>(length);
+        read_raw_blob(r, x);
+        set(v, x);
+        break;
+      }
+     case value_type::DATETIME:
+      {
+        int64_t t;
+        raw_read(r, &t, 8);
+        set(v, the_epoch + boost::posix_time::milliseconds(t));
+        break;
+      }
+     case value_type::LIST:
+      {
+        uint64_t length;
+        raw_read(r, &length, 8);
+        skip_item_table(r, length);
+        // Items are read directly into place, and the list is swapped
+        // into v, so nothing is copied.
+        value_list list(boost::numeric_cast<size_t>(length));
+        for (value_list::iterator i = list.begin(); i != list.end(); ++i)
+            read_raw_value(r, *i);
+        v.swap_in(list);
+        break;
+      }
+     case value_type::MAP:
+      {
+        uint64_t length;
+        raw_read(r, &length, 8);
+        skip_item_table(r, length);
+        // Entries are read directly into place and then adopted by the map.
+        // (They're written in key order, so they normally don't need to be
+        // sorted.)
+        value_map::sequence_type entries(
+            boost::numeric_cast<size_t>(length));
+        string key_buffer;
+        for (auto& entry : entries)
+        {
+            read_raw_map_key(r, entry.first, key_buffer);
+            read_raw_value(r, entry.second);
+        }
+        value_map map;
+        build_value_map(&map, entries);
+        v.swap_in(map);
+        break;
+      }
+    }
+}
+
+// digest_writer is a writer that feeds everything written to it into a
+// digest_generator rather than storing it.
+struct digest_writer
+{
+    digest_generator generator;
+};
+
+void static
+raw_write(digest_writer& w, void const* src, size_t size)
+{
+    feed(w.generator, src, size);
+}
+
+// When a value is written with value_codec::INDEXED, the size of each list
+// and map is followed by a table of the offsets of its items (or, for maps,
+// its keys) relative to the start of the raw encoding. Since the table comes
+// before the items, their offsets are gathered in a separate pass (by an
+// index_layout_writer), which walks the value in the same order as the real
+// writer but only counts bytes. Lists and maps are visited in the same order
+// in both passes, so the real writer just consumes the offsets in order.
+struct item_offset_table
+{
+    item_offset_table() : next(0) {}
+    std::vector<uint64_t> offsets;
+    // the next offset to be written
+    size_t next;
+};
+
+struct index_layout_writer
+{
+    index_layout_writer(item_offset_table& table) : table(&table), size(0) {}
+    item_offset_table* table;
+    uint64_t size;
+};
+
+void static
+raw_write(index_layout_writer& w, void const* src, size_t size)
+{
+    w.size += size;
+}
+
+// stream_value_writer writes a raw value incrementally to a
+// stream_compressor, computing its CRC and size along the way. Small writes
+// are collected in a buffer so that the CRC and compressor see reasonably
+// sized blocks, but large ones (i.e., blob contents) go straight through.
+struct stream_value_writer
+{
+    stream_value_writer(stream_compressor& dst, bool aligned_blobs,
+        item_offset_table* index = 0)
+      : dst(&dst), buffer(new uint8_t[stream_buffer_size]), buffered(0),
+        crc(0), size(0), aligned_blobs(aligned_blobs), index(index)
+    {}
+    stream_compressor* dst;
+    boost::scoped_array<uint8_t> buffer;
+    size_t buffered;
+    // the CRC and size of everything that's been written
+    uint32_t crc;
+    uint64_t size;
+    bool aligned_blobs;
+    // If this is non-null, the value is being written with item tables, and
+    // this holds their contents.
+    item_offset_table* index;
+};
+
+void static
+flush_buffer(stream_value_writer& w)
+{
+    if (w.buffered != 0)
+    {
+        w.crc = compute_crc32(w.crc, w.buffer.get(), w.buffered);
+        w.dst->write(w.buffer.get(), w.buffered);
+        w.buffered = 0;
+    }
+}
+
+void static
+raw_write(stream_value_writer& w, void const* src, size_t size)
+{
+    if (w.buffered + size > stream_buffer_size)
+        flush_buffer(w);
+    if (size >= stream_buffer_size)
+    {
+        w.crc = compute_crc32(w.crc, src, size);
+        w.dst->write(src, size);
+    }
+    else
+    {
+        std::memcpy(w.buffer.get() + w.buffered, src, size);
+        w.buffered += size;
+    }
+    w.size += size;
+}
+
+// Write any padding that's required before the contents of a blob.
+void static
+pad_blob(digest_writer& w)
+{
+}
+void static
+pad_blob(stream_value_writer& w)
+{
+    if (w.aligned_blobs)
+    {
+        uint8_t const padding[blob_alignment] = { 0 };
+        raw_write(w, padding, get_blob_padding(w.size));
+    }
+}
+void static
+pad_blob(index_layout_writer& w)
+{
+    w.size += get_blob_padding(w.size);
+}
+
+// Write the item table for a list or map with n_items items (if the writer
+// is writing them). The return value identifies the table in subsequent calls
+// to record_item_offset, which must be made just before each item is
+// written.
+size_t static
+write_item_table(digest_writer& w, uint64_t n_items)
+{
+    return 0;
+}
+void static
+record_item_offset(digest_writer& w, size_t table, size_t item)
+{
+}
+size_t static
+write_item_table(stream_value_writer& w, uint64_t n_items)
+{
+    if (w.index && n_items != 0)
+    {
+        item_offset_table& index = *w.index;
+        assert(index.next + n_items <= index.offsets.size());
+        raw_write(w, &index.offsets[index.next], size_t(n_items * 8));
+        index.next += size_t(n_items);
+    }
+    return 0;
+}
+void static
+record_item_offset(stream_value_writer& w, size_t table, size_t item)
+{
+}
+size_t static
+write_item_table(index_layout_writer& w, uint64_t n_items)
+{
+    size_t table = w.table->offsets.size();
+    w.table->offsets.resize(table + size_t(n_items));
+    w.size += n_items * 8;
+    return table;
+}
+void static
+record_item_offset(index_layout_writer& w, size_t table, size_t item)
+{
+    w.table->offsets[table + item] = w.size;
+}
+
+// This writes a string in the same format as write_string<uint32_t>, but it
+// works with any writer type.
+template<class Writer>
+void static
+write_raw_string(Writer& w, string const& s)
+{
+    uint32_t length = boost::numeric_cast<uint32_t>(s.length());
+    swap_on_little_endian(&length);
+    raw_write(w, &length, 4);
+    raw_write(w, s.c_str(), s.length());
+}
+
+template<class Writer>
+void static
+write_raw_value(Writer& w, value const& v)
+{
+    {
+        uint32_t t = uint32_t(v.type());
+        raw_write(w, &t, 4);
+    }
+    switch (v.type())
+    {
+     case value_type::NIL:
+        break;
+     case value_type::BOOLEAN:
+      {
+        uint8_t t = cast<bool>(v) ? 1 : 0;
+        raw_write(w, &t, 1);
+        break;
+      }
+     case value_type::INTEGER:
+      {
+        integer t = cast<integer>(v);
+        raw_write(w, &t, 8);
+        break;
+      }
+     case value_type::FLOAT:
+      {
+        double t = cast<double>(v);
+        raw_write(w, &t, 8);
+        break;
+      }
+     case value_type::STRING:
+        write_raw_string(w, cast<string>(v));
+        break;
+     case value_type::BLOB:
+      {
+        blob const& x = cast<blob>(v);
+        uint64_t length = x.size;
+        raw_write(w, &length, 8);
+        pad_blob(w);
+        raw_write(w, x.data, x.size);
+        break;
+      }
+     case value_type::DATETIME:
+      {
+        int64_t t = (cast<time>(v) - the_epoch).total_milliseconds();
+        raw_write(w, &t, 8);
+        break;
+      }
+     case value_type::LIST:
+      {
+        value_list const& x = cast<value_list>(v);
+        uint64_t size = x.size();
+        raw_write(w, &size, 8);
+        size_t table = write_item_table(w, size);
+        for (size_t i = 0; i != x.size(); ++i)
+        {
+            record_item_offset(w, table, i);
+            write_raw_value(w, x[i]);
+        }
+        break;
+      }
+     case value_type::MAP:
+      {
+        value_map const& x = cast<value_map>(v);
+        uint64_t size = x.size();
+        raw_write(w, &size, 8);
+        size_t table = write_item_table(w, size);
+        size_t n = 0;
+        for (value_map::const_iterator i = x.begin(); i != x.end(); ++i)
+        {
+            record_item_offset(w, table, n++);
+            write_raw_value(w, i->first);
+            write_raw_value(w, i->second);
+        }
+        break;
+      }
+    }
+}
+
+}
+
+// DIGESTS
+
+digest compute_value_digest(value const& v)
+{
+    digest_writer w;
+    write_raw_value(w, v);
+    return get_digest(w.generator);
+}
+
+// CHECKED MEMORY I/O
+
+namespace {
+
+// Write a number as a 0xff-terminated base-255 string.
+// 'length' is the length of the string. If it's longer than necessary, the
+// string must already be zeroed, since leading zeros are used as padding.
+void write_base_255_number(uint8_t* data, size_t length, uint64_t n)
+{
+    data += length - 1;
+    *data = 0xff;
+    --data;
+    while (n > 0)
+    {
+        *data = (n % 255);
+        --data;
+        n /= 255;
+    }
+}
+
+// Read a number as a 0xff-terminated base-255 string.
+uint64_t read_base_255_number(uint8_t const*& data, size_t& size)
+{
+    uint64_t n = 0;
+    while (1)
+    {
+        if (size == 0)
+            throw corrupt_data();
+        uint8_t digit = *data;
+        ++data;
+        --size;
+        if (digit == 0xff)
+            break;
+        n *= 255;
+        n += digit;
+    }
+    return n;
+}
+
+// Serialized values consist of the CRC of the raw encoding followed by the
+// size of the raw encoding and the zlib-compressed raw encoding.
+// Values encoded with other codecs insert a marker byte and a codec ID
+// between the CRC and the size. (The marker can't be confused with a size,
+// since it would indicate a size of 0, and a raw encoding is never empty.)
+uint8_t const codec_marker = 0xff;
+uint8_t const uncompressed_codec_id = 0;
+uint8_t const lz4_codec_id = 1;
+uint8_t const zstd_codec_id = 2;
+uint8_t const chunked_codec_id = 3;
+uint8_t const indexed_codec_id = 4;
+
+// Values encoded with value_codec::INDEXED are followed by a table of CRCs,
+// one for each chunk of this size within the raw encoding (the last one may
+// be shorter), so that parts of the value can be checked without reading the
+// whole thing.
+size_t const indexed_crc_chunk_size = 0x1000;
+
+uint64_t static
+get_chunk_crc_table_size(uint64_t raw_size)
+{
+    return (raw_size + indexed_crc_chunk_size - 1) /
+        indexed_crc_chunk_size * 4;
+}
+
+// The header of an uncompressed value is padded to this size, so the raw
+// encoding starts out aligned. (This is enough to hold the largest possible
+// header.)
+size_t const uncompressed_header_size = 16;
+
+// Values are serialized in a single pass, so the size of the raw encoding
+// isn't known until the rest has been written. The header is written with a
+// fixed-width size field that's filled in afterwards. Readers accept the
+// leading zeros, and this is wide enough for any 64-bit size.
+size_t const streamed_size_length = 10;
+
+size_t static
+get_header_size(value_codec codec)
+{
+    // zlib values are written without a codec marker, so they're readable
+    // by older code. (For value_codec::NONE and INDEXED, this comes out to
+    // exactly uncompressed_header_size.)
+    return 4 + (codec == value_codec::ZLIB ? 0 : 2) + streamed_size_length;
+}
+
+uint8_t static
+get_codec_id(value_codec codec)
+{
+    switch (codec)
+    {
+     case value_codec::NONE:
+        return uncompressed_codec_id;
+     case value_codec::LZ4:
+        return lz4_codec_id;
+     case value_codec::ZSTD_FAST:
+     case value_codec::ZSTD:
+     case value_codec::ZSTD_HIGH:
+        return zstd_codec_id;
+     case value_codec::CHUNKED:
+        return chunked_codec_id;
+     case value_codec::INDEXED:
+        return indexed_codec_id;
+     case value_codec::ZLIB:
+     default:
+        // zlib values don't have a codec ID.
+        return 0xff;
+    }
+}
+
+// Write the header for a serialized value.
+// 'header' must have room for get_header_size(codec) bytes.
+void static
+write_header(uint8_t* header, value_codec codec, uint32_t crc,
+    uint64_t raw_size)
+{
+    std::memset(header, 0, get_header_size(codec));
+    std::memcpy(header, &crc, 4);
+    uint8_t* p = header + 4;
+    if (codec != value_codec::ZLIB)
+    {
+        *p++ = codec_marker;
+        *p++ = get_codec_id(codec);
+    }
+    write_base_255_number(p, streamed_size_length, raw_size);
+}
+
+// Get the zstd compression level that corresponds to a codec.
+int static
+get_zstd_level(value_codec codec)
+{
+    switch (codec)
+    {
+     case value_codec::ZSTD_FAST:
+        return 1;
+     case value_codec::ZSTD:
+     default:
+        return 3;
+     case value_codec::ZSTD_HIGH:
+        return 9;
+    }
+}
+
+// These stand in for the compression streams when the raw encoding is
+// stored as is.
+struct passthrough_compressor : stream_compressor
+{
+    passthrough_compressor(byte_sink& dst) : dst(&dst) {}
+    void write(void const* data, size_t size)
+    { dst->write(data, size); }
+    void finish()
+    {}
+    byte_sink* dst;
+};
+// For value_codec::INDEXED, this also computes the chunk CRCs as the raw
+// encoding goes through and writes them out at the end.
+struct chunk_crc_compressor : stream_compressor
+{
+    chunk_crc_compressor(byte_sink& dst)
+      : dst(&dst), chunk_crc(0), chunk_used(0)
+    {}
+    void write(void const* data, size_t size);
+    void finish();
+    byte_sink* dst;
+    std::vector<uint32_t> crcs;
+    // the CRC and size of the part of the current chunk that's been written
+    uint32_t chunk_crc;
+    size_t chunk_used;
+};
+// The decompressor skips the chunk CRCs (if there are any), since the CRC
+// of the whole raw encoding is checked anyway.
+struct passthrough_decompressor : stream_decompressor
+{
+    passthrough_decompressor(byte_source& src, uint64_t trailer_size = 0)
+      : src(&src), trailer_size(trailer_size)
+    {}
+    void read(void* dst, size_t size);
+    void finish();
+    byte_source* src;
+    uint64_t trailer_size;
+};
+
+void static
+read_from_source(byte_source& src, void* dst, size_t size)
+{
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    while (size != 0)
+    {
+        size_t n = src.read(d, size);
+        if (n == 0)
+            throw corrupt_data();
+        d += n;
+        size -= n;
+    }
+}
+
+uint8_t static
+read_byte(byte_source& src)
+{
+    uint8_t byte;
+    read_from_source(src, &byte, 1);
+    return byte;
+}
+
+void passthrough_decompressor::read(void* dst, size_t size)
+{
+    read_from_source(*src, dst, size);
+}
+
+void chunk_crc_compressor::write(void const* data, size_t size)
+{
+    dst->write(data, size);
+    uint8_t const* p = reinterpret_cast<uint8_t const*>(data);
+    while (size != 0)
+    {
+        size_t n = (std::min)(size, indexed_crc_chunk_size - chunk_used);
+        chunk_crc = compute_crc32(chunk_crc, p, n);
+        chunk_used += n;
+        p += n;
+        size -= n;
+        if (chunk_used == indexed_crc_chunk_size)
+        {
+            crcs.push_back(chunk_crc);
+            chunk_crc = 0;
+            chunk_used = 0;
+        }
+    }
+}
+
+void chunk_crc_compressor::finish()
+{
+    if (chunk_used != 0)
+        crcs.push_back(chunk_crc);
+    if (!crcs.empty())
+        dst->write(&crcs[0], crcs.size() * 4);
+}
+
+void passthrough_decompressor::finish()
+{
+    uint8_t trailer[0x100];
+    for (uint64_t remaining = trailer_size; remaining != 0; )
+    {
+        size_t n = size_t((std::min)(remaining, uint64_t(sizeof(trailer))));
+        read_from_source(*src, trailer, n);
+        remaining -= n;
+    }
+    uint8_t extra;
+    if (src->read(&extra, 1) != 0)
+        throw corrupt_data();
+}
+
+alia__shared_ptr<stream_compressor> static
+create_value_compressor(byte_sink& dst, value_codec codec)
+{
+    switch (codec)
+    {
+     case value_codec::ZLIB:
+     default:
+        return create_zlib_compressor(dst);
+     case value_codec::NONE:
+        return alia__shared_ptr<stream_compressor>(
+            new passthrough_compressor(dst));
+     case value_codec::INDEXED:
+        return alia__shared_ptr<stream_compressor>(
+            new chunk_crc_compressor(dst));
+     case value_codec::LZ4:
+        return create_lz4_compressor(dst);
+     case value_codec::ZSTD_FAST:
+     case value_codec::ZSTD:
+     case value_codec::ZSTD_HIGH:
+        return create_zstd_compressor(dst, get_zstd_level(codec));
+     case value_codec::CHUNKED:
+        return create_chunked_compressor(dst, get_zstd_level(codec));
+    }
+}
+
+// Write a serialized value to a sink in a single pass.
+// Since the header can't be known until the end, a placeholder is written
+// in its place. The real header is written to 'header' (which must have
+// room for get_header_size(codec) bytes), and it's up to the caller to
+// overwrite the placeholder with it.
+void static
+stream_serialized_value(byte_sink& dst, uint8_t* header, value const& v,
+    value_codec codec, uint32_t* crc)
+{
+    std::memset(header, 0, get_header_size(codec));
+    dst.write(header, get_header_size(codec));
+
+    // For indexed values, the layout pass comes first (see above).
+    item_offset_table index;
+    if (codec == value_codec::INDEXED)
+    {
+        index_layout_writer layout(index);
+        write_raw_value(layout, v);
+    }
+
+    auto compressor = create_value_compressor(dst, codec);
+    stream_value_writer w(*compressor,
+        codec == value_codec::NONE || codec == value_codec::INDEXED,
+        codec == value_codec::INDEXED ? &index : 0);
+    write_raw_value(w, v);
+    flush_buffer(w);
+    compressor->finish();
+
+    write_header(header, codec, w.crc, w.size);
+    if (crc)
+        *crc = w.crc;
+}
+
+// Get the size of the raw encoding within an uncompressed value (and check
+// that it matches the size of the value).
+// 'start' and 'size' describe the entire serialized value.
+// 'data' is the position just after the codec ID.
+// If 'indexed' is true, the raw encoding is followed by its chunk CRCs.
+size_t static
+get_uncompressed_raw_size(uint8_t const* start, size_t size,
+    uint8_t const* data, bool indexed)
+{
+    size_t remaining_size = size - (data - start);
+    size_t raw_size =
+        boost::numeric_cast<size_t>(
+            read_base_255_number(data, remaining_size));
+    if (size < uncompressed_header_size ||
+        size_t(data - start) > uncompressed_header_size ||
+        size - uncompressed_header_size != raw_size +
+            (indexed ? get_chunk_crc_table_size(raw_size) : 0))
+    {
+        throw corrupt_data();
+    }
+    return raw_size;
+}
+
+// 'start' and 'size' describe the entire serialized value.
+// 'data' is the position just after the codec ID.
+void static
+deserialize_uncompressed_value(value* v, uint8_t const* start, size_t size,
+    uint8_t const* data, uint32_t recorded_crc, uint32_t* crc,
+    ownership_holder const* ownership, bool indexed)
+{
+    size_t raw_size = get_uncompressed_raw_size(start, size, data, indexed);
+    uint8_t const* raw = start + uncompressed_header_size;
+
+    uint32_t computed_crc = compute_crc32(0, raw, raw_size);
+    if (recorded_crc != computed_crc)
+        throw crc_error();
+    if (crc)
+        *crc = computed_crc;
+
+    raw_blob_layout layout;
+    layout.aligned_base = start;
+    // Blobs can only reference the buffer if it's actually aligned.
+    if (ownership &&
+        reinterpret_cast<uintptr_t>(start) % blob_alignment == 0)
+    {
+        layout.ownership = ownership;
+    }
+    memory_value_reader r(raw, raw_size, layout, indexed);
+    read_raw_value(r, *v);
+}
+
+void static
+deserialize_value(value* v, uint8_t const* data, size_t size,
+    uint32_t* crc, ownership_holder const* ownership)
 {
-    msgpack::object_handle handle =
-        msgpack::unpack(
-            reinterpret_cast<char const*>(data),
-            size,
-            msgpack_unpack_reference_type);
-    read_msgpack_value(v, ownership, handle.get());
+    // Uncompressed values are read in place, so blobs can reference the
+    // data. Everything else is streamed, which decompresses blobs directly
+    // into their final locations.
+    size_t const crc_size = 4;
+    if (size >= crc_size + 2 && data[crc_size] == codec_marker &&
+        (data[crc_size + 1] == uncompressed_codec_id ||
+        data[crc_size + 1] == indexed_codec_id))
+    {
+        uint32_t recorded_crc;
+        std::memcpy(&recorded_crc, data, crc_size);
+        deserialize_uncompressed_value(v, data, size, data + crc_size + 2,
+            recorded_crc, crc, ownership,
+            data[crc_size + 1] == indexed_codec_id);
+        return;
+    }
+    memory_source src(data, size);
+    deserialize_value(v, src, crc);
 }
 
-string value_to_msgpack_string(value const& v)
+}
+
+void deserialize_value(value* v, uint8_t const* data, size_t size,
+    uint32_t* crc)
 {
-    std::stringstream stream;
-    msgpack::packer<std::stringstream> packer(stream);
-    write_msgpack_value(packer, v);
-    return stream.str();
+    deserialize_value(v, data, size, crc, 0);
 }
 
-blob value_to_msgpack_blob(value const& v)
+void deserialize_value(value* v, blob const& data, uint32_t* crc)
 {
-    alia__shared_ptr<msgpack::sbuffer> sbuffer(new msgpack::sbuffer);
-    msgpack::packer<msgpack::sbuffer> packer(*sbuffer);
-    write_msgpack_value(packer, v);
-    blob b;
-    b.ownership = sbuffer;
-    b.data = sbuffer->data();
-    b.size = sbuffer->size();
-    return b;
+    deserialize_value(v, reinterpret_cast<uint8_t const*>(data.data),
+        data.size, crc, &data.ownership);
 }
 
-// MEMORY I/O
+void deserialize_value(value* v, byte_source& src, uint32_t* crc)
+{
+    uint32_t recorded_crc;
+    read_from_source(src, &recorded_crc, 4);
+    size_t header_size = 5;
+    uint8_t byte = read_byte(src);
 
-namespace {
+    // Values without a codec marker are compressed with zlib.
+    uint8_t codec_id = 0xff;
+    if (byte == codec_marker)
+    {
+        codec_id = read_byte(src);
+        byte = read_byte(src);
+        header_size += 2;
+    }
 
-void static
-read_raw_value(raw_memory_reader& r, value& v)
-{
-    value_type type;
+    uint64_t raw_size = 0;
+    while (byte != 0xff)
     {
-        uint32_t t;
-        raw_read(r, &t, 4);
-        type = value_type(t);
+        if (header_size >= uncompressed_header_size)
+            throw corrupt_data();
+        raw_size = raw_size * 255 + byte;
+        byte = read_byte(src);
+        ++header_size;
     }
-    switch (type)
+
+    alia__shared_ptr<stream_decompressor> decompressor;
+    switch (codec_id)
     {
-     case value_type::NIL:
-        set(v, nil);
+     case 0xff:
+        decompressor = create_zlib_decompressor(src);
         break;
-     case value_type::BOOLEAN:
+     case uncompressed_codec_id:
+     case indexed_codec_id:
       {
-        uint8_t x;
-        raw_read(r, &x, 1);
-        set(v, bool(x != 0));
+        uint8_t padding[uncompressed_header_size];
+        read_from_source(src, padding,
+            uncompressed_header_size - header_size);
+        decompressor.reset(new passthrough_decompressor(src,
+            codec_id == indexed_codec_id ?
+                get_chunk_crc_table_size(raw_size) : 0));
         break;
       }
-     case value_type::INTEGER:
-      {
-        integer x;
-        raw_read(r, &x, 8);
-        set(v, x);
+     case lz4_codec_id:
+        decompressor = create_lz4_decompressor(src);
         break;
-      }
-     case value_type::FLOAT:
-      {
-        double x;
-        raw_read(r, &x, 8);
-        set(v, x);
+     case zstd_codec_id:
+        decompressor = create_zstd_decompressor(src);
         break;
-      }
-     case value_type::STRING:
-      {
-        set(v, read_string<uint32_t>(r));
+     case chunked_codec_id:
+        decompressor = create_chunked_decompressor(src);
         break;
-      }
+     default:
+        throw corrupt_data();
+    }
+
+    stream_value_reader r(*decompressor, raw_size,
+        codec_id == uncompressed_codec_id || codec_id == indexed_codec_id,
+        codec_id == indexed_codec_id);
+    value result;
+    read_raw_value(r, result);
+    check_reader_exhausted(r);
+    decompressor->finish();
+
+    if (r.crc != recorded_crc)
+        throw crc_error();
+    if (crc)
+        *crc = r.crc;
+    v->swap_with(result);
+}
+
+// Add up the sizes of all blobs within a value.
+size_t static
+get_blob_bytes(value const& v)
+{
+    switch (v.type())
+    {
      case value_type::BLOB:
-      {
-        uint64_t length;
-        raw_read(r, &length, 8);
-        blob x;
-        x.size = boost::numeric_cast<size_t>(length);
-        alia__shared_ptr<uint8_t> ptr(new uint8_t[x.size],
-            array_deleter<uint8_t>());
-        x.ownership = ptr;
-        x.data = reinterpret_cast<void const*>(ptr.get());
-        raw_read(r, const_cast<void*>(x.data), x.size);
-        set(v, x);
-        break;
-      }
-     case value_type::DATETIME:
-      {
-        int64_t t;
-        raw_read(r, &t, 8);
-        set(v, the_epoch + boost::posix_time::milliseconds(t));
-        break;
-      }
+        return cast<blob>(v).size;
      case value_type::LIST:
       {
-        uint64_t length;
-        raw_read(r, &length, 8);
-        value_list value(boost::numeric_cast<size_t>(length));
-        for (value_list::iterator i = value.begin(); i != value.end(); ++i)
-            read_raw_value(r, *i);
-        set(v, value);
-        break;
+        size_t total = 0;
+        for (auto const& i : cast<value_list>(v))
+            total += get_blob_bytes(i);
+        return total;
       }
      case value_type::MAP:
       {
-        uint64_t length;
-        raw_read(r, &length, 8);
-        value_map map;
-        for (uint64_t i = 0; i != length; ++i)
-        {
-            value key;
-            read_raw_value(r, key);
-            value value;
-            read_raw_value(r, value);
-            map[key] = value;
-        }
-        set(v, map);
-        break;
+        size_t total = 0;
+        for (auto const& i : cast<value_map>(v))
+            total += get_blob_bytes(i.first) + get_blob_bytes(i.second);
+        return total;
       }
+     default:
+        return 0;
     }
 }
 
-void static
-read_raw_value(value* v, uint8_t const* data, size_t size)
+value_codec choose_value_codec(value const& v, size_t size)
 {
-    raw_memory_reader r(data, size);
-    read_raw_value(r, *v);
+    // Tiny values gain little from compression, and the setup cost of the
+    // compressor would dominate.
+    if (size < 0x100)
+        return value_codec::NONE;
+    // Large values that consist mostly of blobs (i.e., images) are stored
+    // uncompressed so that they can be loaded without copying them out of a
+    // file mapping. (Other values don't benefit from that.) They're also
+    // indexed so that individual parts of them can be read in place.
+    if (size >= 0x1000000 && get_blob_bytes(v) * 2 >= size)
+        return value_codec::INDEXED;
+    // For everything else, zstd decodes about as fast as LZ4 (decoding time
+    // is dominated by reconstructing the value), but it compresses much
+    // better, especially for smooth data like dose grids.
+    // Once there are several chunks' worth of data, it's worth spreading
+    // the work across cores. (Chunking does cost some compression, so it's
+    // not worth it for fewer chunks.)
+    if (size >= 0x800000)
+        return value_codec::CHUNKED;
+    return value_codec::ZSTD;
 }
 
-void static
-write_raw_value(raw_memory_writer& w, value const& v)
+void serialize_value(byte_vector* data, value const& v, uint32_t* crc,
+    value_codec codec)
 {
-    {
-        uint32_t t = uint32_t(v.type());
-        raw_write(w, &t, 4);
-    }
-    switch (v.type())
+    data->clear();
+    byte_vector_sink sink(*data);
+    uint8_t header[uncompressed_header_size];
+    stream_serialized_value(sink, header, v, codec, crc);
+    std::memcpy(&(*data)[0], header, get_header_size(codec));
+}
+
+// INDEXED VALUES
+
+namespace {
+
+// Read a fixed-size field at the given offset within a raw encoding.
+template<class T>
+T static
+read_raw_field(blob const& raw, uint64_t offset)
+{
+    if (offset > raw.size || raw.size - offset < sizeof(T))
+        throw corrupt_data();
+    T x;
+    std::memcpy(&x, reinterpret_cast<uint8_t const*>(raw.data) + offset,
+        sizeof(T));
+    return x;
+}
+
+value_type static
+read_raw_type_at(blob const& raw, uint64_t offset)
+{
+    uint32_t t = read_raw_field<uint32_t>(raw, offset);
+    if (t > uint32_t(value_type::MAP))
+        throw corrupt_data();
+    return value_type(t);
+}
+
+// Get the number of items in the list or map at the given offset (and check
+// that its item table fits in the encoding).
+uint64_t static
+read_raw_item_count(blob const& raw, uint64_t offset)
+{
+    uint64_t count = read_raw_field<uint64_t>(raw, offset + 4);
+    if (count > (raw.size - (offset + 12)) / 8)
+        throw corrupt_data();
+    return count;
+}
+
+// Get the offset of an item from the item table of the list or map at the
+// given offset. Items always come after their table, so following offsets
+// can never loop.
+uint64_t static
+read_raw_item_offset(blob const& raw, uint64_t offset, uint64_t count,
+    size_t index)
+{
+    uint64_t item = read_raw_field<uint64_t>(raw, offset + 12 + index * 8);
+    if (item < offset + 12 + count * 8 || item >= raw.size)
+        throw corrupt_data();
+    return item;
+}
+
+// Get the offset just past the end of the part of a raw encoding that starts
+// at the given offset.
+uint64_t static
+skip_raw_value(blob const& raw, uint64_t offset)
+{
+    value_type type = read_raw_type_at(raw, offset);
+    uint64_t data = offset + 4;
+    uint64_t end;
+    switch (type)
     {
      case value_type::NIL:
+     default:
+        end = data;
         break;
      case value_type::BOOLEAN:
-      {
-        uint8_t t = cast<bool>(v) ? 1 : 0;
-        raw_write(w, &t, 1);
+        end = data + 1;
         break;
-      }
      case value_type::INTEGER:
-      {
-        integer t = cast<integer>(v);
-        raw_write(w, &t, 8);
-        break;
-      }
      case value_type::FLOAT:
-      {
-        double t = cast<double>(v);
-        raw_write(w, &t, 8);
+     case value_type::DATETIME:
+        end = data + 8;
         break;
-      }
      case value_type::STRING:
-        write_string<uint32_t>(w, cast<string>(v));
-        break;
-     case value_type::BLOB:
       {
-        blob const& x = cast<blob>(v);
-        uint64_t length = x.size;
-        raw_write(w, &length, 8);
-        raw_write(w, x.data, x.size);
+        uint32_t length = read_raw_field<uint32_t>(raw, data);
+        swap_on_little_endian(&length);
+        end = data + 4 + length;
         break;
       }
-     case value_type::DATETIME:
+     case value_type::BLOB:
       {
-        int64_t t = (cast<time>(v) - the_epoch).total_milliseconds();
-        raw_write(w, &t, 8);
+        uint64_t length = read_raw_field<uint64_t>(raw, data);
+        if (length > raw.size)
+            throw corrupt_data();
+        // The raw encoding starts out aligned, so blobs are aligned
+        // relative to it.
+        end = data + 8 + get_blob_padding(size_t(data + 8)) + length;
         break;
       }
      case value_type::LIST:
       {
-        value_list const& x = cast<value_list>(v);
-        uint64_t size = x.size();
-        raw_write(w, &size, 8);
-        for (value_list::const_iterator i = x.begin(); i != x.end(); ++i)
-            write_raw_value(w, *i);
+        // A list ends where its last item ends.
+        uint64_t count = read_raw_item_count(raw, offset);
+        end = count == 0 ? data + 8 :
+            skip_raw_value(raw,
+                read_raw_item_offset(raw, offset, count, size_t(count - 1)));
         break;
       }
      case value_type::MAP:
       {
-        value_map const& x = cast<value_map>(v);
-        uint64_t size = x.size();
-        raw_write(w, &size, 8);
-        for (value_map::const_iterator i = x.begin(); i != x.end(); ++i)
-        {
-            write_raw_value(w, i->first);
-            write_raw_value(w, i->second);
-        }
+        // A map ends where the value of its last entry ends.
+        uint64_t count = read_raw_item_count(raw, offset);
+        end = count == 0 ? data + 8 :
+            skip_raw_value(raw, skip_raw_value(raw,
+                read_raw_item_offset(raw, offset, count,
+                    size_t(count - 1))));
         break;
       }
     }
+    if (end > raw.size)
+        throw corrupt_data();
+    return end;
 }
 
-void static
-write_raw_value(byte_vector* data, value const& v)
+// Check the chunks of a raw encoding that overlap the range [begin, end)
+// against their recorded CRCs.
+bool static
+check_raw_chunks(blob const& raw, uint8_t const* crcs, uint64_t begin,
+    uint64_t end)
 {
-    raw_memory_writer w(*data);
-    write_raw_value(w, v);
+    if (begin >= end)
+        return true;
+    if (end > raw.size)
+        return false;
+    uint8_t const* data = reinterpret_cast<uint8_t const*>(raw.data);
+    for (uint64_t chunk = begin / indexed_crc_chunk_size;
+        chunk * indexed_crc_chunk_size < end; ++chunk)
+    {
+        uint64_t chunk_begin = chunk * indexed_crc_chunk_size;
+        size_t chunk_size = size_t((std::min)(
+            uint64_t(indexed_crc_chunk_size), raw.size - chunk_begin));
+        uint32_t recorded;
+        std::memcpy(&recorded, crcs + chunk * 4, 4);
+        if (compute_crc32(0, data + chunk_begin, chunk_size) != recorded)
+            return false;
+    }
+    return true;
 }
 
+// Compare the key at the given offset with 'key', in the same order as
+// operator< for values. String keys are compared in place. (std::string
+// compares characters as unsigned, just like memcmp.)
+int static
+compare_raw_key(blob const& raw, uint64_t offset, value const& key)
+{
+    value_type type = read_raw_type_at(raw, offset);
+    if (type != key.type())
+        return type < key.type() ? -1 : 1;
+    if (type == value_type::STRING)
+    {
+        uint32_t length = read_raw_field<uint32_t>(raw, offset + 4);
+        swap_on_little_endian(&length);
+        if (length > raw.size - (offset + 8))
+            throw corrupt_data();
+        string const& s = cast<string>(key);
+        size_t n = (std::min)(size_t(length), s.length());
+        int c = std::memcmp(
+            reinterpret_cast<uint8_t const*>(raw.data) + offset + 8,
+            s.data(), n);
+        if (c != 0)
+            return c;
+        return length < s.length() ? -1 : (length > s.length() ? 1 : 0);
+    }
+    value k;
+    // Other types of keys are rare, so they're just read.
+    raw_blob_layout layout;
+    memory_value_reader r(
+        reinterpret_cast<uint8_t const*>(raw.data) + offset,
+        size_t(raw.size - offset), layout, true);
+    read_raw_value(r, k);
+    return k < key ? -1 : (key < k ? 1 : 0);
 }
 
-// CHECKED MEMORY I/O
+}
 
-namespace {
+// Each step through a view checks the parts of the encoding that it relies
+// on: the type and size of a list or map, the entries that are used from its
+// item table, and (for maps) the keys that are visited.
 
-// Get the length of a number stored as a 0xff-terminated base-255 string.
-size_t base_255_length(uint64_t n)
+void value_view::check(uint64_t begin, uint64_t end) const
 {
-    size_t length = 1;
-    while (n > 0)
-    {
-        n /= 255;
-        ++length;
-    }
-    return length;
+    if (!check_raw_chunks(raw_, chunk_crcs_, begin, end))
+        throw crc_error();
 }
 
-// Write a number as a 0xff-terminated base-255 string.
-// 'length' is the length of the string, as computed above.
-void write_base_255_number(uint8_t* data, size_t length, uint64_t n)
+value_type value_view::type() const
 {
-    data += length - 1;
-    *data = 0xff;
-    --data;
-    while (n > 0)
-    {
-        *data = (n % 255);
-        --data;
-        n /= 255;
-    }
+    check(position_, uint64_t(position_) + 4);
+    return read_raw_type_at(raw_, position_);
 }
 
-// Read a number as a 0xff-terminated base-255 string.
-uint64_t read_base_255_number(uint8_t const*& data, size_t& size)
+size_t value_view::size() const
 {
-    uint64_t n = 0;
-    while (1)
-    {
-        if (size == 0)
-            throw corrupt_data();
-        uint8_t digit = *data;
-        ++data;
-        --size;
-        if (digit == 0xff)
-            break;
-        n *= 255;
-        n += digit;
-    }
-    return n;
+    value_type t = this->type();
+    if (t != value_type::LIST && t != value_type::MAP)
+        throw type_mismatch(value_type::LIST, t);
+    check(position_, uint64_t(position_) + 12);
+    return size_t(read_raw_item_count(raw_, position_));
 }
 
+value_view value_view::item(size_t index) const
+{
+    value_type t = this->type();
+    if (t != value_type::LIST)
+        throw type_mismatch(value_type::LIST, t);
+    check(position_, uint64_t(position_) + 12);
+    uint64_t count = read_raw_item_count(raw_, position_);
+    check_index_bounds("value_view item", index, size_t(count));
+    uint64_t entry = uint64_t(position_) + 12 + index * 8;
+    check(entry, entry + 8);
+    value_view item = *this;
+    item.position_ =
+        size_t(read_raw_item_offset(raw_, position_, count, index));
+    return item;
 }
 
-void deserialize_value(value* v, uint8_t const* data, size_t size,
-    uint32_t* crc)
+value_view value_view::key(size_t index) const
 {
-    size_t const crc_size = 4;
-    uint32_t recorded_crc;
-    std::memcpy(&recorded_crc, data, crc_size);
-    data += crc_size;
-    size -= crc_size;
-
-    size_t raw_size =
-        boost::numeric_cast<size_t>(read_base_255_number(data, size));
-
-    boost::scoped_array<uint8_t> raw(new uint8_t[raw_size]);
-    decompress(raw.get(), raw_size, data, size);
-
-    uint32_t computed_crc = compute_crc32(0, raw.get(), raw_size);
-    if (recorded_crc != computed_crc)
-        throw crc_error();
-    if (crc)
-        *crc = computed_crc;
-
-    read_raw_value(v, raw.get(), raw_size);
+    value_type t = this->type();
+    if (t != value_type::MAP)
+        throw type_mismatch(value_type::MAP, t);
+    check(position_, uint64_t(position_) + 12);
+    uint64_t count = read_raw_item_count(raw_, position_);
+    check_index_bounds("value_view key", index, size_t(count));
+    uint64_t entry = uint64_t(position_) + 12 + index * 8;
+    check(entry, entry + 8);
+    value_view key = *this;
+    key.position_ =
+        size_t(read_raw_item_offset(raw_, position_, count, index));
+    return key;
 }
 
-void serialize_value(byte_vector* data, value const& v, uint32_t* crc)
+value_view value_view::entry_value(size_t index) const
 {
-    byte_vector raw;
-    write_raw_value(&raw, v);
-    size_t raw_size = raw.size();
-
-    uint32_t computed_crc = compute_crc32(0, &raw[0], raw_size);
-    if (crc)
-        *crc = computed_crc;
-
-    boost::scoped_array<uint8_t> compressed;
-    size_t compressed_size;
-    compress(&compressed, &compressed_size, &raw[0], raw_size);
+    value_view v = this->key(index);
+    uint64_t key_end = skip_raw_value(raw_, v.position_);
+    check(v.position_, key_end);
+    v.position_ = size_t(key_end);
+    return v;
+}
 
-    // We no longer need the memory used to hold the raw bytes, so free it.
+bool value_view::find(value_view* v, value const& key) const
+{
+    value_type t = this->type();
+    if (t != value_type::MAP)
+        throw type_mismatch(value_type::MAP, t);
+    check(position_, uint64_t(position_) + 12);
+    uint64_t count = read_raw_item_count(raw_, position_);
+    size_t low = 0, high = size_t(count);
+    while (low < high)
     {
-        byte_vector tmp;
-        raw.swap(tmp);
+        size_t mid = low + (high - low) / 2;
+        uint64_t entry = uint64_t(position_) + 12 + mid * 8;
+        check(entry, entry + 8);
+        uint64_t offset = read_raw_item_offset(raw_, position_, count, mid);
+        uint64_t key_end = skip_raw_value(raw_, offset);
+        check(offset, key_end);
+        int c = compare_raw_key(raw_, offset, key);
+        if (c == 0)
+        {
+            *v = *this;
+            v->position_ = size_t(key_end);
+            return true;
+        }
+        if (c < 0)
+            low = mid + 1;
+        else
+            high = mid;
     }
-
-    size_t const crc_size = 4;
-    size_t const size_size = base_255_length(raw_size);
-    data->resize(crc_size + size_size + compressed_size);
-    // TODO: All this copying could be eliminated with better interfaces, but
-    // the time it takes to serialize data is less important than the time it
-    // takes to deserialize, so the effort required to redesign the interfaces
-    // doesn't seem worth it.
-    uint8_t* p = &(*data)[0];
-    std::memcpy(p, &computed_crc, crc_size);
-    p += crc_size;
-    write_base_255_number(p, size_size, raw_size);
-    p += size_size;
-    std::memcpy(p, compressed.get(), compressed_size);
+    return false;
 }
 
-// FILE I/O
+value_view value_view::field(string const& name) const
+{
+    value_view v;
+    if (!this->find(&v, value(name)))
+        throw cradle::exception("missing field: " + name);
+    return v;
+}
 
-static void write_block(std::ofstream& f, void const* data, size_t size)
+void value_view::read(value* v, bool check_blob_contents) const
 {
-    // Windows has demonstrated problems handling large blocks of data,
-    // so we split them up before passing them in.
-    char const* p = reinterpret_cast<char const*>(data);
-    size_t max_block_size = 40000000;
-    while (size > max_block_size)
+    if (position_ >= raw_.size)
+        throw corrupt_data();
+    raw_blob_layout layout;
+    uint8_t const* raw = reinterpret_cast<uint8_t const*>(raw_.data);
+    layout.aligned_base = raw;
+    // Blobs can only reference the data if it's actually aligned.
+    if (reinterpret_cast<uintptr_t>(raw) % blob_alignment == 0)
+        layout.ownership = &raw_.ownership;
+    memory_value_reader r(raw + position_, raw_.size - position_, layout,
+        true);
+    std::vector<std::pair<size_t,size_t> > skipped;
+    if (!check_blob_contents)
+        r.referenced_blobs = &skipped;
+    value result;
+    read_raw_value(r, result);
+    // Check everything that was read (except the skipped blobs) before
+    // handing it out.
+    size_t checked = position_;
+    for (auto const& range : skipped)
     {
-        f.write(p, max_block_size);
-        p += max_block_size;
-        size -= max_block_size;
+        check(checked, range.first);
+        checked = range.second;
     }
-    f.write(p, size);
+    check(checked, raw_.size - r.raw.size);
+    v->swap_with(result);
 }
 
-static void read_block(std::ifstream& f, void* data, size_t size)
+bool value_view::check_crcs(void const* begin, void const* end) const
 {
-    // Analagous to write_block().
-    char* p = reinterpret_cast<char*>(data);
-    size_t max_block_size = 40000000;
-    while (size > max_block_size)
+    uint8_t const* raw = reinterpret_cast<uint8_t const*>(raw_.data);
+    uint8_t const* b = reinterpret_cast<uint8_t const*>(begin);
+    uint8_t const* e = reinterpret_cast<uint8_t const*>(end);
+    // Memory outside the data entirely must belong to a blob that was
+    // copied out of it, and that was checked when it was read.
+    if (e <= raw || b >= raw + raw_.size)
+        return true;
+    if (b < raw || e < b || e > raw + raw_.size)
+        return false;
+    return check_raw_chunks(raw_, chunk_crcs_, b - raw, e - raw);
+}
+
+bool view_serialized_value(value_view* v, blob const& data, uint32_t* crc)
+{
+    uint8_t const* start = reinterpret_cast<uint8_t const*>(data.data);
+    size_t const crc_size = 4;
+    if (data.size < crc_size + 2 || start[crc_size] != codec_marker ||
+        start[crc_size + 1] != indexed_codec_id)
     {
-        f.read(p, max_block_size);
-        p += max_block_size;
-        size -= max_block_size;
+        return false;
     }
-    f.read(p, size);
+    size_t raw_size =
+        get_uncompressed_raw_size(start, data.size, start + crc_size + 2,
+            true);
+    if (crc)
+        std::memcpy(crc, start, crc_size);
+    v->raw_.data = start + uncompressed_header_size;
+    v->raw_.size = raw_size;
+    v->raw_.ownership = data.ownership;
+    v->chunk_crcs_ = start + uncompressed_header_size + raw_size;
+    v->position_ = 0;
+    return true;
 }
 
+// FILE I/O
+
 void read_value_file(value* v, file_path const& file, uint32_t* crc)
 {
-    // TODO: 64-bit proof this
-    std::ifstream f;
-    open(f, file, std::ios::in | std::ios::binary);
-    byte_vector raw;
-    f.seekg(0, std::ios::end);
-    // TODO: actual 64-bit alternative
-    size_t size = boost::numeric_cast<size_t>(int64_t(f.tellg()));
-    f.seekg(0);
-    raw.resize(size);
-    read_block(f, &raw[0], size);
-    deserialize_value(v, &raw[0], size, crc);
+    // Mapping the file avoids reading it into a separate buffer, and blobs
+    // in uncompressed values can reference the mapping directly.
+    deserialize_value(v, map_file(file), crc);
 }
 
-void write_value_file(file_path const& file, value const& v, uint32_t* crc)
+void write_value_file(file_path const& file, value const& v, uint32_t* crc,
+    value_codec codec)
 {
-    byte_vector raw;
-    serialize_value(&raw, v, crc);
-    std::ofstream f;
-    open(f, file, std::ios::out | std::ios::binary | std::ios::trunc);
-    write_block(f, &raw[0], raw.size());
+    // The value is streamed directly into the file, and then the header is
+    // filled in.
+    c_file f(file, "wb");
+    c_file_sink sink(f);
+    uint8_t header[uncompressed_header_size];
+    stream_serialized_value(sink, header, v, codec, crc);
+    f.seek(0, SEEK_SET);
+    f.write(header, get_header_size(codec));
 }
 
 // BASE-64 I/O
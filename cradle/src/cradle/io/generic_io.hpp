@@ -2,6 +2,7 @@
 #define CRADLE_IO_GENERIC_IO_HPP
 
 #include <cradle/common.hpp>
+#include <cradle/digest.hpp>
 #include <cradle/io/file.hpp>
 #include <cradle/io/raw_memory_io.hpp>
 
@@ -84,11 +85,52 @@ string value_to_msgpack_string(value const& v);
 
 blob value_to_msgpack_blob(value const& v);
 
+// This encodes v as MessagePack without copying the contents of its large
+// blobs and strings. The result is a list of segments that, concatenated,
+// form the encoding. Large bodies are referenced where they reside (and the
+// segments share ownership of v), while everything between them is packed
+// into a framing buffer that's reused across calls on the same thread.
+std::vector<blob> value_to_msgpack_segments(value const& v);
+
 // MEMORY I/O - These convert values to and from blocks of bytes.
 // The blocks are compressed and store an additional CRC value.
 // The CRC check is done internally (a crc_error is throw if it doesn't match).
 // Addtionally, both will write the CRC value to *crc if crc's not null.
 
+// the codecs that can be used to encode serialized values
+// (deserialize_value() detects the codec automatically)
+enum class value_codec
+{
+    // zlib compression - This is readable by code that predates the other
+    // codecs.
+    ZLIB,
+    // no compression - The contents of blobs are aligned within the
+    // serialized data, so when the value is deserialized from a blob (e.g.,
+    // a memory-mapped file), blobs within the value can reference it
+    // directly rather than being copied.
+    NONE,
+    // LZ4 compression
+    LZ4,
+    // Zstandard compression at various levels
+    ZSTD_FAST,
+    ZSTD,
+    ZSTD_HIGH,
+    // Zstandard compression of independent chunks (see compression.hpp) -
+    // This is done in parallel, so it's much faster for large values.
+    CHUNKED,
+    // no compression, with an index - This is the same as NONE, but each
+    // list and map also stores the offsets of its items, so individual parts
+    // of the value can be read in place with a value_view (see below). The
+    // encoding is also followed by a CRC for each fixed-size chunk of it, so
+    // those parts can be checked on their own.
+    INDEXED
+};
+
+// Choose the codec that's most appropriate for caching the given value.
+// size is the (approximate) size of the value, e.g., as computed by
+// deep_sizeof().
+value_codec choose_value_codec(value const& v, size_t size);
+
 struct crc_error : exception
 {
     crc_error() : exception("CRC check failed") {}
@@ -98,7 +140,113 @@ struct crc_error : exception
 void deserialize_value(value* v, uint8_t const* data, size_t size,
     uint32_t* crc = 0);
 
-void serialize_value(byte_vector* data, value const& v, uint32_t* crc = 0);
+// This is the same as above, but if the data was encoded with
+// value_codec::NONE or INDEXED, blobs within the value will share ownership
+// of the data rather than copying it.
+void deserialize_value(value* v, blob const& data, uint32_t* crc = 0);
+
+// This reads a serialized value incrementally from a source (e.g., a file),
+// so that only the value itself has to be held in memory.
+// Note that if the data is corrupt, the error may be detected before the CRC
+// is checked, in which case a corrupt_data or decompression_error is thrown.
+void deserialize_value(value* v, byte_source& src, uint32_t* crc = 0);
+
+// Values are serialized in a single pass, feeding the encoding through the
+// CRC and the compressor as it's generated, so no intermediate copies of the
+// data are made.
+void serialize_value(byte_vector* data, value const& v, uint32_t* crc = 0,
+    value_codec codec = value_codec::ZLIB);
+
+// INDEXED VALUES - A value_view provides access to a value that was
+// serialized with value_codec::INDEXED without deserializing the whole thing.
+// Only the parts of the value that are actually visited are read, so, e.g.,
+// one field can be pulled out of a large record in a memory-mapped file
+// without touching the rest of the file.
+//
+// A view shares ownership of the serialized data, so it (and any views or
+// blobs obtained from it) can outlive the original blob.
+// The structure of the data is checked as it's visited (and a corrupt_data
+// exception is thrown if it's invalid). Since the data as a whole is never
+// read, its CRC isn't checked, but each fixed-size chunk of it has its own
+// CRC, and the chunks that a view visits or reads are checked against those.
+// (A crc_error is thrown if one doesn't match.)
+
+class value_view
+{
+ public:
+    value_view() : chunk_crcs_(0), position_(0) {}
+
+    value_type type() const;
+
+    // the number of items in a list or entries in a map
+    size_t size() const;
+
+    // Get an item within a list.
+    value_view item(size_t index) const;
+
+    // Get the key and value of an entry within a map.
+    // Entries are ordered by key, as they are in value_map.
+    value_view key(size_t index) const;
+    value_view entry_value(size_t index) const;
+
+    // Look up the value associated with a key in a map.
+    // Since entries are ordered, this is a binary search over the keys, and
+    // string keys are compared in place.
+    // The return value indicates whether or not the key was found.
+    bool find(value_view* v, value const& key) const;
+
+    // Get the value of a field within a record.
+    // This throws an exception if the record doesn't have it.
+    value_view field(string const& name) const;
+
+    // Read the part of the value that this view refers to.
+    // As with deserialize_value, blobs reference the serialized data (if it's
+    // suitably aligned) rather than being copied.
+    // If check_blob_contents is false, the contents of blobs that reference
+    // the data are left unchecked, so that the caller can check just the
+    // parts of them that it uses (with check_crcs).
+    void read(value* v, bool check_blob_contents = true) const;
+
+    // Check a range of memory within the serialized data (e.g., part of a
+    // blob read from this view) against the CRCs of the chunks that it
+    // overlaps. The return value indicates whether or not they all match.
+    bool check_crcs(void const* begin, void const* end) const;
+
+ private:
+    friend bool view_serialized_value(value_view*, blob const&, uint32_t*);
+    // Check the given range within the raw encoding, throwing a crc_error if
+    // it doesn't match.
+    void check(uint64_t begin, uint64_t end) const;
+    // the raw encoding within the serialized data (which also provides
+    // ownership of the data)
+    blob raw_;
+    // the chunk CRCs, which follow the raw encoding
+    uint8_t const* chunk_crcs_;
+    // the offset of this view's part of the value within the raw encoding
+    size_t position_;
+};
+
+// Get a view of the value serialized in 'data'.
+// If the data wasn't serialized with value_codec::INDEXED, this returns
+// false (and the caller has to deserialize it as usual). Otherwise, this
+// sets *v to a view of the whole value and sets *crc (if it's not null) to
+// the CRC that was recorded when the value was serialized.
+bool view_serialized_value(value_view* v, blob const& data,
+    uint32_t* crc = 0);
+
+static inline value
+read_value(value_view const& view)
+{
+    value v;
+    view.read(&v);
+    return v;
+}
+
+// DIGESTS - This computes a digest of the raw binary encoding of a value.
+// The encoding is canonical (maps are ordered by key), so equal values always
+// have equal digests. The encoded form is never actually materialized.
+
+digest compute_value_digest(value const& v);
 
 // BASE-64 - CRC'd conversion to and from base-64 strings
 
@@ -124,9 +272,13 @@ value_to_base64_string(value const& v)
 
 // FILE I/O - CRC'D file storage
 
+// read_value_file() maps the file into memory, so if the value was written
+// with value_codec::NONE or INDEXED, blobs within it reference the mapping
+// directly.
+// write_value_file() streams the value directly into the file.
 void read_value_file(value* v, file_path const& file, uint32_t* crc = 0);
 void write_value_file(file_path const& file, value const& v,
-    uint32_t* crc = 0);
+    uint32_t* crc = 0, value_codec codec = value_codec::ZLIB);
 
 
 template<class T>
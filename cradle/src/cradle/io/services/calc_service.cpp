@@ -50,7 +50,7 @@ request_remote_calculation(
     //    f << value_to_json(to_value(calculation));
     //}
     null_progress_reporter null_reporter;
-    auto data = value_to_msgpack_blob(to_value(calculation));
+    auto data = to_value(calculation);
     // Post the calculation to ISS using message pack
     auto object_id =
         post_iss_data(
@@ -138,7 +138,7 @@ request_dry_run_calculation(
     //    f << value_to_json(to_value(calculation));
     //}
     null_progress_reporter null_reporter;
-    auto data = value_to_msgpack_blob(to_value(calculation));
+    auto data = to_value(calculation);
     // Post the calculation to ISS using message pack
     auto object_id =
         post_iss_data(
@@ -1,5 +1,6 @@
 #include <cradle/io/services/iss.hpp>
 
+#include <cradle/io/generic_io.hpp>
 #include <cradle/io/services/core_services.hpp>
 #include <cradle/io/web_io.hpp>
 
@@ -79,16 +80,19 @@ post_iss_data(
     web_connection &connection,
     web_session_data session,
     framework_context context,
-    blob const& data,
+    value const& data,
     string const& qualified_type)
 {
+    // The body is streamed straight from the segments of the encoding, so
+    // large blobs within the data are never copied.
     web_response iss_response =
         perform_web_request(
             check_in,
             reporter,
             connection,
             session,
-            make_iss_post_request(context.framework.api_url, qualified_type, data, context));
+            make_iss_post_request(context.framework.api_url, qualified_type, blob(), context),
+            value_to_msgpack_segments(data));
 
     return
         from_value<cradle::iss_response>(parse_json_response(iss_response)).id;
@@ -32,6 +32,7 @@ make_iss_post_request(
     blob const& data,
     framework_context const& fc);
 
+// Post data to ISS (as MessagePack) and return the ID of the resulting object.
 string
 post_iss_data(
     check_in_interface& check_in,
@@ -39,7 +40,7 @@ post_iss_data(
     web_connection &connection,
     web_session_data session,
     framework_context context,
-    blob const& data,
+    value const& data,
     string const& qualified_type);
 
 }
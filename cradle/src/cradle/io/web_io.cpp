@@ -114,14 +114,16 @@ web_connection::~web_connection()
     delete impl;
 }
 
+// The body of a request is sent as a sequence of segments (so that it can be
+// streamed directly out of the buffers where its pieces already reside).
 struct send_transmission_state
 {
-    char const* data;
-    size_t data_length;
+    std::vector<blob> const* segments;
+    size_t segment_index;
     size_t read_position;
 
     send_transmission_state()
-        : data(0), data_length(0), read_position(0)
+        : segments(0), segment_index(0), read_position(0)
     {}
 };
 
@@ -130,13 +132,30 @@ transmit_request_body(void* ptr, size_t size, size_t nmemb, void* userdata)
 {
     send_transmission_state& state =
         *reinterpret_cast<send_transmission_state*>(userdata);
-    size_t n_bytes =
-        (std::min)(size * nmemb, state.data_length - state.read_position);
-    if (n_bytes > 0)
+    assert(state.segments);
+    auto const& segments = *state.segments;
+    char* dst = reinterpret_cast<char*>(ptr);
+    size_t capacity = size * nmemb;
+    size_t n_bytes = 0;
+    while (n_bytes < capacity && state.segment_index < segments.size())
     {
-        assert(state.data);
-        std::memcpy(ptr, state.data + state.read_position, n_bytes);
-        state.read_position += n_bytes;
+        blob const& segment = segments[state.segment_index];
+        size_t n = (std::min)(capacity - n_bytes,
+            segment.size - state.read_position);
+        if (n > 0)
+        {
+            std::memcpy(dst + n_bytes,
+                reinterpret_cast<char const*>(segment.data) +
+                    state.read_position,
+                n);
+            n_bytes += n;
+            state.read_position += n;
+        }
+        if (state.read_position == segment.size)
+        {
+            ++state.segment_index;
+            state.read_position = 0;
+        }
     }
     return n_bytes;
 }
@@ -198,10 +217,9 @@ record_web_response(void* ptr, size_t size, size_t nmemb, void* userdata)
 void static
 set_up_send_transmission(
     CURL* curl, send_transmission_state& send_state,
-    web_request const& request)
+    std::vector<blob> const& body)
 {
-    send_state.data = reinterpret_cast<char const*>(request.body.data);
-    send_state.data_length = request.body.size;
+    send_state.segments = &body;
     curl_easy_setopt(curl, CURLOPT_READFUNCTION, transmit_request_body);
     curl_easy_setopt(curl, CURLOPT_READDATA, &send_state);
 }
@@ -261,6 +279,7 @@ make_blob(receive_transmission_state const& transmission)
 void static
 perform_general_web_request(
     web_connection& connection, web_request const& request,
+    std::vector<blob> const& body,
     curl_progress_data* progress_data,
     web_authentication_credentials const* auth_info,
     web_session_data const* session,
@@ -315,21 +334,22 @@ perform_general_web_request(
     // Let CURL know what the method is and set up for sending the body if
     // necessary.
     send_transmission_state send_state;
+    curl_off_t body_size = 0;
+    for (auto const& segment : body)
+        body_size += segment.size;
     if (request.method == web_request_method::PUT)
     {
-        set_up_send_transmission(curl, send_state, request);
+        set_up_send_transmission(curl, send_state, body);
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-        curl_off_t size = request.body.size;
-        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, size);
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, body_size);
     }
     else
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 0);
     if (request.method == web_request_method::POST)
     {
-        set_up_send_transmission(curl, send_state, request);
+        set_up_send_transmission(curl, send_state, body);
         curl_easy_setopt(curl, CURLOPT_POST, 1);
-        curl_off_t size = request.body.size;
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, size);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, body_size);
     }
     else
         curl_easy_setopt(curl, CURLOPT_POST, 0);
@@ -424,8 +444,8 @@ authenticate_web_user(
     web_authentication_credentials const& user_info)
 {
     web_response response;
-    perform_general_web_request(connection, request, 0, &user_info, 0, 0, 0,
-        &response);
+    perform_general_web_request(connection, request,
+        std::vector<blob>(1, request.body), 0, &user_info, 0, 0, 0, &response);
     return from_value<web_session_data>(parse_json_response(response));
 }
 
@@ -441,7 +461,25 @@ perform_web_request(
 
     web_response response;
     perform_general_web_request(
-        connection, request, &progress_data, 0, &session, 0, 0, &response);
+        connection, request, std::vector<blob>(1, request.body),
+        &progress_data, 0, &session, 0, 0, &response);
+    return response;
+}
+
+web_response
+perform_web_request(
+    check_in_interface& check_in, progress_reporter_interface& reporter,
+    web_connection& connection, web_session_data const& session,
+    web_request const& request, std::vector<blob> const& body)
+{
+    curl_progress_data progress_data;
+    progress_data.check_in = &check_in;
+    progress_data.reporter = &reporter;
+
+    web_response response;
+    perform_general_web_request(
+        connection, request, body, &progress_data, 0, &session, 0, 0,
+        &response);
     return response;
 }
 
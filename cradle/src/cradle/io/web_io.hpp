@@ -184,6 +184,15 @@ perform_web_request(
     web_connection& connection, web_session_data const& session,
     web_request const& request);
 
+// Perform a web request whose body is supplied as a list of segments (which
+// are sent in order, without first being gathered into a single buffer).
+// The body of the request itself is ignored.
+web_response
+perform_web_request(
+    check_in_interface& check_in, progress_reporter_interface& reporter,
+    web_connection& connection, web_session_data const& session,
+    web_request const& request, std::vector<blob> const& body);
+
 }
 
 #endif
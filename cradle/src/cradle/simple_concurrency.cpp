@@ -1,47 +1,228 @@
 #include <cradle/simple_concurrency.hpp>
+#include <cradle/thread_utilities.hpp>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 
 namespace cradle {
 
-void lower_thread_priority(boost::thread& thread);
+// SHARED THREAD POOL
 
-// This class is used for dynamically assigning objects to threads.
-// You tell it how many objects there are and have your threads call it
-// repeatedly to get objects.
-struct dynamic_thread_object_assigner
+// Parallel algorithms that aren't given threads by their caller run on a
+// pool of threads that's created the first time it's needed and then kept
+// around, so short parallel sections don't pay for creating threads.
+//
+// Each call to execute() posts a group of tasks along with a number of slots
+// for idle workers to fill. The workers that join the group and the calling
+// thread all take tasks from the group's shared counter, so whichever
+// threads are free pick up whatever is left. A call only asks for as many
+// workers as are free, so if they're all busy (e.g., because the call is
+// nested within another one), its tasks just run on the calling thread.
+
+struct shared_task_group
+{
+    std::function<void(size_t)> const* task;
+    size_t n_tasks;
+    // the index of the next task to start
+    std::atomic<size_t> next_task;
+    // set if any task has failed
+    std::atomic<bool> failed;
+
+    // All of the following are protected by the pool's mutex.
+
+    // the number of workers that can still join in
+    size_t open_slots;
+    // the number of workers that are working on the tasks
+    size_t n_helpers;
+    // the first exception that a task threw
+    std::exception_ptr failure;
+    // The calling thread waits on this for the workers to finish.
+    boost::condition_variable helpers_done;
+};
+
+struct shared_thread_pool : parallel_executor_interface
 {
-    dynamic_thread_object_assigner(size_t n_objects);
-    // Call this to get an object to process.
-    // If there is one available, this returns true and assigns *object_index
-    // to the index of the object to process.
-    // If it returns false, all objects have already been assigned.
-    bool get_object(size_t* object_index);
-    size_t total_objects() const { return n_objects_; }
+    shared_thread_pool();
+
+    unsigned thread_count() const
+    { return unsigned(threads_.size()) + 1; }
+
+    void execute(size_t n_tasks, std::function<void(size_t)> const& task);
+
+    // the loop that each worker thread runs
+    void work();
+
  private:
-    size_t n_objects_, next_object_;
+    // Run the group's tasks until they've all been started.
+    void run_tasks(shared_task_group& group);
+
+    std::vector<alia__shared_ptr<boost::thread> > threads_;
+
     boost::mutex mutex_;
+    // signaled when a group is posted
+    boost::condition_variable work_cv_;
+    // the groups that are currently executing
+    std::vector<shared_task_group*> groups_;
+    // the number of workers that are neither working on a group nor
+    // promised to one
+    size_t n_free_workers_;
 };
 
-dynamic_thread_object_assigner::dynamic_thread_object_assigner(
-    size_t n_objects)
- : n_objects_(n_objects)
- , next_object_(0)
-{}
+shared_thread_pool::shared_thread_pool()
+{
+    // The calling thread always works too, so one less worker is needed
+    // than there are cores.
+    unsigned n_workers =
+        (std::max)(boost::thread::hardware_concurrency(), 1u) - 1;
+    n_free_workers_ = n_workers;
+    threads_.reserve(n_workers);
+    for (unsigned i = 0; i != n_workers; ++i)
+    {
+        threads_.push_back(alia__shared_ptr<boost::thread>(
+            new boost::thread([this]() { this->work(); })));
+        lower_thread_priority(*threads_.back());
+    }
+}
+
+void shared_thread_pool::run_tasks(shared_task_group& group)
+{
+    try
+    {
+        size_t i;
+        while (!group.failed && (i = group.next_task++) < group.n_tasks)
+            (*group.task)(i);
+    }
+    catch (...)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (!group.failure)
+            group.failure = std::current_exception();
+        group.failed = true;
+    }
+}
+
+void shared_thread_pool::execute(size_t n_tasks,
+    std::function<void(size_t)> const& task)
+{
+    shared_task_group group;
+    group.task = &task;
+    group.n_tasks = n_tasks;
+    group.next_task = 0;
+    group.failed = false;
+    group.n_helpers = 0;
+    size_t n_slots;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        n_slots = (std::min)(n_free_workers_, n_tasks != 0 ? n_tasks - 1 : 0);
+        group.open_slots = n_slots;
+        if (n_slots != 0)
+        {
+            n_free_workers_ -= n_slots;
+            groups_.push_back(&group);
+            work_cv_.notify_all();
+        }
+    }
+    if (n_slots == 0)
+    {
+        for (size_t i = 0; i != n_tasks; ++i)
+            task(i);
+        return;
+    }
+
+    run_tasks(group);
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        // Any slots that haven't been filled by now aren't needed.
+        n_free_workers_ += group.open_slots;
+        group.open_slots = 0;
+        groups_.erase(std::find(groups_.begin(), groups_.end(), &group));
+        while (group.n_helpers != 0)
+            group.helpers_done.wait(lock);
+    }
+
+    if (group.failure)
+        std::rethrow_exception(group.failure);
+}
+
+void shared_thread_pool::work()
+{
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (1)
+    {
+        shared_task_group* group = 0;
+        for (auto* g : groups_)
+        {
+            if (g->open_slots != 0)
+            {
+                group = g;
+                break;
+            }
+        }
+        if (!group)
+        {
+            work_cv_.wait(lock);
+            continue;
+        }
+        --group->open_slots;
+        ++group->n_helpers;
+        lock.unlock();
+        run_tasks(*group);
+        lock.lock();
+        // All the tasks have been started, so there's nothing left for
+        // anyone else to do.
+        n_free_workers_ += group->open_slots + 1;
+        group->open_slots = 0;
+        if (--group->n_helpers == 0)
+            group->helpers_done.notify_all();
+    }
+}
+
+static shared_thread_pool& get_shared_thread_pool()
+{
+    // This is never destroyed, since its threads never exit.
+    static shared_thread_pool* pool = new shared_thread_pool;
+    return *pool;
+}
+
+parallel_executor_interface&
+get_parallel_executor(check_in_interface& check_in)
+{
+    auto* executor = check_in.parallel_executor();
+    return executor ? *executor : get_shared_thread_pool();
+}
+
+namespace impl {
 
-bool dynamic_thread_object_assigner::get_object(size_t* object_index)
+void execute_parallel_chunks(check_in_interface& check_in,
+    parallel_executor_interface& executor, size_t n_chunks,
+    std::function<void(size_t)> const& chunk)
 {
-    boost::mutex::scoped_lock lock(mutex_);
-    if (next_object_ < n_objects_)
+    if (n_chunks == 1)
     {
-        *object_index = next_object_;
-        ++next_object_;
-        return true;
+        check_in();
+        chunk(0);
+        return;
     }
-    else
-        return false;
+    boost::mutex check_in_mutex;
+    executor.execute(n_chunks,
+        [&](size_t i)
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(check_in_mutex);
+                check_in();
+            }
+            chunk(i);
+        });
 }
 
+}
+
+// CONCURRENT JOBS
+
 struct shared_progress_reporting_state
 {
     shared_progress_reporting_state(
@@ -88,7 +269,7 @@ struct shared_check_in_state
     {}
     check_in_interface* check_in;
     boost::mutex mutex;
-    bool abort;
+    std::atomic<bool> abort;
 };
 
 struct worker_thread_aborted : exception
@@ -117,6 +298,11 @@ struct worker_thread_check_in : check_in_interface
         }
     }
 
+    // Parallel algorithms within the jobs run on the same threads as the
+    // jobs themselves.
+    parallel_executor_interface* parallel_executor()
+    { return state_->check_in->parallel_executor(); }
+
   private:
     shared_check_in_state* state_;
 };
@@ -134,68 +320,6 @@ struct worker_thread_error_report
     string msg;
 };
 
-struct worker_thread
-{
-    worker_thread(
-        dynamic_thread_object_assigner* assigner,
-        simple_job_interface** jobs,
-        shared_progress_reporting_state* reporter_state,
-        shared_check_in_state* check_in_state,
-        worker_thread_error_report* report)
-      : assigner_(assigner)
-      , jobs_(jobs)
-      , reporter_state_(reporter_state)
-      , check_in_state_(check_in_state)
-      , report_(report)
-    {}
-
-    void operator()()
-    {
-        try
-        {
-            while (1)
-            {
-                size_t i;
-                if (!assigner_->get_object(&i))
-                    break;
-                worker_thread_check_in check_in(check_in_state_);
-                worker_thread_progress_reporter reporter(reporter_state_);
-                jobs_[i]->execute(check_in, reporter);
-            }
-            report_->result = worker_thread_result::SUCCEEDED;
-        }
-        catch (worker_thread_aborted const&)
-        {
-            report_->result = worker_thread_result::ABORTED;
-        }
-        catch (std::bad_alloc const&)
-        {
-            check_in_state_->abort = true;
-            report_->result = worker_thread_result::FAILED;
-            report_->msg = "out of memory";
-        }
-        catch (std::exception const& e)
-        {
-            check_in_state_->abort = true;
-            report_->result = worker_thread_result::FAILED;
-            report_->msg = e.what();
-        }
-        catch (...)
-        {
-            check_in_state_->abort = true;
-            report_->result = worker_thread_result::FAILED;
-            report_->msg = "unknown error";
-        }
-    }
-
- private:
-    dynamic_thread_object_assigner* assigner_;
-    simple_job_interface** jobs_;
-    shared_progress_reporting_state* reporter_state_;
-    shared_check_in_state* check_in_state_;
-    worker_thread_error_report* report_;
-};
-
 void execute_jobs_concurrently(
     check_in_interface& check_in,
     progress_reporter_interface& reporter,
@@ -204,58 +328,66 @@ void execute_jobs_concurrently(
     shared_progress_reporting_state reporter_state(&reporter, n_jobs);
     shared_check_in_state check_in_state(&check_in);
 
-    dynamic_thread_object_assigner assigner(n_jobs);
-
-    size_t n_threads_to_create = (std::min)(
-        size_t(boost::thread::hardware_concurrency()),
-        n_jobs);
-
-    //std::cout << "Creating Threads: " << n_threads_to_create << std::endl;
-
-    std::vector<alia__shared_ptr<boost::thread> > threads;
-    threads.reserve(n_threads_to_create);
-
-    std::vector<worker_thread_error_report> error_reports(
-        n_threads_to_create);
+    // the first failure, if any (with failures taking precedence over
+    // aborts)
+    worker_thread_error_report report;
+    report.result = worker_thread_result::SUCCEEDED;
+    boost::mutex report_mutex;
 
-    for (size_t i = 0; i != n_threads_to_create; ++i)
-    {
-        worker_thread fn(
-            &assigner, jobs, &reporter_state,
-            &check_in_state, &error_reports[i]);
-        threads.push_back(alia__shared_ptr<boost::thread>(
-            new boost::thread(fn)));
-        lower_thread_priority(*threads.back());
-    }
-
-    // Wait for all threads to finish.
-    for (size_t i = 0; i != n_threads_to_create; ++i)
-        threads[i]->join();
-
-    // The idea here is that if one of the worker threads was aborted by
-    // check_in, calling it again here should abort the entire calculation,
-    // giving the same behavior that you'd get from a single-threaded
-    // calculation.
+    get_parallel_executor(check_in).execute(n_jobs,
+        [&](size_t i)
+        {
+            // Once a job has failed or been aborted, the rest are skipped.
+            if (check_in_state.abort)
+                return;
+            worker_thread_error_report job_report;
+            try
+            {
+                worker_thread_check_in job_check_in(&check_in_state);
+                worker_thread_progress_reporter job_reporter(&reporter_state);
+                jobs[i]->execute(job_check_in, job_reporter);
+                return;
+            }
+            catch (worker_thread_aborted const&)
+            {
+                job_report.result = worker_thread_result::ABORTED;
+            }
+            catch (std::bad_alloc const&)
+            {
+                job_report.result = worker_thread_result::FAILED;
+                job_report.msg = "out of memory";
+            }
+            catch (std::exception const& e)
+            {
+                job_report.result = worker_thread_result::FAILED;
+                job_report.msg = e.what();
+            }
+            catch (...)
+            {
+                job_report.result = worker_thread_result::FAILED;
+                job_report.msg = "unknown error";
+            }
+            check_in_state.abort = true;
+            boost::lock_guard<boost::mutex> lock(report_mutex);
+            if (report.result != worker_thread_result::FAILED)
+                report = job_report;
+        });
+
+    // The idea here is that if one of the jobs was aborted by check_in,
+    // calling it again here should abort the entire calculation, giving the
+    // same behavior that you'd get from a single-threaded calculation.
     check_in();
 
-    // Check if any threads failed or were aborted.
-    bool aborted = false;
-    for (size_t i = 0; i != n_threads_to_create; ++i)
+    switch (report.result)
     {
-        switch (error_reports[i].result)
-        {
-         case worker_thread_result::FAILED:
-            throw worker_thread_failed(error_reports[i].msg);
-         case worker_thread_result::ABORTED:
-            aborted = true;
-            break;
-         default:
-             break;
-        }
-    }
-    // This shouldn't happen, but just in case...
-    if (aborted)
+     case worker_thread_result::FAILED:
+        throw worker_thread_failed(report.msg);
+     case worker_thread_result::ABORTED:
+        // This shouldn't happen, but just in case...
         throw worker_thread_failed("aborted");
+     default:
+        break;
+    }
 
     check_in();
 }
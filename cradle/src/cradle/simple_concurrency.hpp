@@ -2,6 +2,7 @@
 #define CRADLE_SIMPLE_CONCURRENCY_HPP
 
 #include <cradle/common.hpp>
+#include <functional>
 
 namespace cradle {
 
@@ -16,11 +17,13 @@ struct simple_job_interface
         progress_reporter_interface& reporter) = 0;
 };
 
-// Given a list of jobs to be done, execute_jobs_concurrently will spawn an
-// appropriate number of threads and dynamically allocate the jobs to the
-// threads so that they can be done in parallel. The number of threads is
-// chosen based on the number of jobs to be done and the number of processor
-// cores in the system.
+// Given a list of jobs to be done, execute_jobs_concurrently dynamically
+// allocates the jobs to threads so that they can be done in parallel.
+// The threads come from the parallel executor for check_in (see below), so
+// within a background job, they're the cores that the job can use, and
+// elsewhere, they're a shared pool of threads that persists across calls.
+// The calling thread always works on the jobs as well, so if there are no
+// other threads free, the jobs just run on it.
 //
 // Each job is invoked as follows...
 //
@@ -61,6 +64,137 @@ void execute_jobs_concurrently(
     execute_jobs_concurrently(check_in, reporter, n_jobs, &job_ptrs[0]);
 }
 
+// PARALLEL LOOPS
+
+// A parallel_executor_interface runs tasks on a set of threads (including
+// the calling one). The background execution system supplies one through the
+// check_in object of its calculation jobs, which runs tasks on the cores
+// that the job has reserved or can borrow. Elsewhere, a shared thread pool
+// is used.
+struct parallel_executor_interface
+{
+    virtual ~parallel_executor_interface() {}
+
+    // the number of threads that tasks run on
+    virtual unsigned thread_count() const = 0;
+
+    // Call task(i) for each i in [0, n_tasks), spreading the calls across
+    // the executor's threads, and wait for them all to finish.
+    // If any task throws an exception, the tasks that haven't started yet
+    // are skipped, and the exception is rethrown here.
+    // If this is called from within a task, or if the executor's other
+    // threads are all busy, the tasks all run on the calling thread.
+    virtual void execute(size_t n_tasks,
+        std::function<void(size_t)> const& task) = 0;
+};
+
+// Get the executor that parallel algorithms invoked with the given check_in
+// object should use. This is the one that check_in supplies, if any, or
+// otherwise the shared thread pool.
+parallel_executor_interface&
+get_parallel_executor(check_in_interface& check_in);
+
+namespace impl {
+
+// Get the number of chunks that a parallel loop over n items is split into
+// when it runs on the given number of threads.
+size_t static inline
+get_parallel_chunk_count(unsigned thread_count, size_t n)
+{
+    if (thread_count < 2 || n < 2)
+        return 1;
+    // Use several chunks per thread so that the load is balanced even if
+    // the items vary in cost.
+    return (std::min)(n, size_t(thread_count) * 8);
+}
+
+// Get the index of the first item in the given chunk.
+size_t static inline
+get_parallel_chunk_begin(size_t begin, size_t n, size_t n_chunks,
+    size_t chunk)
+{
+    return begin + size_t(uint64_t(n) * chunk / n_chunks);
+}
+
+// Call chunk(i) for each i in [0, n_chunks) on the given executor, checking
+// in (through check_in) before each one. Since check_in wasn't necessarily
+// written to be called from multiple threads, the calls to it are
+// serialized.
+void execute_parallel_chunks(check_in_interface& check_in,
+    parallel_executor_interface& executor, size_t n_chunks,
+    std::function<void(size_t)> const& chunk);
+
+}
+
+// parallel_for(check_in, begin, end, body) calls body(i) for each i in
+// [begin, end). The range is split into chunks that are spread across the
+// threads of the parallel executor for check_in, so body must be safe to
+// call concurrently.
+// check_in is called before each chunk.
+template<class Body>
+void parallel_for(check_in_interface& check_in, size_t begin, size_t end,
+    Body const& body)
+{
+    if (end <= begin)
+        return;
+    size_t n = end - begin;
+    auto& executor = get_parallel_executor(check_in);
+    size_t n_chunks =
+        impl::get_parallel_chunk_count(executor.thread_count(), n);
+    auto run_chunk =
+        [&](size_t chunk)
+        {
+            size_t chunk_end =
+                impl::get_parallel_chunk_begin(begin, n, n_chunks, chunk + 1);
+            for (size_t i =
+                    impl::get_parallel_chunk_begin(begin, n, n_chunks, chunk);
+                i != chunk_end; ++i)
+            {
+                body(i);
+            }
+        };
+    impl::execute_parallel_chunks(check_in, executor, n_chunks, run_chunk);
+}
+
+// parallel_reduce(check_in, begin, end, identity, map, combine) computes
+//
+//   combine(...combine(combine(identity, map(begin)), map(begin + 1))...,
+//       map(end - 1))
+//
+// with the calls spread across threads in the same way as parallel_for.
+// combine must be associative (but needn't be commutative), and identity
+// must be an identity for it.
+template<class T, class Map, class Combine>
+T parallel_reduce(check_in_interface& check_in, size_t begin, size_t end,
+    T const& identity, Map const& map, Combine const& combine)
+{
+    if (end <= begin)
+        return identity;
+    size_t n = end - begin;
+    auto& executor = get_parallel_executor(check_in);
+    size_t n_chunks =
+        impl::get_parallel_chunk_count(executor.thread_count(), n);
+    std::vector<T> partial_results(n_chunks, identity);
+    auto run_chunk =
+        [&](size_t chunk)
+        {
+            T& result = partial_results[chunk];
+            size_t chunk_end =
+                impl::get_parallel_chunk_begin(begin, n, n_chunks, chunk + 1);
+            for (size_t i =
+                    impl::get_parallel_chunk_begin(begin, n, n_chunks, chunk);
+                i != chunk_end; ++i)
+            {
+                result = combine(result, map(i));
+            }
+        };
+    impl::execute_parallel_chunks(check_in, executor, n_chunks, run_chunk);
+    T result = partial_results[0];
+    for (size_t i = 1; i != n_chunks; ++i)
+        result = combine(result, partial_results[i]);
+    return result;
+}
+
 }
 
 #endif
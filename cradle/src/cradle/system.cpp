@@ -4,6 +4,21 @@
     #include <windows.h>
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+  #define CRADLE_X86
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #else
+    #include <cpuid.h>
+  #endif
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+  #include <sys/auxv.h>
+  #include <asm/hwcap.h>
+#endif
+
 namespace cradle {
 
 uint64_t get_total_physical_memory()
@@ -30,4 +45,77 @@ uint64_t get_free_physical_memory()
   #endif
 }
 
+#ifdef CRADLE_X86
+
+static void
+query_cpuid(unsigned leaf, unsigned registers[4])
+{
+  #ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, int(leaf), 0);
+    for (int i = 0; i != 4; ++i)
+        registers[i] = unsigned(info[i]);
+  #else
+    if (!__get_cpuid_count(leaf, 0, &registers[0], &registers[1],
+            &registers[2], &registers[3]))
+    {
+        registers[0] = registers[1] = registers[2] = registers[3] = 0;
+    }
+  #endif
+}
+
+// Has the OS enabled saving of the YMM registers? (Otherwise, AVX can't be
+// used even if the CPU supports it.)
+static bool
+os_supports_avx()
+{
+  #ifdef _MSC_VER
+    return (_xgetbv(0) & 6) == 6;
+  #else
+    unsigned eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (eax & 6) == 6;
+  #endif
+}
+
+#endif
+
+static cpu_features
+detect_cpu_features()
+{
+    cpu_features features;
+    features.ssse3 = features.sse41 = features.pclmul = features.avx2 =
+        features.armv8_crc32 = false;
+  #ifdef CRADLE_X86
+    unsigned registers[4];
+    query_cpuid(0, registers);
+    unsigned max_leaf = registers[0];
+    if (max_leaf >= 1)
+    {
+        query_cpuid(1, registers);
+        unsigned ecx = registers[2];
+        features.pclmul = (ecx & (1u << 1)) != 0;
+        features.ssse3 = (ecx & (1u << 9)) != 0;
+        features.sse41 = (ecx & (1u << 19)) != 0;
+        bool osxsave = (ecx & (1u << 27)) != 0;
+        if (max_leaf >= 7 && osxsave && os_supports_avx())
+        {
+            query_cpuid(7, registers);
+            features.avx2 = (registers[1] & (1u << 5)) != 0;
+        }
+    }
+  #elif defined(__aarch64__) && defined(__linux__)
+    features.armv8_crc32 = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+  #elif defined(__aarch64__) && defined(__APPLE__)
+    features.armv8_crc32 = true;
+  #endif
+    return features;
+}
+
+cpu_features const& get_cpu_features()
+{
+    static cpu_features const features = detect_cpu_features();
+    return features;
+}
+
 }
@@ -8,6 +8,29 @@ namespace cradle {
 uint64_t get_total_physical_memory();
 uint64_t get_free_physical_memory();
 
+// Which of the optional instruction set extensions that CRADLE can take
+// advantage of are supported by the CPU (and OS)?
+struct cpu_features
+{
+    // x86
+    bool ssse3, sse41, pclmul, avx2;
+    // ARMv8
+    bool armv8_crc32;
+};
+
+// This is only checked once, so it's cheap to call.
+cpu_features const& get_cpu_features();
+
+// GCC and Clang only allow instruction set extensions to be used in functions
+// that are marked as using them, so code that checks for those extensions at
+// runtime has to mark the functions that use them with this. (MSVC allows
+// them anywhere.)
+#ifdef __GNUC__
+  #define CRADLE_TARGET(extensions) __attribute__((target(extensions)))
+#else
+  #define CRADLE_TARGET(extensions)
+#endif
+
 }
 
 #endif
@@ -1,4 +1,5 @@
 #include <cradle/common.hpp>
+#include <cradle/date_time.hpp>
 #include <boost/shared_array.hpp>
 
 #define BOOST_TEST_MODULE cradle_common
@@ -136,3 +137,252 @@ BOOST_AUTO_TEST_CASE(value_equality_tests)
     m.push_back(y);
     BOOST_CHECK(l != m);
 }
+
+BOOST_AUTO_TEST_CASE(value_sharing_test)
+{
+    value_map r;
+    r["x"] = value(0.1);
+    r["b"] = value(make_blob(10));
+    value_list l;
+    l.push_back(value(r));
+    l.push_back(value("foo"));
+    value a(l);
+
+    // Copies should share their contents.
+    value b = a;
+    BOOST_CHECK(&cast<value_list>(b) == &cast<value_list>(a));
+    BOOST_CHECK_EQUAL(a, b);
+
+    // Setting one shouldn't affect the other.
+    set(b, value_list());
+    BOOST_CHECK(cast<value_list>(b).empty());
+    BOOST_CHECK_EQUAL(cast<value_list>(a).size(), 2);
+    BOOST_CHECK_EQUAL(a, value(l));
+
+    // A value can be set from its own contents.
+    b = a;
+    b = cast<value_list>(b)[0];
+    BOOST_CHECK_EQUAL(b, value(r));
+    b = a;
+    set(b, cast<value_map>(cast<value_list>(b)[0]));
+    BOOST_CHECK_EQUAL(b, value(r));
+    a = a;
+    BOOST_CHECK_EQUAL(a, value(l));
+
+    // Moving leaves the original nil.
+    value c(std::move(a));
+    BOOST_CHECK_EQUAL(a.type(), value_type::NIL);
+    BOOST_CHECK_EQUAL(c, value(l));
+
+    // Scalars are stored inline.
+    value i(integer(4));
+    value j = i;
+    BOOST_CHECK(&cast<integer>(i) != &cast<integer>(j));
+    BOOST_CHECK_EQUAL(cast<integer>(j), 4);
+    set(i, false);
+    BOOST_CHECK_EQUAL(cast<bool>(i), false);
+    BOOST_CHECK_EQUAL(cast<integer>(j), 4);
+
+    // swap_in consumes its argument without copying it.
+    value_list m(3, value(1.5));
+    value const* first = &m[0];
+    value d;
+    d.swap_in(m);
+    BOOST_CHECK(m.empty());
+    BOOST_CHECK(&cast<value_list>(d)[0] == first);
+}
+
+BOOST_AUTO_TEST_CASE(field_key_test)
+{
+    // Interning the same name twice yields keys that share their contents.
+    field_key a = intern_field_name("field_key_test_a");
+    field_key b = intern_field_name("field_key_test_a");
+    BOOST_CHECK(a.key().shares_contents_with(b.key()));
+    BOOST_CHECK_EQUAL(a.name(), "field_key_test_a");
+
+    // Converting a name only shares the key if the name is interned.
+    BOOST_CHECK(field_key("field_key_test_a").key().shares_contents_with(
+        a.key()));
+    field_key c("field_key_test_c");
+    BOOST_CHECK(!c.key().shares_contents_with(
+        field_key("field_key_test_c").key()));
+    BOOST_CHECK_EQUAL(c.key(), value("field_key_test_c"));
+
+    value key;
+    BOOST_CHECK(find_interned_field_key(&key, "field_key_test_a", 16));
+    BOOST_CHECK(key.shares_contents_with(a.key()));
+    BOOST_CHECK(!find_interned_field_key(&key, "field_key_test_c", 16));
+    value copy(string("field_key_test_a"));
+    share_interned_field_key(copy);
+    BOOST_CHECK(copy.shares_contents_with(a.key()));
+
+    // Records can be searched with interned keys or plain names, and they
+    // stay sorted regardless of insertion order.
+    value_map r;
+    r[value("z")] = value(integer(1));
+    r[a.key()] = value(integer(2));
+    r[value("b")] = value(integer(3));
+    BOOST_CHECK_EQUAL(get_field(r, a), value(integer(2)));
+    BOOST_CHECK_EQUAL(get_field(r, "field_key_test_a"), value(integer(2)));
+    BOOST_CHECK_EQUAL(get_field(r, string("z")), value(integer(1)));
+    BOOST_CHECK_THROW(get_field(r, c), cradle::exception);
+    BOOST_CHECK_EQUAL(r.begin()->first, value("b"));
+    BOOST_CHECK_EQUAL(r.rbegin()->first, value("z"));
+
+    // Decoding a record shares the interned copies of its keys.
+    auto encoding = binary_encoding_of(value(r));
+    value decoded;
+    decode_binary(&decoded, &encoding[0], encoding.size());
+    BOOST_CHECK_EQUAL(decoded, value(r));
+    auto i = cast<value_map>(decoded).find(a.key());
+    BOOST_REQUIRE(i != cast<value_map>(decoded).end());
+    BOOST_CHECK(i->first.shares_contents_with(a.key()));
+
+    // Interned keys are ordered the same way as their names, including
+    // relative to plain strings.
+    field_key d = intern_field_name("field_key_test_d");
+    field_key b2 = intern_field_name("field_key_test_b");
+    BOOST_CHECK(a.key().interned_atom() != 0);
+    BOOST_CHECK(a.key().interned_atom() != d.key().interned_atom());
+    BOOST_CHECK_EQUAL(c.key().interned_atom(), 0);
+    BOOST_CHECK(a.key() < b2.key() && b2.key() < d.key());
+    BOOST_CHECK(!(d.key() < b2.key()) && !(b2.key() < a.key()));
+    BOOST_CHECK(b2.key() < c.key() && c.key() < d.key());
+    BOOST_CHECK(a.key() != d.key());
+
+    // Maps can be built from entries in any order, and the last value for a
+    // repeated key is the one that's kept.
+    value_map::sequence_type entries;
+    entries.emplace_back(d.key(), value(integer(1)));
+    entries.emplace_back(value("field_key_test_a"), value(integer(2)));
+    entries.emplace_back(b2.key(), value(integer(3)));
+    entries.emplace_back(a.key(), value(integer(4)));
+    value_map built;
+    build_value_map(&built, entries);
+    BOOST_REQUIRE_EQUAL(built.size(), 3);
+    BOOST_CHECK_EQUAL(get_field(built, a), value(integer(4)));
+    BOOST_CHECK_EQUAL(built.begin()->first, a.key());
+    BOOST_CHECK_EQUAL(built.rbegin()->first, d.key());
+}
+
+static request<std::vector<double> >
+make_array_request(int n_items, double last_item)
+{
+    std::vector<request<double> > items;
+    for (int i = 0; i != n_items; ++i)
+        items.push_back(rq_value(i == n_items - 1 ? last_item : double(i)));
+    return rq_array(items);
+}
+
+BOOST_AUTO_TEST_CASE(request_interning_test)
+{
+    // Identical requests should share their contents, even when they're
+    // constructed independently.
+    auto a = rq_value(1.5), b = rq_value(1.5), c = rq_value(2.5);
+    BOOST_CHECK(get_value_pointer(a.untyped.contents) ==
+        get_value_pointer(b.untyped.contents));
+    BOOST_CHECK(get_value_pointer(a.untyped.contents) !=
+        get_value_pointer(c.untyped.contents));
+    BOOST_CHECK(a == b);
+    BOOST_CHECK(a != c);
+
+    // The same goes for compound requests.
+    auto x = make_array_request(100, 1), y = make_array_request(100, 1),
+        z = make_array_request(100, 2);
+    BOOST_CHECK(get_value_pointer(x.untyped.contents) ==
+        get_value_pointer(y.untyped.contents));
+    BOOST_CHECK(x == y);
+    BOOST_CHECK(x != z);
+}
+
+template<class T>
+static T binary_round_trip(T const& x)
+{
+    auto encoding = binary_encoding_of(x);
+    T y;
+    decode_binary(&y, encoding.empty() ? 0 : &encoding[0], encoding.size());
+    return y;
+}
+
+BOOST_AUTO_TEST_CASE(binary_encoding_test)
+{
+    std::vector<double> doubles = { 1.5, -2, 0.25 };
+    BOOST_CHECK(binary_round_trip(doubles) == doubles);
+    std::vector<string> strings = { "abc", "", "de" };
+    BOOST_CHECK(binary_round_trip(strings) == strings);
+    std::vector<bool> bools = { true, false, true };
+    BOOST_CHECK(binary_round_trip(bools) == bools);
+
+    std::map<string,std::vector<int> > map;
+    map["a"] = std::vector<int>(3, 4);
+    map["b"] = std::vector<int>();
+    BOOST_CHECK(binary_round_trip(map) == map);
+
+    optional<double> some(3.5), none;
+    BOOST_CHECK(binary_round_trip(some) == some);
+    BOOST_CHECK(binary_round_trip(none) == none);
+
+    // Anything else goes through its dynamic value.
+    value_map record;
+    record[value("i")] = value(integer(-7));
+    record[value("f")] = value(0.5);
+    record[value("s")] = value("text");
+    record[value("l")] =
+        value(value_list{ value(true), value(nil), value("x") });
+    record[value("t")] =
+        value(boost::posix_time::ptime(boost::gregorian::date(2017, 4, 12),
+            boost::posix_time::milliseconds(123)));
+    BOOST_CHECK_EQUAL(binary_round_trip(value(record)), value(record));
+
+    // Truncated data is detected.
+    auto encoding = binary_encoding_of(strings);
+    std::vector<string> truncated;
+    BOOST_CHECK_THROW(
+        decode_binary(&truncated, &encoding[0], encoding.size() - 1),
+        corrupt_binary_data);
+    BOOST_CHECK_THROW(
+        decode_binary(&truncated, &encoding[0], 4),
+        corrupt_binary_data);
+}
+
+BOOST_AUTO_TEST_CASE(binary_array_test)
+{
+    std::vector<float> elements = { 1, 2, 3, 4, 5 };
+    array<float> a;
+    initialize(&a, elements);
+
+    // The elements are aligned within the encoding, so a reader with
+    // ownership of the data can reference them in place.
+    alia__shared_ptr<std::vector<uint8_t> > encoding(
+        new std::vector<uint8_t>);
+    binary_writer w(*encoding);
+    write_binary(w, string("misaligning"));
+    write_binary(w, a);
+    ownership_holder ownership = encoding;
+    binary_reader r(&(*encoding)[0], encoding->size(), &ownership);
+    string s;
+    read_binary(r, &s);
+    array<float> b;
+    read_binary(r, &b);
+    BOOST_CHECK(b == a);
+    BOOST_CHECK(b.elements != a.elements);
+    BOOST_CHECK(
+        reinterpret_cast<uint8_t const*>(b.elements) > &(*encoding)[0] &&
+        reinterpret_cast<uint8_t const*>(b.elements) <
+            &(*encoding)[0] + encoding->size());
+
+    // Without ownership, they're copied.
+    BOOST_CHECK(binary_round_trip(a) == a);
+}
+
+BOOST_AUTO_TEST_CASE(binary_schema_hash_test)
+{
+    auto h = get_binary_schema_hash(std::vector<double>());
+    BOOST_CHECK_EQUAL(h, get_binary_schema_hash(std::vector<double>()));
+    BOOST_CHECK(h != get_binary_schema_hash(std::vector<float>()));
+    BOOST_CHECK(h != get_binary_schema_hash(std::vector<int64_t>()));
+    BOOST_CHECK(get_binary_schema_hash(std::map<string,int>()) !=
+        get_binary_schema_hash(std::map<int,string>()));
+    BOOST_CHECK(get_binary_schema_hash(some(1.)) !=
+        get_binary_schema_hash(1.));
+}
@@ -0,0 +1,87 @@
+#include <cradle/digest.hpp>
+#include <cstring>
+
+#define BOOST_TEST_MODULE digest
+#include <cradle/test.hpp>
+
+using namespace cradle;
+
+static string digest_of(char const* s)
+{
+    return to_hex_string(compute_digest(s, strlen(s)));
+}
+
+BOOST_AUTO_TEST_CASE(known_digests_test)
+{
+    // These are the standard MurmurHash3 x64_128 results.
+    BOOST_CHECK_EQUAL(digest_of(""),
+        "00000000000000000000000000000000");
+    BOOST_CHECK_EQUAL(digest_of("hello"),
+        "cbd8a7b341bd9b025b1e906a48ae1d19");
+}
+
+BOOST_AUTO_TEST_CASE(incremental_digest_test)
+{
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i != data.size(); ++i)
+        data[i] = uint8_t(i * 7);
+    digest expected = compute_digest(&data[0], data.size());
+
+    // Feeding the data in chunks of any size should give the same result.
+    for (size_t chunk_size = 1; chunk_size != 40; ++chunk_size)
+    {
+        digest_generator generator;
+        for (size_t i = 0; i < data.size(); i += chunk_size)
+        {
+            feed(generator, &data[i],
+                (std::min)(chunk_size, data.size() - i));
+        }
+        BOOST_CHECK(get_digest(generator) == expected);
+    }
+
+    // Changing a single byte should change the digest.
+    data[500] ^= 1;
+    BOOST_CHECK(compute_digest(&data[0], data.size()) != expected);
+}
+
+static blob make_blob(std::vector<uint8_t> const& data)
+{
+    auto storage = std::make_shared<std::vector<uint8_t> >(data);
+    blob b;
+    b.ownership = storage;
+    b.data = &(*storage)[0];
+    b.size = storage->size();
+    return b;
+}
+
+BOOST_AUTO_TEST_CASE(buffer_hash_test)
+{
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i != data.size(); ++i)
+        data[i] = uint8_t(i * 7);
+
+    // Blobs with the same contents should hash the same, regardless of where
+    // their data lives.
+    blob a = make_blob(data), b = make_blob(data);
+    std::hash<blob> hasher;
+    size_t hash = hasher(a);
+    BOOST_CHECK_EQUAL(hasher(b), hash);
+    data[10] ^= 1;
+    BOOST_CHECK(hasher(make_blob(data)) != hash);
+
+    // Arrays are hashed like the equivalent blobs.
+    array<uint8_t> x;
+    from_value(&x, value(a));
+    BOOST_CHECK_EQUAL(std::hash<array<uint8_t> >()(x), hash);
+
+    // Once a hash is computed, it should be remembered (even by copies)
+    // rather than recomputed, so altering the data (which normal code
+    // shouldn't do) goes unnoticed...
+    blob c = a;
+    const_cast<uint8_t*>(reinterpret_cast<uint8_t const*>(a.data))[10] ^= 1;
+    BOOST_CHECK_EQUAL(hasher(a), hash);
+    BOOST_CHECK_EQUAL(hasher(c), hash);
+    // ... but pointing the blob at different data should invalidate it.
+    c.size = 999;
+    BOOST_CHECK(hasher(c) != hash);
+}
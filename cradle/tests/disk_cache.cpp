@@ -0,0 +1,326 @@
+#include <cradle/disk_cache.hpp>
+#include <cradle/io/file.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <fstream>
+#include <set>
+#include <vector>
+
+#define BOOST_TEST_MODULE disk_cache
+#include <cradle/test.hpp>
+
+using namespace cradle;
+
+static void write_entry_file(disk_cache& cache, int64_t id, size_t size)
+{
+    std::ofstream f;
+    open(f, get_path_for_id(cache, id),
+        std::ios::out | std::ios::binary | std::ios::trunc);
+    f << string(size, 'x');
+}
+
+static void insert_entry(disk_cache& cache, string const& key, size_t size,
+    uint32_t crc)
+{
+    int64_t id = initiate_insert(cache, key);
+    write_entry_file(cache, id, size);
+    finish_insert(cache, id, crc);
+}
+
+BOOST_AUTO_TEST_CASE(disk_cache_test)
+{
+    file_path dir = "disk_cache_test";
+    boost::filesystem::remove_all(dir);
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "test/", 0x10000);
+
+        int64_t id;
+        uint32_t crc;
+        BOOST_CHECK(!entry_exists(cache, "a", &id, &crc));
+
+        // An entry that's been initiated but not finished shouldn't be
+        // visible, and initiating it again should give the same ID.
+        int64_t a_id = initiate_insert(cache, "a");
+        BOOST_CHECK(!entry_exists(cache, "a", &id, &crc));
+        BOOST_CHECK_EQUAL(initiate_insert(cache, "a"), a_id);
+
+        // Once it's finished, it should be visible immediately, even though
+        // it hasn't necessarily been written to the index yet.
+        write_entry_file(cache, a_id, 10);
+        finish_insert(cache, a_id, 17);
+        BOOST_REQUIRE(entry_exists(cache, "a", &id, &crc));
+        BOOST_CHECK_EQUAL(id, a_id);
+        BOOST_CHECK_EQUAL(crc, 17);
+
+        insert_entry(cache, "b", 20, 18);
+        record_usage(cache, a_id);
+
+        auto info = get_summary_info(cache);
+        BOOST_CHECK_EQUAL(info.n_entries, 2);
+        BOOST_CHECK_EQUAL(info.total_size, 30);
+
+        // Key descriptions are only recorded when they're enabled.
+        BOOST_CHECK(!key_descriptions_enabled(cache));
+        record_key_description(cache, a_id, "ignored");
+        BOOST_CHECK(!get_key_description(cache, a_id));
+        enable_key_descriptions(cache, true);
+        record_key_description(cache, a_id, "entry a");
+        BOOST_CHECK(get_key_description(cache, a_id) ==
+            some(string("entry a")));
+    }
+
+    // Reopen the cache and check that everything was persisted.
+    {
+        disk_cache cache;
+        initialize(cache, dir, "test/", 0x10000);
+
+        int64_t id;
+        uint32_t crc;
+        BOOST_REQUIRE(entry_exists(cache, "b", &id, &crc));
+        BOOST_CHECK_EQUAL(crc, 18);
+
+        // A different key prefix shouldn't see the same entries.
+        disk_cache other;
+        initialize(other, dir, "other/", 0x10000);
+        BOOST_CHECK(!entry_exists(other, "b", &id, &crc));
+
+        int64_t a_id;
+        BOOST_REQUIRE(entry_exists(cache, "a", &a_id, &crc));
+        BOOST_CHECK(get_key_description(cache, a_id) ==
+            some(string("entry a")));
+
+        remove_entry(cache, id);
+        BOOST_CHECK(!entry_exists(cache, "b", &id, &crc));
+        BOOST_CHECK_EQUAL(get_entry_list(cache).size(), 1);
+
+        clear(cache);
+        BOOST_CHECK_EQUAL(get_summary_info(cache).n_entries, 0);
+        BOOST_CHECK(!get_key_description(cache, a_id));
+    }
+
+    boost::filesystem::remove_all(dir);
+}
+
+static std::vector<uint8_t> make_data(size_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i != size; ++i)
+        data[i] = uint8_t(seed + i);
+    return data;
+}
+
+static std::set<string> get_segment_files(file_path const& dir)
+{
+    std::set<string> files;
+    for (boost::filesystem::directory_iterator i(dir), end; i != end; ++i)
+    {
+        auto name = i->path().filename().string();
+        if (name.find("segment-") == 0)
+            files.insert(name);
+    }
+    return files;
+}
+
+BOOST_AUTO_TEST_CASE(packed_storage_test)
+{
+    file_path dir = "disk_cache_packed_test";
+    boost::filesystem::remove_all(dir);
+
+    int const n_entries = 100;
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 0x10000000);
+
+        for (int i = 0; i != n_entries; ++i)
+        {
+            auto data = make_data(1000, uint8_t(i));
+            int64_t id = initiate_insert(cache, to_string(i));
+            finish_insert(cache, id, &data[0], data.size(), uint32_t(i));
+        }
+
+        // Large entries should still get their own files.
+        auto large_data = make_data(0x20000, 1);
+        int64_t large_id = initiate_insert(cache, "large");
+        finish_insert(cache, large_id, &large_data[0], large_data.size(), 1);
+        BOOST_CHECK(exists(get_path_for_id(cache, large_id)));
+
+        // The small entries should all be readable (even before the inserts
+        // are written to the index) without having their own files.
+        for (int i = 0; i != n_entries; ++i)
+        {
+            int64_t id;
+            uint32_t crc;
+            BOOST_REQUIRE(entry_exists(cache, to_string(i), &id, &crc));
+            BOOST_CHECK_EQUAL(crc, uint32_t(i));
+            BOOST_CHECK(!exists(get_path_for_id(cache, id)));
+            std::vector<uint8_t> data;
+            read_entry(&data, cache, id);
+            BOOST_CHECK(data == make_data(1000, uint8_t(i)));
+        }
+        BOOST_CHECK_EQUAL(get_segment_files(dir).size(), 1);
+    }
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 0x10000000);
+
+        // The initial sweep merges the small sealed segment into a new
+        // active one, so make sure that's done before looking at the files.
+        enforce_cache_size_limit(cache);
+        auto original_segments = get_segment_files(dir);
+        BOOST_REQUIRE_EQUAL(original_segments.size(), 1);
+
+        // Remove most of the entries and compact the cache.
+        for (int i = 0; i != n_entries; ++i)
+        {
+            int64_t id;
+            BOOST_REQUIRE(entry_exists(cache, to_string(i), &id));
+            if (i % 4 != 0)
+                remove_entry(cache, id);
+        }
+        compact(cache);
+
+        // The original segment should be gone, and the remaining entries
+        // should have been moved intact.
+        auto compacted_segments = get_segment_files(dir);
+        BOOST_REQUIRE_EQUAL(compacted_segments.size(), 1);
+        BOOST_CHECK(compacted_segments != original_segments);
+        BOOST_CHECK_EQUAL(
+            file_size(dir / *compacted_segments.begin()),
+            (n_entries / 4) * 1000);
+        for (int i = 0; i != n_entries; ++i)
+        {
+            int64_t id;
+            uint32_t crc;
+            bool found = entry_exists(cache, to_string(i), &id, &crc);
+            BOOST_CHECK_EQUAL(found, i % 4 == 0);
+            if (found)
+            {
+                BOOST_CHECK_EQUAL(crc, uint32_t(i));
+                std::vector<uint8_t> data;
+                read_entry(&data, cache, id);
+                BOOST_CHECK(data == make_data(1000, uint8_t(i)));
+            }
+        }
+
+        int64_t large_id;
+        BOOST_REQUIRE(entry_exists(cache, "large", &large_id));
+        std::vector<uint8_t> data;
+        read_entry(&data, cache, large_id);
+        BOOST_CHECK(data == make_data(0x20000, 1));
+
+        // Mapping entries should give the same data, regardless of how
+        // they're stored.
+        {
+            blob mapped = map_entry(cache, large_id);
+            auto p = reinterpret_cast<uint8_t const*>(mapped.data);
+            BOOST_CHECK(std::vector<uint8_t>(p, p + mapped.size) == data);
+        }
+        {
+            int64_t id;
+            BOOST_REQUIRE(entry_exists(cache, to_string(4), &id));
+            blob mapped = map_entry(cache, id);
+            auto p = reinterpret_cast<uint8_t const*>(mapped.data);
+            BOOST_CHECK(std::vector<uint8_t>(p, p + mapped.size) ==
+                make_data(1000, 4));
+        }
+
+        clear(cache);
+        BOOST_CHECK(get_segment_files(dir).empty());
+    }
+
+    boost::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(orphaned_segment_test)
+{
+    file_path dir = "disk_cache_orphaned_segment_test";
+    boost::filesystem::remove_all(dir);
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 0x10000000);
+        auto data = make_data(1000, 0);
+        int64_t id = initiate_insert(cache, "a");
+        finish_insert(cache, id, &data[0], data.size(), 0);
+    }
+
+    // Leave behind a segment file that isn't in the index (as happens if
+    // removing a compacted segment's file fails).
+    {
+        std::ofstream f;
+        open(f, dir / "segment-1000000", std::ios::out | std::ios::binary);
+        f << "orphaned";
+    }
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 0x10000000);
+        enforce_cache_size_limit(cache);
+        auto segments = get_segment_files(dir);
+        BOOST_CHECK(segments.find("segment-1000000") == segments.end());
+        BOOST_CHECK_EQUAL(segments.size(), 1);
+
+        // The real entry should be intact.
+        int64_t id;
+        BOOST_REQUIRE(entry_exists(cache, "a", &id));
+        std::vector<uint8_t> data;
+        read_entry(&data, cache, id);
+        BOOST_CHECK(data == make_data(1000, 0));
+    }
+
+    boost::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(size_limit_test)
+{
+    file_path dir = "disk_cache_size_limit_test";
+    boost::filesystem::remove_all(dir);
+
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 0x10000000);
+        for (int i = 0; i != 100; ++i)
+        {
+            auto data = make_data(1000, uint8_t(i));
+            int64_t id = initiate_insert(cache, to_string(i));
+            finish_insert(cache, id, &data[0], data.size(), 0);
+        }
+        auto info = get_summary_info(cache);
+        BOOST_CHECK_EQUAL(info.n_entries, 100);
+        BOOST_CHECK_EQUAL(info.total_size, 100000);
+    }
+
+    // Reopen the cache with a smaller limit and check that it's enforced.
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 10000);
+        enforce_cache_size_limit(cache);
+        auto info = get_summary_info(cache);
+        BOOST_CHECK_EQUAL(info.n_entries, 10);
+        BOOST_CHECK_EQUAL(info.total_size, 10000);
+
+        // The running total should match the entries that are actually
+        // there.
+        int64_t total_size = 0;
+        for (auto const& entry : get_entry_list(cache))
+            total_size += entry.size;
+        BOOST_CHECK_EQUAL(total_size, info.total_size);
+    }
+
+    // The total should persist, and new entries should count towards it.
+    {
+        disk_cache cache;
+        initialize(cache, dir, "", 0x10000000);
+        int64_t id = initiate_insert(cache, "new");
+        auto data = make_data(500, 0);
+        finish_insert(cache, id, &data[0], data.size(), 0);
+        auto info = get_summary_info(cache);
+        BOOST_CHECK_EQUAL(info.total_size, 10500);
+        BOOST_CHECK_EQUAL(info.n_entries, 11);
+    }
+
+    boost::filesystem::remove_all(dir);
+}
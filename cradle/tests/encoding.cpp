@@ -14,7 +14,7 @@ static void check_mime_encoding(char const* original, char const* encoded)
     using namespace cradle;
     BOOST_CHECK_EQUAL(
         base64_encode(reinterpret_cast<cradle::uint8_t const*>(original),
-            strlen(original), mime_base64_character_set),
+            strlen(original), get_mime_base64_character_set()),
         encoded);
 }
 
@@ -70,8 +70,112 @@ BOOST_AUTO_TEST_CASE(base64_encoding_test)
         "sure",
         "c3VyZQ==");
 
-    test_random_base64_encoding(url_friendly_base64_character_set);
-    test_random_base64_encoding(mime_base64_character_set);
+    test_random_base64_encoding(get_url_friendly_base64_character_set());
+    test_random_base64_encoding(get_mime_base64_character_set());
+}
+
+static base64_method const all_base64_methods[] = {
+    base64_method::SCALAR, base64_method::SSSE3, base64_method::AVX2 };
+
+static void check_base64_method_agreement(
+    std::vector<cradle::uint8_t> const& src,
+    base64_character_set const& character_set)
+{
+    boost::scoped_array<char> expected_encoding(
+        new char[get_base64_encoded_length(src.size())]);
+    size_t expected_encoded_length;
+    base64_encode(base64_method::SCALAR, expected_encoding.get(),
+        &expected_encoded_length, src.empty() ? 0 : &src[0], src.size(),
+        character_set);
+    for (auto method : all_base64_methods)
+    {
+        if (!is_base64_method_supported(method))
+            continue;
+        boost::scoped_array<char> encoded(
+            new char[get_base64_encoded_length(src.size())]);
+        size_t encoded_length;
+        base64_encode(method, encoded.get(), &encoded_length,
+            src.empty() ? 0 : &src[0], src.size(), character_set);
+        BOOST_REQUIRE_EQUAL(encoded_length, expected_encoded_length);
+        BOOST_CHECK(memcmp(encoded.get(), expected_encoding.get(),
+            encoded_length + 1) == 0);
+
+        std::vector<cradle::uint8_t> decoded(
+            get_base64_decoded_length(encoded_length));
+        size_t decoded_length;
+        base64_decode(method, decoded.empty() ? 0 : &decoded[0],
+            &decoded_length, encoded.get(), encoded_length, character_set);
+        decoded.resize(decoded_length);
+        CRADLE_CHECK_RANGES_EQUAL(src, decoded);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(base64_method_agreement_test)
+{
+    // Every method should agree with the scalar one for all lengths,
+    // including the bits that are left over after the SIMD blocks.
+    for (size_t length = 0; length != 300; ++length)
+    {
+        std::vector<cradle::uint8_t> data(length);
+        for (size_t j = 0; j != length; ++j)
+            data[j] = cradle::uint8_t(rand() & 0xff);
+        check_base64_method_agreement(data,
+            get_mime_base64_character_set());
+        check_base64_method_agreement(data,
+            get_url_friendly_base64_character_set());
+    }
+    // A character set that doesn't start with the usual digits should still
+    // work (via the scalar code).
+    base64_character_set reversed;
+    reversed.digits =
+        "/+9876543210zyxwvutsrqponmlkjihgfedcbaZYXWVUTSRQPONMLKJIHGFEDCBA";
+    reversed.padding = '=';
+    std::vector<cradle::uint8_t> data(1000);
+    for (size_t j = 0; j != data.size(); ++j)
+        data[j] = cradle::uint8_t(rand() & 0xff);
+    check_base64_method_agreement(data, reversed);
+}
+
+BOOST_AUTO_TEST_CASE(invalid_base64_test)
+{
+    // An invalid character anywhere in the string (including in the middle of
+    // a SIMD block) should be rejected by every method.
+    std::vector<cradle::uint8_t> data(300);
+    for (size_t j = 0; j != data.size(); ++j)
+        data[j] = cradle::uint8_t(rand() & 0xff);
+    string encoded = base64_encode(&data[0], data.size(),
+        get_mime_base64_character_set());
+    char const invalid_characters[] = { '*', '-', ' ', '\x80', '\xff' };
+    std::vector<cradle::uint8_t> decoded(
+        get_base64_decoded_length(encoded.length()));
+    for (auto method : all_base64_methods)
+    {
+        if (!is_base64_method_supported(method))
+            continue;
+        for (size_t i = 0; i < encoded.length() - 1; i += 7)
+        {
+            for (char c : invalid_characters)
+            {
+                string corrupted = encoded;
+                corrupted[i] = c;
+                size_t decoded_length;
+                BOOST_CHECK_THROW(
+                    base64_decode(method, &decoded[0], &decoded_length,
+                        corrupted.c_str(), corrupted.length(),
+                        get_mime_base64_character_set()),
+                    cradle::exception);
+            }
+        }
+        // A single trailing character is also invalid.
+        string extended = encoded + "A";
+        decoded.resize(get_base64_decoded_length(extended.length()));
+        size_t decoded_length;
+        BOOST_CHECK_THROW(
+            base64_decode(method, &decoded[0], &decoded_length,
+                extended.c_str(), extended.length(),
+                get_mime_base64_character_set()),
+            cradle::exception);
+    }
 }
 
 static void check_base36_round_trip(
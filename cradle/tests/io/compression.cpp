@@ -3,6 +3,7 @@
 #include <boost/scoped_array.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <cstdlib>
+#include <cstring>
 
 #define BOOST_TEST_MODULE compression
 #include <cradle/test.hpp>
@@ -53,3 +54,189 @@ BOOST_AUTO_TEST_CASE(to_memory)
     BOOST_CHECK_EQUAL_COLLECTIONS(data.get(), data.get() + data_size,
         decompressed_data.get(), decompressed_data.get() + data_size);
 }
+
+BOOST_AUTO_TEST_CASE(other_codecs)
+{
+    // This is large enough to be split into multiple LZ4 blocks.
+    std::size_t const data_size = 0x2020401;
+    boost::scoped_array<cradle::uint8_t> data(new cradle::uint8_t[data_size]);
+    for (std::size_t i = 0; i < data_size; ++i)
+        data[i] = (std::rand() & 0x7f) + 0x70;
+
+    for (int codec = 0; codec != 2; ++codec)
+    {
+        boost::scoped_array<cradle::uint8_t> compressed_data;
+        std::size_t compressed_data_size;
+        if (codec == 0)
+        {
+            lz4_compress(&compressed_data, &compressed_data_size,
+                data.get(), data_size);
+        }
+        else
+        {
+            zstd_compress(&compressed_data, &compressed_data_size,
+                data.get(), data_size, 3);
+        }
+
+        boost::scoped_array<cradle::uint8_t> decompressed_data(
+            new cradle::uint8_t[data_size]);
+        auto decompress = codec == 0 ? lz4_decompress : zstd_decompress;
+        decompress(decompressed_data.get(), data_size,
+            compressed_data.get(), compressed_data_size);
+        BOOST_CHECK_EQUAL_COLLECTIONS(data.get(), data.get() + data_size,
+            decompressed_data.get(), decompressed_data.get() + data_size);
+
+        // Truncated data should be detected.
+        BOOST_CHECK_THROW(
+            decompress(decompressed_data.get(), data_size,
+                compressed_data.get(), compressed_data_size - 1),
+            decompression_error);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(streaming)
+{
+    std::size_t const data_size = 0x1020401;
+    boost::scoped_array<cradle::uint8_t> data(new cradle::uint8_t[data_size]);
+    for (std::size_t i = 0; i < data_size; ++i)
+        data[i] = (std::rand() & 0x7f) + 0x70;
+
+    for (int codec = 0; codec != 3; ++codec)
+    {
+        // Compress the data in uneven pieces.
+        std::vector<cradle::uint8_t> compressed_data;
+        {
+            byte_vector_sink sink(compressed_data);
+            auto compressor =
+                codec == 0 ? create_zlib_compressor(sink) :
+                codec == 1 ? create_lz4_compressor(sink) :
+                create_zstd_compressor(sink, 3);
+            std::size_t offset = 0;
+            for (std::size_t piece = 1; offset != data_size; piece *= 3)
+            {
+                std::size_t size = (std::min)(piece, data_size - offset);
+                compressor->write(data.get() + offset, size);
+                offset += size;
+            }
+            compressor->finish();
+        }
+
+        // The result should be readable by the in-memory functions.
+        boost::scoped_array<cradle::uint8_t> decompressed_data(
+            new cradle::uint8_t[data_size]);
+        auto decompress_in_memory =
+            codec == 0 ? static_cast<void(*)(void*, std::size_t,
+                void const*, std::size_t)>(decompress) :
+            codec == 1 ? lz4_decompress : zstd_decompress;
+        decompress_in_memory(decompressed_data.get(), data_size,
+            &compressed_data[0], compressed_data.size());
+        BOOST_CHECK_EQUAL_COLLECTIONS(data.get(), data.get() + data_size,
+            decompressed_data.get(), decompressed_data.get() + data_size);
+
+        // Read it back in uneven pieces.
+        {
+            memory_source source(&compressed_data[0], compressed_data.size());
+            auto decompressor =
+                codec == 0 ? create_zlib_decompressor(source) :
+                codec == 1 ? create_lz4_decompressor(source) :
+                create_zstd_decompressor(source);
+            std::memset(decompressed_data.get(), 0, data_size);
+            std::size_t offset = 0;
+            for (std::size_t piece = 1; offset != data_size; piece *= 5)
+            {
+                std::size_t size = (std::min)(piece, data_size - offset);
+                decompressor->read(decompressed_data.get() + offset, size);
+                offset += size;
+            }
+            decompressor->finish();
+            BOOST_CHECK_EQUAL_COLLECTIONS(data.get(),
+                data.get() + data_size, decompressed_data.get(),
+                decompressed_data.get() + data_size);
+        }
+
+        // Reading past the end of the data should be detected.
+        {
+            memory_source source(&compressed_data[0], compressed_data.size());
+            auto decompressor =
+                codec == 0 ? create_zlib_decompressor(source) :
+                codec == 1 ? create_lz4_decompressor(source) :
+                create_zstd_decompressor(source);
+            decompressor->read(decompressed_data.get(), data_size - 1);
+            BOOST_CHECK_THROW(decompressor->read(decompressed_data.get(), 2),
+                decompression_error);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(chunked)
+{
+    // This spans several chunks, with a partial one at the end.
+    std::size_t const data_size = 0x520401;
+    boost::scoped_array<cradle::uint8_t> data(new cradle::uint8_t[data_size]);
+    for (std::size_t i = 0; i < data_size; ++i)
+        data[i] = cradle::uint8_t((i / 7) ^ (std::rand() & 0x3));
+
+    boost::scoped_array<cradle::uint8_t> compressed_data;
+    std::size_t compressed_data_size;
+    chunked_compress(&compressed_data, &compressed_data_size,
+        data.get(), data_size, 3);
+    BOOST_CHECK_EQUAL(
+        get_chunked_size(compressed_data.get(), compressed_data_size),
+        data_size);
+
+    boost::scoped_array<cradle::uint8_t> decompressed_data(
+        new cradle::uint8_t[data_size]);
+    chunked_decompress(decompressed_data.get(), data_size,
+        compressed_data.get(), compressed_data_size);
+    BOOST_CHECK_EQUAL_COLLECTIONS(data.get(), data.get() + data_size,
+        decompressed_data.get(), decompressed_data.get() + data_size);
+
+    // Ranges should be extractable on their own, whether they're within a
+    // single chunk or span several.
+    std::size_t const ranges[][2] = {
+        { 0, 1 }, { 0x200000, 0x200000 }, { 0x12345, 0x300000 },
+        { data_size - 10, 10 } };
+    for (auto const& range : ranges)
+    {
+        std::vector<cradle::uint8_t> part(range[1]);
+        chunked_decompress_range(&part[0], range[0], range[1],
+            compressed_data.get(), compressed_data_size);
+        BOOST_CHECK_EQUAL_COLLECTIONS(data.get() + range[0],
+            data.get() + range[0] + range[1], part.begin(), part.end());
+    }
+    {
+        std::vector<cradle::uint8_t> part(2);
+        BOOST_CHECK_THROW(
+            chunked_decompress_range(&part[0], data_size - 1, 2,
+                compressed_data.get(), compressed_data_size),
+            decompression_error);
+    }
+
+    // The streaming interface should produce and accept the same format.
+    std::vector<cradle::uint8_t> streamed_data;
+    {
+        byte_vector_sink sink(streamed_data);
+        auto compressor = create_chunked_compressor(sink, 3);
+        compressor->write(data.get(), 1000);
+        compressor->write(data.get() + 1000, data_size - 1000);
+        compressor->finish();
+    }
+    BOOST_CHECK(streamed_data == std::vector<cradle::uint8_t>(
+        compressed_data.get(), compressed_data.get() + compressed_data_size));
+    {
+        memory_source source(compressed_data.get(), compressed_data_size);
+        auto decompressor = create_chunked_decompressor(source);
+        std::memset(decompressed_data.get(), 0, data_size);
+        decompressor->read(decompressed_data.get(), 1000);
+        decompressor->read(decompressed_data.get() + 1000, data_size - 1000);
+        decompressor->finish();
+        BOOST_CHECK_EQUAL_COLLECTIONS(data.get(), data.get() + data_size,
+            decompressed_data.get(), decompressed_data.get() + data_size);
+    }
+
+    // Truncated data should be detected.
+    BOOST_CHECK_THROW(
+        chunked_decompress(decompressed_data.get(), data_size,
+            compressed_data.get(), compressed_data_size - 1),
+        decompression_error);
+}
@@ -0,0 +1,80 @@
+#include <cradle/io/crc.hpp>
+#include <vector>
+
+#define BOOST_TEST_MODULE crc
+#include <cradle/test.hpp>
+
+using namespace cradle;
+
+static std::vector<uint8_t> make_data(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    uint32_t x = 1;
+    for (size_t i = 0; i != size; ++i)
+    {
+        x = x * 1103515245 + 12345;
+        data[i] = uint8_t(x >> 16);
+    }
+    return data;
+}
+
+static crc32_method const all_methods[] = {
+    crc32_method::BYTEWISE, crc32_method::SLICING_BY_8,
+    crc32_method::PCLMUL, crc32_method::ARMV8 };
+
+BOOST_AUTO_TEST_CASE(check_value_test)
+{
+    char const* check = "123456789";
+    for (auto method : all_methods)
+    {
+        if (!is_crc32_method_supported(method))
+            continue;
+        BOOST_CHECK_EQUAL(compute_crc32(method, 0, check, 9), 0xcbf43926);
+        BOOST_CHECK_EQUAL(compute_crc32(method, 0, check, 0), 0);
+    }
+    BOOST_CHECK_EQUAL(compute_crc32(0, check, 9), 0xcbf43926);
+}
+
+BOOST_AUTO_TEST_CASE(method_agreement_test)
+{
+    // Every method should agree with the bytewise one for all sizes and
+    // alignments, including the odd bits at either end of a block.
+    auto data = make_data(1100);
+    for (size_t offset = 0; offset != 17; ++offset)
+    {
+        for (size_t size = 0; offset + size <= data.size();
+            size += size < 200 ? 1 : 37)
+        {
+            uint32_t expected = compute_crc32(crc32_method::BYTEWISE,
+                0x12345678, &data[offset], size);
+            for (auto method : all_methods)
+            {
+                if (!is_crc32_method_supported(method))
+                    continue;
+                BOOST_CHECK_EQUAL(
+                    compute_crc32(method, 0x12345678, &data[offset], size),
+                    expected);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(combine_test)
+{
+    auto data = make_data(5000);
+    uint32_t whole = compute_crc32(0, &data[0], data.size());
+    size_t const splits[] = { 0, 1, 7, 64, 1000, 4999, 5000 };
+    for (size_t split : splits)
+    {
+        uint32_t first = compute_crc32(0, &data[0], split);
+        uint32_t second =
+            compute_crc32(0, &data[0] + split, data.size() - split);
+        // Computing incrementally should match.
+        BOOST_CHECK_EQUAL(
+            compute_crc32(first, &data[0] + split, data.size() - split),
+            whole);
+        // And so should combining the two independent CRCs.
+        BOOST_CHECK_EQUAL(
+            combine_crc32s(first, second, data.size() - split), whole);
+    }
+}
@@ -1,6 +1,9 @@
 #include <cradle/io/generic_io.hpp>
+#include <cradle/io/compression.hpp>
+#include <cradle/date_time.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/shared_array.hpp>
+#include <cstring>
 
 #define BOOST_TEST_MODULE generic_io
 #include <cradle/test.hpp>
@@ -40,6 +43,27 @@ void test_value_io(value const& v)
         BOOST_CHECK_EQUAL(u, v);
     }
 
+    value_codec const codecs[] = { value_codec::NONE, value_codec::LZ4,
+        value_codec::ZSTD_FAST, value_codec::ZSTD, value_codec::ZSTD_HIGH,
+        value_codec::CHUNKED, value_codec::INDEXED };
+    for (auto codec : codecs)
+    {
+        byte_vector data;
+        uint32_t crc, read_crc;
+        serialize_value(&data, v, &crc, codec);
+        value u;
+        deserialize_value(&u, &data[0], data.size(), &read_crc);
+        BOOST_CHECK_EQUAL(u, v);
+        BOOST_CHECK_EQUAL(read_crc, crc);
+    }
+
+    {
+        write_value_file("value_file", v, 0, value_codec::NONE);
+        value u;
+        read_value_file(&u, "value_file");
+        BOOST_CHECK_EQUAL(u, v);
+    }
+
     {
         std::string s;
         value_to_base64_string(&s, v);
@@ -124,14 +148,536 @@ BOOST_AUTO_TEST_CASE(generic_io_test)
     BOOST_CHECK_EQUAL(json,
         "[\n"
         "   {\n"
-        "      \"b\" : {\n"
-        "         \"blob\" : \"AQIDBAUGBwgJCg==\",\n"
-        "         \"type\" : \"base64-encoded-blob\"\n"
+        "      \"b\": {\n"
+        "         \"blob\": \"AQIDBAUGBwgJCg==\",\n"
+        "         \"type\": \"base64-encoded-blob\"\n"
         "      },\n"
-        "      \"x\" : 0.10,\n"
-        "      \"y\" : 0.20\n"
+        "      \"x\": 0.10,\n"
+        "      \"y\": 0.20\n"
         "   },\n"
         "   0.10,\n"
         "   0.20\n"
         "]\n");
 }
+
+BOOST_AUTO_TEST_CASE(json_test)
+{
+    // Numbers are integers only if they're written as such and fit in 32
+    // bits.
+    BOOST_CHECK_EQUAL(parse_json_value("12"), value(integer(12)));
+    BOOST_CHECK_EQUAL(parse_json_value("-2147483639"),
+        value(integer(-2147483639)));
+    BOOST_CHECK_EQUAL(parse_json_value("4294967289"),
+        value(integer(4294967289)));
+    BOOST_CHECK_EQUAL(parse_json_value("99999999999"), value(99999999999.));
+    BOOST_CHECK_EQUAL(parse_json_value("12.0"), value(12.));
+    BOOST_CHECK_EQUAL(parse_json_value("-1.5e3"), value(-1500.));
+    BOOST_CHECK_EQUAL(parse_json_value("0.000123"), value(0.000123));
+    BOOST_CHECK_EQUAL(parse_json_value("3.14159265358979323846264"),
+        value(3.14159265358979323846264));
+    BOOST_CHECK_EQUAL(parse_json_value("1.7976931348623157e308"),
+        value(1.7976931348623157e308));
+
+    BOOST_CHECK_EQUAL(
+        parse_json_value("\"a\\\"\\\\\\/\\n\\u00e9\\ud83d\\ude00 b\""),
+        value("a\"\\/\n\xc3\xa9\xf0\x9f\x98\x80 b"));
+    BOOST_CHECK_EQUAL(parse_json_value("\"2017-04-12T18:30:01.123Z\""),
+        value(parse_time("2017-04-12T18:30:01.123Z")));
+    BOOST_CHECK_EQUAL(parse_json_value("\"2017-02-30T18:30:01.123Z\""),
+        value("2017-02-30T18:30:01.123Z"));
+
+    // Comments are allowed, and repeated fields take the last value.
+    {
+        value_map r;
+        r[value("a")] = value(value_list{ value(true), value(nil) });
+        r[value("b")] = value(integer(2));
+        BOOST_CHECK_EQUAL(
+            parse_json_value(
+                "// record\n{ \"b\": 1, \"a\": [true, /* x */ null],\n"
+                "  \"b\": 2 }"),
+            value(r));
+    }
+
+    // Lists of key/value pairs are maps.
+    {
+        value_map m;
+        m[value(integer(1))] = value("x");
+        m[value(integer(2))] = value("z");
+        BOOST_CHECK_EQUAL(
+            parse_json_value(
+                "[{\"key\": 1, \"value\": \"x\"},"
+                " {\"value\": \"y\", \"key\": 2},"
+                " {\"key\": 2, \"value\": \"z\"}]"),
+            value(m));
+        value_list l;
+        value_map pair;
+        pair[value("key")] = value(integer(1));
+        pair[value("value")] = value(integer(2));
+        l.push_back(value(pair));
+        l.push_back(value(integer(3)));
+        BOOST_CHECK_EQUAL(
+            parse_json_value("[{\"key\": 1, \"value\": 2}, 3]"), value(l));
+    }
+
+    BOOST_CHECK_EQUAL(
+        parse_json_value(
+            "{\"type\": \"base64-encoded-blob\", \"blob\": \"AQID\"}"),
+        value(make_blob(3)));
+    BOOST_CHECK_THROW(
+        parse_json_value("{\"type\": \"base64-encoded-blob\", \"blob\": 3}"),
+        json_parse_error);
+
+    char const* const malformed[] = {
+        "", "[1, 2", "[1 2]", "[1,]", "{\"a\" 1}", "{a: 1}", "\"abc",
+        "\"\\q\"", "\"\\ud83d\"", "tru", "/* x", "--1" };
+    for (auto json : malformed)
+        BOOST_CHECK_THROW(parse_json_value(json), json_parse_error);
+
+    // Short lists of simple values are written on a single line.
+    {
+        value_map r;
+        r[value("i")] = value(integer(-3));
+        r[value("l")] = value(value_list{ value(1.5), value("a\tb"),
+            value(value_list()), value(value_map()) });
+        r[value("t")] = value(parse_time("2017-04-12T18:30:01.123Z"));
+        BOOST_CHECK_EQUAL(value_to_json(value(r)),
+            "{\n"
+            "   \"i\": -3.0,\n"
+            "   \"l\": [ 1.50, \"a\\tb\", [], {} ],\n"
+            "   \"t\": \"2017-04-12T18:30:01.123Z\"\n"
+            "}\n");
+    }
+    {
+        value_map m;
+        m[value(integer(1))] = value(value_list(30, value(integer(0))));
+        string json = value_to_json(value(m));
+        string start =
+            "[\n"
+            "   {\n"
+            "      \"key\": 1.0,\n"
+            "      \"value\": [\n"
+            "         0.0,\n";
+        BOOST_CHECK_EQUAL(json.substr(0, start.length()), start);
+        BOOST_CHECK_EQUAL(parse_json_value(json),
+            value(value_map{ { value(1.), value(value_list(30, value(0.))) }
+                }));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgpack_segments_test)
+{
+    value_map r;
+    r[value("a")] = value(make_blob(3));
+    r[value("b")] = value(make_blob(100000));
+    r[value("c")] = value(string(5000, 'c'));
+    r[value("d")] =
+        value(value_list{ value(1.5), value("x"), value(integer(7)) });
+    value v(r);
+
+    string packed = value_to_msgpack_string(v);
+    blob packed_blob = value_to_msgpack_blob(v);
+    BOOST_REQUIRE_EQUAL(packed_blob.size, packed.length());
+    BOOST_CHECK(std::memcmp(packed_blob.data, packed.data(),
+        packed.length()) == 0);
+
+    // Do this a few times to exercise the reuse of the framing buffer.
+    blob b = cast<blob>(get_field(r, "b"));
+    for (int i = 0; i != 3; ++i)
+    {
+        std::vector<blob> segments = value_to_msgpack_segments(v);
+        string concatenated;
+        bool referenced = false;
+        for (auto const& segment : segments)
+        {
+            concatenated.append(
+                reinterpret_cast<char const*>(segment.data), segment.size);
+            // The large blob should be referenced rather than copied.
+            if (segment.data == b.data)
+                referenced = true;
+        }
+        BOOST_CHECK_EQUAL(concatenated, packed);
+        BOOST_CHECK(referenced);
+    }
+
+    // Segments should remain valid after the value and the thread's framing
+    // buffer have moved on.
+    std::vector<blob> segments;
+    string expected;
+    {
+        value u(value_map{ { value("e"), value(make_blob(10000)) } });
+        segments = value_to_msgpack_segments(u);
+        expected = value_to_msgpack_string(u);
+    }
+    value_to_msgpack_segments(v);
+    string concatenated;
+    for (auto const& segment : segments)
+    {
+        concatenated.append(
+            reinterpret_cast<char const*>(segment.data), segment.size);
+    }
+    BOOST_CHECK_EQUAL(concatenated, expected);
+}
+
+BOOST_AUTO_TEST_CASE(uncompressed_blob_aliasing_test)
+{
+    value_map r;
+    r["a"] = value(make_blob(3));
+    r["b"] = value(make_blob(1000));
+    value v(r);
+
+    byte_vector data;
+    uint32_t crc;
+    serialize_value(&data, v, &crc, value_codec::NONE);
+
+    // Deserializing from a blob should produce blobs that reference the
+    // original data (at aligned addresses) rather than copies of it.
+    auto storage = std::make_shared<byte_vector>(data);
+    blob serialized;
+    serialized.ownership = storage;
+    serialized.data = &(*storage)[0];
+    serialized.size = storage->size();
+    value u;
+    uint32_t read_crc;
+    deserialize_value(&u, serialized, &read_crc);
+    BOOST_CHECK_EQUAL(u, v);
+    BOOST_CHECK_EQUAL(read_crc, crc);
+    if (reinterpret_cast<uintptr_t>(serialized.data) % 16 == 0)
+    {
+        value field = get_field(cast<value_map>(u), "b");
+        auto p = reinterpret_cast<uint8_t const*>(cast<blob>(field).data);
+        uint8_t const* begin = &(*storage)[0];
+        BOOST_CHECK(p >= begin && p < begin + storage->size());
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(p) % 16, 0);
+    }
+
+    // Corrupting the data should be detected.
+    (*storage)[storage->size() - 1] ^= 1;
+    BOOST_CHECK_THROW(deserialize_value(&u, serialized), crc_error);
+}
+
+static blob make_serialized_blob(byte_vector const& data)
+{
+    auto storage = std::make_shared<byte_vector>(data);
+    blob serialized;
+    serialized.ownership = storage;
+    serialized.data = &(*storage)[0];
+    serialized.size = storage->size();
+    return serialized;
+}
+
+// Check that a view matches the value it's supposed to refer to, visiting
+// every part of it through the view.
+static void check_view(value_view const& view, value const& v)
+{
+    BOOST_REQUIRE_EQUAL(view.type(), v.type());
+    BOOST_CHECK_EQUAL(read_value(view), v);
+    switch (v.type())
+    {
+     case value_type::LIST:
+      {
+        value_list const& list = cast<value_list>(v);
+        BOOST_REQUIRE_EQUAL(view.size(), list.size());
+        for (size_t i = 0; i != list.size(); ++i)
+            check_view(view.item(i), list[i]);
+        BOOST_CHECK_THROW(view.item(list.size()), index_out_of_bounds);
+        break;
+      }
+     case value_type::MAP:
+      {
+        value_map const& map = cast<value_map>(v);
+        BOOST_REQUIRE_EQUAL(view.size(), map.size());
+        size_t n = 0;
+        for (auto const& entry : map)
+        {
+            check_view(view.key(n), entry.first);
+            check_view(view.entry_value(n), entry.second);
+            value_view found;
+            BOOST_REQUIRE(view.find(&found, entry.first));
+            check_view(found, entry.second);
+            ++n;
+        }
+        break;
+      }
+     default:
+        break;
+    }
+}
+
+// Visit every part of a view without knowing what's there.
+static void visit_view(value_view const& view)
+{
+    value unused;
+    view.read(&unused);
+    switch (view.type())
+    {
+     case value_type::LIST:
+        for (size_t i = 0; i != view.size(); ++i)
+            visit_view(view.item(i));
+        break;
+     case value_type::MAP:
+        for (size_t i = 0; i != view.size(); ++i)
+        {
+            visit_view(view.key(i));
+            visit_view(view.entry_value(i));
+        }
+        break;
+     default:
+        break;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(value_view_test)
+{
+    value_map inner;
+    inner[value("blob")] = value(make_blob(1000));
+    inner[value("empty")] = value(value_list());
+    inner[value(integer(4))] = value("integer key");
+    value_list points;
+    for (int i = 0; i != 100; ++i)
+    {
+        value_map point;
+        point[value("x")] = value(double(i));
+        point[value("label")] = value(string(i % 7, 'a'));
+        points.push_back(value(point));
+    }
+    value_map r;
+    r[value("inner")] = value(inner);
+    r[value("points")] = value(points);
+    r[value("size")] = value(make_blob(3));
+    r[value("origin")] = value("origin");
+    r[value("")] = value(false);
+    r[value("z")] = value(nil);
+    value v(r);
+
+    byte_vector data;
+    uint32_t crc;
+    serialize_value(&data, v, &crc, value_codec::INDEXED);
+    blob serialized = make_serialized_blob(data);
+
+    value_view view;
+    uint32_t view_crc;
+    BOOST_REQUIRE(view_serialized_value(&view, serialized, &view_crc));
+    BOOST_CHECK_EQUAL(view_crc, crc);
+    check_view(view, v);
+
+    BOOST_CHECK_EQUAL(read_value(view.field("origin")), value("origin"));
+    BOOST_CHECK_EQUAL(
+        read_value(view.field("points").item(42).field("x")),
+        value(42.));
+    value_view missing;
+    BOOST_CHECK(!view.find(&missing, value("missing")));
+    BOOST_CHECK(!view.find(&missing, value("originals")));
+    BOOST_CHECK(!view.find(&missing, value(integer(1))));
+    BOOST_CHECK_THROW(view.field("missing"), cradle::exception);
+    BOOST_CHECK_THROW(view.item(0), type_mismatch);
+    BOOST_CHECK_THROW(view.field("origin").size(), type_mismatch);
+
+    // Blobs read through the view should reference the serialized data.
+    if (reinterpret_cast<uintptr_t>(serialized.data) % 16 == 0)
+    {
+        value b = read_value(view.field("inner").field("blob"));
+        auto p = reinterpret_cast<uint8_t const*>(cast<blob>(b).data);
+        auto begin = reinterpret_cast<uint8_t const*>(serialized.data);
+        BOOST_CHECK(p >= begin && p < begin + serialized.size);
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(p) % 16, 0);
+    }
+
+    // A view (and its parts) can outlive the original blob.
+    value_view points_view = view.field("points");
+    view = value_view();
+    serialized = blob();
+    BOOST_CHECK_EQUAL(read_value(points_view), value(points));
+
+    // Other codecs can't be viewed.
+    serialize_value(&data, v, 0, value_codec::NONE);
+    BOOST_CHECK(!view_serialized_value(&view,
+        make_serialized_blob(data)));
+
+    // Corrupt sizes and item tables should be detected rather than followed.
+    // (Depending on what's corrupted, that's either by the structural checks
+    // or by the CRC checks.)
+    serialize_value(&data, v, 0, value_codec::INDEXED);
+    for (size_t i = 16; i != 16 + 12 + 6 * 8; ++i)
+    {
+        byte_vector corrupted = data;
+        corrupted[i] = 0xff;
+        BOOST_REQUIRE(view_serialized_value(&view,
+            make_serialized_blob(corrupted)));
+        BOOST_CHECK_THROW(visit_view(view), cradle::exception);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(value_view_crc_test)
+{
+    value_map r;
+    r[value("count")] = value(integer(3));
+    r[value("image")] = value(make_blob(0x10000));
+    r[value("label")] = value("label");
+    value v(r);
+
+    byte_vector data;
+    serialize_value(&data, v, 0, value_codec::INDEXED);
+    blob serialized = make_serialized_blob(data);
+    value_view view;
+    BOOST_REQUIRE(view_serialized_value(&view, serialized));
+    // This only works if blobs can reference the serialized data.
+    if (reinterpret_cast<uintptr_t>(serialized.data) % 16 != 0)
+        return;
+
+    // Corrupt a byte in the middle of the image.
+    value image;
+    view.field("image").read(&image, false);
+    size_t offset =
+        reinterpret_cast<uint8_t const*>(cast<blob>(image).data) -
+        reinterpret_cast<uint8_t const*>(serialized.data) + 0x8000;
+    data[offset] ^= 1;
+    serialized = make_serialized_blob(data);
+    BOOST_REQUIRE(view_serialized_value(&view, serialized));
+
+    // The other fields are still readable, but the image isn't.
+    BOOST_CHECK_EQUAL(read_value(view.field("count")), value(integer(3)));
+    BOOST_CHECK_EQUAL(read_value(view.field("label")), value("label"));
+    BOOST_CHECK_THROW(read_value(view.field("image")), crc_error);
+
+    // If the image's contents aren't checked when it's read, only the parts
+    // of it that overlap the corrupt byte fail their checks.
+    view.field("image").read(&image, false);
+    auto p = reinterpret_cast<uint8_t const*>(cast<blob>(image).data);
+    BOOST_CHECK(view.check_crcs(p, p + 0x100));
+    BOOST_CHECK(view.check_crcs(p + 0xc000, p + 0x10000));
+    BOOST_CHECK(!view.check_crcs(p + 0x7ff0, p + 0x8010));
+    BOOST_CHECK(!view.check_crcs(p, p + 0x10000));
+
+    value u;
+    BOOST_CHECK_THROW(deserialize_value(&u, serialized), crc_error);
+}
+
+BOOST_AUTO_TEST_CASE(streaming_test)
+{
+    // This is large enough that blobs bypass the stream buffers and LZ4
+    // and chunked data is split into multiple blocks.
+    value_map r;
+    r["small"] = value(make_blob(100));
+    r["large"] = value(make_blob(0x1100000));
+    value_list numbers;
+    for (int i = 0; i != 10000; ++i)
+        numbers.push_back(value(double(i)));
+    r["numbers"] = value(numbers);
+    value v(r);
+
+    value_codec const codecs[] = { value_codec::ZLIB, value_codec::NONE,
+        value_codec::LZ4, value_codec::ZSTD, value_codec::CHUNKED,
+        value_codec::INDEXED };
+    for (auto codec : codecs)
+    {
+        uint32_t crc;
+        write_value_file("value_file", v, &crc, codec);
+
+        // Writing to a file and writing to memory should give the same data.
+        byte_vector data;
+        uint32_t memory_crc;
+        serialize_value(&data, v, &memory_crc, codec);
+        BOOST_CHECK_EQUAL(memory_crc, crc);
+        BOOST_CHECK_EQUAL(file_size(file_path("value_file")), data.size());
+
+        // Read it back incrementally from the file.
+        {
+            c_file f("value_file", "rb");
+            c_file_source src(f);
+            value u;
+            uint32_t read_crc;
+            deserialize_value(&u, src, &read_crc);
+            BOOST_CHECK_EQUAL(u, v);
+            BOOST_CHECK_EQUAL(read_crc, crc);
+        }
+
+        // Truncated data should be detected.
+        {
+            memory_source src(&data[0], data.size() - 1);
+            value u;
+            BOOST_CHECK_THROW(deserialize_value(&u, src), std::exception);
+        }
+    }
+
+    remove(file_path("value_file"));
+}
+
+BOOST_AUTO_TEST_CASE(small_blob_test)
+{
+    // Small blobs share storage when they're decoded, so use enough of them
+    // (in a variety of sizes) to fill several blocks of it.
+    value_list blobs;
+    for (int i = 0; i != 200; ++i)
+        blobs.push_back(value(make_blob((i * 37) % 5000)));
+    value v(blobs);
+
+    byte_vector data;
+    serialize_value(&data, v, 0, value_codec::ZSTD);
+    blob kept;
+    {
+        value u;
+        deserialize_value(&u, &data[0], data.size());
+        BOOST_CHECK_EQUAL(u, v);
+        for (auto const& item : cast<value_list>(u))
+        {
+            BOOST_CHECK_EQUAL(
+                reinterpret_cast<uintptr_t>(cast<blob>(item).data) % 16, 0);
+        }
+        kept = cast<blob>(cast<value_list>(u)[3]);
+    }
+    // A blob should remain valid on its own after the rest of the value is
+    // gone.
+    BOOST_CHECK_EQUAL(value(kept), blobs[3]);
+}
+
+BOOST_AUTO_TEST_CASE(legacy_format_test)
+{
+    // Values written by older code use the smallest possible size field.
+    value v(string(1000, 'x'));
+    byte_vector data;
+    uint32_t crc;
+    serialize_value(&data, v, &crc, value_codec::ZLIB);
+
+    // The raw encoding of the string is its type tag, its length and its
+    // contents, and its size (1008) is 3, 243 in base 255.
+    byte_vector legacy(data.begin(), data.begin() + 4);
+    legacy.push_back(3);
+    legacy.push_back(243);
+    legacy.push_back(0xff);
+    legacy.insert(legacy.end(), data.begin() + 14, data.end());
+
+    value u;
+    uint32_t read_crc;
+    deserialize_value(&u, &legacy[0], legacy.size(), &read_crc);
+    BOOST_CHECK_EQUAL(u, v);
+    BOOST_CHECK_EQUAL(read_crc, crc);
+}
+
+BOOST_AUTO_TEST_CASE(interned_field_name_test)
+{
+    // Records that are decoded should share the interned copies of their
+    // field names (but keep their own copies of anything else).
+    field_key interned = intern_field_name("interned_field_name_test");
+    value_map r;
+    r[interned.key()] = value("a");
+    r[value("uninterned_field_name_test")] = value("b");
+    value v(r);
+
+    auto check_keys = [&](value const& u)
+    {
+        BOOST_CHECK_EQUAL(u, v);
+        value_map const& decoded = cast<value_map>(u);
+        BOOST_CHECK(decoded.begin()->first.shares_contents_with(
+            interned.key()));
+        BOOST_CHECK(!decoded.rbegin()->first.shares_contents_with(
+            r.rbegin()->first));
+    };
+
+    check_keys(parse_json_value(value_to_json(v)));
+    check_keys(parse_msgpack_value(value_to_msgpack_string(v)));
+    byte_vector data;
+    serialize_value(&data, v, 0, value_codec::NONE);
+    value u;
+    deserialize_value(&u, &data[0], data.size());
+    check_keys(u);
+}
@@ -1,6 +1,7 @@
 #include <cradle/simple_concurrency.hpp>
 #include <cradle/background/system.hpp>
 #include <cradle/background/api.hpp>
+#include <cradle/background/internals.hpp>
 
 #define BOOST_TEST_MODULE cradle_multithreading
 #include <cradle/test.hpp>
@@ -107,3 +108,444 @@ BOOST_AUTO_TEST_CASE(background_execution_system_test)
         BOOST_CHECK_EQUAL(n[i], i);
     }
 }
+
+// a node in a dependency graph, which produces its node number once the
+// nodes that it depends on have been produced
+struct dependent_node_job : background_job_interface
+{
+    void gather_inputs()
+    {
+        for (auto& input : inputs)
+            input.update();
+    }
+    bool inputs_ready()
+    {
+        for (auto const& input : inputs)
+        {
+            if (!input.is_ready())
+                return false;
+        }
+        return true;
+    }
+    void execute(
+        check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        int sum = node;
+        for (auto const& input : inputs)
+            sum += get(cast_immutable<int>(input.data()));
+        set_cached_data(*bg, make_id(node), erase_type(make_immutable(node)));
+        *result = sum;
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "dependent node job";
+        return info;
+    }
+    background_execution_system* bg;
+    int node;
+    std::vector<untyped_background_data_ptr> inputs;
+    int* result;
+};
+
+// Run a layered graph of jobs where each job depends on 'fan_in' jobs in the
+// previous layer and check that every job runs exactly once with the right
+// inputs. The return value is the number of times that jobs were woken up
+// because of their dependencies.
+static size_t
+run_dependency_graph(background_execution_system& bg, int* next_node,
+    int n_layers, int width, int fan_in)
+{
+    auto& executor =
+        *bg.impl_->pools[int(background_job_queue_type::CALCULATION)].executor;
+    size_t initial_wakeups = executor.woken_job_count;
+
+    int first_node = *next_node;
+    int n_nodes = n_layers * width;
+    *next_node += n_nodes;
+    std::vector<int> results(n_nodes, -1);
+    std::vector<untyped_background_data_ptr> ptrs(n_nodes);
+    // The layers are queued in order, so every input is already being
+    // computed by the time a job that needs it is queued.
+    for (int layer = 0; layer != n_layers; ++layer)
+    {
+        for (int i = 0; i != width; ++i)
+        {
+            int index = layer * width + i;
+            auto* job = new dependent_node_job;
+            job->bg = &bg;
+            job->node = first_node + index;
+            job->result = &results[index];
+            if (layer != 0)
+            {
+                for (int j = 0; j != fan_in; ++j)
+                {
+                    int input = first_node + (layer - 1) * width +
+                        (i + j * 7) % width;
+                    job->inputs.push_back(
+                        untyped_background_data_ptr(bg, make_id(input)));
+                }
+            }
+            ptrs[index].reset(bg, make_id(job->node));
+            add_untyped_background_job(ptrs[index], bg,
+                background_job_queue_type::CALCULATION, job);
+        }
+    }
+
+    for (int index = 0; index != n_nodes; ++index)
+    {
+        while (!ptrs[index].is_ready())
+        {
+            boost::this_thread::yield();
+            ptrs[index].update();
+        }
+    }
+    // Wait for the last job to record its result.
+    while (executor.n_idle_threads !=
+        bg.impl_->pools[int(background_job_queue_type::CALCULATION)].
+            threads.size())
+    {
+        boost::this_thread::yield();
+    }
+
+    for (int layer = 0; layer != n_layers; ++layer)
+    {
+        for (int i = 0; i != width; ++i)
+        {
+            int index = layer * width + i;
+            int expected = first_node + index;
+            if (layer != 0)
+            {
+                for (int j = 0; j != fan_in; ++j)
+                {
+                    expected += first_node + (layer - 1) * width +
+                        (i + j * 7) % width;
+                }
+            }
+            BOOST_CHECK_EQUAL(results[index], expected);
+        }
+    }
+    BOOST_CHECK_EQUAL(size_t(executor.reported_size), 0);
+
+    size_t wakeups = executor.woken_job_count - initial_wakeups;
+    BOOST_TEST_MESSAGE(n_layers << "x" << width << " graph (fan-in " <<
+        fan_in << "): " << double(wakeups) / n_nodes <<
+        " wakeups per completed job");
+    return wakeups;
+}
+
+BOOST_AUTO_TEST_CASE(dependency_wakeup_test)
+{
+    // Jobs that are waiting on their inputs should only be woken up once
+    // all of those inputs are available, so no matter what the shape of the
+    // graph is, there should never be more wakeups than jobs.
+    int next_node = 0;
+    for (unsigned n_threads : { 1, 2, 4, 8 })
+    {
+        background_execution_system bg(n_threads);
+        // deep
+        BOOST_CHECK(run_dependency_graph(bg, &next_node, 500, 1, 1) <= 500);
+        // wide
+        BOOST_CHECK(run_dependency_graph(bg, &next_node, 2, 2000, 1) <= 4000);
+        // layered
+        BOOST_CHECK(run_dependency_graph(bg, &next_node, 30, 50, 2) <= 1500);
+        // wide fan-in
+        BOOST_CHECK(run_dependency_graph(bg, &next_node, 2, 200, 40) <= 400);
+    }
+}
+
+struct failing_job : simple_job_interface
+{
+    void execute(
+        check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        throw cradle::exception("failing job");
+    }
+};
+
+BOOST_AUTO_TEST_CASE(failed_concurrent_job_test)
+{
+    int const n_jobs = 100;
+
+    int n[n_jobs];
+    std::vector<simple_set_int_job> jobs;
+    for (int i = 0; i != n_jobs; ++i)
+        jobs.push_back(simple_set_int_job(n + i, i));
+    failing_job failing;
+
+    std::vector<simple_job_interface*> job_ptrs;
+    for (int i = 0; i != n_jobs; ++i)
+    {
+        job_ptrs.push_back(&jobs[i]);
+        if (i == n_jobs / 2)
+            job_ptrs.push_back(&failing);
+    }
+
+    float progress;
+    progress_recorder reporter(&progress);
+    null_check_in check_in;
+
+    BOOST_CHECK_THROW(
+        execute_jobs_concurrently(check_in, reporter, job_ptrs.size(),
+            &job_ptrs[0]),
+        worker_thread_failed);
+
+    // The pool should still be usable afterwards.
+    execute_jobs_concurrently(check_in, reporter, n_jobs, &jobs[0]);
+    for (int i = 0; i != n_jobs; ++i)
+        BOOST_CHECK_EQUAL(n[i], i);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_loops_test)
+{
+    // Without a parallel executor from the caller, the loops run on the
+    // shared thread pool.
+    null_check_in check_in;
+    std::vector<int> n(1000, -1);
+    parallel_for(check_in, 0, n.size(), [&](size_t i) { n[i] = int(i); });
+    for (size_t i = 0; i != n.size(); ++i)
+        BOOST_CHECK_EQUAL(n[i], int(i));
+    BOOST_CHECK_EQUAL(
+        parallel_reduce(check_in, 10, 20, 0,
+            [](size_t i) { return int(i); },
+            [](int a, int b) { return a + b; }),
+        145);
+    BOOST_CHECK_EQUAL(
+        parallel_reduce(check_in, 5, 5, 7,
+            [](size_t i) { return int(i); },
+            [](int a, int b) { return a + b; }),
+        7);
+
+    // Nested loops should work too.
+    std::vector<int> sums(100, 0);
+    parallel_for(check_in, 0, sums.size(),
+        [&](size_t i)
+        {
+            sums[i] = parallel_reduce(check_in, 0, i + 1, 0,
+                [](size_t j) { return int(j); },
+                [](int a, int b) { return a + b; });
+        });
+    for (size_t i = 0; i != sums.size(); ++i)
+        BOOST_CHECK_EQUAL(sums[i], int(i * (i + 1) / 2));
+
+    // Exceptions should make it back to the caller.
+    BOOST_CHECK_THROW(
+        parallel_for(check_in, 0, 1000,
+            [](size_t i)
+            {
+                if (i == 500)
+                    throw cradle::exception("failing task");
+            }),
+        cradle::exception);
+}
+
+// the number of threads that are currently doing work for multi-core jobs,
+// and the most there have ever been
+static std::atomic<int> active_thread_count(0), max_active_thread_count(0);
+
+static void
+enter_multi_core_work(std::atomic<int>& active, std::atomic<int>& max_active)
+{
+    int n = ++active;
+    int max = max_active;
+    while (n > max && !max_active.compare_exchange_weak(max, n))
+        ;
+}
+
+// a job that asks for multiple cores and sums the integers in
+// [0, n_values) over them
+struct multi_core_sum_job : background_job_interface
+{
+    multi_core_sum_job(unsigned core_count, size_t n_values)
+      : core_count(core_count), n_values(n_values), result(0),
+        thread_count(0), max_concurrency(0)
+    {}
+    unsigned get_core_count() const
+    { return core_count; }
+    void execute(
+        check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        enter_multi_core_work(active_thread_count, max_active_thread_count);
+        thread_count = get_parallel_executor(check_in).thread_count();
+        auto owner = boost::this_thread::get_id();
+        std::atomic<int> concurrency(0);
+        result = parallel_reduce(check_in, 0, n_values, uint64_t(0),
+            [&](size_t i)
+            {
+                bool helping = boost::this_thread::get_id() != owner;
+                if (helping)
+                {
+                    enter_multi_core_work(active_thread_count,
+                        max_active_thread_count);
+                }
+                enter_multi_core_work(concurrency, max_concurrency);
+                volatile double x = 0;
+                for (int j = 0; j != 100; ++j)
+                    x = x + j;
+                --concurrency;
+                if (helping)
+                    --active_thread_count;
+                return uint64_t(i);
+            },
+            [](uint64_t a, uint64_t b) { return a + b; });
+        --active_thread_count;
+        reporter(1);
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "multi-core sum job";
+        return info;
+    }
+    unsigned core_count;
+    size_t n_values;
+    uint64_t result;
+    unsigned thread_count;
+    std::atomic<int> max_concurrency;
+};
+
+BOOST_AUTO_TEST_CASE(multi_core_job_test)
+{
+    for (unsigned n_threads : { 1, 2, 4 })
+    {
+        active_thread_count = 0;
+        max_active_thread_count = 0;
+
+        background_execution_system bg(n_threads);
+
+        int const n_jobs = 60;
+        size_t const n_values = 10000;
+        std::vector<multi_core_sum_job*> jobs(n_jobs);
+        std::vector<alia__shared_ptr<background_job_controller> >
+            controllers(n_jobs);
+        for (int i = 0; i != n_jobs; ++i)
+        {
+            jobs[i] = new multi_core_sum_job(i % 6, n_values);
+            controllers[i].reset(new background_job_controller);
+            add_background_job(bg, background_job_queue_type::CALCULATION,
+                &*controllers[i], jobs[i]);
+        }
+
+        for (int i = 0; i != n_jobs; ++i)
+        {
+            while (controllers[i]->state() != background_job_state::FINISHED)
+                boost::this_thread::yield();
+            // A job gets as many cores as it asks for, up to the size of the
+            // pool. A job that only asks for one can borrow any of them.
+            unsigned expected_cores = jobs[i]->core_count > 1 ?
+                (std::min)(jobs[i]->core_count, n_threads) : n_threads;
+            BOOST_CHECK_EQUAL(jobs[i]->thread_count, expected_cores);
+            BOOST_CHECK(
+                jobs[i]->max_concurrency <= int(expected_cores));
+            BOOST_CHECK_EQUAL(jobs[i]->result,
+                uint64_t(n_values) * (n_values - 1) / 2);
+        }
+
+        // Jobs shouldn't ever use more threads than the pool has cores.
+        BOOST_CHECK(max_active_thread_count <= int(n_threads));
+    }
+}
+
+// a job that blocks (inside a blocking_wait_scope) until a flag is set
+struct blocking_job : background_job_interface
+{
+    blocking_job(std::atomic<bool>& flag) : flag(flag) {}
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        blocking_wait_scope blocking;
+        while (!flag)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "blocking job";
+        return info;
+    }
+    std::atomic<bool>& flag;
+};
+
+// a job that takes all the cores in the pool and sets a flag
+struct flag_setting_job : background_job_interface
+{
+    flag_setting_job(unsigned core_count, std::atomic<bool>& flag)
+      : core_count(core_count), flag(flag)
+    {}
+    unsigned get_core_count() const { return core_count; }
+    void execute(check_in_interface& check_in,
+        progress_reporter_interface& reporter)
+    {
+        flag = true;
+    }
+    background_job_info get_info() const
+    {
+        background_job_info info;
+        info.description = "flag setting job";
+        return info;
+    }
+    unsigned core_count;
+    std::atomic<bool>& flag;
+};
+
+BOOST_AUTO_TEST_CASE(blocking_wait_test)
+{
+    // All but one of the threads block until a job that needs every core
+    // has run, which is only possible if the blocked jobs give up their
+    // cores.
+    unsigned const n_threads = 4;
+    background_execution_system bg(n_threads);
+    std::atomic<bool> flag(false);
+    std::vector<alia__shared_ptr<background_job_controller> > controllers;
+    for (unsigned i = 0; i != n_threads; ++i)
+    {
+        controllers.push_back(alia__shared_ptr<background_job_controller>(
+            new background_job_controller));
+        background_job_interface* job;
+        if (i + 1 != n_threads)
+            job = new blocking_job(flag);
+        else
+            job = new flag_setting_job(n_threads, flag);
+        add_background_job(bg, background_job_queue_type::CALCULATION,
+            &*controllers.back(), job);
+    }
+    for (auto const& controller : controllers)
+    {
+        while (controller->state() != background_job_state::FINISHED)
+            boost::this_thread::yield();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(memory_cache_eviction_test)
+{
+    background_execution_system bg(1);
+
+    // Fill the cache with 1 MB records, spread across its segments, and
+    // release them in key order.
+    int const n_records = 64;
+    for (int key = 0; key != n_records; ++key)
+    {
+        untyped_background_data_ptr ptr(bg, make_id(key));
+        set_cached_data(bg, make_id(key),
+            erase_type(make_immutable(
+                std::vector<double>(0x100000 / sizeof(double)))));
+    }
+    BOOST_CHECK_EQUAL(get_memory_cache_snapshot(bg).pending_eviction.size(),
+        size_t(n_records));
+
+    // Shrinking the cache should evict the least recently used records,
+    // regardless of which segment they live in.
+    reduce_memory_cache_size(bg, n_records / 2);
+    size_t n_remaining = get_memory_cache_snapshot(bg).pending_eviction.size();
+    BOOST_CHECK(n_remaining < size_t(n_records / 2));
+    BOOST_CHECK(n_remaining > size_t(n_records / 4));
+    for (int key = 0; key != n_records; ++key)
+    {
+        untyped_background_data_ptr ptr(bg, make_id(key));
+        BOOST_CHECK_EQUAL(ptr.is_ready(),
+            key >= n_records - int(n_remaining));
+    }
+}